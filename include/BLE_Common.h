@@ -21,6 +21,7 @@
 //Cycling Power Service
 #define CSCSERVICE_UUID BLEUUID((uint16_t)0x1816)
 #define CSCMEASUREMENT_UUID BLEUUID((uint16_t)0x2A5B)
+#define CSCFEATURE_UUID BLEUUID((uint16_t)0x2A5C)
 #define CYCLINGPOWERSERVICE_UUID BLEUUID((uint16_t)0x1818)
 #define CYCLINGPOWERMEASUREMENT_UUID BLEUUID((uint16_t)0x2A63)
 #define CYCLINGPOWERFEATURE_UUID BLEUUID((uint16_t)0x2A65)
@@ -40,6 +41,9 @@
 #define FLYWHEEL_UART_RX_UUID BLEUUID((uint16_t)0xCA9E)
 #define FLYWHEEL_UART_TX_UUID BLEUUID((uint16_t)0xCA9E)
 
+//Max simultaneous BLE links (server + client) we track connection parameters for
+#define BLE_MAX_LINKS CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+
 // macros to convert different types of bytes into int The naming here sucks and should be fixed.
 #define bytes_to_s16(MSB, LSB) (((signed int)((signed char)MSB))) << 8 | (((signed char)LSB))
 #define bytes_to_u16(MSB, LSB) (((signed int)((signed char)MSB))) << 8 | (((unsigned char)LSB))
@@ -55,7 +59,9 @@ void startBLEServer();
 void BLENotify(void *pvParameters);
 void computeERG(int, int);
 void computeCSC();
+float computeWheelRPM();
 void updateIndoorBikeDataChar();
+bool updateCSCMeasurementChar();
 void updateCyclingPowerMesurementChar();
 void calculateInstPwrFromHR();
 
@@ -70,6 +76,81 @@ class MyCallbacks : public BLECharacteristicCallbacks
     void onWrite(BLECharacteristic *);
 };
 
+//*****************************Advertising*****************************
+
+// Advertises fast for a short window after boot, a disconnect or a shifter gesture,
+// then backs off to a slow interval. Stops advertising while every connection slot is in use.
+class BLEAdvertisingManager
+{
+public:
+    void    setup();
+    void    fastAdvertise();
+    void    update();
+
+private:
+    unsigned long   fastUntil   = 0;
+    bool            fast        = false;
+
+    void    start(bool fastInterval);
+    bool    slotsFull();
+};
+
+extern BLEAdvertisingManager advertisingManager;
+
+//*************************Connection Parameters**************************
+
+//Every link we hold gets its connection parameters from its role.
+enum BLELinkRole : uint8_t
+{
+    LINK_NONE           = 0,
+    LINK_APP_CONTROLLER = 1, //App that writes to the FTMS control point
+    LINK_APP_LISTENER   = 2, //App that only subscribes to our notifications
+    LINK_POWER_METER    = 3, //Our client connection to a PM/FTMS bike
+    LINK_HEART_MONITOR  = 4  //Our client connection to a HRM
+};
+
+struct BLELinkStats
+{
+    uint16_t        connHandle      = 0;
+    BLELinkRole     role            = LINK_NONE;
+    bool            needsUpdate     = false;
+    uint16_t        minInterval     = 0; //1.25ms units
+    uint16_t        maxInterval     = 0; //1.25ms units
+    uint16_t        latency         = 0; //connection events the peripheral may skip
+    uint16_t        timeout         = 0; //10ms units
+    uint32_t        notifications   = 0;
+    unsigned long   lastNotify      = 0; //millis() of the last notification seen on this link
+    unsigned long   minGap          = 0; //ms between consecutive notifications, not how long one takes to arrive
+    unsigned long   maxGap          = 0;
+    float           avgGap          = 0;
+};
+
+class BLEConnParamsManager
+{
+public:
+    void    addLink(uint16_t connHandle, BLELinkRole role);
+    void    setRole(uint16_t connHandle, BLELinkRole role);
+    void    setScanning(bool scan);
+    void    setWifiActive(bool active);
+    void    recordNotify(uint16_t connHandle);
+    void    recordNotifyRound();
+    void    update();
+    void    getParams(BLELinkRole role, uint16_t *minInterval, uint16_t *maxInterval, uint16_t *latency, uint16_t *timeout);
+    String  returnJSON();
+
+private:
+    BLELinkStats    links[BLE_MAX_LINKS];
+    bool            scanning    = false;
+    bool            wifiActive  = false;
+    portMUX_TYPE    linksMux    = portMUX_INITIALIZER_UNLOCKED;
+
+    void    markAllForUpdate();
+    bool    isServerRole(BLELinkRole role);
+    bool    isLinkConnected(const BLELinkStats &link);
+};
+
+extern BLEConnParamsManager connParams;
+
 //*****************************Client*****************************
 
 //Keeping the task outside the class so we don't need a mask. 
@@ -91,6 +172,21 @@ class SpinBLEClient{
     int cscLastCrankEvtTime     = 0;
     int lastConnectedPMID       = 0;
 
+    //Virtual wheel event stream for the CSC service, driven by computeWheelRPM()
+    uint32_t cscCumulativeWheelRev      = 0;
+    uint16_t cscLastWheelEvtTime        = 0;
+    float cscWheelRevFraction           = 0;
+    unsigned long cscLastWheelUpdate    = 0;
+
+    //Raw fields from the connected power meter's Cycling Power Measurement.
+    //The server forwards these unchanged instead of synthesizing crank events.
+    uint16_t pmFlags                = 0;
+    uint8_t  pmPedalPowerBalance    = 0;
+    uint16_t pmAccumulatedTorque    = 0;
+    uint16_t pmCumulativeCrankRev   = 0;
+    uint16_t pmLastCrankEvtTime     = 0;
+    unsigned long pmCrankDataTime   = 0; //millis() of the last upstream packet with crank data
+
     BLERemoteCharacteristic *pRemoteCharacteristic  = nullptr;
     BLEAdvertisedDevice     *myPowerMeter           = nullptr;
     BLEAdvertisedDevice     *myHeartMonitor         = nullptr;
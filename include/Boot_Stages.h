@@ -0,0 +1,53 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+// Boot is a set of stages with dependencies instead of one long sequence in setup().
+// A small dispatcher task starts each stage in its own task as soon as the stages it depends on
+// are done, so BLE advertises right after the config is loaded while WiFi, NTP and the update
+// check are still running. Each stage's start time and duration are logged once everything is up.
+
+#pragma once
+
+#include <Arduino.h>
+#include <freertos/event_groups.h>
+
+enum BootStage : uint8_t
+{
+    BOOT_FILESYSTEM = 0,
+    BOOT_CONFIG     = 1,
+    BOOT_STEPPER    = 2,
+    BOOT_BLE        = 3,
+    BOOT_WIFI       = 4,
+    BOOT_TIME       = 5,
+    BOOT_HTTP       = 6,
+    BOOT_UPDATE     = 7,
+    BOOT_RECORDER   = 8,
+    BOOT_STAGES     = 9
+};
+
+#define BOOT_BIT(stage) (1UL << (stage))
+#define BOOT_ALL        (BOOT_BIT(BOOT_STAGES) - 1)
+
+struct BootStageInfo
+{
+    const char *name;
+    bool      (*run)();     //Returns false if the stage failed. Stages that depend on it still run.
+    uint32_t    dependsOn;  //BOOT_BIT()s that have to be done first
+    uint32_t    stackSize;
+};
+
+struct BootStageTiming
+{
+    uint32_t    start;      //ms since power on
+    uint32_t    end;
+    bool        ok;
+};
+
+void bootStart();
+bool bootWait(uint32_t bits, uint32_t timeoutMs);
+bool bootDone(BootStage stage);
+void bootTask(void *pvParameters);
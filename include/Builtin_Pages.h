@@ -8,22 +8,23 @@
 
 
 //OTA Update pages. Not stored in SPIFFS because we will use this to restore the webserver files if they get corrupt.
-/* Style */
+//Everything here is a constexpr array, so it stays in flash and is sent straight from there.
 #ifndef BUILTIN_PAGES_H
 #define BUILTIN_PAGES_H
 
 #include <Arduino.h>
 
-String OTAStyle =
-    "<style>#file-input,input{width:100%;height:44px;border-radius:4px;margin:10px auto;font-size:15px}"
-    "input{background:#f1f1f1;border:0;padding:0 15px}body{background:#3498db;font-family:sans-serif;font-size:14px;color:#777}"
-    "#file-input{padding:0;border:1px solid #ddd;line-height:44px;text-align:left;display:block;cursor:pointer}"
-    "#bar,#prgbar{background-color:#f1f1f1;border-radius:10px}#bar{background-color:#3498db;width:0%;height:10px}"
-    "form{background:#fff;max-width:258px;margin:75px auto;padding:30px;border-radius:5px;text-align:center}"
-    ".btn{background:#3498db;color:#fff;cursor:pointer}</style>";
+/* Style */
+#define OTA_STYLE \
+    "<style>#file-input,input{width:100%;height:44px;border-radius:4px;margin:10px auto;font-size:15px}" \
+    "input{background:#f1f1f1;border:0;padding:0 15px}body{background:#3498db;font-family:sans-serif;font-size:14px;color:#777}" \
+    "#file-input{padding:0;border:1px solid #ddd;line-height:44px;text-align:left;display:block;cursor:pointer}" \
+    "#bar,#prgbar{background-color:#f1f1f1;border-radius:10px}#bar{background-color:#3498db;width:0%;height:10px}" \
+    "form{background:#fff;max-width:258px;margin:75px auto;padding:30px;border-radius:5px;text-align:center}" \
+    ".btn{background:#3498db;color:#fff;cursor:pointer}</style>"
 
 /* Login page */
-String OTALoginIndex =
+constexpr char OTALoginIndex[] PROGMEM =
     "<form name=loginForm>"
     "<h1>ESP32 Login</h1>"
     "<input name=userid placeholder='User ID'> "
@@ -36,10 +37,10 @@ String OTALoginIndex =
     "else"
     "{alert('Error Password or Username')}"
     "}"
-    "</script>" +
-    OTAStyle;
+    "</script>"
+    OTA_STYLE;
 
-String noIndexHTML =
+constexpr char noIndexHTML[] PROGMEM =
     "<!DOCTYPE html>"
     "<html>"
     "<body>"
@@ -61,11 +62,11 @@ String noIndexHTML =
     "</form>"
     "<p style='text-align: center;'><strong><a href='login'>Update Firmware</a></strong></p></h2>"
     "</body>"
-    "</html> " +
-    OTAStyle;
+    "</html> "
+    OTA_STYLE;
 
 /* Server Index Page */
-String OTAServerIndex =
+constexpr char OTAServerIndex[] PROGMEM =
     "<script src='https://code.jquery.com/jquery-3.3.1.min.js'></script>"
     "<form method='POST' action='#' enctype='multipart/form-data' id='upload_form'>"
     "<input type='file' name='update' id='file' onchange='sub(this)' style=display:none>"
@@ -107,9 +108,30 @@ String OTAServerIndex =
     "}"
     "});"
     "});"
-    "</script>" +
-    OTAStyle;
+    "</script>"
+    OTA_STYLE;
+
+/* Response templates. %IP% is replaced while the page is streamed out (see webTemplateProcessor()) */
+constexpr char settingsSavedBTHTML[] PROGMEM =
+    "<!DOCTYPE html><html><body><h2>Selections Saved!</h2></body>"
+    "<script> setTimeout(\"location.href = 'http://%IP%/bluetoothscanner.html';\",1000);</script></html>";
+
+constexpr char settingsSavedHTML[] PROGMEM =
+    "<!DOCTYPE html><html><body><h2>Network settings will be applied at next reboot. <br> Everything else is availiable immediatly.</h2></body>"
+    "<script> setTimeout(\"location.href = 'http://%IP%/index.html';\",1000);</script></html>";
+
+constexpr char bleScanHTML[] PROGMEM =
+    "<!DOCTYPE html><html><body>Scanning for BLE Devices. Please wait 15 seconds.</body>"
+    "<script> setTimeout(\"location.href = 'http://%IP%/bluetoothscanner.html';\",15000);</script></html>";
+
+constexpr char defaultsLoadedHTML[] PROGMEM =
+    "<!DOCTYPE html><html><body><h1>Defaults have been loaded.</h1>"
+    "<p><br><br> Please reconnect to the device on WiFi network: %IP%</p></body></html>";
 
+constexpr char rebootingHTML[] PROGMEM =
+    "Rebooting....<script> setTimeout(\"location.href = 'http://%IP%/index.html';\",500); </script>";
 
+constexpr char fileNotFoundHTML[] PROGMEM =
+    "<html><body><h1>ERROR 404 <br> FILE NOT FOUND!</h1></body></html>";
 
-    #endif
\ No newline at end of file
+#endif
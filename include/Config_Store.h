@@ -0,0 +1,47 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+// Small binary records kept in an A/B pair of SPIFFS files. A write always goes to the slot that
+// doesn't hold the newest record, with the next sequence number and a CRC32 over header and payload.
+// A power cut mid-write leaves a slot that fails its CRC, so the previous record still loads.
+
+#pragma once
+
+#include <Arduino.h>
+
+struct ConfigRecordHeader
+{
+    uint32_t    magic;
+    uint16_t    version;
+    uint16_t    length;     //Payload bytes following the header
+    uint32_t    sequence;   //Highest valid sequence wins
+    uint32_t    crc;        //CRC32 of the header up to here and the payload
+};
+
+uint32_t configCRC32(uint32_t crc, const uint8_t *data, size_t length);
+
+class ConfigStore
+{
+public:
+    ConfigStore(const char *slotA, const char *slotB, uint32_t magic, uint16_t version);
+
+    // Copies the newest valid payload into payload. Returns its length, 0 when neither slot is valid.
+    size_t  read(uint8_t *payload, size_t maxLength);
+    // Skips the write when the payload matches the newest record, unless force is set
+    // (the slot files may be gone, e.g. after a filesystem update).
+    bool    write(const uint8_t *payload, size_t length, bool force = false);
+
+private:
+    const char *slots[2];
+    uint32_t    magic;
+    uint16_t    version;
+    uint32_t    sequence = 0;
+    int         current  = -1;  //Slot holding the newest record, -1 until read() found one
+    uint32_t    payloadCRC = 0; //CRC of the newest record's payload
+
+    bool    readSlot(int slot, ConfigRecordHeader &header, uint8_t *payload, size_t maxLength);
+};
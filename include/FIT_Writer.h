@@ -0,0 +1,89 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+// Writes a Garmin FIT activity file one message at a time:
+//   header, file_id, event (start), record..., event (stop), lap, session, activity, CRC
+// Each call encodes into a buffer the caller provides (FIT_MAX_MESSAGE bytes are always enough)
+// and keeps the file CRC and the lap/session totals as it goes, so a file of any length is made in
+// constant memory. The header has to state the data size, dataSize() works it out from the record
+// count up front. Plain C++ without Arduino: tools/fit_host_test.py builds it on a computer and
+// checks the output with tools/fit_check.py.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Largest message incl. the definition written before its first use
+#define FIT_MAX_MESSAGE 96
+#define FIT_HEADER_SIZE 14
+#define FIT_CRC_SIZE    2
+
+//Seconds from the Unix epoch to the FIT epoch (1989-12-31 00:00 UTC)
+#define FIT_EPOCH_OFFSET 631065600UL
+
+struct FitRecord
+{
+    uint32_t    timestamp;  //FIT time, s
+    uint16_t    power;      //W
+    uint8_t     cadence;    //rpm
+    uint8_t     heartRate;  //bpm, 0 if unknown
+    int16_t     grade;      //0.01%
+};
+
+struct FitFieldDef
+{
+    uint8_t     number;
+    uint8_t     size;
+    uint8_t     baseType;
+};
+
+struct FitMessageDef
+{
+    uint16_t            global;
+    uint8_t             local;
+    uint8_t             fieldCount;
+    const FitFieldDef  *fields;
+};
+
+class FitWriter
+{
+public:
+    // Bytes between the header and the CRC for a file with records records
+    static uint32_t dataSize(uint32_t records);
+
+    void        begin();
+    size_t      header(uint8_t *out, uint32_t records);
+    size_t      fileId(uint8_t *out, uint32_t timeCreated, uint32_t serialNumber);
+    size_t      startEvent(uint8_t *out, uint32_t timestamp);
+    size_t      record(uint8_t *out, const FitRecord &record);
+    size_t      stopEvent(uint8_t *out, uint32_t timestamp);
+    size_t      lap(uint8_t *out);
+    size_t      session(uint8_t *out);
+    size_t      activity(uint8_t *out);
+    size_t      crc(uint8_t *out);
+
+private:
+    uint16_t    fileCRC     = 0;
+    uint8_t     defined     = 0;    //Bit per local message type whose definition was written
+    uint32_t    startTime   = 0;
+    uint32_t    lastTime    = 0;
+    uint32_t    timerTime   = 0;    //s, without pauses
+    uint32_t    records     = 0;
+    uint32_t    powerSum    = 0;
+    uint32_t    cadenceSum  = 0;
+    uint32_t    hrSum       = 0;
+    uint32_t    hrCount     = 0;
+    uint16_t    maxPower    = 0;
+    uint8_t     maxCadence  = 0;
+    uint8_t     maxHr       = 0;
+
+    size_t      message(uint8_t *out, const FitMessageDef &def, const uint32_t *values);
+    size_t      finish(uint8_t *out, size_t length);
+};
+
+uint16_t fitCRC(uint16_t crc, const uint8_t *data, size_t length);
@@ -0,0 +1,43 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#pragma once
+
+#include <Arduino.h>
+
+#include "settings.h"
+
+class AsyncWebServerRequest;
+
+// Static web UI files. tools/compress_data.py gzips data/ at build time and writes
+// /manifest.txt with a content hash per file. Assets listed there are served precompressed
+// with the hash as a strong ETag, so a browser that already has a file gets a 304.
+// Files that aren't in the manifest (a plain data/ upload) are still served as they are.
+struct WebAsset
+{
+    String  path;
+    String  etag;
+    bool    gzipped;
+};
+
+class WebAssets
+{
+public:
+    void        begin();
+    bool        exists(const String &path);
+    void        invalidate(const String &path);
+    bool        send(AsyncWebServerRequest *request, const String &path);
+    static const char *contentType(const String &path);
+
+private:
+    WebAsset    assets[WEB_ASSET_MAX_FILES];
+    int         assetCount = 0;
+
+    const WebAsset *find(const String &path);
+};
+
+extern WebAssets webAssets;
@@ -0,0 +1,53 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#pragma once
+
+#include <Arduino.h>
+#include <ESPAsyncWebServer.h>
+
+#include "settings.h"
+
+// Server-Sent Events stream at /events. Web pages open one EventSource instead of polling /configJSON.
+// "telemetry" events carry the ride values and are only sent when one of them changes.
+// "log" events carry new log lines. Their id is the log sequence number, so a new or
+// reconnecting viewer first gets everything after its Last-Event-ID and then the live lines.
+struct WebTelemetry
+{
+    int     watts;
+    float   cadence;
+    int     hr;
+    float   incline;
+    int     stepperPosition;
+    int     targetPosition;
+    int     power3s;
+    int     normalizedPower;
+    float   kiloJoules;
+    float   tss;
+};
+
+class WebEventStream
+{
+public:
+    WebEventStream() : source("/events") {}
+    void    begin(AsyncWebServer &server);
+    void    update();
+
+private:
+    AsyncEventSource    source;
+    WebTelemetry        lastTelemetry   = {};
+    unsigned long       lastTelemetryAt = 0;
+    bool                telemetryValid  = false;
+    uint32_t            logCursor       = 0; //Last log line broadcast to everyone
+
+    WebTelemetry    readTelemetry();
+    bool            telemetryChanged(const WebTelemetry &now);
+    void            formatTelemetry(char *out, size_t size);
+    void            onConnect(AsyncEventSourceClient *client);
+};
+
+extern WebEventStream webEvents;
@@ -8,18 +8,33 @@
 #pragma once
 
 #include <Arduino.h>
+#include <FS.h>
+#include "JSON_Stream_Writer.h"
+
+class AsyncWebServerRequest;
+
+//Actions a request handler hands to the web task (see webDeferAction())
+#define WEB_ACTION_LOAD_DEFAULTS    0x02
+#define WEB_ACTION_REBOOT           0x04
 
 void startHttpServer();
 void webClientUpdate(void *pvParameters);
-void handleSpiffsFile();
-void handleIndexFile();
-void handleHrSlider();
-void FirmwareUpdate();
+void webDeferAction(uint8_t action);
+void handleSpiffsFile(AsyncWebServerRequest *request);
+void handleIndexFile(AsyncWebServerRequest *request);
+void handleRides(AsyncWebServerRequest *request);
+void sendSpiffsFile(AsyncWebServerRequest *request, File file, const String &path, const char *contentType, const String &etag = String(), const char *cacheControl = nullptr);
+void sendJSON(AsyncWebServerRequest *request, const JsonFieldSource &source);
+String webTemplateProcessor(const String &placeholder);
+void sendTemplate(AsyncWebServerRequest *request, const char *page);
+void handleUpload(AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final);
 
 #ifdef USE_TELEGRAM
 void sendTelegram(String textToSend);
 void telegramUpdate(void *pvParameters);
 #endif
 
-//wifi Function
-void startWifi();
+//Set while the station connection is up and the last internet request worked
+extern bool internetConnection;
+
+bool syncTime();
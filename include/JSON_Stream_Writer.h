@@ -0,0 +1,76 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+
+// Writes JSON straight to a Print (an HTTP response stream, Serial, a file) as the fields are added,
+// without building a document or a String first. Only flat objects (and arrays of numbers), which is
+// all our endpoints need.
+// fields is an optional comma separated list of keys ("simulatedWatts,simulatedHr"); when it's
+// given, every other key is skipped.
+class JsonStreamWriter
+{
+public:
+    JsonStreamWriter(Print &output, const char *fields = nullptr);
+
+    void    beginObject();
+    void    endObject();
+    void    field(const char *key, const char *value);
+    void    field(const char *key, const String &value)    {field(key, value.c_str());}
+    void    field(const char *key, int value);
+    void    field(const char *key, float value);
+    void    field(const char *key, bool value);
+    void    field(const char *key, const uint16_t *values, size_t count);
+    bool    wanted(const char *key);
+
+private:
+    Print       &out;
+    const char  *filter;
+    bool        firstField = true;
+
+    void    writeKey(const char *key);
+    void    writeString(const char *value);
+};
+
+//Room first reserved for a field that spills over into the next chunk
+#define JSON_CARRY_RESERVE 128
+
+// Writes field index of an object and returns true, or returns false once index is past the last field
+typedef std::function<bool(JsonStreamWriter &writer, size_t index)> JsonFieldSource;
+
+// Chunk callback for AsyncWebServer's beginChunkedResponse(). The object is made one field at a time
+// when the connection has room for more, straight into the buffer the server hands over, so the
+// body never exists in RAM as a whole. Only a field that doesn't fit the rest of a chunk is carried
+// over to the next one. The server owns the callback (and this) until the response is done.
+class JsonChunkedSource : public Print
+{
+public:
+    JsonChunkedSource(const JsonFieldSource &fieldSource, const String &fields);
+
+    size_t  read(uint8_t *buffer, size_t maxLength);
+    size_t  write(uint8_t c) override;
+    size_t  write(const uint8_t *data, size_t length) override;
+
+private:
+    void    reserveCarry(size_t more);
+
+    JsonFieldSource source;
+    String          filter;         //Before writer, which keeps a pointer into it
+    JsonStreamWriter writer;
+    size_t          nextField   = 0;
+    bool            started     = false;
+    bool            finished    = false;
+    uint8_t         *chunk      = nullptr;
+    size_t          chunkLength = 0;
+    size_t          chunkMax    = 0;
+    String          carry;
+    size_t          carryPos    = 0;
+    size_t          carryCapacity = 0;
+};
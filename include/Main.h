@@ -12,6 +12,9 @@
 #include "HTTP_Server_Basic.h"
 #include "SmartSpin_parameters.h"
 #include "BLE_Common.h"
+#include "Radio_Scheduler.h"
+#include "SS2K_Log.h"
+#include "Boot_Stages.h"
 
 //Function Prototypes
 bool IRAM_ATTR deBounce();
@@ -19,21 +22,26 @@ void IRAM_ATTR moveStepper(void * pvParameters);
 void IRAM_ATTR shiftUp();
 void IRAM_ATTR shiftDown(); 
 void debugDirector(String, bool = true, bool = false);
+void debugDirector(LogCategory category, const String &textToPrint, bool newline = true, bool telegram = false);
 void resetIfShiftersHeld();
 void scanIfShiftersHeld();
 void setupTMCStepperDriver();
 void updateStepperPower();
 void updateStealthchop();
+bool mountFilesystem();
+bool loadConfig();
+bool setupStepper();
 
 //Main program variable that stores most everything
 extern userParameters userConfig;
 
+//Current and target stepper position
+extern int stepperPosition;
+extern int targetPosition;
+
 //Users Physical Working Capacity Calculation Parameters (heartrate to Power calculation)
 extern physicalWorkingCapacity userPWC;
 
-//Variable that will store debugging information that will get appended and then cleared once posted to HTML or a timer expires.
-extern String debugToHTML; 
-
 #endif
 
 
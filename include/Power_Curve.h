@@ -0,0 +1,51 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+// Mean-maximal power: the best average power held for each of a few durations, for the current
+// ride and for all rides. The last POWER_CURVE_HISTORY seconds of power sit in a ring, and each
+// duration keeps the running sum of its window, so a new sample costs one subtraction and one
+// addition per duration however long the ride is. All-time bests are kept in NVS.
+
+#pragma once
+
+#include <Arduino.h>
+
+#include "settings.h"
+
+//1 s, 5 s, 30 s, 1, 5, 20 and 60 min
+#define POWER_CURVE_POINTS 7
+
+//Index of the 20 min duration the FTP estimate is based on
+#define POWER_CURVE_FTP_POINT 5
+
+class PowerCurve
+{
+public:
+    static const uint16_t durations[POWER_CURVE_POINTS];
+
+    void        load();
+    void        save();
+    void        reset();
+    void        add(int power);
+    // Copies the bests (W) of the current ride and of all rides, 0 where no window was full yet
+    void        bests(uint16_t *ride, uint16_t *allTime);
+    // POWER_CURVE_FTP_PERCENT of the best 20 min power, 0 until there is one
+    int         ftpEstimate();
+
+private:
+    uint16_t        history[POWER_CURVE_HISTORY];
+    uint16_t        head                            = 0;
+    uint32_t        count                           = 0;
+    uint32_t        sums[POWER_CURVE_POINTS]        = {};
+    uint16_t        rideBest[POWER_CURVE_POINTS]    = {};
+    uint16_t        best[POWER_CURVE_POINTS]        = {};
+    bool            dirty                           = false;
+    unsigned long   lastSave                        = 0;
+    portMUX_TYPE    curveMux                        = portMUX_INITIALIZER_UNLOCKED;
+};
+
+extern PowerCurve powerCurve;
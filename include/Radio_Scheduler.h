@@ -0,0 +1,43 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#pragma once
+
+#include <Arduino.h>
+
+// BLE and WiFi share one antenna and take turns on it. Everything that wants a large share
+// of airtime asks here first, so a ride's BLE connection events always win and bulk traffic waits.
+// Web pages and their files are interactive and short, they don't ask.
+enum RadioUser : uint8_t
+{
+    RADIO_SCAN      = 0, //Active BLE scan
+    RADIO_OTA       = 1, //Firmware & filesystem transfers
+    RADIO_TELEGRAM  = 2, //Telegram posts
+    RADIO_USERS     = 3
+};
+
+class RadioScheduler
+{
+public:
+    bool        acquire(RadioUser user, unsigned long waitMs = 0);
+    void        release(RadioUser user);
+    bool        rideActive();
+    uint16_t    scanInterval();
+    uint16_t    scanWindow();
+    String      returnJSON();
+
+private:
+    uint8_t         active[RADIO_USERS]     = {0, 0, 0};
+    uint32_t        granted[RADIO_USERS]    = {0, 0, 0};
+    uint32_t        postponed[RADIO_USERS]  = {0, 0, 0};
+    portMUX_TYPE    radioMux                = portMUX_INITIALIZER_UNLOCKED;
+
+    bool    isBulk(RadioUser user);
+    bool    mayStart(RadioUser user);
+};
+
+extern RadioScheduler radioScheduler;
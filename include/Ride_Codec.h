@@ -0,0 +1,76 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+// Packed ride blocks (RIDE_FORMAT_PACKED). Samples are stored column by column, each column as
+// the differences between neighbouring samples, zig-zag varint encoded and run-length coded:
+//   column  = runs until the block's sample count is reached
+//   run     = varint (length << 1 | repeat), then one delta if repeat, else length deltas
+//   delta   = zig-zag varint of value - previous value (previous is 0 for the first sample)
+// Time steps by one every sample and incline doesn't move in ERG mode, so those columns are a
+// couple of bytes per block. Every block decodes on its own. tools/ride_codec.py is the same
+// codec for the computer side.
+
+#pragma once
+
+#include <Arduino.h>
+
+#include "Ride_Recorder.h"
+
+//Column order in a packed block
+enum RideChannel : uint8_t
+{
+    RIDE_CH_TIME        = 0,
+    RIDE_CH_POWER       = 1,
+    RIDE_CH_CADENCE     = 2,
+    RIDE_CH_HEART_RATE  = 3,
+    RIDE_CH_INCLINE     = 4,
+    RIDE_CH_TARGET      = 5,
+    RIDE_CH_FLAGS       = 6,
+    RIDE_CH_STEPPER     = 7,
+    RIDE_CHANNELS       = 8
+};
+
+//Runs of at least this many equal deltas are stored as a repeat
+#define RIDE_MIN_REPEAT 3
+
+// Packs count samples into out. Returns the packed length, 0 if they don't fit in maxLength.
+size_t rideEncode(const RideSample *samples, uint8_t count, uint8_t *out, size_t maxLength);
+
+// Reads one column of a packed block, one value at a time
+class RideColumnReader
+{
+public:
+    void        begin(const uint8_t *data, const uint8_t *end);
+    bool        next(int32_t &value);
+    const uint8_t *position()   {return pos;}
+
+private:
+    const uint8_t  *pos         = nullptr;
+    const uint8_t  *end         = nullptr;
+    int32_t         value       = 0;
+    int32_t         delta       = 0;
+    uint32_t        runLeft     = 0;
+    bool            repeat      = false;
+};
+
+// Hands out the samples of a stored block one at a time, raw or packed. Only keeps a cursor per
+// column, so even a full block is read without a sample buffer.
+class RideBlockReader
+{
+public:
+    RideBlockReader() {}
+    explicit RideBlockReader(const RideBlock &block)    {begin(block);}
+    void        begin(const RideBlock &block);
+    bool        next(RideSample &sample);
+    uint8_t     count()         {return total;}
+
+private:
+    const RideBlock    *block   = nullptr;
+    RideColumnReader    columns[RIDE_CHANNELS];
+    uint8_t             total   = 0;
+    uint8_t             read    = 0;
+};
@@ -0,0 +1,61 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+// Turns a recorded ride into a FIT file while it's being sent. read() is the chunk callback of
+// the HTTP response: it reads the ride one block at a time and encodes the next FIT messages
+// into whatever room the response has, so memory use doesn't depend on the ride's length.
+// The ring file stays open from begin() until the last record is encoded.
+
+#pragma once
+
+#include <Arduino.h>
+
+#include "Ride_Recorder.h"
+#include "Ride_Codec.h"
+#include "FIT_Writer.h"
+
+class RideExport
+{
+public:
+    // False if there is no such ride
+    bool        begin(uint16_t id);
+    size_t      read(uint8_t *buffer, size_t maxLength);
+
+private:
+    enum ExportStage : uint8_t
+    {
+        EXPORT_HEADER,
+        EXPORT_FILE_ID,
+        EXPORT_START,
+        EXPORT_RECORDS,
+        EXPORT_STOP,
+        EXPORT_LAP,
+        EXPORT_SESSION,
+        EXPORT_ACTIVITY,
+        EXPORT_CRC,
+        EXPORT_DONE
+    };
+
+    ExportStage     stage       = EXPORT_HEADER;
+    RideInfo        ride;
+    File            ring;
+    FitWriter       fit;
+    uint32_t        baseTime    = 0;    //FIT time of the ride start
+    uint32_t        total       = 0;    //Records in the file, counted by begin()
+    uint32_t        written     = 0;
+    uint32_t        nextBlock   = 0;
+    uint32_t        endBlock    = 0;
+    RideBlock       block;
+    RideBlockReader reader;
+    FitRecord       last;
+    uint8_t         staged[FIT_MAX_MESSAGE];
+    size_t          stagedLength    = 0;
+    size_t          stagedPos       = 0;
+
+    bool    nextBlockOfRide();
+    size_t  produce(uint8_t *out);
+};
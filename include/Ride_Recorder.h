@@ -0,0 +1,119 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+// Records a sample every RIDE_SAMPLE_INTERVAL while an app is connected. Samples are collected
+// in RAM and written a whole block at a time into a ring file that is allocated once, so flash is
+// only touched a few times a minute and the file never grows. Each block carries its own sequence
+// number and CRC32, so a power cut costs at most the block that was being filled. Blocks are
+// packed by Ride_Codec, a block is full when the next sample wouldn't fit anymore. Every sample
+// also goes to rideStats, which starts over with each ride.
+
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+
+#include "settings.h"
+
+//Block payload formats
+#define RIDE_FORMAT_RAW 0 //RideSample array
+#define RIDE_FORMAT_PACKED 1 //Column packed, see Ride_Codec.h
+
+//Sample flags
+#define RIDE_FLAG_ERG 0x01 //ERG mode was on, targetWatts is valid
+
+struct RideSample
+{
+    uint16_t    time;               //s since the ride started
+    int16_t     power;              //W
+    uint8_t     cadence;            //rpm
+    uint8_t     heartRate;          //bpm
+    int16_t     incline;            //0.01%
+    int16_t     targetWatts;        //ERG target, W
+    uint16_t    flags;
+    int32_t     stepperPosition;
+};
+
+struct RideBlockHeader
+{
+    uint32_t    sequence;           //Counts up forever, the ring slot is sequence % RIDE_RING_BLOCKS
+    uint32_t    startTime;          //Ride start, UTC seconds. 0 if the time wasn't set yet.
+    uint16_t    rideId;
+    uint8_t     count;              //Samples in the block
+    uint8_t     format;             //RIDE_FORMAT_*
+    uint32_t    crc;                //CRC32 of the header up to here and the payload
+};
+
+#define RIDE_BLOCK_PAYLOAD (RIDE_BLOCK_SIZE - sizeof(RideBlockHeader))
+#define RIDE_BLOCK_SAMPLES (RIDE_BLOCK_PAYLOAD / sizeof(RideSample)) //Raw blocks
+
+//Stored as its first RIDE_BLOCK_SIZE bytes, without the padding the compiler adds at the end
+struct RideBlock
+{
+    RideBlockHeader header;
+    uint8_t         payload[RIDE_BLOCK_PAYLOAD];
+};
+
+struct RideInfo
+{
+    uint16_t    id;
+    uint32_t    startTime;
+    uint32_t    firstSequence;
+    uint16_t    blocks;
+    uint16_t    duration;           //s, time of the last stored sample
+};
+
+class RideRecorder
+{
+public:
+    void        begin();
+    void        run();
+    bool        recording()         {return state == RIDE_RECORDING;}
+    uint16_t    currentRide()       {return rideId;}
+    uint32_t    nextSequence()      {return sequence;}
+
+    // Reads the block with this sequence number. False if it was overwritten or never written.
+    bool        readBlock(uint32_t blockSequence, RideBlock &block);
+    // For reading many blocks: open the ring once and pass it to readBlock()
+    File        openForReading();
+    bool        readBlock(File &file, uint32_t blockSequence, RideBlock &block);
+    // Fills rides with the stored rides, oldest first. Returns how many there are.
+    int         listRides(RideInfo *rides, int maxRides);
+    // Finds where a ride starts. Only id, startTime and firstSequence are filled in.
+    bool        findRide(uint16_t id, RideInfo &ride);
+
+private:
+    enum RideState : uint8_t
+    {
+        RIDE_IDLE,
+        RIDE_RECORDING,
+        RIDE_PAUSED
+    };
+
+    TaskHandle_t    task            = nullptr;
+    volatile bool   ready           = false;
+    RideState       state           = RIDE_IDLE;
+    uint16_t        rideId          = 0;
+    uint32_t        sequence        = 0;
+    uint32_t        startTime       = 0;
+    unsigned long   startMillis     = 0;
+    unsigned long   pausedAt        = 0;
+    RideBlock       block;
+    RideSample      pending[RIDE_PACKED_MAX_SAMPLES];
+    uint8_t         pendingCount    = 0;
+
+    bool    openRing();
+    void    scanRing();
+    void    startRide();
+    void    addSample();
+    void    flush(uint8_t count);
+    void    update();
+};
+
+extern RideRecorder rideRecorder;
+
+void rideRecorderTask(void *pvParameters);
@@ -0,0 +1,70 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+// Running statistics of the current ride, fed one sample a second by the ride recorder.
+// Rolling averages come from one ring of the last RIDE_STATS_WINDOW watts with a running sum per
+// window, normalized power from a running sum of the 30 s average to the 4th power, so add() is
+// the same handful of operations however long the ride is. Readers (BLE server, web events) get
+// plain values and never wait on the recorder.
+
+#pragma once
+
+#include <Arduino.h>
+
+#include "settings.h"
+
+//Longest rolling window (s). Normalized power is based on the 30 s average.
+#define RIDE_STATS_WINDOW 30
+
+struct RideTotals
+{
+    uint32_t    seconds;        //Samples so far
+    uint16_t    avgPower;       //W
+    uint16_t    maxPower;
+    uint16_t    avgCadence;     //rpm
+    uint8_t     maxCadence;
+    uint8_t     avgHr;          //bpm, 0 without a heart rate
+    uint8_t     maxHr;
+    uint16_t    power3s;        //Rolling averages, W
+    uint16_t    power10s;
+    uint16_t    power30s;
+    uint16_t    normalizedPower;
+    float       intensity;      //NP / FTP
+    float       tss;
+    float       kiloJoules;
+};
+
+class RideStats
+{
+public:
+    void        reset();
+    void        add(int power, int cadence, int hr);
+    RideTotals  totals();
+    uint32_t    seconds()           {return count;}
+
+private:
+    uint16_t        window[RIDE_STATS_WINDOW]   = {};
+    uint8_t         head                        = 0;
+    uint32_t        count                       = 0;
+    uint32_t        sum3                        = 0;
+    uint32_t        sum10                       = 0;
+    uint32_t        sum30                       = 0;
+    double          np4Sum                      = 0; //Sum of (30 s average)^4 once the first window is full
+    uint32_t        np4Count                    = 0;
+    uint64_t        powerSum                    = 0; //Ws, i.e. J
+    uint32_t        cadenceSum                  = 0;
+    uint32_t        hrSum                       = 0;
+    uint32_t        hrCount                     = 0;
+    uint16_t        maxPower                    = 0;
+    uint8_t         maxCadence                  = 0;
+    uint8_t         maxHr                       = 0;
+    portMUX_TYPE    statsMux                    = portMUX_INITIALIZER_UNLOCKED;
+
+    uint16_t    ago(int seconds);
+};
+
+extern RideStats rideStats;
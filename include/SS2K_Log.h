@@ -0,0 +1,204 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+// Logging goes through a fixed size, multi-producer, lock-free ring of binary records.
+// Producers (any task or ISR) only copy a format pointer and a few arguments into a slot.
+// A low priority drain task formats the records later and hands the text to the sinks (Serial, web, Telegram).
+
+#pragma once
+
+#include <Arduino.h>
+#include <atomic>
+
+#include "settings.h"
+
+enum LogLevel : uint8_t
+{
+    LOG_LEVEL_NONE      = 0,
+    LOG_LEVEL_ERROR     = 1,
+    LOG_LEVEL_WARNING   = 2,
+    LOG_LEVEL_INFO      = 3,
+    LOG_LEVEL_DEBUG     = 4,
+    LOG_LEVEL_VERBOSE   = 5
+};
+
+//Numeric copies of the levels for the preprocessor
+#define LOG_LEVEL_NUM_ERROR     1
+#define LOG_LEVEL_NUM_WARNING   2
+#define LOG_LEVEL_NUM_INFO      3
+#define LOG_LEVEL_NUM_DEBUG     4
+#define LOG_LEVEL_NUM_VERBOSE   5
+
+// Runtime levels are set per category from the settings page.
+enum LogCategory : uint8_t
+{
+    LOG_CAT_MAIN        = 0,
+    LOG_CAT_BLE_CLIENT  = 1,
+    LOG_CAT_BLE_SERVER  = 2,
+    LOG_CAT_STEPPER     = 3,
+    LOG_CAT_HTTP        = 4,
+    LOG_CAT_CONFIG      = 5,
+    LOG_CATEGORIES      = 6
+};
+
+//Record flags
+#define LOG_FLAG_NEWLINE    0x01 //End the line after this message
+#define LOG_FLAG_TELEGRAM   0x02 //Also send this message to Telegram
+#define LOG_FLAG_MORE       0x04 //The next record continues this message's text
+#define LOG_FLAG_HEX        0x08 //text holds raw bytes to dump in hex after the format string
+
+#define LOG_MAX_ARGS        4
+#define LOG_RECORD_TEXT     44
+
+enum LogArgType : uint8_t
+{
+    LOG_ARG_INT     = 0,
+    LOG_ARG_UINT    = 1,
+    LOG_ARG_FLOAT   = 2,
+    LOG_ARG_STR     = 3 //Must point to a string that lives forever (a literal)
+};
+
+union LogArgValue
+{
+    int32_t     i;
+    uint32_t    u;
+    float       f;
+    const char *s;
+};
+
+struct LogArg
+{
+    LogArgType  type;
+    LogArgValue value;
+};
+
+// 64 bytes. format is the "format id": a pointer to a string literal, nullptr for plain text records.
+// Hex records use format as a label and text for the bytes.
+struct LogEntry
+{
+    uint32_t        timestamp;
+    TaskHandle_t    task;       //nullptr when logged from an ISR
+    const char     *format;
+    uint8_t         level;
+    uint8_t         flags;
+    uint8_t         length;     //Number of args, or number of text characters
+    uint8_t         argTypes;   //2 bits per arg
+    union
+    {
+        LogArgValue args[LOG_MAX_ARGS];
+        char        text[LOG_RECORD_TEXT];
+    };
+};
+
+struct LogSlot
+{
+    std::atomic<uint32_t>   sequence; //Ring position + 1 once the entry is complete, 0 while it's being written
+    LogEntry                entry;
+};
+
+inline LogArg logArg(int v)             { LogArg a; a.type = LOG_ARG_INT;   a.value.i = v; return a; }
+inline LogArg logArg(long v)            { LogArg a; a.type = LOG_ARG_INT;   a.value.i = v; return a; }
+inline LogArg logArg(unsigned int v)    { LogArg a; a.type = LOG_ARG_UINT;  a.value.u = v; return a; }
+inline LogArg logArg(unsigned long v)   { LogArg a; a.type = LOG_ARG_UINT;  a.value.u = v; return a; }
+inline LogArg logArg(bool v)            { LogArg a; a.type = LOG_ARG_INT;   a.value.i = v; return a; }
+inline LogArg logArg(float v)           { LogArg a; a.type = LOG_ARG_FLOAT; a.value.f = v; return a; }
+inline LogArg logArg(double v)          { LogArg a; a.type = LOG_ARG_FLOAT; a.value.f = v; return a; }
+inline LogArg logArg(const char *v)     { LogArg a; a.type = LOG_ARG_STR;   a.value.s = v; return a; }
+
+//Current runtime level of each category. Written by logSetLevels(), read everywhere.
+extern uint8_t logLevels[LOG_CATEGORIES];
+
+void logWrite(uint8_t level, uint8_t flags, const char *format, const LogArg *args, uint8_t argCount);
+void logText(uint8_t level, uint8_t flags, const char *text, size_t length);
+void logHex(uint8_t level, uint8_t flags, const char *label, const uint8_t *data, size_t length);
+void logSetLevels(uint32_t packedLevels);
+void logStart();
+void logDrainTask(void *pvParameters);
+String logHistoryHTML(uint32_t &cursor, uint32_t end = 0);
+uint32_t logHistoryEnd();
+
+// printf style logging that is safe from ISRs. Formatting is deferred to the drain task,
+// so string arguments have to be literals. Use SS2K_LOG_TEXT() for text built at runtime.
+template <typename... Args>
+void ss2kLog(uint8_t level, const char *format, Args... args)
+{
+    static_assert(sizeof...(args) <= LOG_MAX_ARGS, "Too many log arguments");
+    const LogArg packed[] = {logArg(args)..., logArg(0)};
+    logWrite(level, LOG_FLAG_NEWLINE, format, packed, sizeof...(args));
+}
+
+/*********************************Front end*********************************/
+// Use these instead of calling ss2kLog()/logHex() directly. Levels above SS2K_LOG_COMPILE_LEVEL
+// expand to nothing, so neither the call nor its arguments are compiled in. Enabled levels still
+// check the category's runtime level before any argument is evaluated.
+
+#define SS2K_LOG_ENABLED(category, level) ((level) <= logLevels[(category)])
+
+#define SS2K_LOG_AT(category, level, format, ...)                 \
+    do                                                            \
+    {                                                             \
+        if (SS2K_LOG_ENABLED(category, level))                    \
+        {                                                         \
+            ss2kLog((level), (format), ##__VA_ARGS__);            \
+        }                                                         \
+    } while (0)
+
+#define SS2K_LOG_HEX_AT(category, level, label, data, length)     \
+    do                                                            \
+    {                                                             \
+        if (SS2K_LOG_ENABLED(category, level))                    \
+        {                                                         \
+            logHex((level), LOG_FLAG_NEWLINE, (label), (data), (length)); \
+        }                                                         \
+    } while (0)
+
+#define SS2K_LOG_NOTHING() \
+    do                     \
+    {                      \
+    } while (0)
+
+#if SS2K_LOG_COMPILE_LEVEL >= LOG_LEVEL_NUM_ERROR
+#define SS2K_LOGE(category, format, ...) SS2K_LOG_AT(category, LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+#else
+#define SS2K_LOGE(category, format, ...) SS2K_LOG_NOTHING()
+#endif
+
+#if SS2K_LOG_COMPILE_LEVEL >= LOG_LEVEL_NUM_WARNING
+#define SS2K_LOGW(category, format, ...) SS2K_LOG_AT(category, LOG_LEVEL_WARNING, format, ##__VA_ARGS__)
+#else
+#define SS2K_LOGW(category, format, ...) SS2K_LOG_NOTHING()
+#endif
+
+#if SS2K_LOG_COMPILE_LEVEL >= LOG_LEVEL_NUM_INFO
+#define SS2K_LOGI(category, format, ...) SS2K_LOG_AT(category, LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+// debugDirector() for a category: text is a String built at runtime, only built if the category logs INFO
+#define SS2K_LOG_TEXT(category, text, ...)                        \
+    do                                                            \
+    {                                                             \
+        if (SS2K_LOG_ENABLED(category, LOG_LEVEL_INFO))           \
+        {                                                         \
+            debugDirector((category), (text), ##__VA_ARGS__);     \
+        }                                                         \
+    } while (0)
+#else
+#define SS2K_LOGI(category, format, ...) SS2K_LOG_NOTHING()
+#define SS2K_LOG_TEXT(category, text, ...) SS2K_LOG_NOTHING()
+#endif
+
+#if SS2K_LOG_COMPILE_LEVEL >= LOG_LEVEL_NUM_DEBUG
+#define SS2K_LOGD(category, format, ...) SS2K_LOG_AT(category, LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#define SS2K_LOG_HEXD(category, label, data, length) SS2K_LOG_HEX_AT(category, LOG_LEVEL_DEBUG, label, data, length)
+#else
+#define SS2K_LOGD(category, format, ...) SS2K_LOG_NOTHING()
+#define SS2K_LOG_HEXD(category, label, data, length) SS2K_LOG_NOTHING()
+#endif
+
+#if SS2K_LOG_COMPILE_LEVEL >= LOG_LEVEL_NUM_VERBOSE
+#define SS2K_LOGV(category, format, ...) SS2K_LOG_AT(category, LOG_LEVEL_VERBOSE, format, ##__VA_ARGS__)
+#else
+#define SS2K_LOGV(category, format, ...) SS2K_LOG_NOTHING()
+#endif
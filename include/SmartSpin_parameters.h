@@ -8,10 +8,12 @@
 #define SmartSpin_PARAMETERS_H
 
 #include <Arduino.h>
+#include <functional>
+#include "JSON_Stream_Writer.h"
 
-class userParameters
+// Config values live in a plain struct so the field table below can point straight at them.
+struct userParametersData
 {
-    private:
     String  firmwareUpdateURL;              
     float   incline;                        
     int     simulatedWatts;                 
@@ -19,19 +21,88 @@ class userParameters
     int     simulatedCad;                   
     String  deviceName;                     
     int     shiftStep;         
+    int     ftp;            //Functional threshold power (W) for intensity and TSS
     int     stepperPower;
     bool    stealthchop;             
     float   inclineMultiplier;              
     bool    doublePower;  //didn't really have a good purpose before, going to be used for HR2VP like calculation            
     bool    simulateHr;                     
     bool    ERGMode;                      
+    int     targetWatts;    //ERG target from the app
     bool    autoUpdate;                 
+    int     logLevels;  //4 bits per log category
     String  ssid;                          
     String  password;                      
-    String  foundDevices = " ";            
-    String  connectedPowerMeter = "any";      
-    String  connectedHeartMonitor = "any";       
+    String  foundDevices;            
+    String  connectedPowerMeter;      
+    String  connectedHeartMonitor;       
+};
+
+enum ConfigFieldType : uint8_t
+{
+    CONFIG_INT      = 0,
+    CONFIG_FLOAT    = 1,
+    CONFIG_BOOL     = 2,
+    CONFIG_STRING   = 3
+};
+
+//Field flags
+#define CONFIG_PERSIST  0x01 //Saved to and loaded from SPIFFS
+#define CONFIG_FORM     0x02 //Set from the /send_settings form
+#define CONFIG_SECRET   0x04 //Never written to the log
+
+// Looks up a submitted form argument. Returns false when the argument wasn't sent.
+typedef std::function<bool(const char *name, String &value)> ConfigFormReader;
+
+// One entry of the config schema. Every path that reads or writes the config (defaults, SPIFFS,
+// JSON, the settings form) walks the same table, so adding a setting is a single line in SmartSpin_parameters.cpp.
+struct ConfigField
+{
+    const char     *name;
+    const char     *formName;       //Form argument name when it differs from name
+    const char     *formMarker;     //Checkboxes only: a field that's always on the same form. Its presence without the checkbox means off.
+    ConfigFieldType type;
+    uint8_t         flags;
+    uint16_t        maxLength;      //Strings only
+    int     userParametersData::*intMember;
+    float   userParametersData::*floatMember;
+    bool    userParametersData::*boolMember;
+    String  userParametersData::*stringMember;
+    float           defaultValue;
+    float           minValue;
+    float           maxValue;
+    const char     *defaultString;
+    void          (*apply)();       //Called after the form changed the value
+    bool          (*readForm)(const ConfigFormReader &readArg, String &value); //Builds the value from several form arguments
+
+    constexpr ConfigField(const char *n, int userParametersData::*m, int def, int lo, int hi, uint8_t f,
+                          void (*a)() = nullptr, const char *form = nullptr,
+                          bool (*reader)(const ConfigFormReader &, String &) = nullptr)
+        : name(n), formName(form), formMarker(nullptr), type(CONFIG_INT), flags(f), maxLength(0),
+          intMember(m), floatMember(nullptr), boolMember(nullptr), stringMember(nullptr),
+          defaultValue(def), minValue(lo), maxValue(hi), defaultString(nullptr), apply(a), readForm(reader) {}
 
+    constexpr ConfigField(const char *n, float userParametersData::*m, float def, float lo, float hi, uint8_t f,
+                          void (*a)() = nullptr, const char *form = nullptr)
+        : name(n), formName(form), formMarker(nullptr), type(CONFIG_FLOAT), flags(f), maxLength(0),
+          intMember(nullptr), floatMember(m), boolMember(nullptr), stringMember(nullptr),
+          defaultValue(def), minValue(lo), maxValue(hi), defaultString(nullptr), apply(a), readForm(nullptr) {}
+
+    constexpr ConfigField(const char *n, bool userParametersData::*m, bool def, uint8_t f,
+                          const char *marker = nullptr, void (*a)() = nullptr)
+        : name(n), formName(nullptr), formMarker(marker), type(CONFIG_BOOL), flags(f), maxLength(0),
+          intMember(nullptr), floatMember(nullptr), boolMember(m), stringMember(nullptr),
+          defaultValue(def), minValue(0), maxValue(1), defaultString(nullptr), apply(a), readForm(nullptr) {}
+
+    constexpr ConfigField(const char *n, String userParametersData::*m, const char *def, uint16_t len, uint8_t f,
+                          void (*a)() = nullptr, const char *form = nullptr)
+        : name(n), formName(form), formMarker(nullptr), type(CONFIG_STRING), flags(f), maxLength(len),
+          intMember(nullptr), floatMember(nullptr), boolMember(nullptr), stringMember(m),
+          defaultValue(0), minValue(0), maxValue(0), defaultString(def), apply(a), readForm(nullptr) {}
+};
+
+class userParameters : private userParametersData
+{
     public:
     const char* getFirmwareUpdateURL()       {return firmwareUpdateURL.c_str();}
     float       getIncline()                 {return incline;}
@@ -40,13 +111,16 @@ class userParameters
     float       getSimulatedCad()            {return simulatedCad;}
     const char* getDeviceName()              {return deviceName.c_str();}
     int         getShiftStep()               {return shiftStep;}
+    int         getFTP()                     {return ftp;}
     int         getStepperPower()            {return stepperPower;}
     bool        getStealthchop()             {return stealthchop;}
     float       getInclineMultiplier()       {return inclineMultiplier;}
     bool        getDoublePower()             {return doublePower;}
     bool        getSimulateHr()              {return simulateHr;}
     bool        getERGMode()                 {return ERGMode;}
+    int         getTargetWatts()             {return targetWatts;}
     bool        getautoUpdate()              {return autoUpdate;}
+    int         getLogLevels()               {return logLevels;}
     const char* getSsid()                    {return ssid.c_str();}
     const char* getPassword()                {return password.c_str();}
     const char* getFoundDevices()            {return foundDevices.c_str();}
@@ -61,27 +135,39 @@ class userParameters
     void    setSimulatedCad(float cad)          {simulatedCad = cad;}
     void    setDeviceName(String dvcn)          {deviceName = dvcn;}
     void    setShiftStep(int ss)                {shiftStep = ss;}
+    void    setFTP(int watts)                   {ftp = watts;}
     void    setStepperPower(int sp)             {stepperPower = sp;}
     void    setStealthChop(bool sc)             {stealthchop = sc;}
     void    setInclineMultiplier(float im)      {inclineMultiplier = im;}
     void    setDoublePower(bool sp)             {doublePower = sp;}
     void    setSimulateHr(bool shr)             {simulateHr = shr;}
     void    setERGMode(bool erg)                {ERGMode = erg;}
+    void    setTargetWatts(int w)               {targetWatts = w;}
     void    setAutoUpdate(bool atupd)           {autoUpdate = atupd;}
+    void    setLogLevels(int ll)                {logLevels = ll;}
     void    setSsid(String sid)                 {ssid = sid;}
     void    setPassword(String pwd)             {password = pwd;} 
     void    setFoundDevices(String fdev)        {foundDevices = fdev;};
     void    setConnectedPowerMeter(String cpm)  {connectedPowerMeter = cpm;}
     void    setConnectedHeartMonitor(String cHr){connectedHeartMonitor = cHr;}
   
-    String  returnJSON();
-    void    saveToSPIFFS();
+    void    writeJSON(JsonStreamWriter &writer);
+    bool    writeJSONField(JsonStreamWriter &writer, size_t index);
+    bool    applyForm(const ConfigFormReader &readArg);
+    bool    saveToSPIFFS(bool force = false);
     void    loadFromSPIFFS();
     void    printFile();
 
-
+    private:
+    bool    loadFromJSON();
+    size_t  encodeRecord(uint8_t *record);
+    void    decodeRecord(const uint8_t *record, size_t length);
+    void    setDefault(const ConfigField &field);
+    bool    setField(const ConfigField &field, float value);
+    bool    setField(const ConfigField &field, String value);
 };
 
+// The HR to power calibration. Its fields are listed in pwcFields (SmartSpin_parameters.cpp) the same way.
 class physicalWorkingCapacity
 {
 public:
@@ -93,12 +179,25 @@ int     session2Pwr;
 bool    hr2Pwr;
 
 void    setDefaults();
-String  returnJSON();
+void    writeJSON(JsonStreamWriter &writer);
+bool    writeJSONField(JsonStreamWriter &writer, size_t index);
+bool    applyForm(const ConfigFormReader &readArg);
 void    saveToSPIFFS();
 void    loadFromSPIFFS();
 void    printFile();
 
 };
 
+/*********************************Persistence*********************************/
+// Changes are marked dirty and written by configPersistUpdate() once nothing changed for CONFIG_SAVE_DELAY,
+// so a burst of form posts or slider moves costs one write. configFlush() writes right away (before a restart or update).
+
+#define CONFIG_DIRTY_USER   0x01 //userConfig
+#define CONFIG_DIRTY_PWC    0x02 //userPWC
+
+void    configMarkDirty(uint8_t what);
+void    configPersistUpdate();
+void    configFlush();
+
 #endif
 
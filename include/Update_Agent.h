@@ -0,0 +1,53 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+// Firmware updates run in a low priority background task once the ride stack is up.
+// The firmware (as a delta patch when the server has one, see Update_Delta.h) is streamed into
+// the inactive OTA partition while the unit keeps working, hashed with SHA-256 as it arrives and
+// resumed with an HTTP Range request if the transfer drops or a ride starts. Web files are updated
+// one by one from the server's manifest. Everything that takes the unit offline (a whole
+// filesystem image, the reboot) waits until nobody has been riding for UPDATE_IDLE_TIME, and a
+// filesystem image is abandoned rather than paused if a ride starts anyway.
+
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+
+#include "settings.h"
+
+typedef std::function<bool(size_t total)> UpdateStart;
+typedef std::function<bool(const uint8_t *data, size_t length)> UpdateSink;
+
+class UpdateAgent
+{
+public:
+    void    begin();
+    void    rebootWhenIdle();
+    bool    busy()      {return updating;}
+    void    run();
+
+private:
+    TaskHandle_t    task            = nullptr;
+    volatile bool   rebootPending   = false;
+    volatile bool   updating        = false;
+
+    bool    fetchText(const String &url, String &text);
+    bool    fetchHash(const String &url, String &sha256);
+    bool    download(const String &url, const String &sha256, const UpdateStart &start, const UpdateSink &sink, bool abortOnRide = false);
+    bool    installImage(const String &url, const String &sha256, int command, bool abortOnRide = false);
+    bool    installFirmware(const String &base);
+    bool    syncFiles(const String &base, bool &complete);
+    bool    updateFilesystem();
+    bool    checkForUpdate();
+    void    waitForIdle();
+    void    reboot();
+};
+
+extern UpdateAgent updateAgent;
+
+void updateAgentTask(void *pvParameters);
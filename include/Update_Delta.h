@@ -0,0 +1,95 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+// Firmware delta patches, made by tools/make_delta.py. A patch is a DeltaHeader followed by a zlib
+// stream of ops that rebuild the new image from the running one:
+//   ADD    u8 1, u32 source offset, u32 length, then length bytes added (mod 256) to the source bytes
+//   INSERT u8 2, u32 length, then length new bytes
+//   END    u8 0
+// Recompiled code mostly moves around and has its addresses shifted, so the ADD bytes are nearly
+// all zeros or repeats and the patch compresses to a small fraction of the image. The patch is fed
+// in as it downloads and the rebuilt image goes straight into the inactive OTA partition.
+
+#pragma once
+
+#include <Arduino.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+
+//mbedtls 3 dropped the _ret suffix
+#if defined(MBEDTLS_VERSION_MAJOR) && MBEDTLS_VERSION_MAJOR >= 3
+#define sha256Starts(ctx) mbedtls_sha256_starts((ctx), 0)
+#define sha256Update(ctx, data, length) mbedtls_sha256_update((ctx), (data), (length))
+#define sha256Finish(ctx, out) mbedtls_sha256_finish((ctx), (out))
+#else
+#define sha256Starts(ctx) mbedtls_sha256_starts_ret((ctx), 0)
+#define sha256Update(ctx, data, length) mbedtls_sha256_update_ret((ctx), (data), (length))
+#define sha256Finish(ctx, out) mbedtls_sha256_finish_ret((ctx), (out))
+#endif
+
+#define DELTA_MAGIC         "S2KD"
+#define DELTA_VERSION       1
+
+#define DELTA_OP_END        0
+#define DELTA_OP_ADD        1
+#define DELTA_OP_INSERT     2
+
+struct DeltaHeader
+{
+    char        magic[4];
+    uint32_t    version;
+    uint32_t    sourceSize;
+    uint8_t     sourceSHA256[32];
+    uint32_t    targetSize;
+    uint8_t     targetSHA256[32];
+};
+
+struct tinfl_decompressor_tag;
+
+class DeltaPatch
+{
+public:
+    bool    write(const uint8_t *data, size_t length);
+    bool    end();
+    void    abort();
+
+private:
+    enum ParseState : uint8_t
+    {
+        DELTA_HEADER,
+        DELTA_OP,
+        DELTA_ARGS,
+        DELTA_DATA,
+        DELTA_DONE,
+        DELTA_FAILED
+    };
+
+    ParseState                      state       = DELTA_HEADER;
+    DeltaHeader                     header;
+    size_t                          headerBytes = 0;
+    struct tinfl_decompressor_tag  *inflator    = nullptr;
+    uint8_t                        *dictionary  = nullptr;
+    size_t                          dictOffset  = 0;
+    const esp_partition_t          *source      = nullptr;
+    mbedtls_sha256_context          targetHash;
+    bool                            hashing     = false;
+
+    uint8_t     op          = 0;
+    uint8_t     args[8];
+    size_t      argBytes    = 0;
+    uint32_t    sourceOffset = 0;
+    uint32_t    remaining   = 0;
+    uint32_t    written     = 0;
+
+    bool    start();
+    bool    checkSource();
+    bool    inflate(const uint8_t *data, size_t length);
+    bool    apply(uint8_t *data, size_t length);
+    bool    output(uint8_t *data, size_t length);
+    bool    fail(const char *reason);
+    void    release();
+};
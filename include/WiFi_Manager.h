@@ -0,0 +1,73 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+// Keeps the station connection up in the background. The ESP32 WiFi events only flag what happened,
+// the manager task does the rest: retries with exponential backoff, runs the setup AP next to the
+// station while the network is missing, and follows every change with mDNS and the captive portal DNS.
+// The BSSID and channel of the last good connection are kept in NVS so the next association skips the scan.
+
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+#include "settings.h"
+
+enum WiFiManagerState : uint8_t
+{
+    WIFI_STATE_OFF          = 0,
+    WIFI_STATE_CONNECTING   = 1, //Station attempt running, or waiting for the next one
+    WIFI_STATE_CONNECTED    = 2,
+    WIFI_STATE_AP_ONLY      = 3  //No network configured, only the setup AP
+};
+
+//Event flags set from the WiFi event task
+#define WIFI_EVENT_FLAG_GOT_IP          0x01
+#define WIFI_EVENT_FLAG_DISCONNECTED    0x02
+
+class WiFiManager
+{
+public:
+    void                begin();
+    void                update();
+    void                onEvent(WiFiEvent_t event);
+    WiFiManagerState    state()         {return currentState;}
+    bool                staConnected()  {return currentState == WIFI_STATE_CONNECTED;}
+    bool                apActive()      {return apUp;}
+    bool                waitConnected(unsigned long timeoutMs);
+    IPAddress           ip();
+
+private:
+    volatile WiFiManagerState   currentState    = WIFI_STATE_OFF;
+    volatile uint8_t            pendingEvents   = 0;
+    portMUX_TYPE                eventMux        = portMUX_INITIALIZER_UNLOCKED;
+    TaskHandle_t                task            = nullptr;
+
+    bool            apUp            = false;
+    bool            attemptRunning  = false;
+    bool            useCache        = true;
+    bool            timeConfigured  = false;
+    unsigned long   attemptStarted  = 0;
+    unsigned long   retryAt         = 0;
+    unsigned long   retryDelay      = WIFI_RETRY_MIN;
+
+    uint8_t         cachedBSSID[6];
+    int32_t         cachedChannel   = 0;
+
+    void    connect();
+    void    attemptFailed();
+    void    connected();
+    void    startAP();
+    void    stopAP();
+    void    restartMDNS();
+    bool    loadCache();
+    void    saveCache();
+};
+
+extern WiFiManager wifiManager;
+
+void wifiManagerTask(void *pvParameters);
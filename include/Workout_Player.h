@@ -0,0 +1,100 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+// Plays a structured workout without an app. The workout is a list of steps (tools/zwo_convert.py
+// makes one from a .zwo file) loaded from SPIFFS. An esp_timer ticks every WORKOUT_TICK_INTERVAL,
+// interpolates the ERG target along ramps and runs the ERG controller, so the target doesn't wait
+// on app writes. While a workout runs the shifters change its intensity and holding both skips a
+// step. An app taking ERG or SIM control stops the workout. ERG needs a power meter: a workout
+// doesn't start without one and rides its steps free while the meter is gone.
+
+#pragma once
+
+#include <Arduino.h>
+#include <esp_timer.h>
+
+#include "settings.h"
+#include "JSON_Stream_Writer.h"
+
+#define WORKOUT_MAGIC   0x4B575353  //"SSWK"
+#define WORKOUT_VERSION 1
+
+//Step flags
+#define WORKOUT_STEP_FREE   0x01    //No ERG target, the rider rides freely
+
+//File layout, little endian: a WorkoutHeader followed by stepCount WorkoutSteps
+struct WorkoutHeader
+{
+    uint32_t    magic;
+    uint8_t     version;
+    uint8_t     reserved;
+    uint16_t    stepCount;
+    char        name[24];           //Zero padded
+};
+
+struct WorkoutStep
+{
+    uint16_t    duration;           //s
+    uint16_t    startPower;         //0.1% of FTP
+    uint16_t    endPower;           //Same as startPower unless it's a ramp
+    uint8_t     flags;
+    uint8_t     reserved;
+};
+
+//Why start() did or didn't start a workout
+enum WorkoutStartResult : uint8_t
+{
+    WORKOUT_STARTED,
+    WORKOUT_NOT_FOUND,          //No such file
+    WORKOUT_INVALID,            //Not a workout file, or one from another version
+    WORKOUT_NO_POWER_METER,     //ERG can't hold a target without one
+    WORKOUT_NO_TIMER            //The tick timer couldn't be created
+};
+
+class WorkoutPlayer
+{
+public:
+    // Loads WORKOUT_PATH_PREFIX + name + WORKOUT_FILE_SUFFIX and starts it
+    WorkoutStartResult start(const String &name);
+    void        stop();
+    void        skip()                  {skipPending = true;}
+    bool        running()               {return active;}
+    // From the shifter interrupts: +1 harder, -1 easier. Only the interrupts change offsetSteps, and
+    // it stops at WORKOUT_OFFSET_MAX so shifting back works right away.
+    void IRAM_ATTR shift(int direction)
+    {
+        int next = offsetSteps + direction;
+        if (abs(next) * WORKOUT_OFFSET_STEP <= WORKOUT_OFFSET_MAX)
+        {
+            offsetSteps = next;
+        }
+    }
+    void        writeJSON(JsonStreamWriter &writer);
+    // esp_timer callback
+    void        tick();
+
+private:
+    esp_timer_handle_t  timer           = nullptr;
+    WorkoutStep         steps[WORKOUT_MAX_STEPS];
+    char                name[sizeof(WorkoutHeader::name) + 1] = {};
+    uint16_t            stepCount       = 0;
+    uint16_t            stepIndex       = 0;
+    int64_t             stepStartedAt   = 0;    //esp_timer_get_time() (us)
+    int64_t             lastERGAt       = 0;
+    int                 targetWatts     = 0;
+    volatile bool       active          = false;
+    volatile bool       skipPending     = false;
+    volatile int8_t     offsetSteps     = 0;
+    portMUX_TYPE        playerMux       = portMUX_INITIALIZER_UNLOCKED;
+
+    WorkoutStartResult load(const String &path);
+    int     offsetPercent()             {return offsetSteps * WORKOUT_OFFSET_STEP;}
+};
+
+extern WorkoutPlayer workoutPlayer;
+
+void workoutTick(void *arg);
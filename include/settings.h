@@ -25,6 +25,10 @@
 //and put it in /include/cert.h
 #define FW_UPDATEURL "https://raw.githubusercontent.com/doudar/OTAUpdates/main/"
 
+//Accept a plain http:// update URL. Only for testing against tools/update_server.py on a local network,
+//nothing authenticates the image then.
+#define FW_ALLOW_PLAIN_HTTP false
+
 //File that contains Version info
 #define FW_VERSIONFILE "version.txt"
 
@@ -34,12 +38,95 @@
 //Path to the latest filesystem
 #define FW_SPIFFSFILE "spiffs.bin"
 
-//name of local file to save configuration in SPIFFS
+//File next to each image with its SHA-256 in hex ("firmware.bin.sha256"). An image without one isn't installed.
+#define FW_HASH_SUFFIX ".sha256"
+
+//Delta patch from the running version, "firmware-<FIRMWARE_VERSION>.delta". Made by tools/make_delta.py.
+#define FW_DELTA_SUFFIX ".delta"
+
+//Server folder with the individual web files and their manifest (tools/compress_data.py output)
+#define FW_DATA_DIR "data"
+
+//Scratch file for downloads that replace a file in place
+#define FW_TEMP_FILE "/update.tmp"
+
+//Download buffer, transfer retries and the wait (ms) between them for background updates
+#define UPDATE_CHUNK_SIZE 1024
+#define UPDATE_MAX_RESUMES 5
+#define UPDATE_RESUME_DELAY 5000
+
+//A transfer that gets no data for this long (ms) is dropped and resumed
+#define UPDATE_STREAM_TIMEOUT 10000
+
+//How long (ms) nobody has to be riding before an update writes the filesystem or reboots
+#define UPDATE_IDLE_TIME 60000
+
+//name of local file to save configuration in SPIFFS. Only read once to migrate to the binary config slots.
 #define configFILENAME "/config.txt"
 
+//A/B pair of files holding the binary config record
+#define configSLOT_A "/config.a"
+#define configSLOT_B "/config.b"
+
+//Time (ms) without further changes before modified settings are written to flash
+#define CONFIG_SAVE_DELAY 2000
+
+//Binary config record format version. Fields are stored by name, so adding or removing one doesn't need a new version.
+#define CONFIG_RECORD_VERSION 1
+
+//Ride recorder ring file and its size in blocks. 240 blocks hold several hours at one sample a second.
+//A block is the data a SPIFFS page holds (256 byte page less its 5 byte header), so every block sits in
+//exactly one data page and rewriting it costs that page and an index page update.
+#define RIDE_RING_FILE "/rides.bin"
+#define RIDE_RING_BLOCKS 240
+#define RIDE_BLOCK_SIZE 251
+
+//Max samples in one packed ride block. Bounds the RAM buffer and what a power cut can lose (2 minutes at 1 Hz).
+#define RIDE_PACKED_MAX_SAMPLES 120
+
+//Time (ms) between ride samples
+#define RIDE_SAMPLE_INTERVAL 1000
+
+//An app that reconnects within this time (ms) continues the same ride
+#define RIDE_RESUME_TIMEOUT 300000
+
+//Max number of rides listed from the recorder
+#define RIDE_MAX_LISTED 16
+
+//Seconds of power kept for the power curve. Has to cover its longest duration.
+#define POWER_CURVE_HISTORY 3600
+
+//Save improved power curve bests at most this often during a ride (ms)
+#define POWER_CURVE_SAVE_INTERVAL 600000
+
+//FTP estimate in percent of the best 20 minute power
+#define POWER_CURVE_FTP_PERCENT 95
+
+//Workout files are stored as WORKOUT_PATH_PREFIX + name + WORKOUT_FILE_SUFFIX
+#define WORKOUT_PATH_PREFIX "/wk/"
+#define WORKOUT_FILE_SUFFIX ".wkt"
+
+//Most steps a workout file may have
+#define WORKOUT_MAX_STEPS 200
+
+//Workout timeline resolution (ms). The ERG target follows ramps at this rate.
+#define WORKOUT_TICK_INTERVAL 100
+
+//How often the workout runs the ERG controller (ms). Step changes run it right away.
+#define WORKOUT_ERG_INTERVAL 1000
+
+//Intensity change per shift during a workout (%)
+#define WORKOUT_OFFSET_STEP 5
+
+//Largest intensity change the shifters can make (%)
+#define WORKOUT_OFFSET_MAX 50
+
 //name of local file to save Physical Working Capacity in Spiffs
 #define userPWCFILENAME "/userPWC.txt"
 
+//Default functional threshold power (W), used for intensity and TSS until the rider sets theirs
+#define DEFAULT_FTP 200
+
 //Default Stepper Power
 #define STEPPER_POWER 1000
 
@@ -88,15 +175,61 @@
 //Give up scanning for the lost connection after this many tries: 
 #define MAX_SCAN_RETRIES 1
 
+//BLE scan interval and window (ms) when no app is connected
+#define SCAN_INTERVAL 550
+#define SCAN_WINDOW 500
+
+//BLE scan interval and window (ms) while an app is connected. Keeps the scan duty cycle low during a ride.
+#define RIDE_SCAN_INTERVAL 300
+#define RIDE_SCAN_WINDOW 30
+
 //loop speed for the SmartSpin2k BLE Server
 #define BLE_NOTIFY_DELAY 1000
 
+//Fast advertising interval (0.625ms units) used right after boot, a disconnect or a shifter gesture
+#define ADV_FAST_MIN_INTERVAL 32
+#define ADV_FAST_MAX_INTERVAL 48
+
+//Slow advertising interval (0.625ms units) used for the rest of the time
+#define ADV_SLOW_MIN_INTERVAL 668
+#define ADV_SLOW_MAX_INTERVAL 700
+
+//How long (ms) to advertise fast before backing off
+#define ADV_FAST_WINDOW 30000
+
+//Wheel revolutions per crank revolution used to compute virtual speed
+#define VIRTUAL_GEAR_RATIO 2.75
+
+//Wheel circumference in meters used to compute virtual speed
+#define WHEEL_CIRCUMFERENCE 2.08
+
+//Power meter crank data older than this (ms) is considered stale and crank events are synthesized from cadence instead
+#define CPM_PASSTHROUGH_TIMEOUT 3000
+
 //loop speed for the SmartSpin2k BLE Client reconnect 
 #define BLE_CLIENT_DELAY 998
 
-//loop speed for the Webserver
+//loop speed for the Webserver task (captive portal DNS, event stream and deferred actions)
 #define WEBSERVER_DELAY 30
 
+//Time (ms) a deferred web action waits so the response that triggered it gets sent first
+#define WEB_ACTION_DELAY 500
+
+//Asset list written by tools/compress_data.py and the max number of entries read from it
+#define WEB_ASSET_MANIFEST "/manifest.txt"
+#define WEB_ASSET_MAX_FILES 16
+
+//Cache-Control for pages and for everything else (css, icons). Pages are revalidated with their ETag on every load
+//so a filesystem update shows up right away, the rest is kept for a day.
+#define WEB_PAGE_CACHE_CONTROL "no-cache"
+#define WEB_ASSET_CACHE_CONTROL "max-age=86400"
+
+//Max number of browsers connected to the /events stream at once
+#define WEB_EVENT_MAX_VIEWERS 3
+
+//Minimum time (ms) between telemetry events
+#define WEB_EVENT_TELEMETRY_INTERVAL 250
+
 //Name of default Power Meter. any connects to anything, none connects to nothing.
 #define CONNECTED_POWER_METER "any"
 
@@ -109,11 +242,43 @@
 //stealthchop enabled by default
 #define STEALTHCHOP true
 
-//how long to try STA mode before falling back to AP mode
+//how long (s) a station connection attempt may take before the setup AP is started next to it
 #define WIFI_CONNECT_TIMEOUT 10
 
-//Max size of userconfig
-#define USERCONFIG_JSON_SIZE 768
+//Delay (ms) before the first station retry. Doubles with every failed attempt up to WIFI_RETRY_MAX.
+#define WIFI_RETRY_MIN 2000
+#define WIFI_RETRY_MAX 60000
+
+//loop speed for the WiFi manager when the captive portal DNS isn't running. WiFi events wake it up early.
+#define WIFI_MANAGER_DELAY 1000
+
+//How long (ms) the boot waits for NTP time before the update check runs without it
+#define BOOT_NTP_TIMEOUT 10000
+
+//Highest log level compiled in (1 error, 2 warning, 3 info, 4 debug, 5 verbose).
+//Anything above is removed at compile time. Add -D SS2K_LOG_COMPILE_LEVEL=4 to build_flags for packet dumps.
+#ifndef SS2K_LOG_COMPILE_LEVEL
+#define SS2K_LOG_COMPILE_LEVEL 3
+#endif
+
+//Default runtime log level of each category, 4 bits per category (main, BLE client, BLE server, stepper, HTTP, config)
+#define LOG_DEFAULT_LEVELS 0x333333
+
+//Number of records in the log ring buffer. Must be a power of two.
+#define LOG_RING_RECORDS 64
+
+//Max number of records a single text message is split into
+#define LOG_MAX_TEXT_RECORDS 8
+
+//Longest formatted log message
+#define LOG_LINE_LENGTH 384
+
+//loop speed for the log drain task
+#define LOG_DRAIN_DELAY 20
+
+//Number of log messages and their max length kept for the web page
+#define LOG_HISTORY_SEGMENTS 24
+#define LOG_HISTORY_LENGTH 96
 
 //Uncomment to enable sending Telegram debug messages back to the chat specified in telegram_token.h
 #define USE_TELEGRAM
@@ -0,0 +1,107 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#include "Main.h"
+#include "BLE_Common.h"
+
+#include <NimBLEDevice.h>
+
+BLEAdvertisingManager advertisingManager;
+
+// Packs the advertisement as tightly as possible:
+// Advertising data (31 bytes max): Flags (3) + Complete list of 16 bit service UUIDs (2 + 2 per UUID)
+// Scan response    (31 bytes max): Complete local name (2 + name)
+void BLEAdvertisingManager::setup()
+{
+    static const char serviceUUIDs[] = {
+        9, BLE_HS_ADV_TYPE_COMP_UUIDS16,
+        0x26, 0x18, //Fitness Machine
+        0x18, 0x18, //Cycling Power
+        0x16, 0x18, //Cycling Speed and Cadence
+        0x0D, 0x18, //Heart Rate
+    };
+
+    NimBLEAdvertisementData advData;
+    advData.setFlags(BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP);
+    advData.addData(std::string(serviceUUIDs, sizeof(serviceUUIDs)));
+
+    NimBLEAdvertisementData scanResponseData;
+    scanResponseData.setName(userConfig.getDeviceName());
+
+    NimBLEAdvertising *pAdvertising = NimBLEDevice::getAdvertising();
+    pAdvertising->setAdvertisementData(advData);
+    pAdvertising->setScanResponseData(scanResponseData);
+    pAdvertising->setScanResponse(true);
+
+    //We restart advertising ourselves so the interval matches the situation.
+    NimBLEDevice::getServer()->advertiseOnDisconnect(false);
+}
+
+void BLEAdvertisingManager::fastAdvertise()
+{
+    fastUntil = millis() + ADV_FAST_WINDOW;
+    if (!slotsFull())
+    {
+        start(true);
+    }
+}
+
+// Called from the BLE notify loop.
+void BLEAdvertisingManager::update()
+{
+    NimBLEAdvertising *pAdvertising = NimBLEDevice::getAdvertising();
+    if (slotsFull())
+    {
+        if (pAdvertising->isAdvertising())
+        {
+            SS2K_LOG_TEXT(LOG_CAT_BLE_SERVER, "All connection slots in use. Advertising stopped.");
+            pAdvertising->stop();
+        }
+        return;
+    }
+
+    bool wantFast = (long)(fastUntil - millis()) > 0;
+    if (!pAdvertising->isAdvertising() || (fast != wantFast))
+    {
+        start(wantFast);
+    }
+}
+
+void BLEAdvertisingManager::start(bool fastInterval)
+{
+    NimBLEAdvertising *pAdvertising = NimBLEDevice::getAdvertising();
+    if (pAdvertising->isAdvertising())
+    {
+        pAdvertising->stop();
+    }
+    if (fastInterval)
+    {
+        pAdvertising->setMinInterval(ADV_FAST_MIN_INTERVAL);
+        pAdvertising->setMaxInterval(ADV_FAST_MAX_INTERVAL);
+    }
+    else
+    {
+        pAdvertising->setMinInterval(ADV_SLOW_MIN_INTERVAL);
+        pAdvertising->setMaxInterval(ADV_SLOW_MAX_INTERVAL);
+    }
+    fast = fastInterval;
+    pAdvertising->start();
+    SS2K_LOGI(LOG_CAT_BLE_SERVER, "Advertising %s", fastInterval ? "fast" : "slow");
+}
+
+bool BLEAdvertisingManager::slotsFull()
+{
+    int links = NimBLEDevice::getServer()->getConnectedCount();
+    for (auto &pClient : *NimBLEDevice::getClientList())
+    {
+        if (pClient->isConnected())
+        {
+            links++;
+        }
+    }
+    return links >= CONFIG_BT_NIMBLE_MAX_CONNECTIONS;
+}
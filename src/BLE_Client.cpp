@@ -47,7 +47,7 @@ void bleClientTask(void *pvParameters)
         {
             if (spinBLEClient.connectToServer())
             {
-                debugDirector("We are now connected to the BLE Server.");
+                SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "We are now connected to the BLE Server.");
             }
             else
             {
@@ -71,33 +71,25 @@ static void notifyCallback(
     size_t length,
     bool isNotify)
 {
-    //Write the recieved data to the Debug Director
-    String debugOutput = "";
-    for (int i = 0; i < length; i++)
-    {
-        debugOutput += String(pData[i], HEX) + " ";
-    }
-    debugDirector(debugOutput + "<-- " + String(pBLERemoteCharacteristic->getUUID().toString().c_str()), false, true);
+    connParams.recordNotify(pBLERemoteCharacteristic->getRemoteService()->getClient()->getConnId());
+
+    SS2K_LOG_HEXD(LOG_CAT_BLE_CLIENT, "Notify <--", pData, length);
 
     {
         std::unique_ptr<SensorData> sensorData = SensorDataFactory::getSensorData(pBLERemoteCharacteristic, pData, length);
-        debugDirector(" SensorData(" + sensorData->getId() + "):[", false);
         if (sensorData->hasHeartRate()) {
             int heartRate = sensorData->getHeartRate();
             userConfig.setSimulatedHr(heartRate);
-            debugDirector(" HR(" + String(heartRate) + ")", false);
         }
         if (sensorData->hasCadence()) {
             float cadence = sensorData->getCadence();
             userConfig.setSimulatedCad(cadence);
-            debugDirector(" CD(" + String(cadence) + ")", false);
         }
         if (sensorData->hasPower()) {
             int power = sensorData->getPower();
             userConfig.setSimulatedWatts(power);
-            debugDirector(" PW(" + String(power) + ")", false);
         }
-        debugDirector(" ]");
+        SS2K_LOGD(LOG_CAT_BLE_CLIENT, " SensorData:[ HR(%d) CD(%.2f) PW(%d) ]", userConfig.getSimulatedHr(), userConfig.getSimulatedCad(), userConfig.getSimulatedWatts());
     }
 
     //Calculate Cadence and power from Cycling Power Measurement
@@ -108,9 +100,11 @@ static void notifyCallback(
             //first calculate which fields are present. Power is always 2 & 3, cadence can move depending on the flags.
             byte flags = pData[0];
             int cPos = 4; //lowest position cadence could ever be
+            spinBLEClient.pmFlags = bytes_to_int(pData[1], pData[0]);
             if (bitRead(flags, 0))
             {
                 //pedal balance field present
+                spinBLEClient.pmPedalPowerBalance = pData[cPos];
                 cPos++;
             }
             if (bitRead(flags, 1))
@@ -121,6 +115,7 @@ static void notifyCallback(
             if (bitRead(flags, 2))
             {
                 //accumulated torque field present
+                spinBLEClient.pmAccumulatedTorque = bytes_to_int(pData[cPos + 1], pData[cPos]);
                 cPos += 2;
             }
             if (bitRead(flags, 3))
@@ -137,6 +132,10 @@ static void notifyCallback(
             if (bitRead(flags, 5))
             {
                 //Crank Revolution data present, lets process it.
+                //Keep the raw pair so the server can forward real event times instead of synthesizing them.
+                spinBLEClient.pmCumulativeCrankRev = bytes_to_int(pData[cPos + 1], pData[cPos]);
+                spinBLEClient.pmLastCrankEvtTime = bytes_to_int(pData[cPos + 3], pData[cPos + 2]);
+                spinBLEClient.pmCrankDataTime = millis();
                 spinBLEClient.crankRev[1] = spinBLEClient.crankRev[0];
                 spinBLEClient.crankRev[0] = bytes_to_int(pData[cPos + 1], pData[cPos]);
                 spinBLEClient.crankEventTime[1] = spinBLEClient.crankEventTime[0];
@@ -167,8 +166,7 @@ static void notifyCallback(
                     spinBLEClient.noReadingIn++;
                 }
 
-                debugDirector(" CAD: " + String(userConfig.getSimulatedCad()), false);
-                debugDirector("");
+                SS2K_LOGD(LOG_CAT_BLE_CLIENT, " CAD: %.2f", userConfig.getSimulatedCad());
             }
 
             //Watts are so much easier......
@@ -181,7 +179,7 @@ static void notifyCallback(
 
         else
         {
-            debugDirector("Disconnecting secondary PM");
+            SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Disconnecting secondary PM");
             intentionalDisconnect = true;
             pBLERemoteCharacteristic->getRemoteService()->getClient()->disconnect();
             //NimBLEDevice::deleteClient(pBLERemoteCharacteristic->getRemoteService()->getClient()); //this was an old client, disconnect it.
@@ -191,7 +189,7 @@ static void notifyCallback(
 
 bool SpinBLEClient::connectToServer()
 {
-    debugDirector("Initiating Server Connection");
+    SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Initiating Server Connection");
     NimBLEUUID serviceUUID;
     NimBLEUUID charUUID;
 
@@ -204,19 +202,19 @@ bool SpinBLEClient::connectToServer()
         {
             serviceUUID = FLYWHEEL_UART_SERVICE_UUID;
             charUUID = FLYWHEEL_UART_TX_UUID;
-            debugDirector("trying to connect to Flywheel Bike");
+            SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "trying to connect to Flywheel Bike");
         }
         else if (myDevice->isAdvertisingService(CYCLINGPOWERSERVICE_UUID))
         {
             serviceUUID = CYCLINGPOWERSERVICE_UUID;
             charUUID = CYCLINGPOWERMEASUREMENT_UUID;
-            debugDirector("trying to connect to PM");
+            SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "trying to connect to PM");
         }
         else if (myDevice->isAdvertisingService(FITNESSMACHINESERVICE_UUID))
         {
             serviceUUID = FITNESSMACHINESERVICE_UUID;
             charUUID = FITNESSMACHINEINDOORBIKEDATA_UUID;
-            debugDirector("trying to connect to Fitness machine service");
+            SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "trying to connect to Fitness machine service");
         }
     }
     else if (doConnectHR)
@@ -224,11 +222,11 @@ bool SpinBLEClient::connectToServer()
         myDevice = myHeartMonitor;
         serviceUUID = HEARTSERVICE_UUID;
         charUUID = HEARTCHARACTERISTIC_UUID;
-        debugDirector("Trying to connect to HRM");
+        SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Trying to connect to HRM");
     }
     else
     {
-        debugDirector("no doConnect");
+        SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "no doConnect");
         return false;
     }
 
@@ -242,14 +240,14 @@ bool SpinBLEClient::connectToServer()
         //     *  This saves considerable time and power.
         //     *
         pClient = NimBLEDevice::getClientByPeerAddress(myDevice->getAddress());
-        debugDirector("Reusing Client");
+        SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Reusing Client");
         if (pClient)
         {
-            debugDirector("Client RSSI " + String(pClient->getRssi()));
-            debugDirector("device RSSI " + String(myDevice->getRSSI()));
+            SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Client RSSI " + String(pClient->getRssi()));
+            SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "device RSSI " + String(myDevice->getRSSI()));
             if (myDevice->getRSSI() == 0)
             {
-                debugDirector("no signal detected. abortng.");
+                SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "no signal detected. abortng.");
                 reconnectTries--;
                 return false;
             }
@@ -259,7 +257,7 @@ bool SpinBLEClient::connectToServer()
             {
                 Serial.println("Reconnect failed ");
                 reconnectTries--;
-                debugDirector(String(reconnectTries) + " left.");
+                SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, String(reconnectTries) + " left.");
                 if (reconnectTries < 1)
                 {
                     if (myDevice == myPowerMeter)
@@ -285,7 +283,7 @@ bool SpinBLEClient::connectToServer()
 
             if (pRemoteService == nullptr)
             {
-                debugDirector("Couldn't find Service");
+                SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Couldn't find Service");
                 reconnectTries--;
                 return false;
             }
@@ -294,7 +292,7 @@ bool SpinBLEClient::connectToServer()
 
             if (pRemoteCharacteristic == nullptr)
             {
-                debugDirector("Couldn't find Characteristic");
+                SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Couldn't find Characteristic");
                 reconnectTries--;
                 return false;
             }
@@ -305,25 +303,27 @@ bool SpinBLEClient::connectToServer()
                 pRemoteCharacteristic->subscribe(true, notifyCallback);
                 if (myDevice == myPowerMeter)
                 {
-                    debugDirector("Found PM on reconnect");
+                    SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Found PM on reconnect");
                     connectedPM = true;
                     doConnectPM = false;
                     reconnectTries = MAX_RECONNECT_TRIES;
                     lastConnectedPMID = pClient->getConnId();
+                    connParams.addLink(pClient->getConnId(), LINK_POWER_METER);
                 }
 
                 if (myDevice == myHeartMonitor)
                 {
-                    debugDirector("Found HRM on reconnect");
+                    SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Found HRM on reconnect");
                     connectedHR = true;
                     doConnectHR = false;
                     reconnectTries = MAX_RECONNECT_TRIES;
+                    connParams.addLink(pClient->getConnId(), LINK_HEART_MONITOR);
                 }
                 return true;
             }
             else
             {
-                debugDirector("Unable to subscribe to notifications");
+                SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Unable to subscribe to notifications");
                 return false;
             }
         }
@@ -333,7 +333,7 @@ bool SpinBLEClient::connectToServer()
 
         else
         {
-            debugDirector("No Previous client found");
+            SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "No Previous client found");
             pClient = NimBLEDevice::getDisconnectedClient();
         }
     }
@@ -342,38 +342,40 @@ bool SpinBLEClient::connectToServer()
     {
         String t_name = myDevice->getName().c_str();
     }
-    debugDirector("Forming a connection to: " + t_name + " " + String(myDevice->getAddress().toString().c_str()));
+    SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Forming a connection to: " + t_name + " " + String(myDevice->getAddress().toString().c_str()));
     pClient = NimBLEDevice::createClient();
-    debugDirector(" - Created client", false);
+    SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, " - Created client", false);
     pClient->setClientCallbacks(new MyClientCallback(), true);
     // Connect to the remove BLE Server.
-    pClient->setConnectionParams(80, 80, 0, 200);
+    uint16_t minInterval, maxInterval, latency, timeout;
+    connParams.getParams((myDevice == myPowerMeter) ? LINK_POWER_METER : LINK_HEART_MONITOR, &minInterval, &maxInterval, &latency, &timeout);
+    pClient->setConnectionParams(minInterval, maxInterval, latency, timeout);
     /** Set how long we are willing to wait for the connection to complete (seconds), default is 30. */
     pClient->setConnectTimeout(5);
     pClient->connect(myDevice->getAddress()); // if you pass BLEAdvertisedDevice instead of address, it will be recognized type of peer device address (public or private)
-    debugDirector(" - Connected to server", true);
-    debugDirector(" - RSSI " + pClient->getRssi(), true);
+    SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, " - Connected to server", true);
+    SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, " - RSSI " + pClient->getRssi(), true);
 
     // Obtain a reference to the service we are after in the remote BLE server.
     BLERemoteService *pRemoteService = pClient->getService(serviceUUID);
     if (pRemoteService == nullptr)
     {
-        debugDirector("Failed to find service:" + String(serviceUUID.toString().c_str()));
+        SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Failed to find service:" + String(serviceUUID.toString().c_str()));
     }
     else
     {
-        debugDirector(" - Found service:" + String(pRemoteService->getUUID().toString().c_str()));
+        SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, " - Found service:" + String(pRemoteService->getUUID().toString().c_str()));
         sucessful++;
 
         // Obtain a reference to the characteristic in the service of the remote BLE server.
         pRemoteCharacteristic = pRemoteService->getCharacteristic(charUUID);
         if (pRemoteCharacteristic == nullptr)
         {
-            debugDirector("Failed to find our characteristic UUID: " + String(charUUID.toString().c_str()));
+            SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Failed to find our characteristic UUID: " + String(charUUID.toString().c_str()));
         }
         else
         {
-            debugDirector(" - Found Characteristic:" + String(pRemoteCharacteristic->getUUID().toString().c_str()));
+            SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, " - Found Characteristic:" + String(pRemoteCharacteristic->getUUID().toString().c_str()));
             sucessful++;
         }
 
@@ -381,19 +383,19 @@ bool SpinBLEClient::connectToServer()
         if (pRemoteCharacteristic->canRead())
         {
             std::string value = pRemoteCharacteristic->readValue();
-            debugDirector("The characteristic value was: " + String(value.c_str()));
+            SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "The characteristic value was: " + String(value.c_str()));
         }
 
         if (pRemoteCharacteristic->canNotify())
         {
-            debugDirector("Subscribed to notifications");
+            SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Subscribed to notifications");
             pRemoteCharacteristic->subscribe(true, notifyCallback);
             reconnectTries = MAX_RECONNECT_TRIES;
             scanRetries = MAX_SCAN_RETRIES;
         }
         else
         {
-            debugDirector("Unable to subscribe to notifications");
+            SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Unable to subscribe to notifications");
         }
     }
     if (sucessful > 0)
@@ -403,20 +405,22 @@ bool SpinBLEClient::connectToServer()
         {
             connectedPM = true;
             doConnectPM = false;
-            debugDirector("Sucessful PM");
+            SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Sucessful PM");
             lastConnectedPMID = pClient->getConnId();
+            connParams.addLink(pClient->getConnId(), LINK_POWER_METER);
         }
 
         if (myDevice == myHeartMonitor)
         {
             connectedHR = true;
             doConnectHR = false;
-            debugDirector("Sucessful HRM");
+            SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Sucessful HRM");
+            connParams.addLink(pClient->getConnId(), LINK_HEART_MONITOR);
         }
         reconnectTries = MAX_RECONNECT_TRIES;
         return true;
     }
-    debugDirector("disconnecting Client");
+    SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "disconnecting Client");
     pClient->disconnect();
     return false;
 }
@@ -436,14 +440,14 @@ void SpinBLEClient::MyClientCallback::onDisconnect(BLEClient *pclient)
     }
     if ((pclient->getService(HEARTSERVICE_UUID)) && (!(pclient->isConnected())))
     {
-        debugDirector("Detected HR Disconnect. Trying rapid reconnect");
+        SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Detected HR Disconnect. Trying rapid reconnect");
         spinBLEClient.doConnectHR = true; //try rapid reconnect
         return;
     }
     if ((pclient->getService(CYCLINGPOWERSERVICE_UUID) || pclient->getService(FLYWHEEL_UART_SERVICE_UUID) || pclient->getService(FITNESSMACHINESERVICE_UUID)) && (!(pclient->isConnected())))
     {
 
-        debugDirector("Detected PM Disconnect. Trying rapid reconnect");
+        SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Detected PM Disconnect. Trying rapid reconnect");
         spinBLEClient.doConnectPM = true; //try rapid reconnect
         return;
     }
@@ -453,18 +457,18 @@ void SpinBLEClient::MyClientCallback::onDisconnect(BLEClient *pclient)
 ****** Note: these are the same return values as defaults ********/
 uint32_t SpinBLEClient::MyClientCallback::onPassKeyRequest()
 {
-    debugDirector("Client PassKeyRequest");
+    SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Client PassKeyRequest");
     return 123456;
 }
 bool SpinBLEClient::MyClientCallback::onConfirmPIN(uint32_t pass_key)
 {
-    debugDirector("The passkey YES/NO number: " + String(pass_key));
+    SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "The passkey YES/NO number: " + String(pass_key));
     return true;
 }
 
 void SpinBLEClient::MyClientCallback::onAuthenticationComplete(ble_gap_conn_desc desc)
 {
-    debugDirector("Starting BLE work!");
+    SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Starting BLE work!");
 }
 /*******************************************************************/
 
@@ -474,7 +478,7 @@ void SpinBLEClient::MyClientCallback::onAuthenticationComplete(ble_gap_conn_desc
 
 void SpinBLEClient::MyAdvertisedDeviceCallback::onResult(BLEAdvertisedDevice *advertisedDevice)
 {
-    debugDirector("BLE Advertised Device found: " + String(advertisedDevice->toString().c_str()));
+    SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "BLE Advertised Device found: " + String(advertisedDevice->toString().c_str()));
     const char *c_PM = userConfig.getconnectedPowerMeter();
     const char *c_HR = userConfig.getconnectedHeartMonitor();
     if ((advertisedDevice->haveServiceUUID()) && (advertisedDevice->isAdvertisingService(CYCLINGPOWERSERVICE_UUID) || advertisedDevice->isAdvertisingService(FLYWHEEL_UART_SERVICE_UUID) || advertisedDevice->isAdvertisingService(FITNESSMACHINESERVICE_UUID)))
@@ -502,17 +506,26 @@ void SpinBLEClient::MyAdvertisedDeviceCallback::onResult(BLEAdvertisedDevice *ad
 void SpinBLEClient::scanProcess()
 {
     //doConnect = connectRequest;
-    debugDirector("Scanning for BLE servers and putting them into a list...");
+    if (!radioScheduler.acquire(RADIO_SCAN))
+    {
+        SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Radio busy. Postponing scan.");
+        scanRetries++; //doScan is still set, so try again next loop
+        return;
+    }
+    SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Scanning for BLE servers and putting them into a list...");
 
     // Retrieve a Scanner and set the callback we want to use to be informed when we
     // have detected a new device.  Specify that we want active scanning and start the
     // scan to run for 5 seconds.
     BLEScan *pBLEScan = BLEDevice::getScan();
     pBLEScan->setAdvertisedDeviceCallbacks(new MyAdvertisedDeviceCallback());
-    pBLEScan->setInterval(550);
-    pBLEScan->setWindow(500);
+    pBLEScan->setInterval(radioScheduler.scanInterval());
+    pBLEScan->setWindow(radioScheduler.scanWindow());
     pBLEScan->setActiveScan(true);
+    connParams.setScanning(true);
     BLEScanResults foundDevices = pBLEScan->start(10, false);
+    connParams.setScanning(false);
+    radioScheduler.release(RADIO_SCAN);
     // Load the scan into a Json String
     int count = foundDevices.getCount();
 
@@ -542,7 +555,7 @@ void SpinBLEClient::scanProcess()
 
     String output;
     serializeJson(devices, output);
-    debugDirector("Bluetooth Client Found Devices: " + output, true, true);
+    SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Bluetooth Client Found Devices: " + output, true, true);
     userConfig.setFoundDevices(output);
 }
 
@@ -560,7 +573,7 @@ void SpinBLEClient::disconnect()
     scanRetries = 0;
     reconnectTries = 0;
     intentionalDisconnect = true;
-    debugDirector("Shutting Down all BLE services");
+    SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Shutting Down all BLE services");
     if (NimBLEDevice::getInitialized())
     {
         NimBLEDevice::deinit();
@@ -0,0 +1,301 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#include "Main.h"
+#include "BLE_Common.h"
+
+#include <ArduinoJson.h>
+#include <NimBLEDevice.h>
+
+BLEConnParamsManager connParams;
+
+/**************************Connection parameter policy per link role**************************/
+// Intervals are in 1.25ms units, timeout in 10ms units.
+//                                 min   max  latency timeout
+// Controlling app                  24    40     0     200   (30-50ms, fast response to ERG/SIM writes)
+// Listening app                    40    80     2     400   (50-100ms, may skip events between our 1s notifies)
+// Power meter                      40    80     0     300   (PMs notify 1-4 times a second)
+// Heart monitor                    80   160     0     400   (HRMs notify once a second)
+// While scanning the intervals are doubled and while WiFi is busy they get 50% longer so the
+// scheduler has room for scan windows and WiFi slots without dropping connection events.
+struct ConnParamsPolicy
+{
+    uint16_t minInterval;
+    uint16_t maxInterval;
+    uint16_t latency;
+    uint16_t timeout;
+};
+
+static const ConnParamsPolicy connParamsPolicy[] = {
+    {40, 50, 0, 100},  //LINK_NONE - what we used before there was a policy
+    {24, 40, 0, 200},  //LINK_APP_CONTROLLER
+    {40, 80, 2, 400},  //LINK_APP_LISTENER
+    {40, 80, 0, 300},  //LINK_POWER_METER
+    {80, 160, 0, 400}, //LINK_HEART_MONITOR
+};
+
+void BLEConnParamsManager::getParams(BLELinkRole role, uint16_t *minInterval, uint16_t *maxInterval, uint16_t *latency, uint16_t *timeout)
+{
+    const ConnParamsPolicy &policy = connParamsPolicy[role];
+    uint16_t tMin = policy.minInterval;
+    uint16_t tMax = policy.maxInterval;
+    if (scanning)
+    {
+        tMin *= 2;
+        tMax *= 2;
+    }
+    if (wifiActive)
+    {
+        tMin += tMin / 2;
+        tMax += tMax / 2;
+    }
+    //Supervision timeout has to be larger than (1 + latency) * maxInterval * 2
+    uint16_t tTimeout = policy.timeout;
+    uint32_t minTimeout = ((1 + policy.latency) * tMax * 2 * 125 / 1000) + 1;
+    if (tTimeout < minTimeout)
+    {
+        tTimeout = minTimeout;
+    }
+    *minInterval = tMin;
+    *maxInterval = tMax;
+    *latency = policy.latency;
+    *timeout = tTimeout;
+}
+
+void BLEConnParamsManager::addLink(uint16_t connHandle, BLELinkRole role)
+{
+    portENTER_CRITICAL(&linksMux);
+    BLELinkStats *freeLink = nullptr;
+    for (int i = 0; i < BLE_MAX_LINKS; i++)
+    {
+        if (links[i].role != LINK_NONE && links[i].connHandle == connHandle)
+        {
+            freeLink = &links[i]; //Handle was reused. Start over.
+            break;
+        }
+        if (links[i].role == LINK_NONE && freeLink == nullptr)
+        {
+            freeLink = &links[i];
+        }
+    }
+    if (freeLink)
+    {
+        *freeLink = BLELinkStats();
+        freeLink->connHandle = connHandle;
+        freeLink->role = role;
+        freeLink->needsUpdate = true;
+    }
+    portEXIT_CRITICAL(&linksMux);
+}
+
+void BLEConnParamsManager::setRole(uint16_t connHandle, BLELinkRole role)
+{
+    portENTER_CRITICAL(&linksMux);
+    for (int i = 0; i < BLE_MAX_LINKS; i++)
+    {
+        if (links[i].role != LINK_NONE && links[i].connHandle == connHandle && links[i].role != role)
+        {
+            links[i].role = role;
+            links[i].needsUpdate = true;
+        }
+    }
+    portEXIT_CRITICAL(&linksMux);
+}
+
+void BLEConnParamsManager::setScanning(bool scan)
+{
+    if (scanning != scan)
+    {
+        scanning = scan;
+        markAllForUpdate();
+    }
+}
+
+void BLEConnParamsManager::setWifiActive(bool active)
+{
+    if (wifiActive != active)
+    {
+        wifiActive = active;
+        markAllForUpdate();
+    }
+}
+
+void BLEConnParamsManager::markAllForUpdate()
+{
+    portENTER_CRITICAL(&linksMux);
+    for (int i = 0; i < BLE_MAX_LINKS; i++)
+    {
+        links[i].needsUpdate = (links[i].role != LINK_NONE);
+    }
+    portEXIT_CRITICAL(&linksMux);
+}
+
+// Records the time between consecutive notifications on a link. For a sensor link that's how often the
+// sensor notifies us, which shows whether the interval the policy picked keeps up with it.
+void BLEConnParamsManager::recordNotify(uint16_t connHandle)
+{
+    unsigned long now = millis();
+    portENTER_CRITICAL(&linksMux);
+    for (int i = 0; i < BLE_MAX_LINKS; i++)
+    {
+        BLELinkStats &link = links[i];
+        if (link.role == LINK_NONE || link.connHandle != connHandle)
+        {
+            continue;
+        }
+        if (link.lastNotify != 0)
+        {
+            unsigned long delta = now - link.lastNotify;
+            if (link.notifications == 1)
+            {
+                link.minGap = delta;
+                link.maxGap = delta;
+                link.avgGap = delta;
+            }
+            else
+            {
+                link.minGap = min(link.minGap, delta);
+                link.maxGap = max(link.maxGap, delta);
+                link.avgGap += (delta - link.avgGap) / 8;
+            }
+        }
+        link.lastNotify = now;
+        link.notifications++;
+    }
+    portEXIT_CRITICAL(&linksMux);
+}
+
+// The server notifies every connected app at once, so app links get the period of our notify loop.
+// NimBLE doesn't say when a notification went out on a given connection, so that isn't measured.
+void BLEConnParamsManager::recordNotifyRound()
+{
+    for (int i = 0; i < BLE_MAX_LINKS; i++)
+    {
+        if (isServerRole(links[i].role))
+        {
+            recordNotify(links[i].connHandle);
+        }
+    }
+}
+
+bool BLEConnParamsManager::isServerRole(BLELinkRole role)
+{
+    return (role == LINK_APP_CONTROLLER) || (role == LINK_APP_LISTENER);
+}
+
+bool BLEConnParamsManager::isLinkConnected(const BLELinkStats &link)
+{
+    if (isServerRole(link.role))
+    {
+        NimBLEServer *pServer = NimBLEDevice::getServer();
+        if (pServer == nullptr)
+        {
+            return false;
+        }
+        for (auto &peer : pServer->getPeerDevices())
+        {
+            if (peer == link.connHandle)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    NimBLEClient *pClient = NimBLEDevice::getClientByID(link.connHandle);
+    return (pClient != nullptr) && pClient->isConnected();
+}
+
+// Drops links that went away and applies the policy to links whose inputs changed.
+// Called from the BLE notify loop so connection callbacks never block on a parameter update.
+void BLEConnParamsManager::update()
+{
+    if (!NimBLEDevice::getInitialized())
+    {
+        return;
+    }
+    for (int i = 0; i < BLE_MAX_LINKS; i++)
+    {
+        portENTER_CRITICAL(&linksMux);
+        BLELinkStats link = links[i];
+        portEXIT_CRITICAL(&linksMux);
+
+        if (link.role == LINK_NONE)
+        {
+            continue;
+        }
+        if (!isLinkConnected(link))
+        {
+            portENTER_CRITICAL(&linksMux);
+            if (links[i].connHandle == link.connHandle)
+            {
+                links[i].role = LINK_NONE;
+            }
+            portEXIT_CRITICAL(&linksMux);
+            continue;
+        }
+        if (!link.needsUpdate)
+        {
+            continue;
+        }
+
+        uint16_t minInterval, maxInterval, latency, timeout;
+        getParams(link.role, &minInterval, &maxInterval, &latency, &timeout);
+        if (isServerRole(link.role))
+        {
+            NimBLEDevice::getServer()->updateConnParams(link.connHandle, minInterval, maxInterval, latency, timeout);
+        }
+        else
+        {
+            NimBLEDevice::getClientByID(link.connHandle)->updateConnParams(minInterval, maxInterval, latency, timeout);
+        }
+        SS2K_LOG_TEXT(LOG_CAT_BLE_SERVER, "Conn params for link " + String(link.connHandle) + " role " + String(link.role) + ": " + String(minInterval) + "-" + String(maxInterval) + " " + String(latency) + " " + String(timeout));
+
+        portENTER_CRITICAL(&linksMux);
+        if (links[i].connHandle == link.connHandle)
+        {
+            links[i].needsUpdate = false;
+            links[i].minInterval = minInterval;
+            links[i].maxInterval = maxInterval;
+            links[i].latency = latency;
+            links[i].timeout = timeout;
+        }
+        portEXIT_CRITICAL(&linksMux);
+    }
+}
+
+//-- return the link table with the measured gaps between notifications as a JSON string
+String BLEConnParamsManager::returnJSON()
+{
+    StaticJsonDocument<JSON_ARRAY_SIZE(BLE_MAX_LINKS) + BLE_MAX_LINKS * JSON_OBJECT_SIZE(10) + JSON_OBJECT_SIZE(3)> doc;
+    doc["scanning"] = scanning;
+    doc["wifiActive"] = wifiActive;
+    JsonArray jLinks = doc.createNestedArray("links");
+    for (int i = 0; i < BLE_MAX_LINKS; i++)
+    {
+        portENTER_CRITICAL(&linksMux);
+        BLELinkStats link = links[i];
+        portEXIT_CRITICAL(&linksMux);
+        if (link.role == LINK_NONE)
+        {
+            continue;
+        }
+        JsonObject jLink = jLinks.createNestedObject();
+        jLink["handle"] = link.connHandle;
+        jLink["role"] = (int)link.role;
+        jLink["minInterval"] = link.minInterval;
+        jLink["maxInterval"] = link.maxInterval;
+        jLink["latency"] = link.latency;
+        jLink["timeout"] = link.timeout;
+        jLink["notifications"] = link.notifications;
+        jLink["minGapMs"] = link.minGap;
+        jLink["maxGapMs"] = link.maxGap;
+        jLink["avgGapMs"] = link.avgGap;
+    }
+    String output;
+    serializeJson(doc, output);
+    return output;
+}
@@ -7,6 +7,8 @@
 
 #include "Main.h"
 #include "BLE_Common.h"
+#include "Ride_Stats.h"
+#include "Workout_Player.h"
 
 #include <ArduinoJson.h>
 #include <NimBLEDevice.h>
@@ -15,7 +17,6 @@ TaskHandle_t BLENotifyTask;
 
 //BLE Server Settings
 bool _BLEClientConnected = false;
-bool updateConnParametersFlag = false;
 bool GlobalBLEClientConnected = false; //needs to be moved to BLE_Server
 
 NimBLEServer *pServer = nullptr;
@@ -25,6 +26,7 @@ BLECharacteristic *heartRateMeasurementCharacteristic;
 BLECharacteristic *cyclingPowerMeasurementCharacteristic;
 BLECharacteristic *fitnessMachineFeature;
 BLECharacteristic *fitnessMachineIndoorBikeData;
+BLECharacteristic *cscMeasurementCharacteristic;
 
 /********************************Bit field Flag Example***********************************/
 // 00000000000000000001 - 1   - 0x001 - Pedal Power Balance Present
@@ -46,16 +48,22 @@ BLECharacteristic *fitnessMachineIndoorBikeData;
 // 00000000100001010100
 //               100000
 byte heartRateMeasurement[5] = {0b00000, 60, 0, 0, 0};
-byte cyclingPowerMeasurement[9] = {0b0000000100011, 0, 200, 0, 0, 0, 0, 0, 0};
-byte cpsLocation[1] = {0b000};    //sensor location 5 == left crank
-byte cpFeature[1] = {0b00100000}; //crank information present                                         // 3rd & 2nd byte is reported power
+//Flags(2) Power(2) [Pedal Power Balance(1)] [Accumulated Torque(2)] Crank Revs(2) Last Crank Event Time(2)
+byte cyclingPowerMeasurement[11] = {0b0000000100000, 0, 200, 0, 0, 0, 0, 0, 0, 0, 0};
+int cyclingPowerMeasurementLength = 8;
+byte cpsLocation[1] = {0b000};             //sensor location 5 == left crank
+//Flags(1) Cumulative Wheel Revs(4) Last Wheel Event Time(2) Cumulative Crank Revs(2) Last Crank Event Time(2)
+byte cscMeasurement[11] = {0b11, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+byte cscFeature[2] = {0b11, 0}; //wheel & crank revolution data supported
+byte cpFeature[4] = {0b00001011, 0, 0, 0}; //pedal power balance, accumulated torque & crank revolution data supported
 
 byte ftmsService[6] = {0x00, 0x00, 0x00, 0b01, 0b0100000, 0x00};
 byte ftmsControlPoint[8] = {0, 0, 0, 0, 0, 0, 0, 0}; //0x08 we need to return a value of 1 for any sucessful change
 byte ftmsMachineStatus[8] = {0, 0, 0, 0, 0, 0, 0, 0};
 
 uint8_t ftmsFeature[8] = {0x86, 0x50, 0x00, 0x00, 0x0C, 0xE0, 0x00, 0x00};                            //101000010000110 1110000000001100
-uint8_t ftmsIndoorBikeData[14] = {0x54, 0x0A, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0}; //00000000100001010100 ISpeed, ICAD, TDistance, IPower, ETime
+//Flags(2) ISpeed(2) ICAD(2) ACAD(2) TDistance(3) IPower(2) APower(2) HR(1) ETime(2). Kept within a 20 byte notification.
+uint8_t ftmsIndoorBikeData[18] = {0xDC, 0x0A, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0}; //0000101011011100
 uint8_t ftmsResistanceLevelRange[6] = {0x00, 0x00, 0x3A, 0x98, 0xC5, 0x68};                           //+-15000 not sure what units
 uint8_t ftmsPowerRange[6] = {0x00, 0x00, 0xA0, 0x0F, 0x01, 0x00};                                     //1-4000 watts
 
@@ -63,7 +71,7 @@ void startBLEServer()
 {
 
   //Server Setup
-  debugDirector("Starting BLE Server");
+  SS2K_LOG_TEXT(LOG_CAT_BLE_SERVER, "Starting BLE Server");
   pServer = BLEDevice::createServer();
 
   //HEART RATE MONITOR SERVICE SETUP
@@ -89,6 +97,21 @@ void startBLEServer()
       SENSORLOCATION_UUID,
       NIMBLE_PROPERTY::READ);
 
+  //Cycling Speed and Cadence service setup
+  BLEService *pCSCService = pServer->createService(CSCSERVICE_UUID);
+
+  cscMeasurementCharacteristic = pCSCService->createCharacteristic(
+      CSCMEASUREMENT_UUID,
+      NIMBLE_PROPERTY::NOTIFY);
+
+  BLECharacteristic *cscFeatureCharacteristic = pCSCService->createCharacteristic(
+      CSCFEATURE_UUID,
+      NIMBLE_PROPERTY::READ);
+
+  BLECharacteristic *cscSensorLocationCharacteristic = pCSCService->createCharacteristic(
+      SENSORLOCATION_UUID,
+      NIMBLE_PROPERTY::READ);
+
   //Fitness Machine service setup
   BLEService *pFitnessMachineService = pServer->createService(FITNESSMACHINESERVICE_UUID);
 
@@ -129,14 +152,18 @@ void startBLEServer()
   //Creating Characteristics
   heartRateMeasurementCharacteristic->setValue(heartRateMeasurement, 5);
 
-  cyclingPowerMeasurementCharacteristic->setValue(cyclingPowerMeasurement, 9);
-  cyclingPowerFeatureCharacteristic->setValue(cpFeature, 1);
+  cyclingPowerMeasurementCharacteristic->setValue(cyclingPowerMeasurement, cyclingPowerMeasurementLength);
+  cyclingPowerFeatureCharacteristic->setValue(cpFeature, 4);
   sensorLocationCharacteristic->setValue(cpsLocation, 1);
 
+  cscMeasurementCharacteristic->setValue(cscMeasurement, 11);
+  cscFeatureCharacteristic->setValue(cscFeature, 2);
+  cscSensorLocationCharacteristic->setValue(cpsLocation, 1);
+
   fitnessMachineFeature->setValue(ftmsFeature, 8);
   fitnessMachineControlPoint->setValue(ftmsControlPoint, 8);
 
-  fitnessMachineIndoorBikeData->setValue(ftmsIndoorBikeData, 14);
+  fitnessMachineIndoorBikeData->setValue(ftmsIndoorBikeData, sizeof(ftmsIndoorBikeData));
 
   fitnessMachineStatus->setValue(ftmsMachineStatus, 8);
   fitnessMachineResistanceLevelRange->setValue(ftmsResistanceLevelRange, 6);
@@ -146,18 +173,13 @@ void startBLEServer()
 
   pHeartService->start();          //heart rate service
   pPowerMonitor->start();          //Power Meter Service
+  pCSCService->start();            //Cycling Speed and Cadence Service
   pFitnessMachineService->start(); //Fitness Machine Service
 
-  BLEAdvertising *pAdvertising = BLEDevice::getAdvertising();
-  pAdvertising->addServiceUUID(CYCLINGPOWERSERVICE_UUID);
-  pAdvertising->addServiceUUID(FITNESSMACHINESERVICE_UUID);
-  pAdvertising->addServiceUUID(HEARTSERVICE_UUID);
-  pAdvertising->setMaxInterval(250);
-  pAdvertising->setMinInterval(160);
-  pAdvertising->setScanResponse(true);
-  BLEDevice::startAdvertising();
+  advertisingManager.setup();
+  advertisingManager.fastAdvertise();
 
-  debugDirector("Bluetooth Characteristic defined!");
+  SS2K_LOG_TEXT(LOG_CAT_BLE_SERVER, "Bluetooth Characteristic defined!");
   xTaskCreatePinnedToCore(
       BLENotify,       /* Task function. */
       "BLENotifyTask", /* name of task. */
@@ -167,7 +189,7 @@ void startBLEServer()
       &BLENotifyTask,  /* Task handle to keep track of created task */
       1);              /* pin task to core 0 */
 
-  debugDirector("BLE Notify Task Started");
+  SS2K_LOG_TEXT(LOG_CAT_BLE_SERVER, "BLE Notify Task Started");
 }
 
 void BLENotify(void *pvParameters)
@@ -197,22 +219,22 @@ void BLENotify(void *pvParameters)
       updateIndoorBikeDataChar();
       updateCyclingPowerMesurementChar();
       cyclingPowerMeasurementCharacteristic->notify();
+      if (updateCSCMeasurementChar()) //Only notify CSC listeners when a new crank or wheel event happened
+      {
+        cscMeasurementCharacteristic->notify();
+      }
       fitnessMachineFeature->notify();
       fitnessMachineIndoorBikeData->notify();
       heartRateMeasurementCharacteristic->notify();
+      connParams.recordNotifyRound();
       GlobalBLEClientConnected = true;
-      
-      if (updateConnParametersFlag)
-      {
-        vTaskDelay(100/portTICK_PERIOD_MS);
-        pServer->updateConnParams(bleConnDesc, 40, 50, 0, 100);
-        updateConnParametersFlag = false;
-      }
     }
     else
     {
       GlobalBLEClientConnected = false;
     }
+    connParams.update();
+    advertisingManager.update();
     if (!_BLEClientConnected)
     {
       digitalWrite(LED_PIN, LOW); //blink if no client connected
@@ -264,21 +286,47 @@ void computeERG(int currentWatts, int setPoint)
 
 void computeCSC() //What was SIG smoking when they came up with the Cycling Speed and Cadence Characteristic?
 {
-  if (userConfig.getSimulatedCad() > 0)
+  if (spinBLEClient.connectedPM && ((millis() - spinBLEClient.pmCrankDataTime) < CPM_PASSTHROUGH_TIMEOUT))
   {
+    //The power meter is sending real crank events. Forward them as-is so apps get sensor timing.
+    spinBLEClient.cscCumulativeCrankRev = spinBLEClient.pmCumulativeCrankRev;
+    spinBLEClient.cscLastCrankEvtTime = spinBLEClient.pmLastCrankEvtTime;
+  }
+  else if (userConfig.getSimulatedCad() > 0)
+  {
+    //No crank events available, so make them up from the cadence we have.
     float crankRevPeriod = (60 * 1024) / userConfig.getSimulatedCad();
-    spinBLEClient.cscCumulativeCrankRev++;
-    spinBLEClient.cscLastCrankEvtTime += crankRevPeriod;
-    int remainder, quotient;
-    quotient = spinBLEClient.cscCumulativeCrankRev / 256;
-    remainder = spinBLEClient.cscCumulativeCrankRev % 256;
-    cyclingPowerMeasurement[5] = remainder;
-    cyclingPowerMeasurement[6] = quotient;
-    quotient = spinBLEClient.cscLastCrankEvtTime / 256;
-    remainder = spinBLEClient.cscLastCrankEvtTime % 256;
-    cyclingPowerMeasurement[7] = remainder;
-    cyclingPowerMeasurement[8] = quotient;
-  } //^^Using the old way of setting bytes because I like it and it makes more sense to me looking at it.
+    spinBLEClient.cscCumulativeCrankRev = (spinBLEClient.cscCumulativeCrankRev + 1) & 0xFFFF;
+    spinBLEClient.cscLastCrankEvtTime = ((int)(spinBLEClient.cscLastCrankEvtTime + crankRevPeriod)) & 0xFFFF;
+  }
+
+  //Integrate the virtual wheel speed into whole wheel revolutions and the time (1/1024s) the last one completed.
+  unsigned long now = millis();
+  float revsPerMs = computeWheelRPM() / 60000.0;
+  if ((revsPerMs > 0) && (spinBLEClient.cscLastWheelUpdate != 0))
+  {
+    float revs = spinBLEClient.cscWheelRevFraction + (revsPerMs * (now - spinBLEClient.cscLastWheelUpdate));
+    uint32_t wholeRevs = (uint32_t)revs;
+    spinBLEClient.cscWheelRevFraction = revs - wholeRevs;
+    if (wholeRevs > 0)
+    {
+      unsigned long lastRevTime = now - (unsigned long)(spinBLEClient.cscWheelRevFraction / revsPerMs);
+      spinBLEClient.cscCumulativeWheelRev += wholeRevs;
+      spinBLEClient.cscLastWheelEvtTime = (uint16_t)((uint64_t)lastRevTime * 1024 / 1000);
+    }
+  }
+  else
+  {
+    spinBLEClient.cscWheelRevFraction = 0;
+  }
+  spinBLEClient.cscLastWheelUpdate = now;
+}
+
+//Virtual wheel speed from cadence. Shared by FTMS Indoor Bike Data and CSC Measurement.
+float computeWheelRPM()
+{
+  float gearRatio = 1;
+  return userConfig.getSimulatedCad() * VIRTUAL_GEAR_RATIO * gearRatio;
 }
 
 void updateIndoorBikeDataChar()
@@ -286,39 +334,91 @@ void updateIndoorBikeDataChar()
   int cad = userConfig.getSimulatedCad();
   int watts = userConfig.getSimulatedWatts();
   int hr = userConfig.getSimulatedHr();
-  float gearRatio = 1;
-  int speed = ((cad * 2.75 * 2.08 * 60 * gearRatio) / 10);
+  int speed = ((computeWheelRPM() * WHEEL_CIRCUMFERENCE * 60) / 10);
+  RideTotals ride = rideStats.totals();
   ftmsIndoorBikeData[2] = (uint8_t)(speed & 0xff);
   ftmsIndoorBikeData[3] = (uint8_t)(speed >> 8);
   ftmsIndoorBikeData[4] = (uint8_t)((cad * 2) & 0xff);
   ftmsIndoorBikeData[5] = (uint8_t)((cad * 2) >> 8); // cadence value
-  ftmsIndoorBikeData[6] = 0;                         //distance <
-  ftmsIndoorBikeData[7] = 0;                         //distance <-- uint24 with 1m resolution
+  ftmsIndoorBikeData[6] = (uint8_t)((ride.avgCadence * 2) & 0xff);
+  ftmsIndoorBikeData[7] = (uint8_t)((ride.avgCadence * 2) >> 8); // average cadence, 0.5 rpm
   ftmsIndoorBikeData[8] = 0;                         //distance <
-  ftmsIndoorBikeData[9] = (uint8_t)((watts)&0xff);
-  ftmsIndoorBikeData[10] = (uint8_t)((watts) >> 8); // power value, constrained to avoid negative values, although the specification allows for a sint16
-  ftmsIndoorBikeData[11] = (uint8_t) hr;
-  ftmsIndoorBikeData[12] = 0;                       // Elapsed Time uint16 in seconds
-  ftmsIndoorBikeData[13] = 0;                       // Elapsed Time
-  fitnessMachineIndoorBikeData->setValue(ftmsIndoorBikeData, 14);
+  ftmsIndoorBikeData[9] = 0;                         //distance <-- uint24 with 1m resolution
+  ftmsIndoorBikeData[10] = 0;                        //distance <
+  ftmsIndoorBikeData[11] = (uint8_t)((watts)&0xff);
+  ftmsIndoorBikeData[12] = (uint8_t)((watts) >> 8); // power value, constrained to avoid negative values, although the specification allows for a sint16
+  ftmsIndoorBikeData[13] = (uint8_t)(ride.avgPower & 0xff);
+  ftmsIndoorBikeData[14] = (uint8_t)(ride.avgPower >> 8); // average power since the ride started
+  ftmsIndoorBikeData[15] = (uint8_t) hr;
+  uint16_t elapsed = min(ride.seconds * (RIDE_SAMPLE_INTERVAL / 1000), (uint32_t)UINT16_MAX);
+  ftmsIndoorBikeData[16] = (uint8_t)(elapsed & 0xff); // Elapsed Time uint16 in seconds
+  ftmsIndoorBikeData[17] = (uint8_t)(elapsed >> 8);   // Elapsed Time
+  fitnessMachineIndoorBikeData->setValue(ftmsIndoorBikeData, sizeof(ftmsIndoorBikeData));
 } //^^Using the New Way of setting Bytes.
 
+//Returns true if the measurement changed since the last call, so notifications follow the event stream.
+bool updateCSCMeasurementChar()
+{
+  static uint32_t lastWheelRev = 0;
+  static int lastCrankRev = 0;
+  if ((spinBLEClient.cscCumulativeWheelRev == lastWheelRev) && (spinBLEClient.cscCumulativeCrankRev == lastCrankRev))
+  {
+    return false;
+  }
+  lastWheelRev = spinBLEClient.cscCumulativeWheelRev;
+  lastCrankRev = spinBLEClient.cscCumulativeCrankRev;
+
+  cscMeasurement[1] = (uint8_t)(lastWheelRev & 0xff);
+  cscMeasurement[2] = (uint8_t)((lastWheelRev >> 8) & 0xff);
+  cscMeasurement[3] = (uint8_t)((lastWheelRev >> 16) & 0xff);
+  cscMeasurement[4] = (uint8_t)((lastWheelRev >> 24) & 0xff);
+  cscMeasurement[5] = (uint8_t)(spinBLEClient.cscLastWheelEvtTime & 0xff);
+  cscMeasurement[6] = (uint8_t)(spinBLEClient.cscLastWheelEvtTime >> 8);
+  cscMeasurement[7] = (uint8_t)(lastCrankRev & 0xff);
+  cscMeasurement[8] = (uint8_t)((lastCrankRev >> 8) & 0xff);
+  cscMeasurement[9] = (uint8_t)(spinBLEClient.cscLastCrankEvtTime & 0xff);
+  cscMeasurement[10] = (uint8_t)((spinBLEClient.cscLastCrankEvtTime >> 8) & 0xff);
+  cscMeasurementCharacteristic->setValue(cscMeasurement, 11);
+  return true;
+}
+
 void updateCyclingPowerMesurementChar()
 {
+  //Balance and torque are only present when the connected power meter supplies them.
+  bool passThrough = spinBLEClient.connectedPM && ((millis() - spinBLEClient.pmCrankDataTime) < CPM_PASSTHROUGH_TIMEOUT);
+  uint16_t flags = 0b100000; //Crank Revolution Data Present
+  if (passThrough)
+  {
+    flags |= spinBLEClient.pmFlags & 0b1111; //Pedal Power Balance & Accumulated Torque fields and their reference bits
+  }
   int remainder, quotient;
+  int pos = 0;
+  cyclingPowerMeasurement[pos++] = flags & 0xff;
+  cyclingPowerMeasurement[pos++] = flags >> 8;
   quotient = userConfig.getSimulatedWatts() / 256;
   remainder = userConfig.getSimulatedWatts() % 256;
-  cyclingPowerMeasurement[2] = remainder;
-  cyclingPowerMeasurement[3] = quotient;
-  cyclingPowerMeasurementCharacteristic->setValue(cyclingPowerMeasurement, 9);
-  debugDirector("");
-  for (const auto &text : cyclingPowerMeasurement)
-  { // Range-for!
-    debugDirector(String(text, HEX) + " ", false);
+  cyclingPowerMeasurement[pos++] = remainder;
+  cyclingPowerMeasurement[pos++] = quotient;
+  if (bitRead(flags, 0))
+  {
+    cyclingPowerMeasurement[pos++] = spinBLEClient.pmPedalPowerBalance;
   }
-
-  debugDirector("<-- CPMC sent ", false);
-  debugDirector("");
+  if (bitRead(flags, 2))
+  {
+    cyclingPowerMeasurement[pos++] = spinBLEClient.pmAccumulatedTorque & 0xff;
+    cyclingPowerMeasurement[pos++] = spinBLEClient.pmAccumulatedTorque >> 8;
+  }
+  quotient = spinBLEClient.cscCumulativeCrankRev / 256;
+  remainder = spinBLEClient.cscCumulativeCrankRev % 256;
+  cyclingPowerMeasurement[pos++] = remainder;
+  cyclingPowerMeasurement[pos++] = quotient;
+  quotient = spinBLEClient.cscLastCrankEvtTime / 256;
+  remainder = spinBLEClient.cscLastCrankEvtTime % 256;
+  cyclingPowerMeasurement[pos++] = remainder;
+  cyclingPowerMeasurement[pos++] = quotient;
+  cyclingPowerMeasurementLength = pos;
+  cyclingPowerMeasurementCharacteristic->setValue(cyclingPowerMeasurement, cyclingPowerMeasurementLength);
+  SS2K_LOG_HEXD(LOG_CAT_BLE_SERVER, "CPMC sent -->", cyclingPowerMeasurement, cyclingPowerMeasurementLength);
 }
 
 //Creating Server Connection Callbacks
@@ -326,15 +426,16 @@ void updateCyclingPowerMesurementChar()
 void MyServerCallbacks::onConnect(BLEServer *pServer, ble_gap_conn_desc *desc)
 {
   _BLEClientConnected = true;
-  debugDirector("Bluetooth Client Connected! " + String(desc->conn_handle));
-  updateConnParametersFlag = true;
+  SS2K_LOGI(LOG_CAT_BLE_SERVER, "Bluetooth Client Connected! %u", desc->conn_handle);
   bleConnDesc = desc->conn_handle;
+  connParams.addLink(desc->conn_handle, LINK_APP_LISTENER);
 };
 
 void MyServerCallbacks::onDisconnect(BLEServer *pServer)
 {
   _BLEClientConnected = false;
-  debugDirector("Bluetooth Client Disconnected!");
+  SS2K_LOG_TEXT(LOG_CAT_BLE_SERVER, "Bluetooth Client Disconnected!");
+  advertisingManager.fastAdvertise(); //Let the app find us again quickly
 }
 
 void MyCallbacks::onWrite(BLECharacteristic *pCharacteristic)
@@ -343,11 +444,9 @@ void MyCallbacks::onWrite(BLECharacteristic *pCharacteristic)
 
   if (rxValue.length() > 1)
   {
-    for (const auto &text : rxValue)
-    { // Range-for!
-      debugDirector(String(text, HEX) + " ", false);
-    }
-    debugDirector("<-- From APP ", false);
+    SS2K_LOG_HEXD(LOG_CAT_BLE_SERVER, "From APP <--", (const uint8_t *)rxValue.data(), rxValue.length());
+    //The write callback doesn't tell us which link wrote, so promote the most recent connection.
+    connParams.setRole(bleConnDesc, LINK_APP_CONTROLLER);
     /* 17 means FTMS Incline Control Mode  (aka SIM mode)*/
 
     if ((int)rxValue[0] == 17)
@@ -357,29 +456,27 @@ void MyCallbacks::onWrite(BLECharacteristic *pCharacteristic)
       buf[1] = rxValue[4]; // (Most significant byte)
 
       int port = bytes_to_u16(buf[1], buf[0]);
+      workoutPlayer.stop(); //The app takes over
       userConfig.setIncline(port);
       if (userConfig.getERGMode())
       {
         userConfig.setERGMode(false);
       }
-      debugDirector(" Target Incline: " + String((userConfig.getIncline() / 100)), false);
+      SS2K_LOGI(LOG_CAT_BLE_SERVER, " Target Incline: %.2f", userConfig.getIncline() / 100);
     }
-    debugDirector("");
 
     /* 5 means FTMS Watts Control Mode (aka ERG mode) */
     if (((int)rxValue[0] == 5) && (spinBLEClient.connectedPM))
     {
       int targetWatts = bytes_to_int(rxValue[2], rxValue[1]);
+      workoutPlayer.stop();
+      userConfig.setTargetWatts(targetWatts);
       if (!userConfig.getERGMode())
       {
         userConfig.setERGMode(true);
       }
       computeERG(userConfig.getSimulatedWatts(), targetWatts);
-      debugDirector("ERG MODE", false);
-      debugDirector(" Target: " + String(targetWatts), false);
-      debugDirector(" Current: " + String(userConfig.getSimulatedWatts()), false); //not displaying numbers less than 256 correctly but they do get sent to Zwift correctly.
-      debugDirector(" Incline: " + String(userConfig.getIncline() / 100), false);
-      debugDirector("");
+      SS2K_LOGI(LOG_CAT_BLE_SERVER, "ERG MODE Target: %d Current: %d Incline: %.2f", targetWatts, userConfig.getSimulatedWatts(), userConfig.getIncline() / 100);
     }
   }
 }
@@ -408,5 +505,5 @@ void calculateInstPwrFromHR()
   userConfig.setSimulatedWatts(avgP);
   userConfig.setSimulatedCad(90);
 
-  debugDirector("Power From HR: " + String(avgP));
+  SS2K_LOGD(LOG_CAT_BLE_SERVER, "Power From HR: %d", avgP);
 }
\ No newline at end of file
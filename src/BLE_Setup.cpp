@@ -12,7 +12,7 @@
 
 void setupBLE() //Common BLE setup for both client and server
 {
-  debugDirector("Starting Arduino BLE Client application...");
+  SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Starting Arduino BLE Client application...");
   BLEDevice::init(userConfig.getDeviceName());
   spinBLEClient.start();
   startBLEServer();
@@ -20,8 +20,8 @@ void setupBLE() //Common BLE setup for both client and server
   if (!((String(userConfig.getconnectedPowerMeter()) == "none") && (String(userConfig.getconnectedHeartMonitor()) == "none")))
   {
     spinBLEClient.serverScan(true);
-    debugDirector("Scanning");
+    SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "Scanning");
   }
-  debugDirector(String(userConfig.getconnectedPowerMeter()) + " " + String(userConfig.getconnectedHeartMonitor()));
-  debugDirector("End BLE Setup");
+  SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, String(userConfig.getconnectedPowerMeter()) + " " + String(userConfig.getconnectedHeartMonitor()));
+  SS2K_LOG_TEXT(LOG_CAT_BLE_CLIENT, "End BLE Setup");
 } 
\ No newline at end of file
@@ -0,0 +1,112 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#include "Main.h"
+#include "Boot_Stages.h"
+#include "WiFi_Manager.h"
+#include "Update_Agent.h"
+#include "Ride_Recorder.h"
+
+//Indexed by BootStage
+static const BootStageInfo bootStages[BOOT_STAGES] = {
+    {"filesystem", mountFilesystem,                                     0,                                      2500},
+    {"config",     loadConfig,                                          BOOT_BIT(BOOT_FILESYSTEM),              4000},
+    {"stepper",    setupStepper,                                        BOOT_BIT(BOOT_CONFIG),                  2500},
+    {"ble",        []() -> bool { setupBLE(); return true; },                   BOOT_BIT(BOOT_CONFIG),                  5000},
+    {"wifi",       []() -> bool { wifiManager.begin(); return true; },          BOOT_BIT(BOOT_CONFIG),                  4000},
+    {"time",       syncTime,                                            BOOT_BIT(BOOT_WIFI),                    2500},
+    {"http",       []() -> bool { startHttpServer(); return true; },            BOOT_BIT(BOOT_WIFI),                    5000},
+    {"update",     []() -> bool { updateAgent.begin(); return true; },
+                                                                        BOOT_BIT(BOOT_BLE) | BOOT_BIT(BOOT_TIME), 2500},
+    {"recorder",   []() -> bool { rideRecorder.begin(); return true; },         BOOT_BIT(BOOT_CONFIG),                  2500},
+};
+
+static EventGroupHandle_t bootEvents = nullptr;
+static BootStageTiming bootTimings[BOOT_STAGES];
+TaskHandle_t bootDispatchTask;
+
+static void bootRunStage(BootStage stage)
+{
+  bootTimings[stage].start = millis();
+  bootTimings[stage].ok    = bootStages[stage].run();
+  bootTimings[stage].end   = millis();
+  xEventGroupSetBits(bootEvents, BOOT_BIT(stage));
+}
+
+static void bootStageTask(void *pvParameters)
+{
+  bootRunStage((BootStage)(uint32_t)pvParameters);
+  vTaskDelete(NULL);
+}
+
+// Starts every stage whose dependencies are done, then waits for the next stage to finish.
+// Stage tasks are only created when they can run, so their stacks aren't all allocated at once.
+void bootTask(void *pvParameters)
+{
+  uint32_t started = 0;
+  for (;;)
+  {
+    uint32_t done = xEventGroupGetBits(bootEvents) & BOOT_ALL;
+    for (int stage = 0; stage < BOOT_STAGES; stage++)
+    {
+      const BootStageInfo &info = bootStages[stage];
+      if ((started & BOOT_BIT(stage)) || (info.dependsOn & done) != info.dependsOn)
+      {
+        continue;
+      }
+      started |= BOOT_BIT(stage);
+      if (xTaskCreatePinnedToCore(bootStageTask, info.name, info.stackSize, (void *)(uint32_t)stage, 1, NULL, tskNO_AFFINITY) != pdPASS)
+      {
+        //Run it here rather than hold up everything that depends on it
+        SS2K_LOGE(LOG_CAT_MAIN, "Boot: no memory for the %s task", info.name);
+        bootRunStage((BootStage)stage);
+      }
+    }
+    if (done == BOOT_ALL)
+    {
+      break;
+    }
+    xEventGroupWaitBits(bootEvents, BOOT_ALL & ~done, pdFALSE, pdFALSE, portMAX_DELAY);
+  }
+
+  for (int stage = 0; stage < BOOT_STAGES; stage++)
+  {
+    SS2K_LOGI(LOG_CAT_MAIN, "Boot %s: start %u ms, took %u ms%s", bootStages[stage].name, (unsigned)bootTimings[stage].start,
+              (unsigned)(bootTimings[stage].end - bootTimings[stage].start), bootTimings[stage].ok ? "" : " (failed)");
+  }
+  SS2K_LOGI(LOG_CAT_MAIN, "Boot complete in %u ms", (unsigned)millis());
+  digitalWrite(LED_PIN, HIGH);
+  vTaskDelete(NULL);
+}
+
+void bootStart()
+{
+  bootEvents = xEventGroupCreate();
+  xTaskCreatePinnedToCore(
+      bootTask,          /* Task function. */
+      "bootTask",        /* name of task. */
+      2500,              /* Stack size of task */
+      NULL,              /* parameter of the task */
+      1,                 /* priority of the task */
+      &bootDispatchTask, /* Task handle to keep track of created task */
+      tskNO_AFFINITY);
+}
+
+// Waits until all the given stages are done. Returns false on timeout.
+bool bootWait(uint32_t bits, uint32_t timeoutMs)
+{
+  if (bootEvents == nullptr)
+  {
+    return false;
+  }
+  return (xEventGroupWaitBits(bootEvents, bits, pdFALSE, pdTRUE, timeoutMs / portTICK_PERIOD_MS) & bits) == bits;
+}
+
+bool bootDone(BootStage stage)
+{
+  return bootEvents != nullptr && (xEventGroupGetBits(bootEvents) & BOOT_BIT(stage));
+}
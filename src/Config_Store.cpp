@@ -0,0 +1,123 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#include "Main.h"
+#include "Config_Store.h"
+
+#include <SPIFFS.h>
+#include <stddef.h>
+#if __has_include("esp32/rom/crc.h")
+#include "esp32/rom/crc.h"
+#else
+#include "rom/crc.h"
+#endif
+
+uint32_t configCRC32(uint32_t crc, const uint8_t *data, size_t length)
+{
+  return crc32_le(crc, data, length);
+}
+
+static uint32_t recordCRC(const ConfigRecordHeader &header, const uint8_t *payload)
+{
+  uint32_t crc = configCRC32(0, (const uint8_t *)&header, offsetof(ConfigRecordHeader, crc));
+  return configCRC32(crc, payload, header.length);
+}
+
+ConfigStore::ConfigStore(const char *slotA, const char *slotB, uint32_t magic, uint16_t version)
+    : magic(magic), version(version)
+{
+  slots[0] = slotA;
+  slots[1] = slotB;
+}
+
+//Reads the header, and the payload too when payload isn't null
+bool ConfigStore::readSlot(int slot, ConfigRecordHeader &header, uint8_t *payload, size_t maxLength)
+{
+  File file = SPIFFS.open(slots[slot]);
+  if (!file)
+  {
+    return false;
+  }
+  bool valid = (file.read((uint8_t *)&header, sizeof(header)) == sizeof(header)) &&
+               (header.magic == magic) && (header.version == version) && (header.length <= maxLength);
+  if (valid && payload)
+  {
+    valid = (file.read(payload, header.length) == header.length) && (header.crc == recordCRC(header, payload));
+  }
+  file.close();
+  return valid;
+}
+
+size_t ConfigStore::read(uint8_t *payload, size_t maxLength)
+{
+  current  = -1;
+  sequence = 0;
+
+  //Compare the headers first, then load the newer slot straight into payload.
+  //If its payload fails the CRC the other slot is tried.
+  ConfigRecordHeader headers[2];
+  bool present[2];
+  for (int slot = 0; slot < 2; slot++)
+  {
+    present[slot] = readSlot(slot, headers[slot], nullptr, maxLength);
+  }
+  int newer = (present[1] && (!present[0] || (int32_t)(headers[1].sequence - headers[0].sequence) > 0)) ? 1 : 0;
+
+  for (int slot : {newer, 1 - newer})
+  {
+    ConfigRecordHeader header;
+    if (!present[slot] || !readSlot(slot, header, payload, maxLength))
+    {
+      SS2K_LOGD(LOG_CAT_CONFIG, "Config slot %d empty or corrupt", slot);
+      continue;
+    }
+    current    = slot;
+    sequence   = header.sequence;
+    payloadCRC = configCRC32(0, payload, header.length);
+    SS2K_LOGI(LOG_CAT_CONFIG, "Config record %u loaded from slot %d", (unsigned)sequence, current);
+    return header.length;
+  }
+  return 0;
+}
+
+bool ConfigStore::write(const uint8_t *payload, size_t length, bool force)
+{
+  uint32_t crc = configCRC32(0, payload, length);
+  if (!force && current >= 0 && crc == payloadCRC)
+  {
+    SS2K_LOGD(LOG_CAT_CONFIG, "Config unchanged, not written");
+    return true;
+  }
+  int slot = (current == 0) ? 1 : 0;
+  ConfigRecordHeader header;
+  header.magic    = magic;
+  header.version  = version;
+  header.length   = length;
+  header.sequence = sequence + 1;
+  header.crc      = recordCRC(header, payload);
+
+  File file = SPIFFS.open(slots[slot], FILE_WRITE);
+  if (!file)
+  {
+    SS2K_LOGE(LOG_CAT_CONFIG, "Failed to open config slot %d", slot);
+    return false;
+  }
+  bool written = (file.write((const uint8_t *)&header, sizeof(header)) == sizeof(header)) &&
+                 (file.write(payload, length) == length);
+  file.close();
+  if (!written)
+  {
+    //The other slot still holds the previous record
+    SS2K_LOGE(LOG_CAT_CONFIG, "Failed to write config slot %d", slot);
+    return false;
+  }
+  sequence   = header.sequence;
+  current    = slot;
+  payloadCRC = crc;
+  SS2K_LOGD(LOG_CAT_CONFIG, "Config record %u written to slot %d", (unsigned)sequence, slot);
+  return true;
+}
@@ -0,0 +1,294 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#include "FIT_Writer.h"
+
+#include <string.h>
+
+//Base types
+#define FIT_ENUM    0x00
+#define FIT_UINT8   0x02
+#define FIT_SINT16  0x83
+#define FIT_UINT16  0x84
+#define FIT_UINT32  0x86
+#define FIT_UINT32Z 0x8C
+
+#define FIT_TIMESTAMP 253
+
+//Pauses longer than this (s) don't count as timer time
+#define FIT_MAX_RECORD_GAP 5
+
+/*********************************Messages*********************************/
+// Fields are written in the order listed here, values are passed in the same order.
+
+static const FitFieldDef fileIdFields[] = {
+    {0, 1, FIT_ENUM},           //type
+    {1, 2, FIT_UINT16},         //manufacturer
+    {2, 2, FIT_UINT16},         //product
+    {3, 4, FIT_UINT32Z},        //serial_number
+    {4, 4, FIT_UINT32},         //time_created
+};
+
+static const FitFieldDef eventFields[] = {
+    {FIT_TIMESTAMP, 4, FIT_UINT32},
+    {0, 1, FIT_ENUM},           //event
+    {1, 1, FIT_ENUM},           //event_type
+    {4, 1, FIT_UINT8},          //event_group
+};
+
+static const FitFieldDef recordFields[] = {
+    {FIT_TIMESTAMP, 4, FIT_UINT32},
+    {3, 1, FIT_UINT8},          //heart_rate
+    {4, 1, FIT_UINT8},          //cadence
+    {7, 2, FIT_UINT16},         //power
+    {9, 2, FIT_SINT16},         //grade
+};
+
+static const FitFieldDef lapFields[] = {
+    {FIT_TIMESTAMP, 4, FIT_UINT32},
+    {2, 4, FIT_UINT32},         //start_time
+    {7, 4, FIT_UINT32},         //total_elapsed_time
+    {8, 4, FIT_UINT32},         //total_timer_time
+    {15, 1, FIT_UINT8},         //avg_heart_rate
+    {16, 1, FIT_UINT8},         //max_heart_rate
+    {17, 1, FIT_UINT8},         //avg_cadence
+    {18, 1, FIT_UINT8},         //max_cadence
+    {19, 2, FIT_UINT16},        //avg_power
+    {20, 2, FIT_UINT16},        //max_power
+    {0, 1, FIT_ENUM},           //event
+    {1, 1, FIT_ENUM},           //event_type
+    {25, 1, FIT_ENUM},          //sport
+};
+
+static const FitFieldDef sessionFields[] = {
+    {FIT_TIMESTAMP, 4, FIT_UINT32},
+    {2, 4, FIT_UINT32},         //start_time
+    {7, 4, FIT_UINT32},         //total_elapsed_time
+    {8, 4, FIT_UINT32},         //total_timer_time
+    {16, 1, FIT_UINT8},         //avg_heart_rate
+    {17, 1, FIT_UINT8},         //max_heart_rate
+    {18, 1, FIT_UINT8},         //avg_cadence
+    {19, 1, FIT_UINT8},         //max_cadence
+    {20, 2, FIT_UINT16},        //avg_power
+    {21, 2, FIT_UINT16},        //max_power
+    {0, 1, FIT_ENUM},           //event
+    {1, 1, FIT_ENUM},           //event_type
+    {5, 1, FIT_ENUM},           //sport
+    {6, 1, FIT_ENUM},           //sub_sport
+    {25, 2, FIT_UINT16},        //first_lap_index
+    {26, 2, FIT_UINT16},        //num_laps
+};
+
+static const FitFieldDef activityFields[] = {
+    {FIT_TIMESTAMP, 4, FIT_UINT32},
+    {0, 4, FIT_UINT32},         //total_timer_time
+    {1, 2, FIT_UINT16},         //num_sessions
+    {2, 1, FIT_ENUM},           //type
+    {3, 1, FIT_ENUM},           //event
+    {4, 1, FIT_ENUM},           //event_type
+};
+
+#define FIT_FIELDS(fields) (uint8_t)(sizeof(fields) / sizeof(fields[0])), fields
+
+static const FitMessageDef fileIdMessage   = {0, 0, FIT_FIELDS(fileIdFields)};
+static const FitMessageDef eventMessage    = {21, 1, FIT_FIELDS(eventFields)};
+static const FitMessageDef recordMessage   = {20, 2, FIT_FIELDS(recordFields)};
+static const FitMessageDef lapMessage      = {19, 3, FIT_FIELDS(lapFields)};
+static const FitMessageDef sessionMessage  = {18, 4, FIT_FIELDS(sessionFields)};
+static const FitMessageDef activityMessage = {34, 5, FIT_FIELDS(activityFields)};
+
+//Profile values
+#define FIT_FILE_ACTIVITY       4
+#define FIT_MANUFACTURER_DEV    255
+#define FIT_EVENT_TIMER         0
+#define FIT_EVENT_SESSION       8
+#define FIT_EVENT_LAP           9
+#define FIT_EVENT_ACTIVITY      26
+#define FIT_EVENT_TYPE_START    0
+#define FIT_EVENT_TYPE_STOP     1
+#define FIT_EVENT_TYPE_STOP_ALL 4
+#define FIT_SPORT_CYCLING       2
+#define FIT_SUB_SPORT_INDOOR    6
+
+static uint32_t definitionSize(const FitMessageDef &def)
+{
+  return 6 + 3 * def.fieldCount;
+}
+
+static uint32_t dataMessageSize(const FitMessageDef &def)
+{
+  uint32_t size = 1;
+  for (int i = 0; i < def.fieldCount; i++)
+  {
+    size += def.fields[i].size;
+  }
+  return size;
+}
+
+static uint32_t messageSize(const FitMessageDef &def, uint32_t count)
+{
+  return count ? definitionSize(def) + count * dataMessageSize(def) : 0;
+}
+
+/*********************************Writer*********************************/
+
+uint16_t fitCRC(uint16_t crc, const uint8_t *data, size_t length)
+{
+  static const uint16_t table[16] = {0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+                                     0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400};
+  for (size_t i = 0; i < length; i++)
+  {
+    uint16_t tmp = table[crc & 0xF];
+    crc          = ((crc >> 4) & 0x0FFF) ^ tmp ^ table[data[i] & 0xF];
+    tmp          = table[crc & 0xF];
+    crc          = ((crc >> 4) & 0x0FFF) ^ tmp ^ table[(data[i] >> 4) & 0xF];
+  }
+  return crc;
+}
+
+uint32_t FitWriter::dataSize(uint32_t records)
+{
+  return messageSize(fileIdMessage, 1) + messageSize(eventMessage, 2) + messageSize(recordMessage, records) +
+         messageSize(lapMessage, 1) + messageSize(sessionMessage, 1) + messageSize(activityMessage, 1);
+}
+
+void FitWriter::begin()
+{
+  *this = FitWriter();
+}
+
+// Adds length bytes at out to the file CRC
+size_t FitWriter::finish(uint8_t *out, size_t length)
+{
+  fileCRC = fitCRC(fileCRC, out, length);
+  return length;
+}
+
+size_t FitWriter::message(uint8_t *out, const FitMessageDef &def, const uint32_t *values)
+{
+  uint8_t *pos = out;
+  if (!(defined & (1 << def.local)))
+  {
+    defined |= 1 << def.local;
+    *pos++ = 0x40 | def.local;
+    *pos++ = 0;                 //reserved
+    *pos++ = 0;                 //little endian
+    *pos++ = def.global & 0xFF;
+    *pos++ = def.global >> 8;
+    *pos++ = def.fieldCount;
+    for (int i = 0; i < def.fieldCount; i++)
+    {
+      *pos++ = def.fields[i].number;
+      *pos++ = def.fields[i].size;
+      *pos++ = def.fields[i].baseType;
+    }
+  }
+  *pos++ = def.local;
+  for (int i = 0; i < def.fieldCount; i++)
+  {
+    for (int b = 0; b < def.fields[i].size; b++)
+    {
+      *pos++ = values[i] >> (8 * b);
+    }
+  }
+  return finish(out, pos - out);
+}
+
+size_t FitWriter::header(uint8_t *out, uint32_t recordCount)
+{
+  uint32_t size = dataSize(recordCount);
+  uint16_t profile = 2132;
+  out[0] = FIT_HEADER_SIZE;
+  out[1] = 0x10;                //protocol 1.0
+  out[2] = profile & 0xFF;
+  out[3] = profile >> 8;
+  for (int b = 0; b < 4; b++)
+  {
+    out[4 + b] = size >> (8 * b);
+  }
+  memcpy(out + 8, ".FIT", 4);
+  uint16_t crc = fitCRC(0, out, 12);
+  out[12] = crc & 0xFF;
+  out[13] = crc >> 8;
+  return finish(out, FIT_HEADER_SIZE);
+}
+
+size_t FitWriter::fileId(uint8_t *out, uint32_t timeCreated, uint32_t serialNumber)
+{
+  const uint32_t values[] = {FIT_FILE_ACTIVITY, FIT_MANUFACTURER_DEV, 0, serialNumber, timeCreated};
+  return message(out, fileIdMessage, values);
+}
+
+size_t FitWriter::startEvent(uint8_t *out, uint32_t timestamp)
+{
+  startTime = timestamp;
+  lastTime  = timestamp;
+  const uint32_t values[] = {timestamp, FIT_EVENT_TIMER, FIT_EVENT_TYPE_START, 0};
+  return message(out, eventMessage, values);
+}
+
+size_t FitWriter::record(uint8_t *out, const FitRecord &r)
+{
+  if (records && r.timestamp >= lastTime && r.timestamp - lastTime <= FIT_MAX_RECORD_GAP)
+  {
+    timerTime += r.timestamp - lastTime;
+  }
+  lastTime = r.timestamp;
+  records++;
+  powerSum += r.power;
+  cadenceSum += r.cadence;
+  if (r.heartRate)
+  {
+    hrSum += r.heartRate;
+    hrCount++;
+  }
+  maxPower   = r.power > maxPower ? r.power : maxPower;
+  maxCadence = r.cadence > maxCadence ? r.cadence : maxCadence;
+  maxHr      = r.heartRate > maxHr ? r.heartRate : maxHr;
+
+  const uint32_t values[] = {r.timestamp, r.heartRate ? r.heartRate : 0xFFu, r.cadence, r.power, (uint32_t)(int32_t)r.grade};
+  return message(out, recordMessage, values);
+}
+
+size_t FitWriter::stopEvent(uint8_t *out, uint32_t timestamp)
+{
+  lastTime = timestamp > lastTime ? timestamp : lastTime;
+  const uint32_t values[] = {lastTime, FIT_EVENT_TIMER, FIT_EVENT_TYPE_STOP_ALL, 0};
+  return message(out, eventMessage, values);
+}
+
+size_t FitWriter::lap(uint8_t *out)
+{
+  uint32_t n = records ? records : 1;
+  const uint32_t values[] = {lastTime, startTime, (lastTime - startTime) * 1000, timerTime * 1000,
+                             hrCount ? hrSum / hrCount : 0xFFu, hrCount ? maxHr : 0xFFu, cadenceSum / n, maxCadence,
+                             powerSum / n, maxPower, FIT_EVENT_LAP, FIT_EVENT_TYPE_STOP, FIT_SPORT_CYCLING};
+  return message(out, lapMessage, values);
+}
+
+size_t FitWriter::session(uint8_t *out)
+{
+  uint32_t n = records ? records : 1;
+  const uint32_t values[] = {lastTime, startTime, (lastTime - startTime) * 1000, timerTime * 1000,
+                             hrCount ? hrSum / hrCount : 0xFFu, hrCount ? maxHr : 0xFFu, cadenceSum / n, maxCadence,
+                             powerSum / n, maxPower, FIT_EVENT_SESSION, FIT_EVENT_TYPE_STOP, FIT_SPORT_CYCLING,
+                             FIT_SUB_SPORT_INDOOR, 0, 1};
+  return message(out, sessionMessage, values);
+}
+
+size_t FitWriter::activity(uint8_t *out)
+{
+  const uint32_t values[] = {lastTime, timerTime * 1000, 1, 0, FIT_EVENT_ACTIVITY, FIT_EVENT_TYPE_STOP};
+  return message(out, activityMessage, values);
+}
+
+size_t FitWriter::crc(uint8_t *out)
+{
+  out[0] = fileCRC & 0xFF;
+  out[1] = fileCRC >> 8;
+  return FIT_CRC_SIZE;
+}
@@ -0,0 +1,181 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#include "Main.h"
+#include "HTTP_Assets.h"
+
+#include <ESPAsyncWebServer.h>
+#include <SPIFFS.h>
+
+WebAssets webAssets;
+
+struct MimeType
+{
+    const char *extension;
+    const char *type;
+};
+
+static const MimeType mimeTypes[] = {
+    {".html", "text/html"},
+    {".css", "text/css"},
+    {".js", "application/javascript"},
+    {".json", "application/json"},
+    {".ico", "image/x-icon"},
+    {".png", "image/png"},
+    {".svg", "image/svg+xml"},
+    {".txt", "text/plain"},
+};
+
+const char *WebAssets::contentType(const String &path)
+{
+    for (const MimeType &mime : mimeTypes)
+    {
+        if (path.endsWith(mime.extension))
+        {
+            return mime.type;
+        }
+    }
+    return "application/octet-stream";
+}
+
+// Reads the manifest once at boot so requests don't have to look around the filesystem.
+void WebAssets::begin()
+{
+    assetCount = 0;
+    File manifest = SPIFFS.open(WEB_ASSET_MANIFEST, FILE_READ);
+    if (!manifest)
+    {
+        SS2K_LOG_TEXT(LOG_CAT_HTTP, "No asset manifest. Serving plain files.");
+        return;
+    }
+    while (manifest.available() && assetCount < WEB_ASSET_MAX_FILES)
+    {
+        String line = manifest.readStringUntil('\n');
+        int firstSpace = line.indexOf(' ');
+        int secondSpace = line.indexOf(' ', firstSpace + 1);
+        if (firstSpace < 1 || secondSpace < 0)
+        {
+            continue;
+        }
+        WebAsset &asset = assets[assetCount++];
+        asset.path = line.substring(0, firstSpace);
+        asset.etag = "\"" + line.substring(firstSpace + 1, secondSpace) + "\"";
+        asset.gzipped = line.substring(secondSpace + 1).toInt() == 1;
+    }
+    manifest.close();
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "Loaded " + String(assetCount) + " web assets from manifest");
+}
+
+const WebAsset *WebAssets::find(const String &path)
+{
+    for (int i = 0; i < assetCount; i++)
+    {
+        if (assets[i].path == path)
+        {
+            return &assets[i];
+        }
+    }
+    return nullptr;
+}
+
+// Also works before begin(), the firmware update check runs that early.
+bool WebAssets::exists(const String &path)
+{
+    return (find(path) != nullptr) || SPIFFS.exists(path) || SPIFFS.exists(path + ".gz");
+}
+
+// Writes the manifest again without path's line, so the entry stays gone after a reboot
+static void removeManifestEntry(const String &path)
+{
+    File manifest = SPIFFS.open(WEB_ASSET_MANIFEST, FILE_READ);
+    if (!manifest)
+    {
+        return;
+    }
+    String temp = String(WEB_ASSET_MANIFEST) + ".new";
+    File rewritten = SPIFFS.open(temp, FILE_WRITE);
+    if (!rewritten)
+    {
+        manifest.close();
+        return;
+    }
+    String prefix = path + " ";
+    while (manifest.available())
+    {
+        String line = manifest.readStringUntil('\n');
+        if (line.length() && !line.startsWith(prefix))
+        {
+            rewritten.print(line + "\n");
+        }
+    }
+    manifest.close();
+    rewritten.close();
+    SPIFFS.remove(WEB_ASSET_MANIFEST);
+    SPIFFS.rename(temp, WEB_ASSET_MANIFEST);
+}
+
+// A file was replaced by an upload. Drop its compressed copy and manifest entry so the new file is served.
+void WebAssets::invalidate(const String &path)
+{
+    if (path == WEB_ASSET_MANIFEST)
+    {
+        begin();
+        return;
+    }
+    for (int i = 0; i < assetCount; i++)
+    {
+        if (assets[i].path == path)
+        {
+            if (assets[i].gzipped)
+            {
+                SPIFFS.remove(path + ".gz");
+            }
+            assets[i] = assets[--assetCount];
+            removeManifestEntry(path);
+            return;
+        }
+    }
+}
+
+// Sends path, or returns false if there is no such asset.
+bool WebAssets::send(AsyncWebServerRequest *request, const String &path)
+{
+    const WebAsset *asset = find(path);
+    const char *type = contentType(path);
+    if (asset == nullptr)
+    {
+        if (!SPIFFS.exists(path))
+        {
+            return false;
+        }
+        sendSpiffsFile(request, SPIFFS.open(path, FILE_READ), path, type);
+        return true;
+    }
+
+    AsyncWebServerResponse *response;
+    if (request->hasHeader("If-None-Match") && request->header("If-None-Match") == asset->etag)
+    {
+        response = request->beginResponse(304);
+        response->addHeader("ETag", asset->etag);
+        response->addHeader("Cache-Control", path.endsWith(".html") ? WEB_PAGE_CACHE_CONTROL : WEB_ASSET_CACHE_CONTROL);
+        request->send(response);
+        return true;
+    }
+    File file = SPIFFS.open(asset->gzipped ? path + ".gz" : path, FILE_READ);
+    if (!file)
+    {
+        //The manifest is out of date. A plain copy is still better than nothing.
+        if (!SPIFFS.exists(path))
+        {
+            return false;
+        }
+        sendSpiffsFile(request, SPIFFS.open(path, FILE_READ), path, type);
+        return true;
+    }
+    sendSpiffsFile(request, file, path, type, asset->etag, path.endsWith(".html") ? WEB_PAGE_CACHE_CONTROL : WEB_ASSET_CACHE_CONTROL);
+    return true;
+}
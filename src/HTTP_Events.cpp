@@ -0,0 +1,109 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#include "Main.h"
+#include "HTTP_Events.h"
+#include "Ride_Stats.h"
+
+WebEventStream webEvents;
+
+void WebEventStream::begin(AsyncWebServer &server)
+{
+    source.onConnect([this](AsyncEventSourceClient *client) { onConnect(client); });
+    server.addHandler(&source);
+}
+
+// Runs in the async_tcp task. Brings the new viewer up to the point the broadcasts continue from.
+void WebEventStream::onConnect(AsyncEventSourceClient *client)
+{
+    if (source.count() > WEB_EVENT_MAX_VIEWERS)
+    {
+        client->close();
+        return;
+    }
+    uint32_t cursor = client->lastId();
+    uint32_t end = logCursor;
+    String log = logHistoryHTML(cursor, end);
+    if (log.length())
+    {
+        client->send(log.c_str(), "log", cursor);
+    }
+    if (telemetryValid)
+    {
+        char frame[224];
+        formatTelemetry(frame, sizeof(frame));
+        client->send(frame, "telemetry");
+    }
+}
+
+WebTelemetry WebEventStream::readTelemetry()
+{
+    WebTelemetry t;
+    t.watts = userConfig.getSimulatedWatts();
+    t.cadence = userConfig.getSimulatedCad();
+    t.hr = userConfig.getSimulatedHr();
+    t.incline = userConfig.getIncline();
+    t.stepperPosition = stepperPosition;
+    t.targetPosition = targetPosition;
+    RideTotals ride = rideStats.totals();
+    t.power3s = ride.power3s;
+    t.normalizedPower = ride.normalizedPower;
+    t.kiloJoules = ride.kiloJoules;
+    t.tss = ride.tss;
+    return t;
+}
+
+bool WebEventStream::telemetryChanged(const WebTelemetry &now)
+{
+    return !telemetryValid ||
+           (now.watts != lastTelemetry.watts) ||
+           (now.cadence != lastTelemetry.cadence) ||
+           (now.hr != lastTelemetry.hr) ||
+           (now.incline != lastTelemetry.incline) ||
+           (now.stepperPosition != lastTelemetry.stepperPosition) ||
+           (now.targetPosition != lastTelemetry.targetPosition) ||
+           (now.power3s != lastTelemetry.power3s) ||
+           (now.kiloJoules != lastTelemetry.kiloJoules);
+}
+
+void WebEventStream::formatTelemetry(char *out, size_t size)
+{
+    snprintf(out, size, "{\"watts\":%d,\"cad\":%.1f,\"hr\":%d,\"incline\":%.2f,\"position\":%d,\"target\":%d,"
+             "\"watts3s\":%d,\"np\":%d,\"kj\":%.1f,\"tss\":%.1f}",
+             lastTelemetry.watts, lastTelemetry.cadence, lastTelemetry.hr, lastTelemetry.incline / 100,
+             lastTelemetry.stepperPosition, lastTelemetry.targetPosition, lastTelemetry.power3s,
+             lastTelemetry.normalizedPower, lastTelemetry.kiloJoules, lastTelemetry.tss);
+}
+
+// Called from the web task loop. Broadcasts what changed since the last call.
+void WebEventStream::update()
+{
+    if (source.count() == 0)
+    {
+        logCursor = logHistoryEnd(); //Nobody is watching. New viewers catch up from the history.
+        telemetryValid = false;
+        return;
+    }
+
+    unsigned long now = millis();
+    WebTelemetry telemetry = readTelemetry();
+    if (telemetryChanged(telemetry) && (now - lastTelemetryAt >= WEB_EVENT_TELEMETRY_INTERVAL))
+    {
+        lastTelemetry = telemetry;
+        lastTelemetryAt = now;
+        telemetryValid = true;
+        char frame[224];
+        formatTelemetry(frame, sizeof(frame));
+        source.send(frame, "telemetry");
+    }
+
+    String log = logHistoryHTML(logCursor);
+    if (log.length())
+    {
+        source.send(log.c_str(), "log", logCursor);
+    }
+}
@@ -6,34 +6,45 @@
 // Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
 
 #include "Main.h"
-#include "Version_Converter.h"
 #include "Builtin_Pages.h"
 #include "HTTP_Server_Basic.h"
-#include "cert.h"
-#include <WebServer.h>
+#include "HTTP_Events.h"
+#include "HTTP_Assets.h"
+#include "Update_Agent.h"
+#include "Ride_Export.h"
+#include "Power_Curve.h"
+#include "Workout_Player.h"
+#include <ESPAsyncWebServer.h>
 #include <HTTPClient.h>
-#include <HTTPUpdate.h>
 #include <SPIFFS.h>
 #include <ESPmDNS.h>
 #include <WiFiClientSecure.h>
 #include <Update.h>
-#include <DNSServer.h>
+#include "WiFi_Manager.h"
 
 
 File fsUploadFile;
+//Set by handleUpload() when a firmware upload was refused, answered by the /update handler
+static volatile bool uploadRejected = false;
 
 TaskHandle_t webClientTask;
 #define MAX_BUFFER_SIZE 20
 
-IPAddress myIP;
 bool internetConnection = false;
 
-// DNS server
-const byte DNS_PORT = 53;
-DNSServer dnsServer;
-
 WiFiClientSecure client;
-WebServer server(80);
+AsyncWebServer server(80);
+
+//Deferred web actions
+static volatile uint8_t webPendingActions = 0;
+static unsigned long webActionsAt = 0;
+static portMUX_TYPE webActionsMux = portMUX_INITIALIZER_UNLOCKED;
+
+//Settings posted to /send_settings. The web task applies them, it's the one saving the config,
+//so the config Strings are never rewritten while they're being encoded.
+static std::vector<std::pair<String, String>> webPendingForm;
+static bool webPendingScan = false;
+static SemaphoreHandle_t webFormMutex = nullptr;
 
 #ifdef USE_TELEGRAM
   #include <UniversalTelegramBot.h>
@@ -43,87 +54,34 @@ WebServer server(80);
   String telegramMessage = "";
 #endif
 
-//********************************WIFI Setup*************************//
-void startWifi()
+// Gets UTC time via NTP (needed to check the update server's certificate). Gives up after BOOT_NTP_TIMEOUT.
+bool syncTime()
 {
-
-  int i = 0;
-
-  //Trying Station mode first:
-  debugDirector("Connecting to: " + String(userConfig.getSsid()));
-  if (String(WiFi.SSID()) != userConfig.getSsid())
+  //The WiFi manager starts SNTP once the station is connected
+  if (!wifiManager.waitConnected(WIFI_CONNECT_TIMEOUT * 1000UL))
   {
-    WiFi.mode(WIFI_STA);
-    WiFi.setTxPower(WIFI_POWER_19_5dBm);
-    WiFi.begin(userConfig.getSsid(), userConfig.getPassword());
+    return false;
   }
-
-  while (WiFi.status() != WL_CONNECTED)
+  unsigned long started = millis();
+  while (time(nullptr) < 5 * 3600)
   {
-    vTaskDelay(1000 / portTICK_RATE_MS);
-    debugDirector(".", false);
-    i++;
-    if (i > WIFI_CONNECT_TIMEOUT || (String(userConfig.getSsid()) == DEVICE_NAME))
+    if (millis() - started > BOOT_NTP_TIMEOUT)
     {
-      i = 0;
-      debugDirector("Couldn't Connect. Switching to AP mode");
-      WiFi.disconnect();
-      WiFi.mode(WIFI_AP);
-      break;
+      SS2K_LOGW(LOG_CAT_HTTP, "NTP time not received");
+      return false;
     }
+    vTaskDelay(100 / portTICK_PERIOD_MS);
   }
-  if (WiFi.status() == WL_CONNECTED)
-  {
-    myIP = WiFi.localIP();
-    internetConnection = true;
-  }
-
-  // Couldn't connect to existing network, Create SoftAP
-  if (WiFi.status() != WL_CONNECTED)
-  {
-    String t_pass = DEFAULT_PASSWORD;
-    if (String(userConfig.getSsid()) == DEVICE_NAME) //If default SSID is still in use, let the user select a new password.
-    {                                                //Else Fall Back to the default password (probably "password")
-      String t_pass = String(userConfig.getPassword());
-    }
-    WiFi.softAP(userConfig.getDeviceName(), t_pass.c_str());
-    vTaskDelay(50);
-    myIP = WiFi.softAPIP();
-    /* Setup the DNS server redirecting all the domains to the apIP */
-    dnsServer.setErrorReplyCode(DNSReplyCode::NoError);
-    dnsServer.start(DNS_PORT, "*", myIP);
-  }
-
-  if (!MDNS.begin(userConfig.getDeviceName()))
-  {
-    debugDirector("Error setting up MDNS responder!");
-  }
-
-  MDNS.addService("http", "_tcp", 80);
-  debugDirector("Connected to " + String(userConfig.getSsid()) + " IP address: " + myIP.toString(), true, true);
-  debugDirector(String("Open http://") + userConfig.getDeviceName() + ".local/");
-  WiFi.setTxPower(WIFI_POWER_19_5dBm);
-
-  if (WiFi.getMode() == WIFI_STA)
-  {
-    Serial.print("Retrieving time: ");
-    configTime(0, 0, "pool.ntp.org"); // get UTC time via NTP
-    time_t now = time(nullptr);
-    while (now < 5 * 3600)
-    {
-      Serial.print(".");
-      delay(100);
-      now = time(nullptr);
-    }
-    Serial.println(now);
-  }
+  SS2K_LOGI(LOG_CAT_HTTP, "Time: %u", (unsigned)time(nullptr));
+  return true;
 }
 
 void startHttpServer()
 {
 
-  server.onNotFound([]() {
-    debugDirector("Link Not Found: " + server.uri());
+  server.onNotFound([](AsyncWebServerRequest *request) {
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "Link Not Found: " + request->url());
+    request->send(404, "text/plain", "Not Found");
   });
 
   /********************************************Begin Handlers***********************************/
@@ -140,307 +98,254 @@ void startHttpServer()
   server.on("/hrtowatts.html", handleSpiffsFile);
   server.on("/favicon.ico", handleSpiffsFile);
 
-  server.on("/send_settings", []() {
-    String tString;
-    bool wasBTUpdate = false;
-    if (!server.arg("ssid").isEmpty())
-    {
-      tString = server.arg("ssid");
-      tString.trim();
-      userConfig.setSsid(tString);
-    }
-    if (!server.arg("password").isEmpty())
-    {
-      tString = server.arg("password");
-      tString.trim();
-      userConfig.setPassword(tString);
-    }
-    if (!server.arg("deviceName").isEmpty())
-    {
-      tString = server.arg("deviceName");
-      tString.trim();
-      userConfig.setDeviceName(tString);
-    }
-    if (!server.arg("shiftStep").isEmpty())
-    {
-      userConfig.setShiftStep(server.arg("shiftStep").toInt());
-    }
-    if (!server.arg("stepperPower").isEmpty())
-    {
-      userConfig.setStepperPower(server.arg("stepperPower").toInt());
-      updateStepperPower();
-    }
-    //checkboxes don't report off, so need to check using another parameter that's always present on that page
-    if (!server.arg("stepperPower").isEmpty())
-    {
-      if (!server.arg("autoUpdate").isEmpty())
-      {
-        userConfig.setAutoUpdate(true);
-      }
-      else
-      {
-        userConfig.setAutoUpdate(false);
-      }
-      if (!server.arg("stealthchop").isEmpty())
-      {
-        userConfig.setStealthChop(true);
-        updateStealthchop();
-      }
-      else
-      {
-        userConfig.setStealthChop(false);
-        updateStealthchop();
-      }
-    }
-    if (!server.arg("inclineMultiplier").isEmpty())
+  webFormMutex = xSemaphoreCreateMutex();
+  server.on("/send_settings", [](AsyncWebServerRequest *request) {
+    bool wasBTUpdate = !request->arg("blePMDropdown").isEmpty() || !request->arg("bleHRDropdown").isEmpty();
+    //Copied for the web task, see webApplySettings()
+    xSemaphoreTake(webFormMutex, portMAX_DELAY);
+    for (size_t i = 0; i < request->args(); i++)
     {
-      userConfig.setInclineMultiplier(server.arg("inclineMultiplier").toFloat());
-    }
-    if (!server.arg("blePMDropdown").isEmpty())
-    {
-      wasBTUpdate = true;
-      if (server.arg("blePMDropdown"))
-      {
-        tString = server.arg("blePMDropdown");
-        userConfig.setConnectedPowerMeter(server.arg("blePMDropdown"));
-      }
-      else
-      {
-        userConfig.setConnectedPowerMeter("any");
-      }
-    }
-    if (!server.arg("bleHRDropdown").isEmpty())
-    {
-      wasBTUpdate = true;
-      if (server.arg("bleHRDropdown"))
-      {
-        tString = server.arg("bleHRDropdown");
-        userConfig.setConnectedHeartMonitor(server.arg("bleHRDropdown"));
-      }
-      else
-      {
-        userConfig.setConnectedHeartMonitor("any");
-      }
-      if (!server.arg("doublePower").isEmpty())
-      {
-        userConfig.setDoublePower(true);
-      }
-      else
-      {
-        userConfig.setDoublePower(false);
-      }
+      webPendingForm.emplace_back(request->argName(i), request->arg(i));
     }
-
-    if (!server.arg("session1HR").isEmpty()) //Needs checking for unrealistic numbers.
-    {
-      userPWC.session1HR = server.arg("session1HR").toInt();
-    }
-    if (!server.arg("session1Pwr").isEmpty())
-    {
-      userPWC.session1Pwr = server.arg("session1Pwr").toInt();
-    }
-    if (!server.arg("session2HR").isEmpty())
-    {
-      userPWC.session2HR = server.arg("session2HR").toInt();
-    }
-    if (!server.arg("session2Pwr").isEmpty())
-    {
-      userPWC.session2Pwr = server.arg("session2Pwr").toInt();
-
-      if (!server.arg("hr2Pwr").isEmpty())
-      {
-        userPWC.hr2Pwr = true;
-      }
-      else
-      {
-        userPWC.hr2Pwr = false;
-      }
-    }
-
-    String response = "<!DOCTYPE html><html><body><h2>";
+    webPendingScan |= wasBTUpdate;
+    xSemaphoreGive(webFormMutex);
 
     if (wasBTUpdate) //Special BT update response
     {
-      response += "Selections Saved!</h2></body><script> setTimeout(\"location.href = 'http://" + myIP.toString() + "/bluetoothscanner.html';\",1000);</script></html>";
-      spinBLEClient.serverScan(true);
+      sendTemplate(request, settingsSavedBTHTML);
     }
     else
     { //Normal response
-      response += "Network settings will be applied at next reboot. <br> Everything else is availiable immediatly.</h2></body><script> setTimeout(\"location.href = 'http://" + myIP.toString() + "/index.html';\",1000);</script></html>";
+      sendTemplate(request, settingsSavedHTML);
     }
-    server.send(200, "text/html", response);
-    debugDirector("Config Updated From Web");
-    userConfig.saveToSPIFFS();
-    userConfig.printFile();
-    userPWC.saveToSPIFFS();
-    userPWC.printFile();
   });
 
-  server.on("/BLEScan", []() {
-    debugDirector("Scanning from web request");
-    String response = "<!DOCTYPE html><html><body>Scanning for BLE Devices. Please wait 15 seconds.</body><script> setTimeout(\"location.href = 'http://" + myIP.toString() + "/bluetoothscanner.html';\",15000);</script></html>";
+  server.on("/BLEScan", [](AsyncWebServerRequest *request) {
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "Scanning from web request");
     spinBLEClient.serverScan(true);
     //spinBLEClient.serverScan(true);
-    server.send(200, "text/html", response);
+    sendTemplate(request, bleScanHTML);
   });
 
-  server.on("/load_defaults.html", []() {
-    debugDirector("Setting Defaults from Web Request");
-    SPIFFS.format();
-    userConfig.setDefaults();
-    userConfig.saveToSPIFFS();
-    String response = "<!DOCTYPE html><html><body><h1>Defaults have been loaded.</h1><p><br><br> Please reconnect to the device on WiFi network: " + myIP.toString() + "</p></body></html>";
-    server.send(200, "text/html", response);
-    ESP.restart();
+  server.on("/load_defaults.html", [](AsyncWebServerRequest *request) {
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "Setting Defaults from Web Request");
+    sendTemplate(request, defaultsLoadedHTML);
+    webDeferAction(WEB_ACTION_LOAD_DEFAULTS);
   });
 
-  server.on("/reboot.html", []() {
-    debugDirector("Rebooting from Web Request");
-    String response = "Rebooting....<script> setTimeout(\"location.href = 'http://" + myIP.toString() + "/index.html';\",500); </script>";
-    server.send(200, "text/html", response);
-    vTaskDelay(100 / portTICK_PERIOD_MS);
-    ESP.restart();
+  server.on("/reboot.html", [](AsyncWebServerRequest *request) {
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "Rebooting from Web Request");
+    sendTemplate(request, rebootingHTML);
+    webDeferAction(WEB_ACTION_REBOOT);
   });
 
-  server.on("/hrslider", []() {
-    String value = server.arg("value");
+  server.on("/hrslider", [](AsyncWebServerRequest *request) {
+    String value = request->arg("value");
     if (value == "enable")
     {
       userConfig.setSimulateHr(true);
-      server.send(200, "text/plain", "OK");
-      debugDirector("HR Simulator turned on");
+      configMarkDirty(CONFIG_DIRTY_USER);
+      request->send(200, "text/plain", "OK");
+      SS2K_LOG_TEXT(LOG_CAT_HTTP, "HR Simulator turned on");
     }
     else if (value == "disable")
     {
       userConfig.setSimulateHr(false);
-      server.send(200, "text/plain", "OK");
-      debugDirector("HR Simulator turned off");
+      configMarkDirty(CONFIG_DIRTY_USER);
+      request->send(200, "text/plain", "OK");
+      SS2K_LOG_TEXT(LOG_CAT_HTTP, "HR Simulator turned off");
     }
     else
     {
       userConfig.setSimulatedHr(value.toInt());
-      debugDirector("HR is now: " + String(userConfig.getSimulatedHr()));
-      server.send(200, "text/plain", "OK");
+      SS2K_LOG_TEXT(LOG_CAT_HTTP, "HR is now: " + String(userConfig.getSimulatedHr()));
+      request->send(200, "text/plain", "OK");
     }
-    debugDirector("Webclient High Water Mark: " + String(uxTaskGetStackHighWaterMark(webClientTask)));
   });
 
-  server.on("/wattsslider", []() {
-    String value = server.arg("value");
+  server.on("/wattsslider", [](AsyncWebServerRequest *request) {
+    String value = request->arg("value");
     if (value == "enable")
     {
       userConfig.setDoublePower(true);
-      server.send(200, "text/plain", "OK");
-      debugDirector("Watt Simulator turned on");
+      configMarkDirty(CONFIG_DIRTY_USER);
+      request->send(200, "text/plain", "OK");
+      SS2K_LOG_TEXT(LOG_CAT_HTTP, "Watt Simulator turned on");
     }
     else if (value == "disable")
     {
       userConfig.setDoublePower(false);
-      server.send(200, "text/plain", "OK");
-      debugDirector("Watt Simulator turned off");
+      configMarkDirty(CONFIG_DIRTY_USER);
+      request->send(200, "text/plain", "OK");
+      SS2K_LOG_TEXT(LOG_CAT_HTTP, "Watt Simulator turned off");
     }
     else
     {
       userConfig.setSimulatedWatts(value.toInt());
-      debugDirector("Watts are now: " + String(userConfig.getSimulatedWatts()));
-      server.send(200, "text/plain", "OK");
+      SS2K_LOG_TEXT(LOG_CAT_HTTP, "Watts are now: " + String(userConfig.getSimulatedWatts()));
+      request->send(200, "text/plain", "OK");
     }
-    debugDirector("Webclient High Water Mark: " + String(uxTaskGetStackHighWaterMark(webClientTask)));
   });
 
-  server.on("/hrValue", []() {
+  server.on("/hrValue", [](AsyncWebServerRequest *request) {
     char outString[MAX_BUFFER_SIZE];
     snprintf(outString, MAX_BUFFER_SIZE, "%d", userConfig.getSimulatedHr());
-    server.send(200, "text/plain", outString);
+    request->send(200, "text/plain", outString);
   });
 
-  server.on("/wattsValue", []() {
+  server.on("/wattsValue", [](AsyncWebServerRequest *request) {
     char outString[MAX_BUFFER_SIZE];
     snprintf(outString, MAX_BUFFER_SIZE, "%d", userConfig.getSimulatedWatts());
-    server.send(200, "text/plain", outString);
+    request->send(200, "text/plain", outString);
   });
 
-  server.on("/configJSON", []() {
-    String tString;
-    tString = userConfig.returnJSON();
-    tString.remove(tString.length() - 1, 1);
-    tString += String(",\"debug\":\"") + debugToHTML + "\",\"firmwareVersion\":\"" + String(FIRMWARE_VERSION) + "\"}";
-    server.send(200, "text/plain", tString);
-    debugToHTML = " ";
+  //?fields=a,b,c only returns those keys
+  server.on("/configJSON", [](AsyncWebServerRequest *request) {
+    bool versionWritten = false;
+    sendJSON(request, [versionWritten](JsonStreamWriter &writer, size_t index) mutable -> bool {
+      if (userConfig.writeJSONField(writer, index))
+      {
+        return true;
+      }
+      if (versionWritten)
+      {
+        return false;
+      }
+      writer.field("firmwareVersion", FIRMWARE_VERSION);
+      versionWritten = true;
+      return true;
+    });
   });
 
-  server.on("/PWCJSON", []() {
-    String tString;
-    tString = userPWC.returnJSON();
-    server.send(200, "text/plain", tString);
-    debugToHTML = " ";
+  server.on("/BLELinksJSON", [](AsyncWebServerRequest *request) {
+    request->send(200, "text/plain", connParams.returnJSON());
   });
 
-  server.on("/login", HTTP_GET, []() {
-    server.sendHeader("Connection", "close");
-    server.send(200, "text/html", OTALoginIndex);
+  server.on("/radioJSON", [](AsyncWebServerRequest *request) {
+    request->send(200, "text/plain", radioScheduler.returnJSON());
   });
 
-  server.on("/OTAIndex", HTTP_GET, []() {
-    spinBLEClient.disconnect();
-    server.sendHeader("Connection", "close");
-    server.send(200, "text/html", OTAServerIndex);
+  server.on("/PWCJSON", [](AsyncWebServerRequest *request) {
+    sendJSON(request, [](JsonStreamWriter &writer, size_t index) { return userPWC.writeJSONField(writer, index); });
   });
 
-  /*handling uploading firmware file */
-  server.on(
-      "/update", HTTP_POST, []() {
-    server.sendHeader("Connection", "close");
-    server.send(200, "text/plain", (Update.hasError()) ? "FAIL" : "OK"); }, []() {
-    HTTPUpload& upload = server.upload();
-    if (upload.filename == String ("firmware.bin").c_str()){
-    if (upload.status == UPLOAD_FILE_START) {
-      debugDirector("Update: " + upload.filename);
-      if (!Update.begin(UPDATE_SIZE_UNKNOWN)) { //start with max available size
-        Update.printError(Serial);
-      }
-    } else if (upload.status == UPLOAD_FILE_WRITE) {
-      /* flashing firmware to ESP*/
-      if (Update.write(upload.buf, upload.currentSize) != upload.currentSize) {
-        Update.printError(Serial);
+  //Best average power per duration (s) of this ride and of all rides
+  server.on("/mmpJSON", [](AsyncWebServerRequest *request) {
+    //Taken once, so every chunk shows the same moment
+    uint16_t ride[POWER_CURVE_POINTS];
+    uint16_t best[POWER_CURVE_POINTS];
+    powerCurve.bests(ride, best);
+    int ftpEstimate = powerCurve.ftpEstimate();
+    sendJSON(request, [ride, best, ftpEstimate](JsonStreamWriter &writer, size_t index) -> bool {
+      switch (index)
+      {
+      case 0:
+        writer.field("durations", PowerCurve::durations, POWER_CURVE_POINTS);
+        return true;
+      case 1:
+        writer.field("ride", ride, POWER_CURVE_POINTS);
+        return true;
+      case 2:
+        writer.field("best", best, POWER_CURVE_POINTS);
+        return true;
+      case 3:
+        writer.field("ftpEstimate", ftpEstimate);
+        return true;
+      default:
+        return false;
       }
-    } else if (upload.status == UPLOAD_FILE_END) {
-      if (Update.end(true)) { //true to set the size to the current progress
-              server.send(200, "text/plain", "Firmware Uploaded Sucessfully. Rebooting...");
-              vTaskDelay(2000/portTICK_PERIOD_MS);
-              ESP.restart();
-      } else {
-        Update.printError(Serial);
+    });
+  });
+
+  //?start=<name> plays WORKOUT_PATH_PREFIX<name>WORKOUT_FILE_SUFFIX, ?skip or ?stop control it.
+  //Always answers with the player's state. Starting answers 404 for a missing workout, 422 for a file that
+  //isn't one, 409 without a power meter and 503 if the player's timer can't be created.
+  server.on("/workout", [](AsyncWebServerRequest *request) {
+    int status = 200;
+    if (request->hasArg("start"))
+    {
+      switch (workoutPlayer.start(request->arg("start")))
+      {
+      case WORKOUT_STARTED:
+        break;
+      case WORKOUT_NOT_FOUND:
+        status = 404;
+        break;
+      case WORKOUT_INVALID:
+        status = 422;
+        break;
+      case WORKOUT_NO_POWER_METER:
+        status = 409;
+        break;
+      case WORKOUT_NO_TIMER:
+        status = 503;
+        break;
       }
     }
-    } else {   
-      
-    if (upload.status == UPLOAD_FILE_START) {
-    String filename = upload.filename;
-    if (!filename.startsWith("/")) {
-      filename = "/" + filename;
-    }
-    debugDirector("handleFileUpload Name: " + filename);
-    fsUploadFile = SPIFFS.open(filename, "w");
-    filename = String();
-  } else if (upload.status == UPLOAD_FILE_WRITE) {
-    if (fsUploadFile) {
-      fsUploadFile.write(upload.buf, upload.currentSize);
-    }
-  } else if (upload.status == UPLOAD_FILE_END) {
-    if (fsUploadFile) {
-      fsUploadFile.close();
+    else if (request->hasArg("skip"))
+    {
+      workoutPlayer.skip();
     }
-    debugDirector(String("handleFileUpload Size: ") + String(upload.totalSize));
-    server.send(200, "text/plain", String(upload.filename + " Uploaded Sucessfully."));
-  } } });
+    else if (request->hasArg("stop"))
+    {
+      workoutPlayer.stop();
+    }
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    response->setCode(status);
+    JsonStreamWriter writer(*response);
+    writer.beginObject();
+    workoutPlayer.writeJSON(writer);
+    writer.endObject();
+    request->send(response);
+  });
+
+  //"/rides" lists the recorded rides, "/rides/<id>.fit" downloads one
+  server.on("/rides", HTTP_GET, handleRides);
+
+  server.on("/login", HTTP_GET, [](AsyncWebServerRequest *request) {
+    AsyncWebServerResponse *response = request->beginResponse_P(200, "text/html", OTALoginIndex);
+    response->addHeader("Connection", "close");
+    request->send(response);
+  });
+
+  server.on("/OTAIndex", HTTP_GET, [](AsyncWebServerRequest *request) {
+    AsyncWebServerResponse *response = request->beginResponse_P(200, "text/html", OTAServerIndex);
+    response->addHeader("Connection", "close");
+    request->send(response);
+  });
+
+  /*handling uploading firmware file */
+  server.on(
+      "/update", HTTP_POST, [](AsyncWebServerRequest *request) {
+    //Called once the whole upload went through handleUpload()
+    if (uploadRejected)
+    {
+      uploadRejected = false;
+      AsyncWebServerResponse *response = request->beginResponse(409, "text/plain", "A firmware update is already being installed. Try again later.");
+      response->addHeader("Connection", "close");
+      request->send(response);
+      return;
+    }
+    bool firmwareDone = Update.isFinished() && !Update.hasError();
+    AsyncWebServerResponse *response = request->beginResponse(200, "text/plain", (Update.hasError()) ? "FAIL" : (firmwareDone ? "Firmware Uploaded Sucessfully. Rebooting when the ride is over..." : "OK"));
+    response->addHeader("Connection", "close");
+    request->send(response);
+    if (firmwareDone)
+    {
+      updateAgent.rebootWhenIdle();
+    } }, handleUpload);
+
+  //Live telemetry & log stream. See HTTP_Events.h
+  webEvents.begin(server);
+
+  webAssets.begin();
 
   /********************************************End Server Handlers*******************************/
 
   xTaskCreatePinnedToCore(
       webClientUpdate,   /* Task function. */
       "webClientUpdate", /* name of task. */
-      4000,              /* Stack size of task Used to be 3000*/
+      5000,              /* Stack size of task. Events (float snprintf), deferred actions (SPIFFS format, config save), posted settings and config record writes */
       NULL,              /* parameter of the task */
       1,                 /* priority of the task  - 29 worked*/
       &webClientTask,    /* Task handle to keep track of created task */
@@ -458,148 +363,270 @@ void startHttpServer()
 #endif
 
   server.begin();
-  debugDirector("HTTP server started");
+  SS2K_LOG_TEXT(LOG_CAT_HTTP, "HTTP server started");
 }
 
-void webClientUpdate(void *pvParameters)
+// Firmware and file uploads. Called by the async server for every received chunk.
+void handleUpload(AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final)
 {
-  for (;;)
+  if (filename == "firmware.bin")
   {
-    server.handleClient();
-    vTaskDelay(WEBSERVER_DELAY / portTICK_RATE_MS);
-    if (WiFi.getMode() == WIFI_AP)
+    if (updateAgent.busy())
     {
-      dnsServer.processNextRequest();
+      //Update is a singleton and the background update is using it
+      if (index == 0)
+      {
+        SS2K_LOG_TEXT(LOG_CAT_HTTP, "Update: background update running, upload refused");
+      }
+      uploadRejected = true;
+      return;
     }
+    if (index == 0)
+    {
+      SS2K_LOG_TEXT(LOG_CAT_HTTP, "Update: " + filename);
+      if (!Update.begin(UPDATE_SIZE_UNKNOWN))
+      { //start with max available size
+        Update.printError(Serial);
+      }
+    }
+    /* flashing firmware to ESP*/
+    if (Update.write(data, len) != len)
+    {
+      Update.printError(Serial);
+    }
+    if (final)
+    {
+      if (!Update.end(true))
+      { //true to set the size to the current progress
+        Update.printError(Serial);
+      }
+    }
+    return;
   }
-}
 
-void handleIndexFile()
-{
-  String filename = "/index.html";
-  if (SPIFFS.exists(filename))
+  if (!filename.startsWith("/"))
   {
-    File file = SPIFFS.open(filename, FILE_READ);
-    server.streamFile(file, "text/html");
-    file.close();
+    filename = "/" + filename;
   }
-  else
+  if (index == 0)
+  {
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "handleFileUpload Name: " + filename);
+    fsUploadFile = SPIFFS.open(filename, "w");
+  }
+  if (fsUploadFile)
   {
-    debugDirector(filename + " not found. Sending builtin Index.html");
-    server.send(200, "text/html", noIndexHTML);
+    fsUploadFile.write(data, len);
   }
+  if (final)
+  {
+    if (fsUploadFile)
+    {
+      fsUploadFile.close();
+    }
+    webAssets.invalidate(filename);
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, String("handleFileUpload Size: ") + String(index + len));
+  }
+}
+
+// Work that is too slow for the async_tcp task, or has to wait for a response to go out, is handed to the web task.
+void webDeferAction(uint8_t action)
+{
+  portENTER_CRITICAL(&webActionsMux);
+  webPendingActions |= action;
+  webActionsAt = millis();
+  portEXIT_CRITICAL(&webActionsMux);
 }
 
-void handleSpiffsFile()
+// Applies the settings posted to /send_settings. Runs before configPersistUpdate() in the same task.
+static void webApplySettings()
 {
-  String filename = server.uri();
-  int dotPosition = filename.lastIndexOf(".");
-  String fileType = filename.substring((dotPosition + 1), filename.length());
-  if (SPIFFS.exists(filename))
+  std::vector<std::pair<String, String>> form;
+  bool scan;
+  xSemaphoreTake(webFormMutex, portMAX_DELAY);
+  form.swap(webPendingForm);
+  scan           = webPendingScan;
+  webPendingScan = false;
+  xSemaphoreGive(webFormMutex);
+  if (form.empty())
   {
-    File file = SPIFFS.open(filename, FILE_READ);
-    server.streamFile(file, "text/" + fileType);
-    file.close();
-    debugDirector("Served " + filename);
+    return;
   }
-  else
+
+  //Both schemas pick their fields (and the log level selects) out of the form.
+  //A field sent by two posts since the last run takes the later value.
+  ConfigFormReader readArg = [&form](const char *name, String &value) {
+    for (auto arg = form.rbegin(); arg != form.rend(); ++arg)
+    {
+      if (arg->first == name)
+      {
+        value = arg->second;
+        return true;
+      }
+    }
+    return false;
+  };
+  if (userConfig.applyForm(readArg))
   {
-    debugDirector(filename + " not found. Sending builtin Index.html");
-    server.send(404, "text/html", "<html><body><h1>ERROR 404 <br> FILE NOT FOUND!</h1></body></html>");
+    configMarkDirty(CONFIG_DIRTY_USER);
   }
+  if (userPWC.applyForm(readArg))
+  {
+    configMarkDirty(CONFIG_DIRTY_PWC);
+  }
+  if (scan)
+  {
+    spinBLEClient.serverScan(true);
+  }
+  SS2K_LOG_TEXT(LOG_CAT_HTTP, "Config Updated From Web");
 }
 
-//github fingerprint 70:94:DE:DD:E6:C4:69:48:3A:92:70:A1:48:56:78:2D:18:64:E0:B7
-
-void FirmwareUpdate()
+static void webRunDeferredActions()
 {
-  HTTPClient http;
-  //WiFiClientSecure client;
-
-  client.setCACert(rootCACertificate);
-  debugDirector("Checking for newer firmware:");
-  http.begin(userConfig.getFirmwareUpdateURL() + String(FW_VERSIONFILE), rootCACertificate); // check version URL
-  delay(100);
-  int httpCode = http.GET(); // get data from version file
-  delay(100);
-  String payload;
-  if (httpCode == HTTP_CODE_OK) // if version received
+  if (webPendingActions == 0 || (millis() - webActionsAt) < WEB_ACTION_DELAY)
   {
-    payload = http.getString(); // save received version
-    payload.trim();
-    debugDirector("  -Server Ver " + payload);
-    internetConnection = true;
+    return;
   }
-  else
+  portENTER_CRITICAL(&webActionsMux);
+  uint8_t actions = webPendingActions;
+  webPendingActions = 0;
+  portEXIT_CRITICAL(&webActionsMux);
+
+  if (actions & WEB_ACTION_LOAD_DEFAULTS)
+  {
+    SPIFFS.format();
+    userConfig.setDefaults();
+    userConfig.saveToSPIFFS(true);
+    actions |= WEB_ACTION_REBOOT;
+  }
+  if (actions & WEB_ACTION_REBOOT)
+  {
+    configFlush();
+    ESP.restart();
+  }
+}
+
+// The async server answers requests on its own. This task only keeps the event stream,
+// deferred actions and config saving going. The captive portal DNS runs in the WiFi manager.
+void webClientUpdate(void *pvParameters)
+{
+  for (;;)
   {
-    debugDirector("error downloading " + String(FW_VERSIONFILE) + " " + String(httpCode));
-    internetConnection = false;
+    webEvents.update();
+    webApplySettings();
+    webRunDeferredActions();
+    configPersistUpdate();
+    vTaskDelay(WEBSERVER_DELAY / portTICK_RATE_MS);
   }
+}
 
-  http.end();
-  if (httpCode == HTTP_CODE_OK) // if version received
+void handleRides(AsyncWebServerRequest *request)
+{
+  String url = request->url();
+  if (url == "/rides" || url == "/rides/")
   {
-    bool updateAnyway = false;
-    if (!SPIFFS.exists("/index.html"))
+    RideInfo rides[RIDE_MAX_LISTED];
+    int count = rideRecorder.listRides(rides, RIDE_MAX_LISTED);
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    response->print('[');
+    for (int i = 0; i < count; i++)
     {
-      updateAnyway = true;
-      debugDirector("  -index.html not found. Forcing update");
+      response->printf("%s{\"id\":%u,\"startTime\":%u,\"duration\":%u,\"url\":\"/rides/%u.fit\"}", i ? "," : "", rides[i].id,
+                       rides[i].startTime, rides[i].duration, rides[i].id);
     }
-    Version availiableVer(payload.c_str());
-    Version currentVer(FIRMWARE_VERSION);
+    response->print(']');
+    request->send(response);
+    return;
+  }
 
-    if ((availiableVer > currentVer) || (updateAnyway))
-    {
-      debugDirector("New firmware detected!");
-      debugDirector("Upgrading from " + String(FIRMWARE_VERSION) + " to " + payload);
-
-      //Update Spiffs
-      httpUpdate.setLedPin(LED_BUILTIN, LOW);
-      debugDirector("Updating FileSystem");
-      t_httpUpdate_return ret = httpUpdate.updateSpiffs(client, userConfig.getFirmwareUpdateURL() + String(FW_SPIFFSFILE));
-      vTaskDelay(100 / portTICK_PERIOD_MS);
-      switch (ret)
-      {
-      case HTTP_UPDATE_OK:
-        debugDirector("Saving Config.txt");
-        userConfig.saveToSPIFFS();
-        userPWC.saveToSPIFFS();
-        debugDirector("Updating Program");
-        break;
+  if (!url.endsWith(".fit"))
+  {
+    request->send(404, "text/plain", "Not Found");
+    return;
+  }
+  uint16_t id = url.substring(strlen("/rides/"), url.length() - 4).toInt();
+  //Owned by the response's callback, freed with it
+  std::shared_ptr<RideExport> ride(new RideExport());
+  if (!ride->begin(id))
+  {
+    request->send(404, "text/plain", "No such ride");
+    return;
+  }
+  AsyncWebServerResponse *response = request->beginChunkedResponse("application/vnd.ant.fit", [ride](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+    return ride->read(buffer, maxLen);
+  });
+  response->addHeader("Content-Disposition", "attachment; filename=\"ride-" + String(id) + ".fit\"");
+  request->send(response);
+}
 
-      case HTTP_UPDATE_NO_UPDATES:
-        debugDirector("HTTP_UPDATE_NO_UPDATES");
-        break;
+void handleIndexFile(AsyncWebServerRequest *request)
+{
+  if (!webAssets.send(request, "/index.html"))
+  {
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "/index.html not found. Sending builtin Index.html");
+    request->send_P(200, "text/html", noIndexHTML);
+  }
+}
 
-      case HTTP_UPDATE_FAILED:
-        debugDirector("SPIFFS Update Failed: " + String(httpUpdate.getLastError()) + " : " + httpUpdate.getLastErrorString());
-        break;
-      }
+void handleSpiffsFile(AsyncWebServerRequest *request)
+{
+  String filename = request->url();
+  if (webAssets.send(request, filename))
+  {
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "Served " + filename);
+  }
+  else
+  {
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, filename + " not found. Sending builtin Index.html");
+    request->send_P(404, "text/html", fileNotFoundHTML);
+  }
+}
 
-      //Update Firmware
-      ret = httpUpdate.update(client, userConfig.getFirmwareUpdateURL() + String(FW_BINFILE));
-      switch (ret)
-      {
-      case HTTP_UPDATE_FAILED:
-        debugDirector("HTTP_UPDATE_FAILD Error " + String(httpUpdate.getLastError()) + " : " + httpUpdate.getLastErrorString());
-        break;
+// Fills in the %PLACEHOLDERS% of the builtin response templates
+String webTemplateProcessor(const String &placeholder)
+{
+  if (placeholder == "IP")
+  {
+    return wifiManager.ip().toString();
+  }
+  return String();
+}
 
-      case HTTP_UPDATE_NO_UPDATES:
-        debugDirector("HTTP_UPDATE_NO_UPDATES");
-        break;
+// Streams a builtin template straight from flash. Placeholders are substituted chunk by chunk as it goes out.
+// Only for the templates. The static pages contain '%' in their CSS and are sent with send_P() as they are.
+void sendTemplate(AsyncWebServerRequest *request, const char *page)
+{
+  request->send_P(200, "text/html", page, webTemplateProcessor);
+}
 
-      case HTTP_UPDATE_OK:
-        debugDirector("HTTP_UPDATE_OK");
-        break;
-      }
-    }
-    else //don't update
-    {
-      debugDirector("  -Current ver " + String(FIRMWARE_VERSION));
-    }
+// Sends a JSON object made field by field as the connection drains (see JsonChunkedSource).
+// ?fields=a,b,c limits it to those keys.
+void sendJSON(AsyncWebServerRequest *request, const JsonFieldSource &source)
+{
+  //Owned by the response's callback, freed with it
+  std::shared_ptr<JsonChunkedSource> json(new JsonChunkedSource(source, request->arg("fields")));
+  request->send(request->beginChunkedResponse("application/json", [json](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+    return json->read(buffer, maxLen);
+  }));
+}
+
+// Streams an open file in chunks as the connection drains.
+void sendSpiffsFile(AsyncWebServerRequest *request, File file, const String &path, const char *contentType, const String &etag, const char *cacheControl)
+{
+  //A file ending in .gz served under its plain name gets Content-Encoding: gzip
+  AsyncWebServerResponse *response = request->beginResponse(file, path, contentType);
+  if (etag.length())
+  {
+    response->addHeader("ETag", etag);
   }
+  if (cacheControl)
+  {
+    response->addHeader("Cache-Control", cacheControl);
+  }
+  request->send(response);
 }
 
+//github fingerprint 70:94:DE:DD:E6:C4:69:48:3A:92:70:A1:48:56:78:2D:18:64:E0:B7
+
 #ifdef USE_TELEGRAM
 //Function to handle sending telegram text to the non blocking task
 void sendTelegram(String textToSend)
@@ -615,7 +642,7 @@ void sendTelegram(String textToSend)
     startTime = millis();
   }
 
-  if ((numberOfMessages < MAX_TELEGRAM_MESSAGES) && (WiFi.getMode() == WIFI_STA))
+  if ((numberOfMessages < MAX_TELEGRAM_MESSAGES) && wifiManager.staConnected())
   {
     telegramMessage += "\n" + textToSend;
     telegramMessageWaiting = true;
@@ -631,14 +658,15 @@ void telegramUpdate(void *pvParameters)
   for (;;)
   {
     static int telegramFailures = 0;
-    if (telegramMessageWaiting && internetConnection)
+    //Telegram posts wait for a free radio window, so they're held back while riding.
+    if (telegramMessageWaiting && internetConnection && radioScheduler.acquire(RADIO_TELEGRAM))
     {
       telegramMessageWaiting = false;
       bool rm = (bot.sendMessage(TELEGRAM_CHAT_ID, telegramMessage, ""));
       if (!rm)
       {
         telegramFailures++;
-        debugDirector("Telegram failed to send!", + TELEGRAM_CHAT_ID);
+        SS2K_LOG_TEXT(LOG_CAT_HTTP, "Telegram failed to send!", + TELEGRAM_CHAT_ID);
         if (telegramFailures > 2)
         {
           internetConnection = false;
@@ -651,6 +679,7 @@ void telegramUpdate(void *pvParameters)
 
       client.stop();
       telegramMessage = "";
+      radioScheduler.release(RADIO_TELEGRAM);
     }
     //Serial.println(uxTaskGetStackHighWaterMark(telegramTask));
     //Serial.println(uxTaskGetStackHighWaterMark(webClientTask));
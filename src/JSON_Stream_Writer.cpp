@@ -0,0 +1,246 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#include "JSON_Stream_Writer.h"
+
+JsonStreamWriter::JsonStreamWriter(Print &output, const char *fields) : out(output), filter(fields)
+{
+    if (filter != nullptr && filter[0] == 0)
+    {
+        filter = nullptr;
+    }
+}
+
+void JsonStreamWriter::beginObject()
+{
+    out.write('{');
+    firstField = true;
+}
+
+void JsonStreamWriter::endObject()
+{
+    out.write('}');
+}
+
+// True if key is in the field list (or there is no list)
+bool JsonStreamWriter::wanted(const char *key)
+{
+    if (filter == nullptr)
+    {
+        return true;
+    }
+    size_t keyLength = strlen(key);
+    const char *p = filter;
+    while (*p)
+    {
+        const char *end = strchr(p, ',');
+        size_t length = end ? (size_t)(end - p) : strlen(p);
+        if (length == keyLength && strncmp(p, key, length) == 0)
+        {
+            return true;
+        }
+        if (!end)
+        {
+            break;
+        }
+        p = end + 1;
+    }
+    return false;
+}
+
+void JsonStreamWriter::writeKey(const char *key)
+{
+    if (!firstField)
+    {
+        out.write(',');
+    }
+    firstField = false;
+    writeString(key);
+    out.write(':');
+}
+
+void JsonStreamWriter::writeString(const char *value)
+{
+    out.write('"');
+    for (const char *c = value; *c; c++)
+    {
+        switch (*c)
+        {
+        case '"':
+            out.print("\\\"");
+            break;
+        case '\\':
+            out.print("\\\\");
+            break;
+        case '\n':
+            out.print("\\n");
+            break;
+        case '\r':
+            out.print("\\r");
+            break;
+        case '\t':
+            out.print("\\t");
+            break;
+        default:
+            if ((uint8_t)*c < ' ')
+            {
+                out.printf("\\u%04x", *c);
+            }
+            else
+            {
+                out.write(*c);
+            }
+        }
+    }
+    out.write('"');
+}
+
+void JsonStreamWriter::field(const char *key, const char *value)
+{
+    if (wanted(key))
+    {
+        writeKey(key);
+        writeString(value ? value : "");
+    }
+}
+
+void JsonStreamWriter::field(const char *key, int value)
+{
+    if (wanted(key))
+    {
+        writeKey(key);
+        out.print(value);
+    }
+}
+
+void JsonStreamWriter::field(const char *key, float value)
+{
+    if (wanted(key))
+    {
+        writeKey(key);
+        if (isnan(value) || isinf(value))
+        {
+            out.print("null");
+        }
+        else
+        {
+            out.print(value, 2);
+        }
+    }
+}
+
+void JsonStreamWriter::field(const char *key, bool value)
+{
+    if (wanted(key))
+    {
+        writeKey(key);
+        out.print(value ? "true" : "false");
+    }
+}
+
+void JsonStreamWriter::field(const char *key, const uint16_t *values, size_t count)
+{
+    if (wanted(key))
+    {
+        writeKey(key);
+        out.write('[');
+        for (size_t i = 0; i < count; i++)
+        {
+            if (i)
+            {
+                out.write(',');
+            }
+            out.print((unsigned)values[i]);
+        }
+        out.write(']');
+    }
+}
+
+/*********************************Chunked responses*********************************/
+
+JsonChunkedSource::JsonChunkedSource(const JsonFieldSource &fieldSource, const String &fields)
+    : source(fieldSource), filter(fields), writer(*this, filter.c_str())
+{
+}
+
+// Called by the server whenever the connection can take more, returns 0 when the object is done
+size_t JsonChunkedSource::read(uint8_t *buffer, size_t maxLength)
+{
+    chunk       = buffer;
+    chunkMax    = maxLength;
+    chunkLength = 0;
+    if (carryPos < carry.length())
+    {
+        chunkLength = min(maxLength, (size_t)(carry.length() - carryPos));
+        memcpy(buffer, carry.c_str() + carryPos, chunkLength);
+        carryPos += chunkLength;
+        if (carryPos == carry.length())
+        {
+            carry    = ""; //Keeps its buffer for the next field that spills over
+            carryPos = 0;
+        }
+    }
+    while (chunkLength < chunkMax && !finished)
+    {
+        if (!started)
+        {
+            writer.beginObject();
+            started = true;
+        }
+        else if (source(writer, nextField))
+        {
+            nextField++;
+        }
+        else
+        {
+            writer.endObject();
+            finished = true;
+        }
+    }
+    chunk = nullptr;
+    return chunkLength;
+}
+
+// Strings are escaped a byte at a time, so the carry grows in steps rather than to exactly what's needed
+void JsonChunkedSource::reserveCarry(size_t more)
+{
+    if (carry.length() + more > carryCapacity)
+    {
+        carryCapacity = max(carryCapacity ? carryCapacity * 2 : (size_t)JSON_CARRY_RESERVE, carry.length() + more);
+        carry.reserve(carryCapacity);
+    }
+}
+
+size_t JsonChunkedSource::write(uint8_t c)
+{
+    if (chunk != nullptr && chunkLength < chunkMax)
+    {
+        chunk[chunkLength++] = c;
+    }
+    else
+    {
+        reserveCarry(1);
+        carry += (char)c;
+    }
+    return 1;
+}
+
+size_t JsonChunkedSource::write(const uint8_t *data, size_t length)
+{
+    size_t fits = (chunk != nullptr) ? min(length, chunkMax - chunkLength) : 0;
+    memcpy(chunk + chunkLength, data, fits);
+    chunkLength += fits;
+    if (fits < length)
+    {
+        reserveCarry(length - fits);
+        for (size_t i = fits; i < length; i++)
+        {
+            carry += (char)data[i];
+        }
+    }
+    return length;
+}
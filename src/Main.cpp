@@ -6,12 +6,12 @@
 // Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
 
 #include "Main.h"
+#include "Workout_Player.h"
 #include <TMCStepper.h>
 #include <Arduino.h>
 #include <SPIFFS.h>
 #include <HardwareSerial.h>
 
-String debugToHTML = "<br>Firmware Version " + String(FIRMWARE_VERSION);
 bool lastDir = true; //Stepper Last Direction
 
 // Debounce Setup
@@ -22,6 +22,7 @@ unsigned long debounceDelay = 500;  // the debounce time; increase if the output
 int maxStepperSpeed = 500;
 int shifterPosition = 0;
 int stepperPosition = 0;
+int targetPosition = 0;
 HardwareSerial stepperSerial(2);
 TMC2208Stepper driver(&SERIAL_PORT, R_SENSE); // Hardware Serial
 
@@ -44,39 +45,55 @@ void setup()
 
   // Serial port for debugging purposes
   Serial.begin(512000);
+  logStart();
+  SS2K_LOGI(LOG_CAT_MAIN, "Firmware Version %s", FIRMWARE_VERSION);
   stepperSerial.begin(57600, SERIAL_8N2, STEPPERSERIAL_RX, STEPPERSERIAL_TX);
   debugDirector("Compiled " + String(__DATE__) + String(__TIME__));
 
-  // Initialize SPIFFS
+  pinMode(RADIO_PIN, INPUT_PULLUP);
+  pinMode(SHIFT_UP_PIN, INPUT_PULLUP);   // Push-Button with input Pullup
+  pinMode(SHIFT_DOWN_PIN, INPUT_PULLUP); // Push-Button with input Pullup
+  pinMode(LED_PIN, OUTPUT);
+  pinMode(ENABLE_PIN, OUTPUT);
+  pinMode(DIR_PIN, OUTPUT);       // Stepper Direction Pin
+  pinMode(STEP_PIN, OUTPUT);      // Stepper Step Pin
+  digitalWrite(ENABLE_PIN, HIGH); //Should be called a disable Pin - High Disables FETs
+  digitalWrite(DIR_PIN, LOW);
+  digitalWrite(STEP_PIN, LOW);
+  digitalWrite(LED_PIN, LOW);
+
+  //Everything else runs as boot stages. See Boot_Stages.cpp
+  bootStart();
+}
+
+///////////////////////////////////////////Boot Stages///////////////////////////////
+bool mountFilesystem()
+{
   debugDirector("Mounting Filesystem");
   if (!SPIFFS.begin(true))
   {
     debugDirector("An Error has occurred while mounting SPIFFS");
-    return;
+    return false;
   }
+  return true;
+}
 
-  //Load Config
+bool loadConfig()
+{
   userConfig.loadFromSPIFFS();
+  logSetLevels(userConfig.getLogLevels());
   userConfig.printFile(); //Print userConfig.contents to serial
-  userConfig.saveToSPIFFS();
 
   //load PWC for HR to Pwr Calculation
   userPWC.loadFromSPIFFS();
   userPWC.printFile();
-  userPWC.saveToSPIFFS();
 
-  pinMode(RADIO_PIN, INPUT_PULLUP);
-  pinMode(SHIFT_UP_PIN, INPUT_PULLUP);   // Push-Button with input Pullup
-  pinMode(SHIFT_DOWN_PIN, INPUT_PULLUP); // Push-Button with input Pullup
-  pinMode(LED_PIN, OUTPUT);
-  pinMode(ENABLE_PIN, OUTPUT);
-  pinMode(DIR_PIN, OUTPUT);       // Stepper Direction Pin
-  pinMode(STEP_PIN, OUTPUT);      // Stepper Step Pin
-  digitalWrite(ENABLE_PIN, HIGH); //Should be called a disable Pin - High Disables FETs
-  digitalWrite(DIR_PIN, LOW);
-  digitalWrite(STEP_PIN, LOW);
-  digitalWrite(LED_PIN, LOW);
+  resetIfShiftersHeld();
+  return true;
+}
 
+bool setupStepper()
+{
   setupTMCStepperDriver();
 
   debugDirector("Setting up cpu Tasks");
@@ -91,44 +108,26 @@ void setup()
       &moveStepperTask,      /* Task handle to keep track of created task */
       0);                    /* pin task to core 0 */
 
-  digitalWrite(LED_PIN, HIGH);
-
-  startWifi();
-
-  //Check for firmware update. It's important that this stays before BLE & HTTP setup
-  //because otherwise they use too much traffic and the device fails to update
-  //which really sucks when it corrupts your settings.
-  if (userConfig.getautoUpdate())
-  {
-    FirmwareUpdate();
-  }
-
-  setupBLE();
-  startHttpServer();
-  resetIfShiftersHeld();
   debugDirector("Creating Shifter Interrupts");
   //Setup Interrups so shifters work anytime
   attachInterrupt(digitalPinToInterrupt(SHIFT_UP_PIN), shiftUp, CHANGE);
   attachInterrupt(digitalPinToInterrupt(SHIFT_DOWN_PIN), shiftDown, CHANGE);
-  digitalWrite(LED_PIN, HIGH);
+  return true;
 }
 
 void loop()
 {
   vTaskDelay(1000 / portTICK_RATE_MS);
 
-  if (debugToHTML.length() > 500)
-  { //Clear up memory
-    debugToHTML = "<br>HTML Debug Truncated. Increase buffer if required.";
+  if (bootDone(BOOT_BLE))
+  {
+    scanIfShiftersHeld();
   }
-
-  scanIfShiftersHeld();
 }
 
 void moveStepper(void *pvParameters)
 {
   int acceleration = maxStepperSpeed;
-  int targetPosition = 0;
 
   while (1)
   {
@@ -200,8 +199,13 @@ void IRAM_ATTR shiftUp() // Handle the shift up interrupt IRAM_ATTR is to keep t
   {
     if (!digitalRead(SHIFT_UP_PIN)) //double checking to make sure the interrupt wasn't triggered by emf
     {
+      if (workoutPlayer.running())
+      {
+        workoutPlayer.shift(1); //ERG would undo a resistance change, make the workout harder instead
+        return;
+      }
       shifterPosition = (shifterPosition + userConfig.getShiftStep());
-      debugDirector("Shift UP: " + String(shifterPosition));
+      SS2K_LOGD(LOG_CAT_STEPPER, "Shift UP: %d", shifterPosition);
     }
     else
     {
@@ -216,8 +220,13 @@ void IRAM_ATTR shiftDown() //Handle the shift down interrupt
   {
     if (!digitalRead(SHIFT_DOWN_PIN)) //double checking to make sure the interrupt wasn't triggered by emf
     {
+      if (workoutPlayer.running())
+      {
+        workoutPlayer.shift(-1);
+        return;
+      }
       shifterPosition = (shifterPosition - userConfig.getShiftStep());
-      debugDirector("Shift DOWN: " + String(shifterPosition));
+      SS2K_LOGD(LOG_CAT_STEPPER, "Shift DOWN: %d", shifterPosition);
     }
     else
     {
@@ -237,13 +246,8 @@ void resetIfShiftersHeld()
       vTaskDelay(200 / portTICK_PERIOD_MS);
       digitalWrite(LED_PIN, LOW);
     }
-    for (int i = 0; i < 20; i++)
-    {
-      userConfig.setDefaults();
-      vTaskDelay(200 / portTICK_PERIOD_MS);
-      userConfig.saveToSPIFFS();
-      vTaskDelay(200 / portTICK_PERIOD_MS);
-    }
+    userConfig.setDefaults();
+    userConfig.saveToSPIFFS(true);
     ESP.restart();
   }
 }
@@ -252,21 +256,29 @@ void scanIfShiftersHeld()
 {
   if ((digitalRead(SHIFT_UP_PIN) == LOW) && (digitalRead(SHIFT_DOWN_PIN) == LOW)) //are both shifters held?
   {
-    debugDirector("Shifters Held " + String(shiftersHoldForScan));
+    SS2K_LOGD(LOG_CAT_MAIN, "Shifters Held %d", shiftersHoldForScan);
     if (shiftersHoldForScan < 1) //have they been held for enough loops?
     {
-      debugDirector("Shifters Held < 1 " + String(shiftersHoldForScan));
+      SS2K_LOGD(LOG_CAT_MAIN, "Shifters Held < 1 %d", shiftersHoldForScan);
+      if (workoutPlayer.running()) //During a workout the gesture skips to the next step
+      {
+        workoutPlayer.skip();
+        shiftersHoldForScan = SHIFTERS_HOLD_FOR_SCAN;
+        debugDirector("Workout step skipped from buttons");
+        return;
+      }
       if ((millis() - scanDelayStart) >= scanDelayTime) // Has this already been done within 10 seconds?
       {
         scanDelayStart += scanDelayTime;
         spinBLEClient.serverScan(true);
+        advertisingManager.fastAdvertise();
         shiftersHoldForScan = SHIFTERS_HOLD_FOR_SCAN;
         digitalWrite(LED_PIN, LOW);
         debugDirector("Scan From Buttons");
       }
       else
       {
-        debugDirector("Shifters Held but timer not up " + String((millis() - scanDelayStart) >= scanDelayTime));
+        SS2K_LOGD(LOG_CAT_MAIN, "Shifters Held but timer not up %lu", millis() - scanDelayStart);
         shiftersHoldForScan = SHIFTERS_HOLD_FOR_SCAN;
         return;
       }
@@ -279,24 +291,21 @@ void scanIfShiftersHeld()
 }
 
 // String Text to print, Optional Make newline, Optional Send to Telegram
+// The text is copied into the log ring and printed later by the log drain task.
 void debugDirector(String textToPrint, bool newline, bool telegram)
 {
-  if (newline)
-  {
-    Serial.println(textToPrint);
-    debugToHTML += String("<br>") + textToPrint;
-  }
-  else
-  {
-    Serial.print(textToPrint);
-    debugToHTML += textToPrint;
-  }
-#ifdef USE_TELEGRAM
-  if (telegram)
+  debugDirector(LOG_CAT_MAIN, textToPrint, newline, telegram);
+}
+
+// Same for another category. Call it through SS2K_LOG_TEXT(), which skips building the text.
+void debugDirector(LogCategory category, const String &textToPrint, bool newline, bool telegram)
+{
+  if (!SS2K_LOG_ENABLED(category, LOG_LEVEL_INFO))
   {
-    sendTelegram(textToPrint);
+    return;
   }
-#endif
+  uint8_t flags = (newline ? LOG_FLAG_NEWLINE : 0) | (telegram ? LOG_FLAG_TELEGRAM : 0);
+  logText(LOG_LEVEL_INFO, flags, textToPrint.c_str(), textToPrint.length());
 }
 
 void setupTMCStepperDriver()
@@ -307,7 +316,7 @@ void setupTMCStepperDriver()
   driver.mstep_reg_select(true);
 
   uint16_t msread = driver.microsteps();
-  debugDirector(" read:ms=" + msread);
+  SS2K_LOGI(LOG_CAT_STEPPER, " read:ms=%u", msread);
 
   driver.rms_current(userConfig.getStepperPower()); // Set motor RMS current
   driver.microsteps(4);                             // Set microsteps to 1/8th
@@ -318,8 +327,8 @@ void setupTMCStepperDriver()
   msread = driver.microsteps();
   uint16_t currentread = driver.cs_actual();
 
-  debugDirector(" read:current=" + currentread);
-  debugDirector(" read:ms=" + msread);
+  SS2K_LOGI(LOG_CAT_STEPPER, " read:current=%u", currentread);
+  SS2K_LOGI(LOG_CAT_STEPPER, " read:ms=%u", msread);
 
   driver.toff(5);
   bool t_bool = userConfig.getStealthchop();
@@ -330,7 +339,7 @@ void setupTMCStepperDriver()
 
 void updateStepperPower()
 {
-  debugDirector("Stepper power is now " + String(userConfig.getStepperPower()));
+  SS2K_LOGI(LOG_CAT_STEPPER, "Stepper power is now %d", userConfig.getStepperPower());
   driver.rms_current(userConfig.getStepperPower());
 }
 
@@ -340,5 +349,5 @@ void updateStealthchop()
   driver.en_spreadCycle(!t_bool);
   driver.pwm_autoscale(t_bool);
   driver.pwm_autograd(t_bool);
-  debugDirector("Stealthchop is now " + String(t_bool));
+  SS2K_LOGI(LOG_CAT_STEPPER, "Stealthchop is now %d", t_bool);
 }
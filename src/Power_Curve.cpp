@@ -0,0 +1,117 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#include "Main.h"
+#include "Power_Curve.h"
+
+#include <Preferences.h>
+
+const uint16_t PowerCurve::durations[POWER_CURVE_POINTS] = {1, 5, 30, 60, 300, 1200, 3600};
+
+static_assert(POWER_CURVE_HISTORY >= 3600, "POWER_CURVE_HISTORY has to cover the longest duration");
+
+PowerCurve powerCurve;
+
+void PowerCurve::load()
+{
+  Preferences prefs;
+  prefs.begin("mmp", true);
+  if (prefs.getBytes("best", best, sizeof(best)) != sizeof(best))
+  {
+    memset(best, 0, sizeof(best));
+  }
+  prefs.end();
+  lastSave = millis();
+}
+
+// Only writes when a best improved since the last save
+void PowerCurve::save()
+{
+  uint16_t snapshot[POWER_CURVE_POINTS];
+  portENTER_CRITICAL(&curveMux);
+  bool changed = dirty;
+  dirty        = false;
+  memcpy(snapshot, best, sizeof(snapshot));
+  portEXIT_CRITICAL(&curveMux);
+  lastSave = millis();
+  if (!changed)
+  {
+    return;
+  }
+  Preferences prefs;
+  prefs.begin("mmp", false);
+  prefs.putBytes("best", snapshot, sizeof(snapshot));
+  prefs.end();
+  SS2K_LOGI(LOG_CAT_MAIN, "Power curve saved, 20 min best %dW", (int)snapshot[POWER_CURVE_FTP_POINT]);
+}
+
+void PowerCurve::reset()
+{
+  portENTER_CRITICAL(&curveMux);
+  head  = 0;
+  count = 0;
+  memset(sums, 0, sizeof(sums));
+  memset(rideBest, 0, sizeof(rideBest));
+  portEXIT_CRITICAL(&curveMux);
+}
+
+// One sample a second. Each window adds the new sample and drops the one that just left it.
+void PowerCurve::add(int power)
+{
+  uint16_t watts = constrain(power, 0, UINT16_MAX);
+
+  portENTER_CRITICAL(&curveMux);
+  count++;
+  for (int i = 0; i < POWER_CURVE_POINTS; i++)
+  {
+    uint16_t duration = durations[i];
+    sums[i] += watts;
+    if (count > duration)
+    {
+      sums[i] -= history[(head + POWER_CURVE_HISTORY - duration) % POWER_CURVE_HISTORY];
+    }
+    if (count >= duration)
+    {
+      uint16_t average = sums[i] / duration;
+      if (average > rideBest[i])
+      {
+        rideBest[i] = average;
+        if (average > best[i])
+        {
+          best[i] = average;
+          dirty   = true;
+        }
+      }
+    }
+  }
+  history[head] = watts;
+  head          = (head + 1) % POWER_CURVE_HISTORY;
+  bool saveNow  = dirty && (millis() - lastSave > POWER_CURVE_SAVE_INTERVAL);
+  portEXIT_CRITICAL(&curveMux);
+
+  //Don't lose a long effort to a power cut, but don't wear the flash every second either
+  if (saveNow)
+  {
+    save();
+  }
+}
+
+void PowerCurve::bests(uint16_t *ride, uint16_t *allTime)
+{
+  portENTER_CRITICAL(&curveMux);
+  memcpy(ride, rideBest, sizeof(rideBest));
+  memcpy(allTime, best, sizeof(best));
+  portEXIT_CRITICAL(&curveMux);
+}
+
+int PowerCurve::ftpEstimate()
+{
+  portENTER_CRITICAL(&curveMux);
+  int twentyMinutes = best[POWER_CURVE_FTP_POINT];
+  portEXIT_CRITICAL(&curveMux);
+  return twentyMinutes * POWER_CURVE_FTP_PERCENT / 100;
+}
@@ -0,0 +1,128 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#include "Main.h"
+#include "Radio_Scheduler.h"
+#include "Workout_Player.h"
+
+#include <ArduinoJson.h>
+
+RadioScheduler radioScheduler;
+
+/*********************************Rules*********************************
+ * - HTTP is interactive and short, it doesn't ask.
+ * - Only one bulk WiFi user (OTA, Telegram) at a time.
+ * - Scans and bulk WiFi exclude each other, both want most of the airtime.
+ * - While an app is connected or a workout runs (a ride is going on) bulk WiFi is postponed
+ *   and scans run at a low duty cycle.
+ ***********************************************************************/
+
+bool RadioScheduler::isBulk(RadioUser user)
+{
+    return (user == RADIO_OTA) || (user == RADIO_TELEGRAM);
+}
+
+// An app connection, or a workout running without one
+bool RadioScheduler::rideActive()
+{
+    return GlobalBLEClientConnected || workoutPlayer.running();
+}
+
+//Has to be called inside the critical section
+bool RadioScheduler::mayStart(RadioUser user)
+{
+    bool bulkActive = active[RADIO_OTA] || active[RADIO_TELEGRAM];
+    switch (user)
+    {
+    case RADIO_SCAN:
+        return !bulkActive && !active[RADIO_SCAN];
+    default:
+        return !bulkActive && !active[RADIO_SCAN] && !rideActive();
+    }
+}
+
+// Try to get a window on the radio. Waits up to waitMs for one to become free.
+bool RadioScheduler::acquire(RadioUser user, unsigned long waitMs)
+{
+    unsigned long start = millis();
+    for (;;)
+    {
+        bool grant = false;
+        bool bulkStarted = false;
+        portENTER_CRITICAL(&radioMux);
+        if (mayStart(user))
+        {
+            active[user]++;
+            granted[user]++;
+            grant = true;
+            bulkStarted = isBulk(user);
+        }
+        portEXIT_CRITICAL(&radioMux);
+
+        if (grant)
+        {
+            if (bulkStarted)
+            {
+                connParams.setWifiActive(true);
+            }
+            return true;
+        }
+        if ((millis() - start) >= waitMs)
+        {
+            portENTER_CRITICAL(&radioMux);
+            postponed[user]++;
+            portEXIT_CRITICAL(&radioMux);
+            return false;
+        }
+        vTaskDelay(50 / portTICK_PERIOD_MS);
+    }
+}
+
+void RadioScheduler::release(RadioUser user)
+{
+    bool bulkActive;
+    portENTER_CRITICAL(&radioMux);
+    if (active[user] > 0)
+    {
+        active[user]--;
+    }
+    bulkActive = active[RADIO_OTA] || active[RADIO_TELEGRAM];
+    portEXIT_CRITICAL(&radioMux);
+    if (isBulk(user) && !bulkActive)
+    {
+        connParams.setWifiActive(false);
+    }
+}
+
+//Scan timing in ms. While riding the scanner only gets a small slice so notifications stay on time.
+uint16_t RadioScheduler::scanInterval()
+{
+    return rideActive() ? RIDE_SCAN_INTERVAL : SCAN_INTERVAL;
+}
+
+uint16_t RadioScheduler::scanWindow()
+{
+    return rideActive() ? RIDE_SCAN_WINDOW : SCAN_WINDOW;
+}
+
+//-- return the grant counters as a JSON string
+String RadioScheduler::returnJSON()
+{
+    static const char *const names[RADIO_USERS] = {"scan", "ota", "telegram"};
+    StaticJsonDocument<JSON_OBJECT_SIZE(RADIO_USERS + 1) + RADIO_USERS * JSON_OBJECT_SIZE(3)> doc;
+    doc["rideActive"] = rideActive();
+    for (int i = 0; i < RADIO_USERS; i++)
+    {
+        JsonObject user = doc.createNestedObject(names[i]);
+        user["active"] = active[i];
+        user["granted"] = granted[i];
+        user["postponed"] = postponed[i];
+    }
+    String output;
+    serializeJson(doc, output);
+    return output;
+}
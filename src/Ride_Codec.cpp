@@ -0,0 +1,271 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#include "Ride_Codec.h"
+
+static int32_t sampleValue(const RideSample &sample, int channel)
+{
+  switch (channel)
+  {
+  case RIDE_CH_TIME:
+    return sample.time;
+  case RIDE_CH_POWER:
+    return sample.power;
+  case RIDE_CH_CADENCE:
+    return sample.cadence;
+  case RIDE_CH_HEART_RATE:
+    return sample.heartRate;
+  case RIDE_CH_INCLINE:
+    return sample.incline;
+  case RIDE_CH_TARGET:
+    return sample.targetWatts;
+  case RIDE_CH_FLAGS:
+    return sample.flags;
+  default:
+    return sample.stepperPosition;
+  }
+}
+
+static void setSampleValue(RideSample &sample, int channel, int32_t value)
+{
+  switch (channel)
+  {
+  case RIDE_CH_TIME:
+    sample.time = value;
+    break;
+  case RIDE_CH_POWER:
+    sample.power = value;
+    break;
+  case RIDE_CH_CADENCE:
+    sample.cadence = value;
+    break;
+  case RIDE_CH_HEART_RATE:
+    sample.heartRate = value;
+    break;
+  case RIDE_CH_INCLINE:
+    sample.incline = value;
+    break;
+  case RIDE_CH_TARGET:
+    sample.targetWatts = value;
+    break;
+  case RIDE_CH_FLAGS:
+    sample.flags = value;
+    break;
+  default:
+    sample.stepperPosition = value;
+    break;
+  }
+}
+
+/*********************************Encoder*********************************/
+
+// Appends a varint. Returns false once out is full.
+static bool putVarint(uint8_t *&out, const uint8_t *end, uint32_t value)
+{
+  do
+  {
+    if (out == end)
+    {
+      return false;
+    }
+    uint8_t byte = value & 0x7F;
+    value >>= 7;
+    *out++ = byte | (value ? 0x80 : 0);
+  } while (value);
+  return true;
+}
+
+static uint32_t zigZag(int32_t value)
+{
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t unZigZag(uint32_t value)
+{
+  return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static int32_t channelDelta(const RideSample *samples, int channel, int i)
+{
+  return sampleValue(samples[i], channel) - (i ? sampleValue(samples[i - 1], channel) : 0);
+}
+
+size_t rideEncode(const RideSample *samples, uint8_t count, uint8_t *out, size_t maxLength)
+{
+  uint8_t *pos       = out;
+  const uint8_t *end = out + maxLength;
+  for (int channel = 0; channel < RIDE_CHANNELS; channel++)
+  {
+    int i = 0;
+    while (i < count)
+    {
+      //Length of the run of equal deltas starting here
+      int32_t delta = channelDelta(samples, channel, i);
+      int same      = 1;
+      while (i + same < count && channelDelta(samples, channel, i + same) == delta)
+      {
+        same++;
+      }
+      if (same >= RIDE_MIN_REPEAT)
+      {
+        if (!putVarint(pos, end, (same << 1) | 1) || !putVarint(pos, end, zigZag(delta)))
+        {
+          return 0;
+        }
+        i += same;
+        continue;
+      }
+      //Literals up to the next run that is worth repeating
+      int literals = same;
+      while (i + literals < count)
+      {
+        int32_t next = channelDelta(samples, channel, i + literals);
+        int run      = 1;
+        while (run < RIDE_MIN_REPEAT && i + literals + run < count && channelDelta(samples, channel, i + literals + run) == next)
+        {
+          run++;
+        }
+        if (run >= RIDE_MIN_REPEAT)
+        {
+          break;
+        }
+        literals += run;
+      }
+      if (!putVarint(pos, end, literals << 1))
+      {
+        return 0;
+      }
+      for (int j = 0; j < literals; j++)
+      {
+        if (!putVarint(pos, end, zigZag(channelDelta(samples, channel, i + j))))
+        {
+          return 0;
+        }
+      }
+      i += literals;
+    }
+  }
+  return pos - out;
+}
+
+/*********************************Decoder*********************************/
+
+static bool getVarint(const uint8_t *&pos, const uint8_t *end, uint32_t &value)
+{
+  value = 0;
+  for (int shift = 0; shift < 35 && pos < end; shift += 7)
+  {
+    uint8_t byte = *pos++;
+    value |= (uint32_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void RideColumnReader::begin(const uint8_t *data, const uint8_t *dataEnd)
+{
+  pos     = data;
+  end     = dataEnd;
+  value   = 0;
+  runLeft = 0;
+}
+
+bool RideColumnReader::next(int32_t &out)
+{
+  uint32_t raw;
+  if (runLeft == 0)
+  {
+    if (!getVarint(pos, end, raw) || (raw >> 1) == 0)
+    {
+      return false;
+    }
+    runLeft = raw >> 1;
+    repeat  = raw & 1;
+    if (repeat)
+    {
+      if (!getVarint(pos, end, raw))
+      {
+        return false;
+      }
+      delta = unZigZag(raw);
+    }
+  }
+  if (!repeat)
+  {
+    if (!getVarint(pos, end, raw))
+    {
+      return false;
+    }
+    delta = unZigZag(raw);
+  }
+  runLeft--;
+  value += delta;
+  out = value;
+  return true;
+}
+
+void RideBlockReader::begin(const RideBlock &stored)
+{
+  block = &stored;
+  read  = 0;
+  total = stored.header.count;
+  if (stored.header.format == RIDE_FORMAT_RAW)
+  {
+    total = min((size_t)total, RIDE_BLOCK_SAMPLES);
+    return;
+  }
+  if (stored.header.format != RIDE_FORMAT_PACKED)
+  {
+    total = 0;
+    return;
+  }
+  //Each column starts where the one before it ends
+  const uint8_t *pos = stored.payload;
+  const uint8_t *end = stored.payload + sizeof(stored.payload);
+  for (int channel = 0; channel < RIDE_CHANNELS; channel++)
+  {
+    columns[channel].begin(pos, end);
+    RideColumnReader skip;
+    skip.begin(pos, end);
+    int32_t value;
+    for (int i = 0; i < total; i++)
+    {
+      if (!skip.next(value))
+      {
+        total = 0;
+        return;
+      }
+    }
+    pos = skip.position();
+  }
+}
+
+bool RideBlockReader::next(RideSample &sample)
+{
+  if (read >= total)
+  {
+    return false;
+  }
+  if (block->header.format == RIDE_FORMAT_RAW)
+  {
+    memcpy(&sample, block->payload + read * sizeof(RideSample), sizeof(RideSample));
+  }
+  else
+  {
+    for (int channel = 0; channel < RIDE_CHANNELS; channel++)
+    {
+      int32_t value = 0;
+      columns[channel].next(value);
+      setSampleValue(sample, channel, value);
+    }
+  }
+  read++;
+  return true;
+}
@@ -0,0 +1,139 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#include "Main.h"
+#include "Ride_Export.h"
+
+// Loads the next stored block of the ride. Blocks that fail their CRC are skipped.
+bool RideExport::nextBlockOfRide()
+{
+  while (nextBlock < endBlock)
+  {
+    uint32_t sequence = nextBlock++;
+    if (!rideRecorder.readBlock(ring, sequence, block))
+    {
+      continue;
+    }
+    if (block.header.rideId != ride.id)
+    {
+      endBlock = nextBlock;
+      return false;
+    }
+    reader.begin(block);
+    return true;
+  }
+  return false;
+}
+
+// The FIT header states the data size, so the records are counted before anything is sent
+bool RideExport::begin(uint16_t id)
+{
+  if (!rideRecorder.findRide(id, ride) || !(ring = rideRecorder.openForReading()))
+  {
+    return false;
+  }
+  baseTime  = ride.startTime ? ride.startTime - FIT_EPOCH_OFFSET : 0;
+  nextBlock = ride.firstSequence;
+  endBlock  = rideRecorder.nextSequence();
+  while (nextBlockOfRide())
+  {
+    total += reader.count();
+  }
+  endBlock  = nextBlock;
+  nextBlock = ride.firstSequence;
+  reader    = RideBlockReader();
+  memset(&last, 0, sizeof(last));
+  last.timestamp = baseTime;
+  fit.begin();
+  return total > 0;
+}
+
+// Encodes the next message into out, which has room for FIT_MAX_MESSAGE bytes
+size_t RideExport::produce(uint8_t *out)
+{
+  switch (stage)
+  {
+  case EXPORT_HEADER:
+    stage = EXPORT_FILE_ID;
+    return fit.header(out, total);
+
+  case EXPORT_FILE_ID:
+    stage = EXPORT_START;
+    return fit.fileId(out, baseTime, (uint32_t)ESP.getEfuseMac());
+
+  case EXPORT_START:
+    stage = EXPORT_RECORDS;
+    return fit.startEvent(out, baseTime);
+
+  case EXPORT_RECORDS:
+  {
+    RideSample sample;
+    //If the ring overwrote part of the ride since begin(), the last record is repeated
+    //so the file still has the size its header promised.
+    if (reader.next(sample) || (nextBlockOfRide() && reader.next(sample)))
+    {
+      last.timestamp = baseTime + sample.time;
+      last.power     = max((int16_t)0, sample.power);
+      last.cadence   = sample.cadence;
+      last.heartRate = sample.heartRate;
+      last.grade     = sample.incline;
+    }
+    if (++written == total)
+    {
+      stage = EXPORT_STOP;
+      ring.close();
+    }
+    return fit.record(out, last);
+  }
+
+  case EXPORT_STOP:
+    stage = EXPORT_LAP;
+    return fit.stopEvent(out, last.timestamp);
+
+  case EXPORT_LAP:
+    stage = EXPORT_SESSION;
+    return fit.lap(out);
+
+  case EXPORT_SESSION:
+    stage = EXPORT_ACTIVITY;
+    return fit.session(out);
+
+  case EXPORT_ACTIVITY:
+    stage = EXPORT_CRC;
+    return fit.activity(out);
+
+  case EXPORT_CRC:
+    stage = EXPORT_DONE;
+    return fit.crc(out);
+
+  default:
+    return 0;
+  }
+}
+
+// Chunked response callback. Returning 0 ends the response.
+size_t RideExport::read(uint8_t *buffer, size_t maxLength)
+{
+  size_t length = 0;
+  while (length < maxLength)
+  {
+    if (stagedPos == stagedLength)
+    {
+      if (stage == EXPORT_DONE)
+      {
+        break;
+      }
+      stagedLength = produce(staged);
+      stagedPos    = 0;
+    }
+    size_t count = min(maxLength - length, stagedLength - stagedPos);
+    memcpy(buffer + length, staged + stagedPos, count);
+    length += count;
+    stagedPos += count;
+  }
+  return length;
+}
@@ -0,0 +1,347 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#include "Main.h"
+#include "Ride_Recorder.h"
+#include "Ride_Codec.h"
+#include "Ride_Stats.h"
+#include "Power_Curve.h"
+#include "Config_Store.h"
+
+#include <SPIFFS.h>
+#include <stddef.h>
+#include <time.h>
+
+static_assert(sizeof(RideSample) == 16, "RideSample has to stay 16 bytes");
+static_assert(offsetof(RideBlock, payload) + RIDE_BLOCK_PAYLOAD == RIDE_BLOCK_SIZE, "RideBlock has to fill a SPIFFS data page");
+
+RideRecorder rideRecorder;
+
+static uint32_t blockCRC(const RideBlock &block)
+{
+  uint32_t crc = configCRC32(0, (const uint8_t *)&block.header, offsetof(RideBlockHeader, crc));
+  return configCRC32(crc, block.payload, sizeof(block.payload));
+}
+
+void RideRecorder::begin()
+{
+  xTaskCreatePinnedToCore(
+      rideRecorderTask,   /* Task function. */
+      "rideRecorderTask", /* name of task. */
+      3000,               /* Stack size of task */
+      NULL,               /* parameter of the task */
+      1,                  /* priority of the task */
+      &task,              /* Task handle to keep track of created task */
+      tskNO_AFFINITY);    /* pin task to core */
+}
+
+// Allocates the ring file the first time, or again if it's gone (a filesystem image update) or has the
+// size of an older block layout. Erased blocks fail their CRC and read as empty.
+bool RideRecorder::openRing()
+{
+  File file = SPIFFS.open(RIDE_RING_FILE, FILE_READ);
+  if (file && file.size() == RIDE_RING_BLOCKS * RIDE_BLOCK_SIZE)
+  {
+    file.close();
+    return true;
+  }
+  if (file)
+  {
+    file.close();
+  }
+  debugDirector("Allocating the ride recorder file");
+  file = SPIFFS.open(RIDE_RING_FILE, FILE_WRITE);
+  if (!file)
+  {
+    return false;
+  }
+  memset(&block, 0xFF, sizeof(block));
+  for (int i = 0; i < RIDE_RING_BLOCKS; i++)
+  {
+    if (file.write((uint8_t *)&block, RIDE_BLOCK_SIZE) != RIDE_BLOCK_SIZE)
+    {
+      file.close();
+      SPIFFS.remove(RIDE_RING_FILE);
+      return false;
+    }
+  }
+  file.close();
+  return true;
+}
+
+// Picks up the sequence and ride numbers where the last boot left them
+void RideRecorder::scanRing()
+{
+  File file = SPIFFS.open(RIDE_RING_FILE, FILE_READ);
+  bool found = false;
+  while (file.read((uint8_t *)&block, RIDE_BLOCK_SIZE) == RIDE_BLOCK_SIZE)
+  {
+    if (block.header.crc != blockCRC(block) || (found && block.header.sequence < sequence))
+    {
+      continue;
+    }
+    sequence = block.header.sequence + 1;
+    rideId   = block.header.rideId;
+    found    = true;
+  }
+  file.close();
+  SS2K_LOGI(LOG_CAT_MAIN, "Ride recorder: last ride %u, next block %u", rideId, sequence);
+}
+
+static bool readRingBlock(File &file, uint32_t blockSequence, RideBlock &out)
+{
+  return file.seek((blockSequence % RIDE_RING_BLOCKS) * RIDE_BLOCK_SIZE) &&
+         file.read((uint8_t *)&out, RIDE_BLOCK_SIZE) == RIDE_BLOCK_SIZE && out.header.sequence == blockSequence &&
+         out.header.crc == blockCRC(out) && out.header.count > 0;
+}
+
+bool RideRecorder::readBlock(uint32_t blockSequence, RideBlock &out)
+{
+  File file = openForReading();
+  if (!file)
+  {
+    return false;
+  }
+  bool ok = readRingBlock(file, blockSequence, out);
+  file.close();
+  return ok;
+}
+
+File RideRecorder::openForReading()
+{
+  return ready ? SPIFFS.open(RIDE_RING_FILE, FILE_READ) : File();
+}
+
+bool RideRecorder::readBlock(File &file, uint32_t blockSequence, RideBlock &out)
+{
+  return readRingBlock(file, blockSequence, out);
+}
+
+int RideRecorder::listRides(RideInfo *rides, int maxRides)
+{
+  File file;
+  if (!ready || !(file = SPIFFS.open(RIDE_RING_FILE, FILE_READ)))
+  {
+    return 0;
+  }
+  int count      = 0;
+  uint32_t end   = sequence;
+  uint32_t first = end > RIDE_RING_BLOCKS ? end - RIDE_RING_BLOCKS : 0;
+  RideBlock stored;
+  for (uint32_t s = first; s < end; s++)
+  {
+    if (!readRingBlock(file, s, stored))
+    {
+      continue;
+    }
+    RideInfo *ride = (count > 0 && rides[count - 1].id == stored.header.rideId) ? &rides[count - 1] : nullptr;
+    if (ride == nullptr)
+    {
+      if (count == maxRides)
+      {
+        //Drop the oldest, the newest rides are the interesting ones
+        memmove(rides, rides + 1, (maxRides - 1) * sizeof(RideInfo));
+        count--;
+      }
+      ride                = &rides[count++];
+      ride->id            = stored.header.rideId;
+      ride->startTime     = stored.header.startTime;
+      ride->firstSequence = s;
+      ride->blocks        = 0;
+    }
+    ride->blocks++;
+    RideBlockReader reader(stored);
+    RideSample sample;
+    while (reader.next(sample))
+    {
+      ride->duration = sample.time;
+    }
+  }
+  file.close();
+  return count;
+}
+
+// Only the headers are read until the ride's first block turns up, nothing is decoded
+bool RideRecorder::findRide(uint16_t id, RideInfo &ride)
+{
+  File file = openForReading();
+  if (!file)
+  {
+    return false;
+  }
+  uint32_t end   = sequence;
+  uint32_t first = end > RIDE_RING_BLOCKS ? end - RIDE_RING_BLOCKS : 0;
+  RideBlock stored;
+  bool found = false;
+  for (uint32_t s = first; s < end && !found; s++)
+  {
+    RideBlockHeader header;
+    if (!file.seek((s % RIDE_RING_BLOCKS) * RIDE_BLOCK_SIZE) ||
+        file.read((uint8_t *)&header, sizeof(header)) != sizeof(header) ||
+        header.sequence != s || header.rideId != id)
+    {
+      continue;
+    }
+    //The header matched, the CRC over the whole block decides
+    found = readRingBlock(file, s, stored);
+    if (found)
+    {
+      memset(&ride, 0, sizeof(ride));
+      ride.id            = id;
+      ride.startTime     = stored.header.startTime;
+      ride.firstSequence = s;
+    }
+  }
+  file.close();
+  return found;
+}
+
+void RideRecorder::startRide()
+{
+  rideId++;
+  time_t now  = time(nullptr);
+  startTime   = (now > 5 * 3600) ? now : 0; //Not set before NTP
+  startMillis = millis();
+  state       = RIDE_RECORDING;
+  rideStats.reset();
+  powerCurve.reset();
+  SS2K_LOGI(LOG_CAT_MAIN, "Ride %u started", rideId);
+}
+
+void RideRecorder::addSample()
+{
+  RideSample &sample     = pending[pendingCount++];
+  sample.time            = (millis() - startMillis) / 1000;
+  sample.power           = constrain(userConfig.getSimulatedWatts(), INT16_MIN, INT16_MAX);
+  sample.cadence         = constrain((int)userConfig.getSimulatedCad(), 0, 255);
+  sample.heartRate       = constrain(userConfig.getSimulatedHr(), 0, 255);
+  sample.incline         = constrain((int)userConfig.getIncline(), INT16_MIN, INT16_MAX);
+  sample.targetWatts     = constrain(userConfig.getTargetWatts(), INT16_MIN, INT16_MAX);
+  sample.flags           = userConfig.getERGMode() ? RIDE_FLAG_ERG : 0;
+  sample.stepperPosition = stepperPosition;
+  rideStats.add(sample.power, sample.cadence, sample.heartRate);
+  powerCurve.add(sample.power);
+  if (pendingCount == RIDE_PACKED_MAX_SAMPLES)
+  {
+    flush(pendingCount);
+  }
+  else if (rideEncode(pending, pendingCount, block.payload, sizeof(block.payload)) == 0)
+  {
+    //The newest sample doesn't fit anymore, it starts the next block
+    flush(pendingCount - 1);
+  }
+}
+
+// Packs the first count pending samples into one block and writes it into the next ring slot
+void RideRecorder::flush(uint8_t count)
+{
+  if (count == 0)
+  {
+    return;
+  }
+  File file = SPIFFS.open(RIDE_RING_FILE, "r+");
+  if (!file && openRing())
+  {
+    //A filesystem update took the ring with it. openRing() uses block, so this comes first.
+    file = SPIFFS.open(RIDE_RING_FILE, "r+");
+  }
+  memset(&block, 0, sizeof(block));
+  rideEncode(pending, count, block.payload, sizeof(block.payload));
+  block.header.sequence  = sequence;
+  block.header.startTime = startTime;
+  block.header.rideId    = rideId;
+  block.header.count     = count;
+  block.header.format    = RIDE_FORMAT_PACKED;
+  block.header.crc       = blockCRC(block);
+
+  bool ok = file && file.seek((sequence % RIDE_RING_BLOCKS) * RIDE_BLOCK_SIZE) &&
+            file.write((uint8_t *)&block, RIDE_BLOCK_SIZE) == RIDE_BLOCK_SIZE;
+  if (file)
+  {
+    file.close();
+  }
+  if (!ok)
+  {
+    SS2K_LOGE(LOG_CAT_MAIN, "Ride recorder: writing block %u failed", sequence);
+  }
+  sequence++;
+  pendingCount -= count;
+  memmove(pending, pending + count, pendingCount * sizeof(RideSample));
+}
+
+// A disconnect pauses the ride. Reconnecting within RIDE_RESUME_TIMEOUT continues it.
+void RideRecorder::update()
+{
+  bool riding = radioScheduler.rideActive();
+  switch (state)
+  {
+  case RIDE_IDLE:
+    if (riding)
+    {
+      startRide();
+      addSample();
+    }
+    break;
+
+  case RIDE_RECORDING:
+    if (!riding)
+    {
+      flush(pendingCount);
+      powerCurve.save();
+      pausedAt = millis();
+      state    = RIDE_PAUSED;
+    }
+    else if (millis() - startMillis >= UINT16_MAX * 1000UL)
+    {
+      //Sample times are 16 bit seconds, carry on as a new ride
+      flush(pendingCount);
+      startRide();
+    }
+    else
+    {
+      addSample();
+    }
+    break;
+
+  case RIDE_PAUSED:
+    if (riding)
+    {
+      state = RIDE_RECORDING;
+      addSample();
+    }
+    else if (millis() - pausedAt > RIDE_RESUME_TIMEOUT)
+    {
+      SS2K_LOGI(LOG_CAT_MAIN, "Ride %u ended", rideId);
+      state = RIDE_IDLE;
+    }
+    break;
+  }
+}
+
+void RideRecorder::run()
+{
+  if (!openRing())
+  {
+    SS2K_LOGE(LOG_CAT_MAIN, "Ride recorder: no room for %s", RIDE_RING_FILE);
+    task = nullptr;
+    vTaskDelete(NULL);
+  }
+  scanRing();
+  powerCurve.load();
+  ready = true;
+  TickType_t lastWake = xTaskGetTickCount();
+  for (;;)
+  {
+    vTaskDelayUntil(&lastWake, RIDE_SAMPLE_INTERVAL / portTICK_PERIOD_MS);
+    update();
+  }
+}
+
+void rideRecorderTask(void *pvParameters)
+{
+  rideRecorder.run();
+}
@@ -0,0 +1,102 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#include "Main.h"
+#include "Ride_Stats.h"
+
+RideStats rideStats;
+
+void RideStats::reset()
+{
+  portENTER_CRITICAL(&statsMux);
+  memset(window, 0, sizeof(window));
+  head       = 0;
+  count      = 0;
+  sum3       = 0;
+  sum10      = 0;
+  sum30      = 0;
+  np4Sum     = 0;
+  np4Count   = 0;
+  powerSum   = 0;
+  cadenceSum = 0;
+  hrSum      = 0;
+  hrCount    = 0;
+  maxPower   = 0;
+  maxCadence = 0;
+  maxHr      = 0;
+  portEXIT_CRITICAL(&statsMux);
+}
+
+// Watts of the sample seconds ago, 0 before the ride started
+uint16_t RideStats::ago(int seconds)
+{
+  return (count >= (uint32_t)seconds) ? window[(head + RIDE_STATS_WINDOW - seconds) % RIDE_STATS_WINDOW] : 0;
+}
+
+// One sample a second. Each window drops the sample that just left it and adds the new one.
+void RideStats::add(int power, int cadence, int hr)
+{
+  uint16_t watts = constrain(power, 0, UINT16_MAX);
+  uint8_t cad    = constrain(cadence, 0, UINT8_MAX);
+  uint8_t bpm    = constrain(hr, 0, UINT8_MAX);
+
+  portENTER_CRITICAL(&statsMux);
+  sum3 += watts - ago(3);
+  sum10 += watts - ago(10);
+  sum30 += watts - ago(30);
+  window[head] = watts;
+  head         = (head + 1) % RIDE_STATS_WINDOW;
+  count++;
+  if (count >= RIDE_STATS_WINDOW)
+  {
+    double avg30 = sum30 / (double)RIDE_STATS_WINDOW;
+    double sq    = avg30 * avg30;
+    np4Sum += sq * sq;
+    np4Count++;
+  }
+  powerSum += watts;
+  cadenceSum += cad;
+  if (bpm)
+  {
+    hrSum += bpm;
+    hrCount++;
+  }
+  maxPower   = max(maxPower, watts);
+  maxCadence = max(maxCadence, cad);
+  maxHr      = max(maxHr, bpm);
+  portEXIT_CRITICAL(&statsMux);
+}
+
+RideTotals RideStats::totals()
+{
+  RideTotals t;
+  portENTER_CRITICAL(&statsMux);
+  uint32_t n          = count;
+  uint32_t windowed   = min(n, (uint32_t)RIDE_STATS_WINDOW);
+  t.seconds           = n;
+  t.power3s           = n ? sum3 / min(n, (uint32_t)3) : 0;
+  t.power10s          = n ? sum10 / min(n, (uint32_t)10) : 0;
+  t.power30s          = n ? sum30 / windowed : 0;
+  t.avgPower          = n ? powerSum / n : 0;
+  t.avgCadence        = n ? cadenceSum / n : 0;
+  t.avgHr             = hrCount ? hrSum / hrCount : 0;
+  t.maxPower          = maxPower;
+  t.maxCadence        = maxCadence;
+  t.maxHr             = maxHr;
+  double np4          = np4Count ? np4Sum / np4Count : 0;
+  uint64_t joules     = powerSum;
+  portEXIT_CRITICAL(&statsMux);
+
+  //Until the first 30 s are in, NP is just the average
+  t.normalizedPower = np4 > 0 ? (uint16_t)(sqrt(sqrt(np4)) + 0.5) : t.avgPower;
+  int ftp           = max(userConfig.getFTP(), 1);
+  t.intensity       = t.normalizedPower / (float)ftp;
+  float hours       = n * (RIDE_SAMPLE_INTERVAL / 1000.0f) / 3600.0f;
+  t.tss             = hours * t.intensity * t.intensity * 100.0f;
+  t.kiloJoules      = joules * (RIDE_SAMPLE_INTERVAL / 1000.0f) / 1000.0f;
+  return t;
+}
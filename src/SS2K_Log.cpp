@@ -0,0 +1,402 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#include "Main.h"
+#include "SS2K_Log.h"
+
+TaskHandle_t logTask;
+
+static_assert((LOG_RING_RECORDS & (LOG_RING_RECORDS - 1)) == 0, "LOG_RING_RECORDS must be a power of two");
+
+uint8_t logLevels[LOG_CATEGORIES] = {LOG_LEVEL_INFO, LOG_LEVEL_INFO, LOG_LEVEL_INFO, LOG_LEVEL_INFO, LOG_LEVEL_INFO, LOG_LEVEL_INFO};
+
+static LogSlot logRing[LOG_RING_RECORDS];
+static std::atomic<uint32_t> logWriteIndex(0);
+
+//Only touched by the drain task
+static uint32_t logReadIndex = 0;
+static uint32_t logDropped = 0;
+static char logLine[LOG_LINE_LENGTH];
+static size_t logLineLength = 0;
+static bool logAtLineStart = true;
+
+//Web sink: the latest messages kept as numbered segments. Read by the web server task.
+struct LogHistorySegment
+{
+    uint32_t    sequence;
+    bool        newline;
+    char        text[LOG_HISTORY_LENGTH];
+};
+static LogHistorySegment logHistory[LOG_HISTORY_SEGMENTS];
+static uint32_t logHistorySequence = 0;
+static portMUX_TYPE logHistoryMux = portMUX_INITIALIZER_UNLOCKED;
+
+/*********************************Producers*********************************/
+// Everything a producer does is reserve a position with one atomic add and copy the entry into the slot.
+// If the drain task falls a whole ring behind, the oldest records are overwritten and counted as dropped.
+
+static void IRAM_ATTR logCommit(uint32_t position, const LogEntry &entry)
+{
+    LogSlot &slot = logRing[position & (LOG_RING_RECORDS - 1)];
+    slot.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.entry = entry;
+    slot.sequence.store(position + 1, std::memory_order_release);
+}
+
+static void IRAM_ATTR logFillHeader(LogEntry &entry, uint8_t level, uint8_t flags, const char *format)
+{
+    entry.timestamp = millis();
+    entry.task = xPortInIsrContext() ? nullptr : xTaskGetCurrentTaskHandle();
+    entry.format = format;
+    entry.level = level;
+    entry.flags = flags;
+}
+
+void IRAM_ATTR logWrite(uint8_t level, uint8_t flags, const char *format, const LogArg *args, uint8_t argCount)
+{
+    LogEntry entry;
+    logFillHeader(entry, level, flags, format);
+    entry.length = argCount;
+    entry.argTypes = 0;
+    for (int i = 0; i < argCount; i++)
+    {
+        entry.args[i] = args[i].value;
+        entry.argTypes |= args[i].type << (i * 2);
+    }
+    logCommit(logWriteIndex.fetch_add(1, std::memory_order_relaxed), entry);
+}
+
+// Text built at runtime is copied into as many consecutive records as it needs.
+void logText(uint8_t level, uint8_t flags, const char *text, size_t length)
+{
+    size_t records = (length + LOG_RECORD_TEXT - 1) / LOG_RECORD_TEXT;
+    if (records == 0)
+    {
+        records = 1;
+    }
+    if (records > LOG_MAX_TEXT_RECORDS)
+    {
+        records = LOG_MAX_TEXT_RECORDS;
+        length = records * LOG_RECORD_TEXT;
+    }
+    uint32_t position = logWriteIndex.fetch_add(records, std::memory_order_relaxed);
+    LogEntry entry;
+    logFillHeader(entry, level, 0, nullptr);
+    entry.argTypes = 0;
+    for (size_t i = 0; i < records; i++)
+    {
+        size_t chunk = min((size_t)LOG_RECORD_TEXT, length - (i * LOG_RECORD_TEXT));
+        memcpy(entry.text, text + (i * LOG_RECORD_TEXT), chunk);
+        entry.length = chunk;
+        entry.flags = (i + 1 < records) ? ((flags & LOG_FLAG_TELEGRAM) | LOG_FLAG_MORE) : flags;
+        logCommit(position + i, entry);
+    }
+}
+
+// Raw bytes are copied as they are and only turned into hex by the drain task.
+void logHex(uint8_t level, uint8_t flags, const char *label, const uint8_t *data, size_t length)
+{
+    LogEntry entry;
+    logFillHeader(entry, level, flags | LOG_FLAG_HEX, label);
+    entry.argTypes = 0;
+    entry.length = min(length, (size_t)LOG_RECORD_TEXT);
+    memcpy(entry.text, data, entry.length);
+    logCommit(logWriteIndex.fetch_add(1, std::memory_order_relaxed), entry);
+}
+
+// Unpacks the 4 bit per category levels stored in the config.
+void logSetLevels(uint32_t packedLevels)
+{
+    for (int i = 0; i < LOG_CATEGORIES; i++)
+    {
+        logLevels[i] = min((uint8_t)((packedLevels >> (i * 4)) & 0xF), (uint8_t)LOG_LEVEL_VERBOSE);
+    }
+}
+
+/*********************************Drain*********************************/
+
+// Copies the next complete record out of the ring. Returns false if there is nothing to read yet.
+static bool logRead(LogEntry &entry)
+{
+    for (;;)
+    {
+        uint32_t writeIndex = logWriteIndex.load(std::memory_order_acquire);
+        if (writeIndex == logReadIndex)
+        {
+            return false;
+        }
+        if (writeIndex - logReadIndex > LOG_RING_RECORDS)
+        {
+            //Producers lapped us
+            logDropped += writeIndex - logReadIndex - LOG_RING_RECORDS;
+            logReadIndex = writeIndex - LOG_RING_RECORDS;
+        }
+        LogSlot &slot = logRing[logReadIndex & (LOG_RING_RECORDS - 1)];
+        uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+        if (sequence != logReadIndex + 1)
+        {
+            if ((int32_t)(sequence - (logReadIndex + 1)) > 0)
+            {
+                //Overwritten by a newer record
+                logDropped++;
+                logReadIndex++;
+                continue;
+            }
+            return false; //Still being written
+        }
+        entry = slot.entry;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) != sequence)
+        {
+            logDropped++; //Overwritten while we copied it
+            logReadIndex++;
+            continue;
+        }
+        logReadIndex++;
+        return true;
+    }
+}
+
+// Expands a deferred format with its stored arguments. Every conversion is handed to snprintf
+// on its own with the argument converted to the type the conversion expects.
+static size_t logFormat(const LogEntry &entry, char *out, size_t size)
+{
+    size_t length = 0;
+    int arg = 0;
+    const char *p = entry.format;
+    while (*p && length + 1 < size)
+    {
+        if (*p != '%')
+        {
+            out[length++] = *p++;
+            continue;
+        }
+        if (p[1] == '%')
+        {
+            out[length++] = '%';
+            p += 2;
+            continue;
+        }
+        char spec[16];
+        size_t specLength = 0;
+        spec[specLength++] = *p++;
+        while (*p && !strchr("diouxXcsfFeEgGp", *p) && specLength < sizeof(spec) - 2)
+        {
+            if (*p != 'l' && *p != 'h' && *p != 'z') //Everything is stored as 32 bits
+            {
+                spec[specLength++] = *p;
+            }
+            p++;
+        }
+        if (!*p)
+        {
+            break;
+        }
+        char conversion = *p++;
+        spec[specLength++] = conversion;
+        spec[specLength] = 0;
+        if (arg >= entry.length)
+        {
+            continue;
+        }
+        LogArgType type = (LogArgType)((entry.argTypes >> (arg * 2)) & 0b11);
+        LogArgValue value = entry.args[arg++];
+        int written;
+        if (strchr("fFeEgG", conversion))
+        {
+            double d = (type == LOG_ARG_FLOAT) ? value.f : (type == LOG_ARG_UINT) ? value.u : value.i;
+            written = snprintf(out + length, size - length, spec, d);
+        }
+        else if (conversion == 's')
+        {
+            written = snprintf(out + length, size - length, spec, (type == LOG_ARG_STR && value.s) ? value.s : "?");
+        }
+        else if (conversion == 'p')
+        {
+            written = snprintf(out + length, size - length, spec, value.s);
+        }
+        else if (type == LOG_ARG_FLOAT)
+        {
+            written = snprintf(out + length, size - length, spec, (int)value.f);
+        }
+        else
+        {
+            written = snprintf(out + length, size - length, spec, value.i);
+        }
+        if (written > 0)
+        {
+            length = min(length + written, size - 1);
+        }
+    }
+    out[length] = 0;
+    return length;
+}
+
+static void logHistoryAppend(const char *text, bool newline)
+{
+    portENTER_CRITICAL(&logHistoryMux);
+    LogHistorySegment &segment = logHistory[logHistorySequence % LOG_HISTORY_SEGMENTS];
+    strncpy(segment.text, text, LOG_HISTORY_LENGTH - 1);
+    segment.text[LOG_HISTORY_LENGTH - 1] = 0;
+    segment.newline = newline;
+    segment.sequence = ++logHistorySequence;
+    portEXIT_CRITICAL(&logHistoryMux);
+}
+
+// Sequence number of the newest web log segment
+uint32_t logHistoryEnd()
+{
+    return logHistorySequence;
+}
+
+// Returns the web log newer than cursor (up to end, if given) as HTML on a single line and advances cursor.
+String logHistoryHTML(uint32_t &cursor, uint32_t end)
+{
+    String html;
+    LogHistorySegment segment;
+    uint32_t last = logHistorySequence;
+    if (end != 0 && (end - cursor) < (last - cursor))
+    {
+        last = end;
+    }
+    if (last - cursor > LOG_HISTORY_SEGMENTS)
+    {
+        cursor = last - LOG_HISTORY_SEGMENTS;
+    }
+    while (cursor != last)
+    {
+        portENTER_CRITICAL(&logHistoryMux);
+        segment = logHistory[cursor % LOG_HISTORY_SEGMENTS];
+        portEXIT_CRITICAL(&logHistoryMux);
+        cursor++;
+        if (segment.sequence != cursor)
+        {
+            continue; //Overwritten while we were reading
+        }
+        if (segment.newline)
+        {
+            html += "<br>";
+        }
+        for (const char *c = segment.text; *c; c++)
+        {
+            if (*c == '<')
+            {
+                html += "&lt;";
+            }
+            else if (*c == '>')
+            {
+                html += "&gt;";
+            }
+            else if (*c == '&')
+            {
+                html += "&amp;";
+            }
+            else if ((uint8_t)*c >= ' ')
+            {
+                html += *c;
+            }
+        }
+    }
+    return html;
+}
+
+static const char logLevelLetters[] = "-EWIDV";
+
+// Hands one complete message to every sink.
+static void logEmit(const LogEntry &entry, const char *text)
+{
+    bool newline = entry.flags & LOG_FLAG_NEWLINE;
+    if (logAtLineStart)
+    {
+        const char *taskName = entry.task ? pcTaskGetTaskName(entry.task) : "ISR";
+        Serial.printf("[%lu][%c][%s] ", (unsigned long)entry.timestamp, logLevelLetters[min(entry.level, (uint8_t)LOG_LEVEL_VERBOSE)], taskName);
+    }
+    if (newline)
+    {
+        Serial.println(text);
+    }
+    else
+    {
+        Serial.print(text);
+    }
+    logAtLineStart = newline;
+
+    logHistoryAppend(text, newline);
+
+#ifdef USE_TELEGRAM
+    if (entry.flags & LOG_FLAG_TELEGRAM)
+    {
+        sendTelegram(text);
+    }
+#endif
+}
+
+static void logDrain()
+{
+    LogEntry entry;
+    while (logRead(entry))
+    {
+        if (logDropped)
+        {
+            char dropped[40];
+            snprintf(dropped, sizeof(dropped), "[log] %u records dropped", logDropped);
+            logDropped = 0;
+            LogEntry note = entry;
+            note.flags = LOG_FLAG_NEWLINE;
+            logLineLength = 0;
+            logAtLineStart = true;
+            logEmit(note, dropped);
+        }
+        if (entry.flags & LOG_FLAG_HEX)
+        {
+            size_t length = snprintf(logLine, sizeof(logLine), "%s", entry.format);
+            for (int i = 0; i < entry.length && length + 4 < sizeof(logLine); i++)
+            {
+                length += snprintf(logLine + length, sizeof(logLine) - length, " %02x", (uint8_t)entry.text[i]);
+            }
+            logEmit(entry, logLine);
+            continue;
+        }
+        if (entry.format)
+        {
+            logFormat(entry, logLine, sizeof(logLine));
+            logEmit(entry, logLine);
+            continue;
+        }
+        size_t chunk = min((size_t)entry.length, sizeof(logLine) - 1 - logLineLength);
+        memcpy(logLine + logLineLength, entry.text, chunk);
+        logLineLength += chunk;
+        if (!(entry.flags & LOG_FLAG_MORE))
+        {
+            logLine[logLineLength] = 0;
+            logLineLength = 0;
+            logEmit(entry, logLine);
+        }
+    }
+}
+
+void logDrainTask(void *pvParameters)
+{
+    for (;;)
+    {
+        logDrain();
+        vTaskDelay(LOG_DRAIN_DELAY / portTICK_PERIOD_MS);
+    }
+}
+
+void logStart()
+{
+    xTaskCreatePinnedToCore(
+        logDrainTask,    /* Task function. */
+        "logDrainTask",  /* name of task. */
+        2500,            /* Stack size of task */
+        NULL,            /* parameter of the task */
+        1,               /* priority of the task - as low as it gets, logging never gets in the way */
+        &logTask,        /* Task handle to keep track of created task */
+        tskNO_AFFINITY); /* pin task to core 0 */
+}
@@ -7,258 +7,594 @@
 
 #include "Main.h"
 #include "SmartSpin_parameters.h"
+#include "Config_Store.h"
 
 #include <ArduinoJson.h>
 #include <SPIFFS.h>
 
-// Default Values
-void userParameters::setDefaults() //Move these to set the values as #define in main.h
+/*********************************Config schema*********************************/
+static void applyLogLevels()
 {
-  firmwareUpdateURL     = FW_UPDATEURL;
-  incline               = 0.0;
-  simulatedWatts        = 30;
-  simulatedHr           = 60;
-  simulatedCad          = 90;
-  deviceName            = DEVICE_NAME;
-  shiftStep             = 400;
-  stepperPower          = STEPPER_POWER;
-  stealthchop           = STEALTHCHOP;
-  inclineMultiplier     = 2.0;
-  doublePower           = false;
-  simulateHr            = true;
-  ERGMode               = false;
-  autoUpdate            = AUTO_FIRMWARE_UPDATE;
-  ssid                  = DEVICE_NAME;
-  password              = DEFAULT_PASSWORD;
-  foundDevices          = "";
-  connectedPowerMeter   = "any";
-  connectedHeartMonitor = "any";
+  logSetLevels(userConfig.getLogLevels());
 }
 
-//---------------------------------------------------------------------------------
-//-- return all config as one a single JSON string
-String userParameters::returnJSON()
+// The log level selects logLevel0, logLevel1, ... packed 4 bits per category. They're on the
+// stepperPower form, a category without a select gets INFO.
+static bool readLogLevelsForm(const ConfigFormReader &readArg, String &value)
 {
-  // Allocate a temporary JsonDocument
-  // Don't forget to change the capacity to match your requirements.
-  // Use arduinojson.org/assistant to compute the capacity.
-  StaticJsonDocument<USERCONFIG_JSON_SIZE> doc;
-  // Set the values in the document
-
-  doc["firmwareUpdateURL"]      = firmwareUpdateURL;
-  doc["incline"]                = incline;
-  doc["simulatedWatts"]         = simulatedWatts;
-  doc["simulatedHr"]            = simulatedHr;
-  doc["simulatedCad"]           = simulatedCad;
-  doc["deviceName"]             = deviceName;
-  doc["shiftStep"]              = shiftStep;
-  doc["stepperPower"]           = stepperPower;
-  doc["stealthchop"]            = stealthchop;
-  doc["inclineMultiplier"]      = inclineMultiplier;
-  doc["doublePower"]            = doublePower;
-  doc["simulateHr"]             = simulateHr;
-  doc["ERGMode"]                = ERGMode;
-  doc["autoUpdate"]             = autoUpdate;
-  doc["ssid"]                   = ssid;
-  doc["password"]               = password;
-  doc["foundDevices"]           = foundDevices;  
-  doc["connectedPowerMeter"]    = connectedPowerMeter;
-  doc["connectedHeartMonitor"]  = connectedHeartMonitor;
-  String output;
-  serializeJson(doc, output);
-  return output;
+  if (!readArg("stepperPower", value) || value.isEmpty())
+  {
+    return false;
+  }
+  int levels = 0;
+  for (int i = 0; i < LOG_CATEGORIES; i++)
+  {
+    String name = "logLevel" + String(i);
+    int level   = (readArg(name.c_str(), value) && !value.isEmpty()) ? constrain(value.toInt(), 0, LOG_LEVEL_VERBOSE) : LOG_LEVEL_INFO;
+    levels |= level << (i * 4);
+  }
+  value = String(levels);
+  return true;
 }
 
-//-- Saves all parameters to SPIFFS
-void userParameters::saveToSPIFFS()
+// The single list of config fields. Ranges are enforced on everything coming from the form or the file.
+// Runtime values (incline, the simulator values, ERG mode and target, found devices) are shown on the pages but never saved.
+static constexpr ConfigField configFields[] = {
+    //          name                     member                                      default                  range / length     flags                          checkbox form / apply hook / form name / form reader
+    ConfigField("firmwareUpdateURL",     &userParametersData::firmwareUpdateURL,     FW_UPDATEURL,            128,               CONFIG_PERSIST),
+    ConfigField("incline",               &userParametersData::incline,               0.0f, -30000.0f, 30000.0f,                  0),
+    ConfigField("simulatedWatts",        &userParametersData::simulatedWatts,        30, 0, 4000,                                0),
+    ConfigField("simulatedHr",           &userParametersData::simulatedHr,           60, 0, 250,                                 0),
+    ConfigField("simulatedCad",          &userParametersData::simulatedCad,          90, 0, 250,                                 0),
+    ConfigField("deviceName",            &userParametersData::deviceName,            DEVICE_NAME,             32,                CONFIG_PERSIST | CONFIG_FORM),
+    ConfigField("shiftStep",             &userParametersData::shiftStep,             400, 10, 2000,                              CONFIG_PERSIST | CONFIG_FORM),
+    ConfigField("ftp",                   &userParametersData::ftp,                   DEFAULT_FTP, 50, 600,                       CONFIG_PERSIST | CONFIG_FORM),
+    ConfigField("stepperPower",          &userParametersData::stepperPower,          STEPPER_POWER, 100, 2000,                   CONFIG_PERSIST | CONFIG_FORM, updateStepperPower),
+    ConfigField("stealthchop",           &userParametersData::stealthchop,           STEALTHCHOP,                                CONFIG_PERSIST | CONFIG_FORM, "stepperPower", updateStealthchop),
+    ConfigField("inclineMultiplier",     &userParametersData::inclineMultiplier,     2.0f, 0.0f, 10.0f,                          CONFIG_PERSIST | CONFIG_FORM),
+    ConfigField("doublePower",           &userParametersData::doublePower,           false,                                      CONFIG_PERSIST | CONFIG_FORM, "bleHRDropdown"),
+    ConfigField("simulateHr",            &userParametersData::simulateHr,            true,                                       CONFIG_PERSIST),
+    ConfigField("ERGMode",               &userParametersData::ERGMode,               false,                                      0),
+    ConfigField("targetWatts",           &userParametersData::targetWatts,           0, 0, 4000,                                 0),
+    ConfigField("autoUpdate",            &userParametersData::autoUpdate,            AUTO_FIRMWARE_UPDATE,                       CONFIG_PERSIST | CONFIG_FORM, "stepperPower"),
+    ConfigField("logLevels",             &userParametersData::logLevels,             LOG_DEFAULT_LEVELS, 0, 0xFFFFFF,            CONFIG_PERSIST | CONFIG_FORM, applyLogLevels, nullptr, readLogLevelsForm),
+    ConfigField("ssid",                  &userParametersData::ssid,                  DEVICE_NAME,             32,                CONFIG_PERSIST | CONFIG_FORM | CONFIG_SECRET),
+    ConfigField("password",              &userParametersData::password,              DEFAULT_PASSWORD,        64,                CONFIG_PERSIST | CONFIG_FORM | CONFIG_SECRET),
+    ConfigField("foundDevices",          &userParametersData::foundDevices,          "",                      0,                 0),
+    ConfigField("connectedPowerMeter",   &userParametersData::connectedPowerMeter,   CONNECTED_POWER_METER,   32,                CONFIG_PERSIST | CONFIG_FORM, nullptr, "blePMDropdown"),
+    ConfigField("connectedHeartMonitor", &userParametersData::connectedHeartMonitor, CONNECTED_HEART_MONITOR, 32,                CONFIG_PERSIST | CONFIG_FORM, nullptr, "bleHRDropdown"),
+};
+
+static constexpr size_t CONFIG_FIELD_COUNT = sizeof(configFields) / sizeof(configFields[0]);
+
+static constexpr size_t configNameLength(const char *name)
 {
-  // Delete existing file, otherwise the configuration is appended to the file
-  SPIFFS.remove(configFILENAME);
-
-  // Open file for writing
-  debugDirector("Writing File: " + String(configFILENAME));
-  File file = SPIFFS.open(configFILENAME, FILE_WRITE);
-  if (!file)
-  {
-    debugDirector(F("Failed to create file"));
-    return;
-  }
+  return *name ? 1 + configNameLength(name + 1) : 0;
+}
 
-  // Allocate a temporary JsonDocument
-  // Don't forget to change the capacity to match your requirements.
-  // Use arduinojson.org/assistant to compute the capacity.
-  StaticJsonDocument<USERCONFIG_JSON_SIZE> doc;
+// One slot per persisted field plus room for every key and the longest allowed string value.
+// Keys are copied when reading from a file, values when saving Strings.
+static constexpr size_t configJsonSize(size_t i)
+{
+  return i == CONFIG_FIELD_COUNT ? 0
+         : ((configFields[i].flags & CONFIG_PERSIST)
+                ? JSON_OBJECT_SIZE(1) + configNameLength(configFields[i].name) + 1 +
+                      (configFields[i].type == CONFIG_STRING ? configFields[i].maxLength + 1 : 0)
+                : 0) +
+               configJsonSize(i + 1);
+}
 
-  // Set the values in the document
-
-  doc["firmwareUpdateURL"]      = firmwareUpdateURL;
-  doc["incline"]                = incline;
-  doc["simulatedWatts"]         = simulatedWatts;
-  doc["simulatedHr"]            = simulatedHr;
-  doc["simulatedCad"]           = simulatedCad;
-  doc["deviceName"]             = deviceName;
-  doc["shiftStep"]              = shiftStep;
-  doc["stepperPower"]           = stepperPower;
-  doc["stealthchop"]            = stealthchop;
-  doc["inclineMultiplier"]      = inclineMultiplier;
-  doc["doublePower"]            = doublePower;
-  doc["simulateHr"]             = simulateHr;
-  doc["ERGMode"]                = ERGMode;
-  doc["autoUpdate"]             = autoUpdate;
-  doc["ssid"]                   = ssid;
-  doc["password"]               = password;
-  //doc["foundDevices"]         = foundDevices; //I don't see a need currently in keeping this boot to boot
-  doc["connectedPowerMeter"]    = connectedPowerMeter;
-  doc["connectedHeartMonitor"]  = connectedHeartMonitor;
+static constexpr size_t USERCONFIG_JSON_SIZE = configJsonSize(0);
 
-  // Serialize JSON to file
-  if (serializeJson(doc, file) == 0)
+void userParameters::setDefault(const ConfigField &field)
+{
+  if (field.type == CONFIG_STRING)
   {
-    debugDirector(F("Failed to write to file"));
+    this->*field.stringMember = field.defaultString;
+  }
+  else
+  {
+    setField(field, field.defaultValue);
   }
-  // Close the file
-  file.close();
 }
 
-// Loads the JSON configuration from a file into a userParameters Object
-void userParameters::loadFromSPIFFS()
+// Sets a number or checkbox field, clamped to its range. Returns true if the value changed.
+bool userParameters::setField(const ConfigField &field, float value)
 {
-  // Open file for reading
-  debugDirector("Reading File: " + String(configFILENAME));
-  File file = SPIFFS.open(configFILENAME);
-
-  //load defaults if filename doesn't exist
-  if (!file)
+  if (isnan(value))
   {
-    debugDirector("Couldn't find configuration file. Loading Defaults");
-    setDefaults();
-    return;
+    value = field.defaultValue;
   }
-  // Allocate a temporary JsonDocument
-  // Don't forget to change the capacity to match your requirements.
-  // Use arduinojson.org/v6/assistant to compute the capacity.
-  StaticJsonDocument<USERCONFIG_JSON_SIZE> doc;
+  value = constrain(value, field.minValue, field.maxValue);
+  switch (field.type)
+  {
+  case CONFIG_INT:
+  {
+    int newValue = (int)value;
+    if (this->*field.intMember == newValue)
+    {
+      return false;
+    }
+    this->*field.intMember = newValue;
+    return true;
+  }
+  case CONFIG_FLOAT:
+    if (this->*field.floatMember == value)
+    {
+      return false;
+    }
+    this->*field.floatMember = value;
+    return true;
+  case CONFIG_BOOL:
+    if (this->*field.boolMember == (value != 0))
+    {
+      return false;
+    }
+    this->*field.boolMember = (value != 0);
+    return true;
+  default:
+    return false;
+  }
+}
 
-  // Deserialize the JSON document
-  DeserializationError error = deserializeJson(doc, file);
-  if (error)
+// Sets a string field, trimmed and cut to its max length. Returns true if the value changed.
+bool userParameters::setField(const ConfigField &field, String value)
+{
+  value.trim();
+  if (field.maxLength && value.length() > field.maxLength)
   {
-    debugDirector(F("Failed to read file, using default configuration"));
-    setDefaults();
-    return;
+    value.remove(field.maxLength);
+  }
+  if (this->*field.stringMember == value)
+  {
+    return false;
   }
+  this->*field.stringMember = value;
+  return true;
+}
 
-  // Copy values from the JsonDocument to the Config
-  setFirmwareUpdateURL    (doc["firmwareUpdateURL"]);
-  setIncline              (doc["incline"]);
-  setSimulatedWatts       (doc["simulatedWatts"]);
-  setSimulatedHr          (doc["simulatedHr"]);
-  setSimulatedCad         (doc["simulatedCad"]);
-  setDeviceName           (doc["deviceName"]);
-  setShiftStep            (doc["shiftStep"]);
-  setStepperPower         (doc["stepperPower"]);
-  setStealthChop          (doc["stealthchop"]);
-  setInclineMultiplier    (doc["inclineMultiplier"]);
-  setDoublePower          (doc["doublePower"]);
-  setSimulateHr           (doc["simulateHr"]);
-  setERGMode              (doc["ERGMode"]);
-  setAutoUpdate           (doc["autoUpdate"]);
-  setSsid                 (doc["ssid"]);
-  setPassword             (doc["password"]);
-  //setfoundDevices       (doc["foundDevices"]);
-  setConnectedPowerMeter  (doc["connectedPowerMeter"]);
-  setConnectedHeartMonitor(doc["connectedHeartMonitor"]);
+// Default Values
+void userParameters::setDefaults()
+{
+  for (const ConfigField &field : configFields)
+  {
+    setDefault(field);
+  }
+}
 
-  // Incase these important variables were not in the document, set them to defaults. 
-  if (doc["firmwareUpdateURL"] == "null")
+//---------------------------------------------------------------------------------
+//-- write all config fields straight to a JSON stream. The caller opens and closes the object.
+void userParameters::writeJSON(JsonStreamWriter &writer)
+{
+  for (size_t i = 0; writeJSONField(writer, i); i++)
   {
-    firmwareUpdateURL = FW_UPDATEURL;
   }
-  if (doc["deviceName"] == "null")
+}
+
+//-- writes the config field with this index. False past the last one (a JsonFieldSource).
+bool userParameters::writeJSONField(JsonStreamWriter &writer, size_t index)
+{
+  if (index >= CONFIG_FIELD_COUNT)
   {
-    deviceName = DEVICE_NAME;
+    return false;
   }
-  if (doc["ssid"] == "null")
+  const ConfigField &field = configFields[index];
+  switch (field.type)
   {
-    ssid = DEVICE_NAME;
+  case CONFIG_INT:
+    writer.field(field.name, this->*field.intMember);
+    break;
+  case CONFIG_FLOAT:
+    writer.field(field.name, this->*field.floatMember);
+    break;
+  case CONFIG_BOOL:
+    writer.field(field.name, this->*field.boolMember);
+    break;
+  case CONFIG_STRING:
+    writer.field(field.name, this->*field.stringMember);
+    break;
   }
-  if (doc["password"] == "null")
+  return true;
+}
+
+//-- Sets every form field that was submitted and runs its apply hook if the value changed.
+//-- Returns true if a persisted field changed.
+bool userParameters::applyForm(const ConfigFormReader &readArg)
+{
+  bool changed = false;
+  String value;
+  for (const ConfigField &field : configFields)
   {
-    password = DEFAULT_PASSWORD;
+    if (!(field.flags & CONFIG_FORM))
+    {
+      continue;
+    }
+    bool fieldChanged = false;
+    if (field.type == CONFIG_BOOL)
+    {
+      //checkboxes don't report off, so use another parameter that's always present on that form
+      if (readArg(field.name, value) && !value.isEmpty())
+      {
+        fieldChanged = setField(field, 1.0f);
+      }
+      else if (field.formMarker && readArg(field.formMarker, value) && !value.isEmpty())
+      {
+        fieldChanged = setField(field, 0.0f);
+      }
+    }
+    else if (field.readForm ? field.readForm(readArg, value)
+                            : (readArg(field.formName ? field.formName : field.name, value) && !value.isEmpty()))
+    {
+      fieldChanged = (field.type == CONFIG_STRING) ? setField(field, value) : setField(field, value.toFloat());
+    }
+    if (fieldChanged && field.apply)
+    {
+      field.apply();
+    }
+    changed |= fieldChanged && (field.flags & CONFIG_PERSIST);
   }
-  if (doc["autoUpdate"] == "null")
+  return changed;
+}
+
+/*********************************Binary config record*********************************/
+// Each persisted field is stored as [name length][name][type][value]. Strings are [length][bytes].
+// Fields are matched by name on load, so records written by older firmware still load and new fields get their defaults.
+
+static constexpr size_t configValueSize(const ConfigField &field)
+{
+  return field.type == CONFIG_STRING ? 1 + field.maxLength : field.type == CONFIG_BOOL ? 1 : 4;
+}
+
+static constexpr size_t configRecordSize(size_t i)
+{
+  return i == CONFIG_FIELD_COUNT ? 0
+         : ((configFields[i].flags & CONFIG_PERSIST)
+                ? 1 + configNameLength(configFields[i].name) + 1 + configValueSize(configFields[i])
+                : 0) +
+               configRecordSize(i + 1);
+}
+
+static constexpr size_t CONFIG_RECORD_SIZE = configRecordSize(0);
+
+static_assert(CONFIG_RECORD_SIZE <= 0xFFFF, "Config record too big for its header");
+
+static ConfigStore configStore(configSLOT_A, configSLOT_B, 0x43324B53 /*"SK2C"*/, CONFIG_RECORD_VERSION);
+
+size_t userParameters::encodeRecord(uint8_t *record)
+{
+  uint8_t *p = record;
+  for (const ConfigField &field : configFields)
   {
-    autoUpdate = AUTO_FIRMWARE_UPDATE;
+    if (!(field.flags & CONFIG_PERSIST))
+    {
+      continue;
+    }
+    size_t nameLength = strlen(field.name);
+    *p++              = nameLength;
+    memcpy(p, field.name, nameLength);
+    p += nameLength;
+    *p++ = field.type;
+    switch (field.type)
+    {
+    case CONFIG_INT:
+      memcpy(p, &(this->*field.intMember), 4);
+      p += 4;
+      break;
+    case CONFIG_FLOAT:
+      memcpy(p, &(this->*field.floatMember), 4);
+      p += 4;
+      break;
+    case CONFIG_BOOL:
+      *p++ = this->*field.boolMember;
+      break;
+    case CONFIG_STRING:
+    {
+      //setField() keeps strings within maxLength, setters called directly might not
+      const String &value = this->*field.stringMember;
+      size_t length       = min((size_t)value.length(), (size_t)field.maxLength);
+      *p++                = length;
+      memcpy(p, value.c_str(), length);
+      p += length;
+      break;
+    }
+    }
   }
-  if (doc["stepperPower"] == "null")
+  return p - record;
+}
+
+void userParameters::decodeRecord(const uint8_t *record, size_t length)
+{
+  bool found[CONFIG_FIELD_COUNT] = {false};
+  const uint8_t *p   = record;
+  const uint8_t *end = record + length;
+  while (p + 2 <= end)
   {
-    stepperPower = STEPPER_POWER;
+    size_t nameLength = *p++;
+    if (p + nameLength + 1 > end)
+    {
+      break;
+    }
+    const char *name = (const char *)p;
+    p += nameLength;
+    ConfigFieldType type = (ConfigFieldType)*p++;
+    size_t valueLength   = (type == CONFIG_STRING) ? ((p < end) ? 1 + *p : 1) : (type == CONFIG_BOOL) ? 1 : 4;
+    if (p + valueLength > end)
+    {
+      break;
+    }
+    for (size_t i = 0; i < CONFIG_FIELD_COUNT; i++)
+    {
+      const ConfigField &field = configFields[i];
+      if (field.type != type || !(field.flags & CONFIG_PERSIST) || strlen(field.name) != nameLength ||
+          memcmp(field.name, name, nameLength) != 0)
+      {
+        continue;
+      }
+      switch (type)
+      {
+      case CONFIG_INT:
+      {
+        int32_t value;
+        memcpy(&value, p, 4);
+        setField(field, (float)value);
+        break;
+      }
+      case CONFIG_FLOAT:
+      {
+        float value;
+        memcpy(&value, p, 4);
+        setField(field, value);
+        break;
+      }
+      case CONFIG_BOOL:
+        setField(field, *p ? 1.0f : 0.0f);
+        break;
+      case CONFIG_STRING:
+      {
+        String value;
+        value.reserve(*p);
+        for (size_t c = 0; c < *p; c++)
+        {
+          value += (char)p[1 + c];
+        }
+        setField(field, value);
+        break;
+      }
+      }
+      found[i] = true;
+      break;
+    }
+    p += valueLength;
   }
-  if (doc["stealthchop"] == "null")
+  for (size_t i = 0; i < CONFIG_FIELD_COUNT; i++)
   {
-    stealthchop = STEALTHCHOP;
+    if (!found[i])
+    {
+      setDefault(configFields[i]);
+    }
   }
-  if (doc["connectedPowerMeter"] == "null")
+}
+
+//-- Saves all parameters to the config slot that doesn't hold the current record. Returns false if that failed.
+bool userParameters::saveToSPIFFS(bool force)
+{
+  uint8_t record[CONFIG_RECORD_SIZE];
+  size_t length = encodeRecord(record);
+  if (!configStore.write(record, length, force))
   {
-    connectedPowerMeter = CONNECTED_POWER_METER;
+    SS2K_LOG_TEXT(LOG_CAT_CONFIG, F("Failed to write config"));
+    return false;
   }
-  if (doc["connectedHeartMonitor"] == "null")
+  return true;
+}
+
+// Loads the newest valid config record. On the first boot after the binary format
+// was introduced the old JSON file is migrated and removed.
+void userParameters::loadFromSPIFFS()
+{
+  uint8_t record[CONFIG_RECORD_SIZE];
+  size_t length = configStore.read(record, sizeof(record));
+  if (length)
   {
-    connectedHeartMonitor = CONNECTED_HEART_MONITOR;
+    decodeRecord(record, length);
+    return;
   }
 
-  debugDirector("Config File Loaded: " + String(configFILENAME));
-  file.close();
+  //The JSON file is the only copy of the settings until the record is written, so it stays if that fails
+  if (loadFromJSON() && saveToSPIFFS())
+  {
+    SPIFFS.remove(configFILENAME);
+    SS2K_LOG_TEXT(LOG_CAT_CONFIG, "Migrated " + String(configFILENAME) + " to the binary config");
+  }
 }
 
-// Prints the content of a file to the Serial
-void userParameters::printFile()
+// Loads the old JSON configuration file. Returns false (with defaults set) if there was nothing usable.
+bool userParameters::loadFromJSON()
 {
   // Open file for reading
-  debugDirector("Contents of file: " + String(configFILENAME));
+  SS2K_LOG_TEXT(LOG_CAT_CONFIG, "Reading File: " + String(configFILENAME));
   File file = SPIFFS.open(configFILENAME);
+
+  //load defaults if filename doesn't exist
   if (!file)
   {
-    debugDirector(F("Failed to read file"));
-    return;
+    SS2K_LOG_TEXT(LOG_CAT_CONFIG, "Couldn't find configuration file. Loading Defaults");
+    setDefaults();
+    return false;
   }
 
-  // Extract each characters by one by one
-  while (file.available())
+  // Only keep the persisted keys, so files written by older firmware (which also saved the runtime values) still fit
+  StaticJsonDocument<JSON_OBJECT_SIZE(CONFIG_FIELD_COUNT)> filter;
+  for (const ConfigField &field : configFields)
   {
-    debugDirector(String(char(file.read())), false);
+    if (field.flags & CONFIG_PERSIST)
+    {
+      filter[field.name] = true;
+    }
   }
-  debugDirector(String(" "));
-  // Close the file
+
+  StaticJsonDocument<USERCONFIG_JSON_SIZE> doc;
+  DeserializationError error = deserializeJson(doc, file, DeserializationOption::Filter(filter));
   file.close();
+  if (error)
+  {
+    SS2K_LOG_TEXT(LOG_CAT_CONFIG, F("Failed to read file, using default configuration"));
+    setDefaults();
+    return false;
+  }
+
+  // Fields missing from the file get their defaults
+  for (const ConfigField &field : configFields)
+  {
+    JsonVariant value = doc[field.name];
+    if (!(field.flags & CONFIG_PERSIST) || value.isNull())
+    {
+      setDefault(field);
+    }
+    else if (field.type == CONFIG_STRING)
+    {
+      setField(field, value.as<String>());
+    }
+    else if (field.type == CONFIG_BOOL)
+    {
+      setField(field, value.as<bool>() ? 1.0f : 0.0f);
+    }
+    else
+    {
+      setField(field, value.as<float>());
+    }
+  }
+
+  SS2K_LOG_TEXT(LOG_CAT_CONFIG, "Config File Loaded: " + String(configFILENAME));
+  return true;
+}
+
+// Prints the saved settings to the log, one line each. The log is readable by anyone on the
+// network (/events), so secret fields are masked.
+void userParameters::printFile()
+{
+  for (const ConfigField &field : configFields)
+  {
+    if (!(field.flags & CONFIG_PERSIST))
+    {
+      continue;
+    }
+    if (field.flags & CONFIG_SECRET)
+    {
+      SS2K_LOGI(LOG_CAT_MAIN, "Config %s: ***", field.name);
+      continue;
+    }
+    switch (field.type)
+    {
+    case CONFIG_INT:
+      SS2K_LOGI(LOG_CAT_MAIN, "Config %s: %d", field.name, this->*field.intMember);
+      break;
+    case CONFIG_FLOAT:
+      SS2K_LOGI(LOG_CAT_MAIN, "Config %s: %.2f", field.name, this->*field.floatMember);
+      break;
+    case CONFIG_BOOL:
+      SS2K_LOGI(LOG_CAT_MAIN, "Config %s: %s", field.name, (this->*field.boolMember) ? "true" : "false");
+      break;
+    case CONFIG_STRING:
+      //The text is formatted later, so a String that can change has to go in as text
+      SS2K_LOG_TEXT(LOG_CAT_MAIN, String("Config ") + field.name + ": " + (this->*field.stringMember));
+      break;
+    }
+  }
 }
 
 /*****************************************USERPWC*****************************************/
+// The PWC schema, walked like configFields by the defaults, the file, the JSON and the settings form.
+
+struct PWCField
+{
+    const char *name;
+    int     physicalWorkingCapacity::*intMember;
+    bool    physicalWorkingCapacity::*boolMember;
+    int         defaultValue;
+    int         minValue;
+    int         maxValue;
+    const char *formMarker;     //Checkbox only: the field its form always sends
+};
+
+static constexpr PWCField pwcFields[] = {
+    //  name            int member                                  bool member                         default  range       checkbox form
+    {"session1HR",  &physicalWorkingCapacity::session1HR,   nullptr,                            129,     0, 250,     nullptr}, //examples from https://www.cyclinganalytics.com/
+    {"session1Pwr", &physicalWorkingCapacity::session1Pwr,  nullptr,                            100,     0, 4000,    nullptr},
+    {"session2HR",  &physicalWorkingCapacity::session2HR,   nullptr,                            154,     0, 250,     nullptr},
+    {"session2Pwr", &physicalWorkingCapacity::session2Pwr,  nullptr,                            150,     0, 4000,    nullptr},
+    {"hr2Pwr",      nullptr,                                &physicalWorkingCapacity::hr2Pwr,   true,    0, 1,       "session2Pwr"},
+};
+
+static constexpr size_t PWC_FIELD_COUNT = sizeof(pwcFields) / sizeof(pwcFields[0]);
 
 void physicalWorkingCapacity::setDefaults() 
 {
-session1HR    = 129; //examples from https://www.cyclinganalytics.com/
-session1Pwr   = 100;
-session2HR    = 154; 
-session2Pwr   = 150;
-hr2Pwr        = true;
+  for (const PWCField &field : pwcFields)
+  {
+    if (field.intMember)
+    {
+      this->*field.intMember = field.defaultValue;
+    }
+    else
+    {
+      this->*field.boolMember = field.defaultValue;
+    }
+  }
 }
 
-//-- return all config as one a single JSON string
-String physicalWorkingCapacity::returnJSON()
+//-- sets the fields the settings form sent, returns true if anything changed
+bool physicalWorkingCapacity::applyForm(const ConfigFormReader &readArg)
 {
+  bool changed = false;
+  String value;
+  for (const PWCField &field : pwcFields)
+  {
+    if (field.boolMember)
+    {
+      //checkboxes don't report off, so use another parameter that's always present on that form
+      bool on = readArg(field.name, value) && !value.isEmpty();
+      if ((on || (readArg(field.formMarker, value) && !value.isEmpty())) && this->*field.boolMember != on)
+      {
+        this->*field.boolMember = on;
+        changed                 = true;
+      }
+    }
+    else if (readArg(field.name, value) && !value.isEmpty())
+    {
+      int newValue = constrain(value.toInt(), field.minValue, field.maxValue);
+      changed |= (this->*field.intMember != newValue);
+      this->*field.intMember = newValue;
+    }
+  }
+  return changed;
+}
 
-  StaticJsonDocument<500> doc;
-
-  doc["session1HR"]   = session1HR;
-  doc["session1Pwr"]  = session1Pwr;
-  doc["session2HR"]   = session2HR;
-  doc["session2Pwr"]  = session2Pwr;
-  doc["hr2Pwr"]       = hr2Pwr;
+//-- write all PWC fields straight to a JSON stream. The caller opens and closes the object.
+void physicalWorkingCapacity::writeJSON(JsonStreamWriter &writer)
+{
+  for (size_t i = 0; writeJSONField(writer, i); i++)
+  {
+  }
+}
 
-  String output;
-  serializeJson(doc, output);
-  return output;
+//-- writes the field with this index. False past the last one (a JsonFieldSource).
+bool physicalWorkingCapacity::writeJSONField(JsonStreamWriter &writer, size_t index)
+{
+  if (index >= PWC_FIELD_COUNT)
+  {
+    return false;
+  }
+  const PWCField &field = pwcFields[index];
+  if (field.intMember)
+  {
+    writer.field(field.name, this->*field.intMember);
+  }
+  else
+  {
+    writer.field(field.name, this->*field.boolMember);
+  }
+  return true;
 }
 
 //-- Saves all parameters to SPIFFS
@@ -268,27 +604,32 @@ void physicalWorkingCapacity::saveToSPIFFS()
   SPIFFS.remove(userPWCFILENAME);
 
   // Open file for writing
-  debugDirector("Writing File: " + String(userPWCFILENAME));
+  SS2K_LOG_TEXT(LOG_CAT_CONFIG, "Writing File: " + String(userPWCFILENAME));
   File file = SPIFFS.open(userPWCFILENAME, FILE_WRITE);
   if (!file)
   {
-    debugDirector(F("Failed to create file"));
+    SS2K_LOG_TEXT(LOG_CAT_CONFIG, F("Failed to create file"));
     return;
   }
 
   StaticJsonDocument<500> doc;
 
-  doc["session1HR"]   = session1HR;
-  doc["session1Pwr"]  = session1Pwr;
-  doc["session2HR"]   = session2HR;
-  doc["session2Pwr"]  = session2Pwr;
-  doc["hr2Pwr"]       = hr2Pwr;
-
+  for (const PWCField &field : pwcFields)
+  {
+    if (field.intMember)
+    {
+      doc[field.name] = this->*field.intMember;
+    }
+    else
+    {
+      doc[field.name] = this->*field.boolMember;
+    }
+  }
 
   // Serialize JSON to file
   if (serializeJson(doc, file) == 0)
   {
-    debugDirector(F("Failed to write to file"));
+    SS2K_LOG_TEXT(LOG_CAT_CONFIG, F("Failed to write to file"));
   }
   // Close the file
   file.close();
@@ -298,13 +639,13 @@ void physicalWorkingCapacity::saveToSPIFFS()
 void physicalWorkingCapacity::loadFromSPIFFS()
 {
   // Open file for reading
-  debugDirector("Reading File: " + String(userPWCFILENAME));
+  SS2K_LOG_TEXT(LOG_CAT_CONFIG, "Reading File: " + String(userPWCFILENAME));
   File file = SPIFFS.open(userPWCFILENAME);
 
   //load defaults if filename doesn't exist
   if (!file)
   {
-    debugDirector("Couldn't find configuration file. Loading Defaults");
+    SS2K_LOG_TEXT(LOG_CAT_CONFIG, "Couldn't find configuration file. Loading Defaults");
     setDefaults();
     return;
   }
@@ -315,43 +656,82 @@ void physicalWorkingCapacity::loadFromSPIFFS()
   DeserializationError error = deserializeJson(doc, file);
   if (error)
   {
-    debugDirector(F("Failed to read file, using default configuration"));
+    SS2K_LOG_TEXT(LOG_CAT_CONFIG, F("Failed to read file, using default configuration"));
     setDefaults();
     return;
   }
 
-  // Copy values from the JsonDocument to the Config
-  session1HR  = doc["session1HR"];
-  session1Pwr = doc["session1Pwr"];
-  session2HR  = doc["session2HR"];
-  session2Pwr = doc["session2Pwr"];
-  hr2Pwr      = doc["hr2Pwr"];
+  // Copy values from the JsonDocument to the Config. Missing fields get their defaults.
+  for (const PWCField &field : pwcFields)
+  {
+    if (field.intMember)
+    {
+      this->*field.intMember = constrain(doc[field.name] | field.defaultValue, field.minValue, field.maxValue);
+    }
+    else
+    {
+      this->*field.boolMember = doc[field.name] | (field.defaultValue != 0);
+    }
+  }
 
-  debugDirector("Config File Loaded: " + String(userPWCFILENAME));
+  SS2K_LOG_TEXT(LOG_CAT_CONFIG, "Config File Loaded: " + String(userPWCFILENAME));
   file.close();
 }
 
 // Prints the content of a file to the Serial
 void physicalWorkingCapacity::printFile()
 {
-  // Open file for reading
-  debugDirector("Contents of file: " + String(userPWCFILENAME));
-  File file = SPIFFS.open(userPWCFILENAME);
-  if (!file)
+  //One record per field, the log ring can't take the file a character at a time
+  for (const PWCField &field : pwcFields)
   {
-    debugDirector(F("Failed to read file"));
-    return;
+    if (field.intMember)
+    {
+      SS2K_LOGI(LOG_CAT_CONFIG, "PWC %s: %d", field.name, this->*field.intMember);
+    }
+    else
+    {
+      SS2K_LOGI(LOG_CAT_CONFIG, "PWC %s: %s", field.name, (this->*field.boolMember) ? "true" : "false");
+    }
   }
+}
 
-  // Extract each characters by one by one
-  while (file.available())
-  {
-    debugDirector(String(char(file.read())), false);
-  }
-  debugDirector(String(" "));
-  // Close the file
-  file.close();
+/*********************************Persistence*********************************/
+
+static portMUX_TYPE configDirtyMux = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t configDirty         = 0;
+static unsigned long configDirtyAt = 0;
+
+void configMarkDirty(uint8_t what)
+{
+  portENTER_CRITICAL(&configDirtyMux);
+  configDirty |= what;
+  configDirtyAt = millis();
+  portEXIT_CRITICAL(&configDirtyMux);
 }
 
+void configFlush()
+{
+  portENTER_CRITICAL(&configDirtyMux);
+  uint8_t dirty = configDirty;
+  configDirty   = 0;
+  portEXIT_CRITICAL(&configDirtyMux);
 
+  if (dirty & CONFIG_DIRTY_USER)
+  {
+    userConfig.saveToSPIFFS();
+  }
+  if (dirty & CONFIG_DIRTY_PWC)
+  {
+    userPWC.saveToSPIFFS();
+  }
+}
 
+// Called from the web task loop
+void configPersistUpdate()
+{
+  if (configDirty == 0 || (millis() - configDirtyAt) < CONFIG_SAVE_DELAY)
+  {
+    return;
+  }
+  configFlush();
+}
@@ -0,0 +1,549 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#include "Main.h"
+#include "Update_Agent.h"
+#include "Update_Delta.h"
+#include "Version_Converter.h"
+#include "HTTP_Assets.h"
+#include "WiFi_Manager.h"
+#include "cert.h"
+#include <HTTPClient.h>
+#include <WiFiClientSecure.h>
+#include <Update.h>
+#include <SPIFFS.h>
+#include <Preferences.h>
+
+UpdateAgent updateAgent;
+
+void UpdateAgent::begin()
+{
+  xTaskCreatePinnedToCore(
+      updateAgentTask,   /* Task function. */
+      "updateAgentTask", /* name of task. */
+      8000,              /* Stack size of task. TLS needs most of it */
+      NULL,              /* parameter of the task */
+      0,                 /* priority of the task. Below everything the ride needs */
+      &task,             /* Task handle to keep track of created task */
+      tskNO_AFFINITY);
+}
+
+// A firmware image arrived some other way (web upload). Restart once nobody's riding.
+void UpdateAgent::rebootWhenIdle()
+{
+  rebootPending = true;
+  if (task)
+  {
+    xTaskNotifyGive(task);
+  }
+}
+
+void UpdateAgent::waitForIdle()
+{
+  unsigned long idleSince = millis();
+  while ((millis() - idleSince) < UPDATE_IDLE_TIME)
+  {
+    if (radioScheduler.rideActive())
+    {
+      idleSince = millis();
+    }
+    vTaskDelay(1000 / portTICK_PERIOD_MS);
+  }
+}
+
+void UpdateAgent::reboot()
+{
+  SS2K_LOG_TEXT(LOG_CAT_HTTP, "Update installed. Rebooting", true, true);
+  configFlush();
+  vTaskDelay(500 / portTICK_PERIOD_MS); //Let the log drain
+  ESP.restart();
+}
+
+// The image hash comes from the same server, so only https with the pinned certificate can be trusted.
+// Plain http is for a local stand-in (tools/update_server.py) and needs FW_ALLOW_PLAIN_HTTP.
+static bool urlAllowed(const String &url)
+{
+  if (url.startsWith("http://") && !FW_ALLOW_PLAIN_HTTP)
+  {
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "Update: refusing plain http " + url);
+    return false;
+  }
+  return true;
+}
+
+static void beginRequest(HTTPClient &http, WiFiClientSecure &tls, WiFiClient &plain, const String &url)
+{
+  if (url.startsWith("http://"))
+  {
+    http.begin(plain, url);
+  }
+  else
+  {
+    tls.setCACert(rootCACertificate);
+    http.begin(tls, url);
+  }
+}
+
+bool UpdateAgent::fetchText(const String &url, String &text)
+{
+  if (!urlAllowed(url))
+  {
+    return false;
+  }
+  WiFiClientSecure tls;
+  WiFiClient plain;
+  HTTPClient http;
+  beginRequest(http, tls, plain, url);
+  int httpCode = http.GET();
+  if (httpCode == HTTP_CODE_OK)
+  {
+    text = http.getString();
+    text.trim();
+  }
+  http.end();
+  return httpCode == HTTP_CODE_OK;
+}
+
+// Fetches the SHA-256 published next to url. Only the hex digest is kept, so "sha256sum" output works too.
+bool UpdateAgent::fetchHash(const String &url, String &sha256)
+{
+  if (fetchText(url + FW_HASH_SUFFIX, sha256))
+  {
+    int space = sha256.indexOf(' ');
+    if (space > 0)
+    {
+      sha256 = sha256.substring(0, space);
+    }
+    if (sha256.length() == 64)
+    {
+      return true;
+    }
+  }
+  SS2K_LOG_TEXT(LOG_CAT_HTTP, "Update: no SHA-256 for " + url);
+  sha256 = "";
+  return false;
+}
+
+// Streams url into sink. start gets the total size once, before the first byte.
+// The transfer holds the radio as an OTA user, gives it back whenever a ride starts and picks up
+// where it stopped with a Range request. sha256 is the expected hex digest, nothing is downloaded without one.
+// With abortOnRide a ride ends the transfer instead of pausing it.
+// The caller finishes (or aborts) whatever sink wrote to.
+bool UpdateAgent::download(const String &url, const String &sha256, const UpdateStart &start, const UpdateSink &sink, bool abortOnRide)
+{
+  if (!urlAllowed(url))
+  {
+    return false;
+  }
+  if (sha256.length() != 64)
+  {
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "Update: refusing " + url + " without a SHA-256");
+    return false;
+  }
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  sha256Starts(&sha);
+
+  uint8_t buffer[UPDATE_CHUNK_SIZE];
+  size_t written = 0;
+  size_t total   = 0;
+  int failures   = 0;
+  bool begun     = false;
+
+  while (failures <= UPDATE_MAX_RESUMES && (!begun || written < total))
+  {
+    //Wait for the radio. Bulk transfers aren't granted during a ride.
+    while (!radioScheduler.acquire(RADIO_OTA, 1000))
+    {
+      if (abortOnRide)
+      {
+        mbedtls_sha256_free(&sha);
+        return false;
+      }
+      vTaskDelay(UPDATE_RESUME_DELAY / portTICK_PERIOD_MS);
+    }
+
+    WiFiClientSecure tls;
+    WiFiClient plain;
+    HTTPClient http;
+    beginRequest(http, tls, plain, url);
+    if (written)
+    {
+      http.addHeader("Range", "bytes=" + String(written) + "-");
+    }
+    int httpCode  = http.GET();
+    bool paused   = false;
+    size_t skip   = 0;
+    if (httpCode == HTTP_CODE_OK || httpCode == HTTP_CODE_PARTIAL_CONTENT)
+    {
+      if (!begun)
+      {
+        total = http.getSize();
+        if ((int)total <= 0 || !start(total))
+        {
+          SS2K_LOG_TEXT(LOG_CAT_HTTP, "Update: can't start " + url + " size " + String((int)total));
+          http.end();
+          radioScheduler.release(RADIO_OTA);
+          mbedtls_sha256_free(&sha);
+          return false;
+        }
+        begun = true;
+      }
+      else if (httpCode == HTTP_CODE_OK)
+      {
+        skip = written; //Server ignored the Range header, throw away what we already have
+      }
+
+      WiFiClient *stream     = http.getStreamPtr();
+      unsigned long lastData = millis();
+      while (written < total)
+      {
+        if (radioScheduler.rideActive())
+        {
+          if (abortOnRide)
+          {
+            SS2K_LOGW(LOG_CAT_HTTP, "Update abandoned at %u of %u bytes, a ride started", (unsigned)written, (unsigned)total);
+            written = total + 1; //Not resumable
+            break;
+          }
+          SS2K_LOGI(LOG_CAT_HTTP, "Update paused at %u of %u bytes", (unsigned)written, (unsigned)total);
+          paused = true;
+          break;
+        }
+        size_t available = stream->available();
+        if (available == 0)
+        {
+          if (!http.connected() || (millis() - lastData) > UPDATE_STREAM_TIMEOUT)
+          {
+            break;
+          }
+          vTaskDelay(10 / portTICK_PERIOD_MS);
+          continue;
+        }
+        size_t length = stream->readBytes(buffer, min(available, sizeof(buffer)));
+        lastData      = millis();
+        if (skip)
+        {
+          size_t skipped = min(skip, length);
+          skip -= skipped;
+          memmove(buffer, buffer + skipped, length - skipped);
+          length -= skipped;
+        }
+        if (length == 0)
+        {
+          continue;
+        }
+        if (!sink(buffer, length))
+        {
+          SS2K_LOG_TEXT(LOG_CAT_HTTP, "Update: writing " + url + " failed");
+          written = total + 1; //Not resumable
+          break;
+        }
+        sha256Update(&sha, buffer, length);
+        written += length;
+      }
+    }
+    else
+    {
+      SS2K_LOG_TEXT(LOG_CAT_HTTP, "Update: error downloading " + url + " " + String(httpCode));
+    }
+    http.end();
+    radioScheduler.release(RADIO_OTA);
+
+    if (written > total)
+    {
+      break;
+    }
+    if (written < total && !paused)
+    {
+      failures++;
+      SS2K_LOGW(LOG_CAT_HTTP, "Update transfer dropped at %u bytes, try %d", (unsigned)written, failures);
+      vTaskDelay(UPDATE_RESUME_DELAY / portTICK_PERIOD_MS);
+    }
+  }
+
+  uint8_t digest[32];
+  sha256Finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+  if (!begun || written != total)
+  {
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "Update of " + url + " failed");
+    return false;
+  }
+
+  char hex[65];
+  for (int i = 0; i < 32; i++)
+  {
+    sprintf(hex + i * 2, "%02x", digest[i]);
+  }
+  if (!sha256.equalsIgnoreCase(hex))
+  {
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "Update: SHA-256 mismatch for " + url + " got " + String(hex));
+    return false;
+  }
+  SS2K_LOG_TEXT(LOG_CAT_HTTP, "Update: " + url + " verified, " + String(total) + " bytes");
+  return true;
+}
+
+// Streams a whole image into the Update partition selected by command (U_FLASH or U_SPIFFS).
+// sha256 comes from fetchHash().
+bool UpdateAgent::installImage(const String &url, const String &sha256, int command, bool abortOnRide)
+{
+  bool ok = download(
+      url, sha256, [command](size_t total) { return Update.begin(total, command); },
+      [](const uint8_t *data, size_t length) { return Update.write((uint8_t *)data, length) == length; }, abortOnRide);
+  if (!ok || !Update.end())
+  {
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "Update: " + String(Update.errorString()));
+    Update.abort();
+    return false;
+  }
+  return true;
+}
+
+// Tries a delta patch against the running firmware first, it's a fraction of the size
+bool UpdateAgent::installFirmware(const String &base)
+{
+  String deltaURL = base + "firmware-" + FIRMWARE_VERSION + FW_DELTA_SUFFIX;
+  String sha256;
+  if (fetchHash(deltaURL, sha256))
+  {
+    DeltaPatch patch;
+    bool ok = download(
+        deltaURL, sha256, [](size_t total) { return true; },
+        [&patch](const uint8_t *data, size_t length) { return patch.write(data, length); });
+    if (ok && patch.end())
+    {
+      return true;
+    }
+    patch.abort();
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "Delta update failed, downloading the full image");
+  }
+  String imageURL = base + String(FW_BINFILE);
+  if (!fetchHash(imageURL, sha256))
+  {
+    return false;
+  }
+  return installImage(imageURL, sha256, U_FLASH);
+}
+
+// Brings the web files in line with the server's manifest one file at a time. Files whose hash
+// didn't change aren't touched, and the filesystem stays mounted, so this works during a ride.
+// Returns false if the server has no manifest. complete is false while files are still missing.
+bool UpdateAgent::syncFiles(const String &base, bool &complete)
+{
+  String remote;
+  if (!fetchText(base + FW_DATA_DIR + WEB_ASSET_MANIFEST, remote))
+  {
+    return false;
+  }
+  //Lines are searched with the newline in front so "/a.html" doesn't match "/b/a.html"
+  String local = "\n";
+  File manifest = SPIFFS.open(WEB_ASSET_MANIFEST, FILE_READ);
+  if (manifest)
+  {
+    local += manifest.readString();
+    manifest.close();
+  }
+  remote = "\n" + remote + "\n";
+
+  int updated = 0;
+  complete    = true;
+  for (int start = 1, end; (end = remote.indexOf('\n', start)) >= 0; start = end + 1)
+  {
+    //"<path> <etag> <gzipped> <sha256 of the stored file>"
+    String line = remote.substring(start, end);
+    line.trim();
+    int first  = line.indexOf(' ');
+    int second = line.indexOf(' ', first + 1);
+    int third  = line.indexOf(' ', second + 1);
+    if (first < 1 || second < 0 || third < 0)
+    {
+      continue;
+    }
+    String path   = line.substring(0, first);
+    String stored = path + (line.substring(second + 1, third).toInt() == 1 ? ".gz" : "");
+    if (local.indexOf("\n" + line.substring(0, third)) >= 0 && SPIFFS.exists(stored))
+    {
+      continue;
+    }
+    File file;
+    bool done = download(
+        base + FW_DATA_DIR + stored, line.substring(third + 1),
+        [&file](size_t total) { return (bool)(file = SPIFFS.open(FW_TEMP_FILE, FILE_WRITE)); },
+        [&file](const uint8_t *data, size_t length) { return file.write(data, length) == length; });
+    if (file)
+    {
+      file.close();
+    }
+    if (!done)
+    {
+      SPIFFS.remove(FW_TEMP_FILE);
+      complete = false;
+      continue;
+    }
+    //The old copy may have been stored the other way (plain or gzipped)
+    webAssets.invalidate(path);
+    SPIFFS.remove(path);
+    SPIFFS.remove(path + ".gz");
+    SPIFFS.rename(FW_TEMP_FILE, stored);
+    updated++;
+  }
+  if (!complete)
+  {
+    //Keep the old manifest, the next check retries what's missing
+    return true;
+  }
+
+  //Files the server doesn't list anymore
+  for (int start = 1, end; (end = local.indexOf('\n', start)) >= 0; start = end + 1)
+  {
+    int first = local.indexOf(' ', start);
+    if (first < 0 || first > end)
+    {
+      continue;
+    }
+    String path = local.substring(start, first);
+    if (remote.indexOf("\n" + path + " ") < 0)
+    {
+      webAssets.invalidate(path);
+      SPIFFS.remove(path);
+      SPIFFS.remove(path + ".gz");
+    }
+  }
+
+  File newManifest = SPIFFS.open(FW_TEMP_FILE, FILE_WRITE);
+  if (newManifest)
+  {
+    remote.trim();
+    newManifest.print(remote + "\n");
+    newManifest.close();
+    SPIFFS.remove(WEB_ASSET_MANIFEST);
+    SPIFFS.rename(FW_TEMP_FILE, WEB_ASSET_MANIFEST);
+  }
+  webAssets.begin();
+  SS2K_LOG_TEXT(LOG_CAT_HTTP, "Web files updated: " + String(updated));
+  return true;
+}
+
+// Per file if the server has a manifest. Otherwise the filesystem image overwrites the live SPIFFS
+// partition, so it's only written with nobody riding and the config (in RAM) is written back right after.
+// SPIFFS is unmounted while the image is written. If a ride starts anyway the image is abandoned and
+// the filesystem mounted again (formatted if it was half written), then it's tried again once idle.
+bool UpdateAgent::updateFilesystem()
+{
+  String base   = userConfig.getFirmwareUpdateURL();
+  bool complete = false;
+  if (syncFiles(base, complete))
+  {
+    return complete;
+  }
+  for (;;)
+  {
+    waitForIdle();
+    //Without a hash the image isn't installed, so the filesystem stays mounted
+    String imageURL = base + String(FW_SPIFFSFILE);
+    String sha256;
+    if (!fetchHash(imageURL, sha256))
+    {
+      return false;
+    }
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "Updating FileSystem");
+    SPIFFS.end();
+    bool ok = installImage(imageURL, sha256, U_SPIFFS, true);
+    SPIFFS.begin(true);
+    //The new filesystem image doesn't have our files anymore
+    userConfig.saveToSPIFFS(true);
+    userPWC.saveToSPIFFS();
+    webAssets.begin();
+    if (ok || !radioScheduler.rideActive())
+    {
+      return ok;
+    }
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "Filesystem update interrupted by a ride, retrying later");
+  }
+}
+
+// Returns true when a new firmware is installed and waiting for a reboot
+bool UpdateAgent::checkForUpdate()
+{
+  String base = userConfig.getFirmwareUpdateURL();
+  String payload;
+  SS2K_LOG_TEXT(LOG_CAT_HTTP, "Checking for newer firmware:");
+  if (!fetchText(base + String(FW_VERSIONFILE), payload))
+  {
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "error downloading " + String(FW_VERSIONFILE));
+    internetConnection = false;
+    return false;
+  }
+  internetConnection = true;
+  SS2K_LOG_TEXT(LOG_CAT_HTTP, "  -Server Ver " + payload);
+
+  Preferences prefs;
+  prefs.begin("update", false);
+  bool filesystemPending = prefs.getBool("fsPending", false);
+  bool updateAnyway      = false;
+  if (!webAssets.exists("/index.html"))
+  {
+    updateAnyway = true;
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "  -index.html not found. Forcing update");
+  }
+  Version availiableVer(payload.c_str());
+  Version currentVer(FIRMWARE_VERSION);
+
+  bool installed = false;
+  if ((availiableVer > currentVer) || updateAnyway)
+  {
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "New firmware detected!");
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "Upgrading from " + String(FIRMWARE_VERSION) + " to " + payload);
+    installed = installFirmware(base);
+    if (installed)
+    {
+      //If we lose power before the filesystem is written, the new firmware finishes the job
+      filesystemPending = true;
+      prefs.putBool("fsPending", true);
+    }
+  }
+  else
+  {
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "  -Current ver " + String(FIRMWARE_VERSION));
+  }
+
+  if (filesystemPending && updateFilesystem())
+  {
+    prefs.putBool("fsPending", false);
+  }
+  prefs.end();
+  return installed;
+}
+
+void UpdateAgent::run()
+{
+  if (userConfig.getautoUpdate() && wifiManager.waitConnected(WIFI_CONNECT_TIMEOUT * 1000UL))
+  {
+    updating = true;
+    if (checkForUpdate())
+    {
+      rebootPending = true;
+    }
+    updating = false;
+  }
+  for (;;)
+  {
+    if (rebootPending)
+    {
+      waitForIdle();
+      reboot();
+    }
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  }
+}
+
+void updateAgentTask(void *pvParameters)
+{
+  updateAgent.run();
+}
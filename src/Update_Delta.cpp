@@ -0,0 +1,301 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#include "Main.h"
+#include "Update_Delta.h"
+
+#include <Update.h>
+#include <esp_ota_ops.h>
+#if __has_include("esp32/rom/miniz.h")
+#include "esp32/rom/miniz.h"
+#else
+#include "rom/miniz.h"
+#endif
+
+bool DeltaPatch::fail(const char *reason)
+{
+  SS2K_LOGE(LOG_CAT_HTTP, "Delta update: %s", reason);
+  state = DELTA_FAILED;
+  return false;
+}
+
+// The patch only fits the exact image it was made from
+bool DeltaPatch::checkSource()
+{
+  source = esp_ota_get_running_partition();
+  if (source == nullptr || header.sourceSize > source->size)
+  {
+    return fail("patch is for a bigger image");
+  }
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  sha256Starts(&sha);
+  uint8_t buffer[256];
+  for (uint32_t offset = 0; offset < header.sourceSize; offset += sizeof(buffer))
+  {
+    size_t length = min((size_t)(header.sourceSize - offset), sizeof(buffer));
+    esp_partition_read(source, offset, buffer, length);
+    sha256Update(&sha, buffer, length);
+  }
+  uint8_t digest[32];
+  sha256Finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+  if (memcmp(digest, header.sourceSHA256, sizeof(digest)) != 0)
+  {
+    return fail("patch was made for a different firmware");
+  }
+  return true;
+}
+
+bool DeltaPatch::start()
+{
+  if (memcmp(header.magic, DELTA_MAGIC, sizeof(header.magic)) != 0 || header.version != DELTA_VERSION)
+  {
+    return fail("not a delta patch");
+  }
+  if (!checkSource())
+  {
+    return false;
+  }
+  mbedtls_sha256_init(&targetHash);
+  sha256Starts(&targetHash);
+  hashing = true;
+  //Only needed while a patch is applied, so they come from the heap
+  inflator   = (tinfl_decompressor *)malloc(sizeof(tinfl_decompressor));
+  dictionary = (uint8_t *)malloc(TINFL_LZ_DICT_SIZE);
+  if (inflator == nullptr || dictionary == nullptr)
+  {
+    release();
+    return fail("not enough memory");
+  }
+  tinfl_init(inflator);
+  dictOffset = 0;
+  if (!Update.begin(header.targetSize, U_FLASH))
+  {
+    release();
+    return fail(Update.errorString());
+  }
+  state = DELTA_OP;
+  SS2K_LOGI(LOG_CAT_HTTP, "Delta update: rebuilding %u bytes", (unsigned)header.targetSize);
+  return true;
+}
+
+// Feeds downloaded patch bytes in
+bool DeltaPatch::write(const uint8_t *data, size_t length)
+{
+  if (state == DELTA_FAILED)
+  {
+    return false;
+  }
+  if (state == DELTA_HEADER)
+  {
+    size_t copied = min(length, sizeof(header) - headerBytes);
+    memcpy((uint8_t *)&header + headerBytes, data, copied);
+    headerBytes += copied;
+    data += copied;
+    length -= copied;
+    if (headerBytes < sizeof(header) || !start())
+    {
+      return state != DELTA_FAILED;
+    }
+  }
+  return length == 0 || inflate(data, length);
+}
+
+// The dictionary doubles as the output buffer, so whatever comes out is applied before it wraps
+bool DeltaPatch::inflate(const uint8_t *data, size_t length)
+{
+  for (;;)
+  {
+    size_t inSize  = length;
+    size_t outSize = TINFL_LZ_DICT_SIZE - dictOffset;
+    tinfl_status status = tinfl_decompress(inflator, data, &inSize, dictionary, dictionary + dictOffset, &outSize,
+                                           TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+    data += inSize;
+    length -= inSize;
+    if (outSize && !apply(dictionary + dictOffset, outSize))
+    {
+      return false;
+    }
+    dictOffset = (dictOffset + outSize) & (TINFL_LZ_DICT_SIZE - 1);
+    if (status < TINFL_STATUS_DONE)
+    {
+      return fail("corrupt patch stream");
+    }
+    if (status == TINFL_STATUS_DONE)
+    {
+      return state == DELTA_DONE || fail("patch stream ended early");
+    }
+    if (length == 0 && status == TINFL_STATUS_NEEDS_MORE_INPUT)
+    {
+      return true;
+    }
+  }
+}
+
+bool DeltaPatch::output(uint8_t *data, size_t length)
+{
+  if (Update.write(data, length) != length)
+  {
+    return fail(Update.errorString());
+  }
+  sha256Update(&targetHash, data, length);
+  written += length;
+  return true;
+}
+
+// Runs the ops in the inflated stream
+bool DeltaPatch::apply(uint8_t *data, size_t length)
+{
+  while (length)
+  {
+    switch (state)
+    {
+    case DELTA_OP:
+      op = *data++;
+      length--;
+      if (op == DELTA_OP_END)
+      {
+        state = DELTA_DONE;
+      }
+      else if (op == DELTA_OP_ADD || op == DELTA_OP_INSERT)
+      {
+        argBytes = 0;
+        state    = DELTA_ARGS;
+      }
+      else
+      {
+        return fail("unknown op");
+      }
+      break;
+
+    case DELTA_ARGS:
+    {
+      size_t needed = (op == DELTA_OP_ADD) ? 8 : 4;
+      size_t copied = min(length, needed - argBytes);
+      memcpy(args + argBytes, data, copied);
+      argBytes += copied;
+      data += copied;
+      length -= copied;
+      if (argBytes < needed)
+      {
+        break;
+      }
+      if (op == DELTA_OP_ADD)
+      {
+        memcpy(&sourceOffset, args, 4);
+        memcpy(&remaining, args + 4, 4);
+        if (sourceOffset > header.sourceSize || remaining > header.sourceSize - sourceOffset)
+        {
+          return fail("op reads past the source");
+        }
+      }
+      else
+      {
+        memcpy(&remaining, args, 4);
+      }
+      if (remaining > header.targetSize - written)
+      {
+        return fail("op writes past the target");
+      }
+      state = remaining ? DELTA_DATA : DELTA_OP;
+      break;
+    }
+
+    case DELTA_DATA:
+    {
+      size_t count = min(length, (size_t)remaining);
+      if (op == DELTA_OP_INSERT)
+      {
+        if (!output(data, count))
+        {
+          return false;
+        }
+      }
+      else
+      {
+        uint8_t buffer[256];
+        for (size_t done = 0; done < count;)
+        {
+          size_t chunk = min(count - done, sizeof(buffer));
+          esp_partition_read(source, sourceOffset, buffer, chunk);
+          for (size_t i = 0; i < chunk; i++)
+          {
+            buffer[i] += data[done + i];
+          }
+          if (!output(buffer, chunk))
+          {
+            return false;
+          }
+          sourceOffset += chunk;
+          done += chunk;
+        }
+      }
+      data += count;
+      length -= count;
+      remaining -= count;
+      if (remaining == 0)
+      {
+        state = DELTA_OP;
+      }
+      break;
+    }
+
+    case DELTA_DONE:
+      return fail("data after the end of the patch");
+
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+// Checks the rebuilt image and makes it the next boot partition
+bool DeltaPatch::end()
+{
+  if (state != DELTA_DONE)
+  {
+    abort();
+    return fail("patch incomplete");
+  }
+  uint8_t digest[32];
+  sha256Finish(&targetHash, digest);
+  if (written != header.targetSize || memcmp(digest, header.targetSHA256, sizeof(digest)) != 0)
+  {
+    abort();
+    return fail("rebuilt image doesn't match");
+  }
+  release();
+  if (!Update.end())
+  {
+    return fail(Update.errorString());
+  }
+  return true;
+}
+
+void DeltaPatch::abort()
+{
+  if (Update.isRunning())
+  {
+    Update.abort();
+  }
+  release();
+}
+
+void DeltaPatch::release()
+{
+  if (hashing)
+  {
+    mbedtls_sha256_free(&targetHash);
+    hashing = false;
+  }
+  free(inflator);
+  free(dictionary);
+  inflator   = nullptr;
+  dictionary = nullptr;
+}
@@ -0,0 +1,288 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#include "Main.h"
+#include "WiFi_Manager.h"
+
+#include <ESPmDNS.h>
+#include <DNSServer.h>
+#include <Preferences.h>
+
+//The WiFi event names changed with arduino-esp32 2.0
+#if defined(ESP_ARDUINO_VERSION_MAJOR) && ESP_ARDUINO_VERSION_MAJOR >= 2
+#define WIFI_EVENT_STA_GOT_IP       ARDUINO_EVENT_WIFI_STA_GOT_IP
+#define WIFI_EVENT_STA_LOST         ARDUINO_EVENT_WIFI_STA_DISCONNECTED
+#else
+#define WIFI_EVENT_STA_GOT_IP       SYSTEM_EVENT_STA_GOT_IP
+#define WIFI_EVENT_STA_LOST         SYSTEM_EVENT_STA_DISCONNECTED
+#endif
+
+WiFiManager wifiManager;
+
+// DNS server
+const byte DNS_PORT = 53;
+DNSServer dnsServer;
+
+static void wifiEventHandler(WiFiEvent_t event, WiFiEventInfo_t info)
+{
+  wifiManager.onEvent(event);
+}
+
+// Runs in the WiFi event task. Only records the event and wakes the manager task.
+void WiFiManager::onEvent(WiFiEvent_t event)
+{
+  uint8_t flag = (event == WIFI_EVENT_STA_GOT_IP) ? WIFI_EVENT_FLAG_GOT_IP : (event == WIFI_EVENT_STA_LOST) ? WIFI_EVENT_FLAG_DISCONNECTED : 0;
+  if (flag == 0)
+  {
+    return;
+  }
+  portENTER_CRITICAL(&eventMux);
+  pendingEvents |= flag;
+  portEXIT_CRITICAL(&eventMux);
+  if (task)
+  {
+    xTaskNotifyGive(task);
+  }
+}
+
+void WiFiManager::begin()
+{
+  WiFi.persistent(false);     //We keep our own credentials, don't wear the flash on every begin()
+  WiFi.setAutoReconnect(false); //Retries are ours, with backoff
+  WiFi.onEvent(wifiEventHandler);
+
+  if (String(userConfig.getSsid()) == DEVICE_NAME)
+  {
+    //Nothing configured yet, only offer the setup AP
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "No WiFi network configured. Starting AP mode");
+    WiFi.mode(WIFI_AP);
+    currentState = WIFI_STATE_AP_ONLY;
+    startAP();
+  }
+  else
+  {
+    WiFi.mode(WIFI_STA);
+    currentState = WIFI_STATE_CONNECTING;
+    useCache     = loadCache();
+    connect();
+  }
+  WiFi.setTxPower(WIFI_POWER_19_5dBm);
+
+  xTaskCreatePinnedToCore(
+      wifiManagerTask,   /* Task function. */
+      "wifiManagerTask", /* name of task. */
+      3000,              /* Stack size of task */
+      NULL,              /* parameter of the task */
+      1,                 /* priority of the task */
+      &task,             /* Task handle to keep track of created task */
+      tskNO_AFFINITY);
+}
+
+void WiFiManager::connect()
+{
+  SS2K_LOG_TEXT(LOG_CAT_HTTP, "Connecting to: " + String(userConfig.getSsid()));
+  if (useCache)
+  {
+    WiFi.begin(userConfig.getSsid(), userConfig.getPassword(), cachedChannel, cachedBSSID);
+  }
+  else
+  {
+    WiFi.begin(userConfig.getSsid(), userConfig.getPassword());
+  }
+  attemptRunning = true;
+  attemptStarted = millis();
+}
+
+// The attempt didn't get an IP. Bring up the setup AP so the unit stays reachable and try again later.
+void WiFiManager::attemptFailed()
+{
+  attemptRunning = false;
+  useCache       = false; //The cached BSSID may be stale (new router, mesh node moved). Scan next time.
+  WiFi.disconnect();
+  if (!apUp)
+  {
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "Couldn't Connect. Starting AP mode while retrying");
+    WiFi.mode(WIFI_AP_STA);
+    startAP();
+  }
+  retryAt    = millis() + retryDelay;
+  retryDelay = min(retryDelay * 2, (unsigned long)WIFI_RETRY_MAX);
+  SS2K_LOGI(LOG_CAT_HTTP, "WiFi retry in %u ms", (unsigned)(retryAt - millis()));
+}
+
+void WiFiManager::connected()
+{
+  attemptRunning     = false;
+  currentState       = WIFI_STATE_CONNECTED;
+  retryDelay         = WIFI_RETRY_MIN;
+  internetConnection = true;
+  saveCache();
+
+  //Keep the AP while someone's still on it, they'd lose the page they're looking at
+  if (apUp && WiFi.softAPgetStationNum() == 0)
+  {
+    stopAP();
+    WiFi.mode(WIFI_STA);
+  }
+  if (!timeConfigured)
+  {
+    configTime(0, 0, "pool.ntp.org"); // get UTC time via NTP. SNTP keeps it synced after this.
+    timeConfigured = true;
+  }
+  restartMDNS();
+  SS2K_LOG_TEXT(LOG_CAT_HTTP, "Connected to " + String(userConfig.getSsid()) + " IP address: " + WiFi.localIP().toString(), true, true);
+  SS2K_LOG_TEXT(LOG_CAT_HTTP, String("Open http://") + userConfig.getDeviceName() + ".local/");
+}
+
+void WiFiManager::startAP()
+{
+  //The setup AP always uses the default password, so a mistyped network password can't lock anyone out
+  WiFi.softAP(userConfig.getDeviceName(), DEFAULT_PASSWORD);
+  vTaskDelay(50 / portTICK_PERIOD_MS);
+  apUp = true;
+  /* Setup the DNS server redirecting all the domains to the apIP */
+  dnsServer.setErrorReplyCode(DNSReplyCode::NoError);
+  dnsServer.start(DNS_PORT, "*", WiFi.softAPIP());
+  restartMDNS();
+  SS2K_LOG_TEXT(LOG_CAT_HTTP, "AP started. IP address: " + WiFi.softAPIP().toString());
+}
+
+void WiFiManager::stopAP()
+{
+  dnsServer.stop();
+  WiFi.softAPdisconnect(true);
+  apUp = false;
+  SS2K_LOG_TEXT(LOG_CAT_HTTP, "AP stopped");
+}
+
+void WiFiManager::restartMDNS()
+{
+  MDNS.end();
+  if (!MDNS.begin(userConfig.getDeviceName()))
+  {
+    SS2K_LOG_TEXT(LOG_CAT_HTTP, "Error setting up MDNS responder!");
+    return;
+  }
+  MDNS.addService("http", "_tcp", 80);
+}
+
+IPAddress WiFiManager::ip()
+{
+  return staConnected() ? WiFi.localIP() : WiFi.softAPIP();
+}
+
+bool WiFiManager::waitConnected(unsigned long timeoutMs)
+{
+  unsigned long started = millis();
+  while (!staConnected())
+  {
+    if (currentState == WIFI_STATE_AP_ONLY || (millis() - started) > timeoutMs)
+    {
+      return false;
+    }
+    vTaskDelay(100 / portTICK_PERIOD_MS);
+  }
+  return true;
+}
+
+// Only trust the cache if it was made for the network we're configured for now
+bool WiFiManager::loadCache()
+{
+  Preferences prefs;
+  prefs.begin("wifi", true);
+  bool valid = (prefs.getString("ssid") == userConfig.getSsid()) &&
+               (prefs.getBytes("bssid", cachedBSSID, sizeof(cachedBSSID)) == sizeof(cachedBSSID));
+  cachedChannel = prefs.getInt("channel", 0);
+  prefs.end();
+  return valid && cachedChannel > 0;
+}
+
+void WiFiManager::saveCache()
+{
+  uint8_t *bssid  = WiFi.BSSID();
+  int32_t channel = WiFi.channel();
+  if (bssid == nullptr || (channel == cachedChannel && memcmp(bssid, cachedBSSID, sizeof(cachedBSSID)) == 0))
+  {
+    return;
+  }
+  memcpy(cachedBSSID, bssid, sizeof(cachedBSSID));
+  cachedChannel = channel;
+  Preferences prefs;
+  prefs.begin("wifi", false);
+  prefs.putString("ssid", userConfig.getSsid());
+  prefs.putBytes("bssid", cachedBSSID, sizeof(cachedBSSID));
+  prefs.putInt("channel", cachedChannel);
+  prefs.end();
+  SS2K_LOGD(LOG_CAT_HTTP, "Cached WiFi channel %d", (int)cachedChannel);
+}
+
+void WiFiManager::update()
+{
+  portENTER_CRITICAL(&eventMux);
+  uint8_t events = pendingEvents;
+  pendingEvents  = 0;
+  portEXIT_CRITICAL(&eventMux);
+
+  if (currentState == WIFI_STATE_AP_ONLY)
+  {
+    return;
+  }
+  if (events & WIFI_EVENT_FLAG_GOT_IP)
+  {
+    connected();
+  }
+  else if (events & WIFI_EVENT_FLAG_DISCONNECTED)
+  {
+    if (currentState == WIFI_STATE_CONNECTED)
+    {
+      //Lost a working connection (router reboot, out of range). Try again right away.
+      SS2K_LOG_TEXT(LOG_CAT_HTTP, "WiFi connection lost");
+      currentState       = WIFI_STATE_CONNECTING;
+      internetConnection = false;
+      connect();
+    }
+    else if (attemptRunning)
+    {
+      attemptFailed();
+    }
+  }
+
+  //connected() keeps the AP for whoever is still on it. Drop it once they've left.
+  if (currentState == WIFI_STATE_CONNECTED && apUp && WiFi.softAPgetStationNum() == 0)
+  {
+    stopAP();
+    WiFi.mode(WIFI_STA);
+    restartMDNS();
+  }
+
+  if (currentState != WIFI_STATE_CONNECTING)
+  {
+    return;
+  }
+  if (attemptRunning && (millis() - attemptStarted) > WIFI_CONNECT_TIMEOUT * 1000UL)
+  {
+    attemptFailed();
+  }
+  else if (!attemptRunning && (long)(millis() - retryAt) >= 0)
+  {
+    connect();
+  }
+}
+
+void wifiManagerTask(void *pvParameters)
+{
+  for (;;)
+  {
+    wifiManager.update();
+    if (wifiManager.apActive())
+    {
+      dnsServer.processNextRequest();
+    }
+    //Events wake us up early. Poll fast only while the captive portal DNS has to answer.
+    ulTaskNotifyTake(pdTRUE, (wifiManager.apActive() ? WEBSERVER_DELAY : WIFI_MANAGER_DELAY) / portTICK_PERIOD_MS);
+  }
+}
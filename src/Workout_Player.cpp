@@ -0,0 +1,204 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+#include "Main.h"
+#include "Workout_Player.h"
+
+#include <SPIFFS.h>
+
+static_assert(sizeof(WorkoutHeader) == 32, "WorkoutHeader is part of the file format");
+static_assert(sizeof(WorkoutStep) == 8, "WorkoutStep is part of the file format");
+
+WorkoutPlayer workoutPlayer;
+
+WorkoutStartResult WorkoutPlayer::load(const String &path)
+{
+  File file = SPIFFS.open(path, FILE_READ);
+  if (!file)
+  {
+    SS2K_LOG_TEXT(LOG_CAT_MAIN, "Workout " + path + " not found");
+    return WORKOUT_NOT_FOUND;
+  }
+  WorkoutHeader header;
+  bool ok = file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) && header.magic == WORKOUT_MAGIC &&
+            header.version == WORKOUT_VERSION && header.stepCount > 0 && header.stepCount <= WORKOUT_MAX_STEPS &&
+            file.read((uint8_t *)steps, header.stepCount * sizeof(WorkoutStep)) == header.stepCount * sizeof(WorkoutStep);
+  file.close();
+  if (!ok)
+  {
+    SS2K_LOG_TEXT(LOG_CAT_MAIN, "Workout " + path + " is not a valid workout file");
+    return WORKOUT_INVALID;
+  }
+  stepCount = header.stepCount;
+  memcpy(name, header.name, sizeof(header.name));
+  name[sizeof(header.name)] = 0;
+  return WORKOUT_STARTED;
+}
+
+WorkoutStartResult WorkoutPlayer::start(const String &workoutName)
+{
+  stop();
+  if (!spinBLEClient.connectedPM)
+  {
+    SS2K_LOGW(LOG_CAT_MAIN, "Workout not started, no power meter connected");
+    return WORKOUT_NO_POWER_METER;
+  }
+  WorkoutStartResult loaded = load(WORKOUT_PATH_PREFIX + workoutName + WORKOUT_FILE_SUFFIX);
+  if (loaded != WORKOUT_STARTED)
+  {
+    return loaded;
+  }
+  if (timer == nullptr)
+  {
+    esp_timer_create_args_t args = {};
+    args.callback                = workoutTick;
+    args.name                    = "workout";
+    if (esp_timer_create(&args, &timer) != ESP_OK)
+    {
+      SS2K_LOGE(LOG_CAT_MAIN, "Workout timer couldn't be created");
+      timer = nullptr;
+      return WORKOUT_NO_TIMER;
+    }
+  }
+  portENTER_CRITICAL(&playerMux);
+  stepIndex     = 0;
+  stepStartedAt = esp_timer_get_time();
+  lastERGAt     = 0;
+  skipPending   = false;
+  offsetSteps   = 0;
+  active        = true;
+  portEXIT_CRITICAL(&playerMux);
+  esp_timer_start_periodic(timer, WORKOUT_TICK_INTERVAL * 1000);
+  SS2K_LOGI(LOG_CAT_MAIN, "Workout %s started, %d steps", name, (int)stepCount);
+  return WORKOUT_STARTED;
+}
+
+void WorkoutPlayer::stop()
+{
+  portENTER_CRITICAL(&playerMux);
+  bool wasActive = active;
+  active         = false;
+  portEXIT_CRITICAL(&playerMux);
+  if (!wasActive)
+  {
+    return;
+  }
+  esp_timer_stop(timer);
+  userConfig.setERGMode(false);
+  SS2K_LOGI(LOG_CAT_MAIN, "Workout %s stopped at step %d", name, (int)stepIndex + 1);
+}
+
+// Times are taken from esp_timer_get_time() rather than counted in ticks, so a late tick doesn't
+// stretch the workout.
+void WorkoutPlayer::tick()
+{
+  int64_t now      = esp_timer_get_time();
+  bool stepChanged = false;
+  bool finished    = false;
+  bool freeRide    = false;
+  int watts        = 0;
+
+  portENTER_CRITICAL(&playerMux);
+  if (!active)
+  {
+    portEXIT_CRITICAL(&playerMux);
+    return;
+  }
+  if (skipPending)
+  {
+    skipPending   = false;
+    stepStartedAt = now - steps[stepIndex].duration * 1000000LL;
+  }
+  while (stepIndex < stepCount && now - stepStartedAt >= steps[stepIndex].duration * 1000000LL)
+  {
+    stepStartedAt += steps[stepIndex].duration * 1000000LL;
+    stepIndex++;
+    stepChanged = true;
+  }
+  if (stepIndex >= stepCount)
+  {
+    finished = true;
+  }
+  else
+  {
+    const WorkoutStep &step = steps[stepIndex];
+    freeRide                = (step.flags & WORKOUT_STEP_FREE) || !spinBLEClient.connectedPM; //No ERG on 0 W
+    int64_t elapsed         = now - stepStartedAt;
+    int64_t length          = max(step.duration * 1000000LL, 1LL);
+    int permille            = step.startPower + ((int)step.endPower - (int)step.startPower) * elapsed / length;
+    permille                = permille * (100 + offsetPercent()) / 100;
+    watts                   = max(0, permille * userConfig.getFTP() / 1000);
+    targetWatts             = freeRide ? 0 : watts;
+  }
+  bool runERG = !freeRide && (stepChanged || now - lastERGAt >= WORKOUT_ERG_INTERVAL * 1000LL);
+  if (runERG)
+  {
+    lastERGAt = now;
+  }
+  portEXIT_CRITICAL(&playerMux);
+
+  if (finished)
+  {
+    SS2K_LOGI(LOG_CAT_MAIN, "Workout %s finished", name);
+    stop();
+    return;
+  }
+  if (stepChanged)
+  {
+    SS2K_LOGI(LOG_CAT_MAIN, "Workout step %d of %d", (int)stepIndex + 1, (int)stepCount);
+  }
+  if (!active)
+  {
+    //Stopped while this tick was running
+    return;
+  }
+  if (freeRide)
+  {
+    if (userConfig.getERGMode())
+    {
+      userConfig.setERGMode(false);
+    }
+    return;
+  }
+  userConfig.setTargetWatts(watts);
+  if (!userConfig.getERGMode())
+  {
+    userConfig.setERGMode(true);
+  }
+  if (runERG)
+  {
+    computeERG(userConfig.getSimulatedWatts(), watts);
+  }
+}
+
+void WorkoutPlayer::writeJSON(JsonStreamWriter &writer)
+{
+  portENTER_CRITICAL(&playerMux);
+  bool playing     = active;
+  int step         = stepIndex + 1;
+  int total        = stepCount;
+  int target       = targetWatts;
+  int stepLeft     = 0;
+  if (playing && stepIndex < stepCount)
+  {
+    stepLeft = steps[stepIndex].duration - (int)((esp_timer_get_time() - stepStartedAt) / 1000000LL);
+  }
+  portEXIT_CRITICAL(&playerMux);
+
+  writer.field("running", playing);
+  writer.field("name", (const char *)name);
+  writer.field("step", step);
+  writer.field("steps", total);
+  writer.field("stepRemaining", max(stepLeft, 0));
+  writer.field("targetWatts", target);
+  writer.field("offset", offsetSteps * WORKOUT_OFFSET_STEP);
+}
+
+void workoutTick(void *arg)
+{
+  workoutPlayer.tick();
+}
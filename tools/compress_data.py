@@ -0,0 +1,62 @@
+# SmartSpin2K code
+# This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+# Copyright 2020 Anthony Doud
+# This work is licensed under the GNU General Public License v2
+#
+# PlatformIO pre script. Builds the filesystem image from a gzipped copy of data/
+# plus /manifest.txt, which lists every asset as "<path> <etag> <gzipped> <sha256>".
+# The web server serves the .gz files as they are and uses the etags for If-None-Match.
+# The sha256 is of the file as stored (gzipped or not), the updater checks downloads against it.
+# Publish the output dir as "data/" next to firmware.bin so units can update file by file.
+#
+# Can also be run by hand: python tools/compress_data.py <data dir> <output dir>
+
+import gzip
+import hashlib
+import os
+import shutil
+import sys
+
+# Already compressed or too small to be worth it
+STORE_AS_IS = (".png", ".jpg", ".gz", ".txt")
+MIN_GZIP_SIZE = 256
+MANIFEST = "manifest.txt"
+
+
+def build(src_dir, out_dir):
+    if os.path.isdir(out_dir):
+        shutil.rmtree(out_dir)
+    os.makedirs(out_dir)
+    lines = []
+    for root, _, files in os.walk(src_dir):
+        for name in sorted(files):
+            src = os.path.join(root, name)
+            rel = os.path.relpath(src, src_dir).replace(os.sep, "/")
+            with open(src, "rb") as f:
+                content = f.read()
+            etag = hashlib.sha256(content).hexdigest()[:16]
+            dst = os.path.join(out_dir, rel)
+            os.makedirs(os.path.dirname(dst), exist_ok=True)
+            gzipped = len(content) >= MIN_GZIP_SIZE and not name.endswith(STORE_AS_IS)
+            if gzipped:
+                # mtime=0 keeps the output identical between builds
+                stored = gzip.compress(content, 9, mtime=0)
+                with open(dst + ".gz", "wb") as f:
+                    f.write(stored)
+            else:
+                stored = content
+                shutil.copyfile(src, dst)
+            lines.append("/%s %s %d %s" % (rel, etag, 1 if gzipped else 0, hashlib.sha256(stored).hexdigest()))
+    with open(os.path.join(out_dir, MANIFEST), "w") as f:
+        f.write("\n".join(lines) + "\n")
+    print("Compressed %d web assets into %s" % (len(lines), out_dir))
+
+
+if __name__ == "__main__":
+    build(sys.argv[1], sys.argv[2])
+else:
+    Import("env")  # noqa: F821 - provided by PlatformIO
+    data_dir = env.subst("$PROJECT_DATA_DIR")  # noqa: F821
+    out_dir = os.path.join(env.subst("$BUILD_DIR"), "data_gz")  # noqa: F821
+    build(data_dir, out_dir)
+    env.Replace(PROJECT_DATA_DIR=out_dir)  # noqa: F821
@@ -0,0 +1,128 @@
+# SmartSpin2K code
+# This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+# Copyright 2020 Anthony Doud
+# This work is licensed under the GNU General Public License v2
+#
+# Checks a FIT file the way a strict importer would: header and file CRC, the data size in the
+# header, every data message preceded by its definition, and the messages an activity needs.
+# Use it on exports from /rides/<id>.fit or on output of FIT_Writer built on the computer.
+#
+#   python tools/fit_check.py <file.fit> [-v]
+
+import struct
+import sys
+
+CRC_TABLE = (0x0000, 0xCC01, 0xD801, 0x1400, 0xF001, 0x3C00, 0x2800, 0xE401,
+             0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400)
+
+MESSAGE_NAMES = {0: "file_id", 18: "session", 19: "lap", 20: "record", 21: "event", 34: "activity"}
+TIMESTAMP = 253
+BASE_SIZES = {0x00: 1, 0x01: 1, 0x02: 1, 0x83: 2, 0x84: 2, 0x85: 4, 0x86: 4, 0x07: 1, 0x88: 4, 0x89: 8,
+              0x0A: 1, 0x8B: 2, 0x8C: 4, 0x0D: 1, 0x8E: 8, 0x8F: 8, 0x90: 8}
+
+
+def crc16(data, crc=0):
+    for byte in data:
+        tmp = CRC_TABLE[crc & 0xF]
+        crc = ((crc >> 4) & 0x0FFF) ^ tmp ^ CRC_TABLE[byte & 0xF]
+        tmp = CRC_TABLE[crc & 0xF]
+        crc = ((crc >> 4) & 0x0FFF) ^ tmp ^ CRC_TABLE[(byte >> 4) & 0xF]
+    return crc
+
+
+class FitError(Exception):
+    pass
+
+
+def check(data, verbose=False, messages=None):
+    """Returns the message counts by name. Raises FitError on the first problem.
+    If messages is a list, (name, {field number: value}) of every data message is appended to it."""
+    if len(data) < 14:
+        raise FitError("too short for a header")
+    header_size = data[0]
+    if header_size not in (12, 14) or data[8:12] != b".FIT":
+        raise FitError("not a FIT header")
+    (data_size,) = struct.unpack_from("<I", data, 4)
+    if header_size == 14:
+        (header_crc,) = struct.unpack_from("<H", data, 12)
+        if header_crc and header_crc != crc16(data[:12]):
+            raise FitError("header CRC mismatch")
+    if header_size + data_size + 2 != len(data):
+        raise FitError("header says %d data bytes, file has %d" % (data_size, len(data) - header_size - 2))
+    (file_crc,) = struct.unpack_from("<H", data, len(data) - 2)
+    if file_crc != crc16(data[:-2]):
+        raise FitError("file CRC mismatch")
+
+    definitions = {}
+    counts = {}
+    order = []
+    last_timestamp = 0
+    pos = header_size
+    end = header_size + data_size
+    while pos < end:
+        record_header = data[pos]
+        pos += 1
+        if record_header & 0x80:
+            raise FitError("compressed timestamp headers aren't expected at %d" % (pos - 1))
+        local = record_header & 0x0F
+        if record_header & 0x40:
+            if record_header & 0x20:
+                raise FitError("developer fields aren't expected")
+            arch = data[pos + 1]
+            endian = ">" if arch else "<"
+            (global_num,) = struct.unpack_from(endian + "H", data, pos + 2)
+            count = data[pos + 4]
+            pos += 5
+            fields = []
+            for _ in range(count):
+                number, size, base = data[pos], data[pos + 1], data[pos + 2]
+                if base not in BASE_SIZES or size % BASE_SIZES[base]:
+                    raise FitError("field %d of message %d has a bad type" % (number, global_num))
+                fields.append((number, size, base))
+                pos += 3
+            definitions[local] = (global_num, endian, fields)
+            continue
+        if local not in definitions:
+            raise FitError("data message for undefined local type %d at %d" % (local, pos - 1))
+        global_num, endian, fields = definitions[local]
+        name = MESSAGE_NAMES.get(global_num, str(global_num))
+        values = {}
+        for number, size, base in fields:
+            if pos + size > end:
+                raise FitError("message runs past the data")
+            if size in (1, 2, 4):
+                fmt = {1: "B", 2: "H", 4: "I"}[size]
+                (values[number],) = struct.unpack_from(endian + fmt, data, pos)
+            pos += size
+        if TIMESTAMP in values:
+            if values[TIMESTAMP] < last_timestamp:
+                raise FitError("%s timestamp goes backwards" % name)
+            last_timestamp = values[TIMESTAMP]
+        counts[name] = counts.get(name, 0) + 1
+        if not order or order[-1] != name:
+            order.append(name)
+        if verbose:
+            print(name, values)
+        if messages is not None:
+            messages.append((name, values))
+    if pos != end:
+        raise FitError("last message runs past the data")
+
+    if not order or order[0] != "file_id":
+        raise FitError("file_id has to come first")
+    for required in ("record", "lap", "session", "activity"):
+        if required not in counts:
+            raise FitError("no %s message" % required)
+    return counts
+
+
+if __name__ == "__main__":
+    if len(sys.argv) < 2:
+        raise SystemExit("usage: fit_check.py <file.fit> [-v]")
+    with open(sys.argv[1], "rb") as f:
+        content = f.read()
+    try:
+        result = check(content, "-v" in sys.argv)
+    except FitError as e:
+        raise SystemExit("%s: %s" % (sys.argv[1], e))
+    print("%s: OK %s" % (sys.argv[1], ", ".join("%s %d" % item for item in sorted(result.items()))))
@@ -0,0 +1,66 @@
+# SmartSpin2K code
+# This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+# Copyright 2020 Anthony Doud
+# This work is licensed under the GNU General Public License v2
+#
+# Host test of the FIT writer: builds src/FIT_Writer.cpp with tools/fit_writer_host.cpp using the
+# computer's compiler (warnings are errors), writes a few rides and runs fit_check.py on each.
+# Exits non-zero on the first failure.
+#
+#   python tools/fit_host_test.py [c++ compiler]
+
+import os
+import subprocess
+import sys
+import tempfile
+
+import fit_check
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+# Session fields (ms)
+TOTAL_ELAPSED_TIME = 7
+TOTAL_TIMER_TIME = 8
+
+# records, pause at record, pause length (s)
+CASES = [
+    (1, 0, 0),
+    (3600, 0, 0),
+    (5000, 1800, 600),   # a paused ride, the gap must not count as timer time
+    (70000, 0, 0),       # longer than 16 bit seconds
+]
+
+
+def main():
+    compiler = sys.argv[1] if len(sys.argv) > 1 else os.environ.get("CXX", "g++")
+    with tempfile.TemporaryDirectory() as work:
+        binary = os.path.join(work, "fit_writer_host")
+        subprocess.run([compiler, "-std=gnu++11", "-Wall", "-Wextra", "-Werror", "-O2",
+                        "-I", os.path.join(ROOT, "include"),
+                        os.path.join(ROOT, "src", "FIT_Writer.cpp"),
+                        os.path.join(ROOT, "tools", "fit_writer_host.cpp"),
+                        "-o", binary], check=True)
+        for records, pause_at, pause_for in CASES:
+            path = os.path.join(work, "ride-%d.fit" % records)
+            subprocess.run([binary, path, str(records), str(pause_at), str(pause_for)], check=True)
+            messages = []
+            with open(path, "rb") as f:
+                counts = fit_check.check(f.read(), messages=messages)
+            if counts.get("record") != records:
+                raise SystemExit("%s: %s records, expected %d" % (path, counts.get("record"), records))
+            session = [values for name, values in messages if name == "session"][0]
+            # Records are a second apart, the interval across the pause isn't riding time
+            elapsed = (records - 1 + pause_for) * 1000
+            timer = (records - 1 - (1 if pause_for else 0)) * 1000
+            if session[TOTAL_ELAPSED_TIME] != elapsed or session[TOTAL_TIMER_TIME] != timer:
+                raise SystemExit("%s: elapsed %d timer %d ms, expected %d and %d" % (
+                    path, session[TOTAL_ELAPSED_TIME], session[TOTAL_TIMER_TIME], elapsed, timer))
+            print("  OK", ", ".join("%s %d" % item for item in sorted(counts.items())))
+    print("FIT writer host test passed")
+
+
+if __name__ == "__main__":
+    try:
+        main()
+    except (fit_check.FitError, subprocess.CalledProcessError) as e:
+        raise SystemExit("FAILED: %s" % e)
@@ -0,0 +1,84 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+// Computer build of src/FIT_Writer.cpp, driven the way RideExport drives it. Built and checked by
+// tools/fit_host_test.py.
+//
+//   fit_writer_host <out.fit> <records> [pause at record] [pause length s]
+
+#include "FIT_Writer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: %s <out.fit> <records> [pause at record] [pause length s]\n", argv[0]);
+        return 2;
+    }
+    FILE *out = fopen(argv[1], "wb");
+    if (out == nullptr)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    uint32_t records    = strtoul(argv[2], nullptr, 10);
+    uint32_t pauseAt    = argc > 3 ? strtoul(argv[3], nullptr, 10) : 0;
+    uint32_t pauseFor   = argc > 4 ? strtoul(argv[4], nullptr, 10) : 0;
+    uint32_t start      = 1600000000UL - FIT_EPOCH_OFFSET;
+
+    FitWriter fit;
+    uint8_t buffer[FIT_MAX_MESSAGE];
+    size_t length;
+    size_t total = 0;
+    fit.begin();
+#define EMIT(call)                                          \
+    length = (call);                                        \
+    if (length > FIT_MAX_MESSAGE)                           \
+    {                                                       \
+        fprintf(stderr, "%s wrote %zu bytes\n", #call, length); \
+        return 1;                                           \
+    }                                                       \
+    fwrite(buffer, 1, length, out);                         \
+    total += length;
+
+    EMIT(fit.header(buffer, records));
+    EMIT(fit.fileId(buffer, start, 12345));
+    EMIT(fit.startEvent(buffer, start));
+    uint32_t timestamp = start;
+    for (uint32_t i = 0; i < records; i++)
+    {
+        if (pauseFor && i == pauseAt)
+        {
+            timestamp += pauseFor;
+        }
+        FitRecord record;
+        record.timestamp = timestamp++;
+        record.power     = 150 + (i * 7) % 120;
+        record.cadence   = 85 + i % 10;
+        record.heartRate = (i % 50 == 0) ? 0 : 120 + i % 30;
+        record.grade     = (int16_t)((i % 200) * 5 - 500);
+        EMIT(fit.record(buffer, record));
+    }
+    EMIT(fit.stopEvent(buffer, timestamp - 1));
+    EMIT(fit.lap(buffer));
+    EMIT(fit.session(buffer));
+    EMIT(fit.activity(buffer));
+    EMIT(fit.crc(buffer));
+    fclose(out);
+
+    uint32_t expected = FIT_HEADER_SIZE + FitWriter::dataSize(records) + FIT_CRC_SIZE;
+    if (total != expected)
+    {
+        fprintf(stderr, "wrote %zu bytes, dataSize() promised %u\n", total, expected);
+        return 1;
+    }
+    printf("%s: %u records, %zu bytes\n", argv[1], records, total);
+    return 0;
+}
@@ -0,0 +1,123 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+// Just enough of Arduino's Print and String to build the firmware's plain helpers (JSON_Stream_Writer)
+// on a computer for the host tests in tools/. Not a general replacement. String allocates with new[],
+// so a test can count its heap use by replacing operator new.
+
+#pragma once
+
+#include <algorithm>
+#include <math.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+using std::max;
+using std::min;
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *data, size_t length)
+    {
+        for (size_t i = 0; i < length; i++)
+        {
+            write(data[i]);
+        }
+        return length;
+    }
+    size_t print(const char *text)          {return write((const uint8_t *)text, strlen(text));}
+    size_t print(char c)                    {return write((uint8_t)c);}
+    size_t print(int value)                 {return printf("%d", value);}
+    size_t print(unsigned value)            {return printf("%u", value);}
+    size_t print(double value, int digits = 2)  {return printf("%.*f", digits, value);}
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        char text[64];
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(text, sizeof(text), format, args);
+        va_end(args);
+        return length > 0 ? write((const uint8_t *)text, min((size_t)length, sizeof(text) - 1)) : 0;
+    }
+};
+
+class String
+{
+public:
+    String()                                {}
+    String(const char *text)                {assign(text, strlen(text));}
+    String(const String &other)             {assign(other.c_str(), other.length());}
+    ~String()                               {delete[] buffer;}
+    String &operator=(const String &other)
+    {
+        if (this != &other)
+        {
+            assign(other.c_str(), other.length());
+        }
+        return *this;
+    }
+    String &operator=(const char *text)
+    {
+        assign(text, strlen(text));
+        return *this;
+    }
+    String &operator+=(char c)
+    {
+        reserve(used + 1);
+        buffer[used++] = c;
+        buffer[used]   = 0;
+        return *this;
+    }
+    const char *c_str() const               {return buffer ? buffer : "";}
+    unsigned length() const                 {return used;}
+    bool isEmpty() const                    {return used == 0;}
+    bool operator==(const char *text) const {return strcmp(c_str(), text) == 0;}
+
+    // Grows like Arduino's String, to exactly what's needed
+    void reserve(size_t size)
+    {
+        if (size + 1 <= capacity)
+        {
+            return;
+        }
+        char *grown = new char[size + 1];
+        memcpy(grown, c_str(), used + 1);
+        delete[] buffer;
+        buffer   = grown;
+        capacity = size + 1;
+    }
+
+private:
+    char    *buffer     = nullptr;
+    size_t  capacity    = 0;
+    size_t  used        = 0;
+
+    void assign(const char *text, size_t length)
+    {
+        //Like Arduino's copy(), an empty string keeps the buffer it has
+        if (length == 0)
+        {
+            if (buffer)
+            {
+                buffer[0] = 0;
+            }
+            used = 0;
+            return;
+        }
+        used = 0;
+        reserve(length);
+        memcpy(buffer, text, length);
+        buffer[length] = 0;
+        used           = length;
+    }
+};
@@ -0,0 +1,116 @@
+# SmartSpin2K code
+# This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+# Copyright 2020 Anthony Doud
+# This work is licensed under the GNU General Public License v2
+#
+# Load test for the unit's web server. Several clients fetch the given paths in turn, and the script
+# reports requests per second and latency percentiles for each path and overall.
+#
+#   python tools/http_load_test.py <device address> [-c clients] [-n requests per client] [--keep-alive] [paths ...]
+#
+# The default paths are the ones the settings pages poll. With --keep-alive each client reuses its
+# connection and counts how often the server closed it. ESPAsyncWebServer closes after every response,
+# so expect one reconnect per request there.
+
+import argparse
+import http.client
+import threading
+import time
+
+DEFAULT_PATHS = ["/", "/configJSON", "/BLELinksJSON", "/PWCJSON", "/mmpJSON", "/style.css"]
+
+
+def percentile(values, fraction):
+    if not values:
+        return 0.0
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(fraction * len(ordered)))]
+
+
+class Client(threading.Thread):
+    def __init__(self, host, port, paths, count, keep_alive, timeout):
+        super().__init__(daemon=True)
+        self.host, self.port, self.paths, self.count = host, port, paths, count
+        self.keep_alive, self.timeout = keep_alive, timeout
+        self.times = {path: [] for path in paths}
+        self.errors = 0
+        self.connects = 0
+        self.bytes = 0
+
+    def connect(self):
+        self.connects += 1
+        return http.client.HTTPConnection(self.host, self.port, timeout=self.timeout)
+
+    def run(self):
+        connection = None
+        for i in range(self.count):
+            path = self.paths[i % len(self.paths)]
+            if connection is None:
+                connection = self.connect()
+            start = time.perf_counter()
+            try:
+                connection.request("GET", path, headers={"Connection": "keep-alive" if self.keep_alive else "close"})
+                response = connection.getresponse()
+                self.bytes += len(response.read())
+                if response.status != 200:
+                    self.errors += 1
+                    continue
+                self.times[path].append(time.perf_counter() - start)
+                if not self.keep_alive or response.will_close:
+                    connection.close()
+                    connection = None
+            except (OSError, http.client.HTTPException):
+                self.errors += 1
+                connection.close()
+                connection = None
+        if connection is not None:
+            connection.close()
+
+
+def report(name, times, elapsed):
+    if not times:
+        print("%-16s no successful requests" % name)
+        return
+    print("%-16s %6d  %7.1f  %7.1f  %7.1f  %7.1f  %7.1f" % (
+        name, len(times), len(times) / elapsed, percentile(times, 0.50) * 1000,
+        percentile(times, 0.95) * 1000, percentile(times, 0.99) * 1000, max(times) * 1000))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Load test the SmartSpin2K web server")
+    parser.add_argument("address", help="device address, e.g. 192.168.1.50 or smartspin2k.local")
+    parser.add_argument("paths", nargs="*", default=DEFAULT_PATHS)
+    parser.add_argument("-c", "--clients", type=int, default=4, help="concurrent clients (default 4)")
+    parser.add_argument("-n", "--requests", type=int, default=50, help="requests per client (default 50)")
+    parser.add_argument("--keep-alive", action="store_true", help="reuse connections where the server allows it")
+    parser.add_argument("--timeout", type=float, default=10, help="per request timeout in seconds")
+    args = parser.parse_args()
+
+    host, _, port = args.address.replace("http://", "").rstrip("/").partition(":")
+    clients = [Client(host, int(port or 80), args.paths, args.requests, args.keep_alive, args.timeout)
+               for _ in range(args.clients)]
+    start = time.perf_counter()
+    for client in clients:
+        client.start()
+    for client in clients:
+        client.join()
+    elapsed = time.perf_counter() - start
+
+    print("%d clients, %d requests each, %.1f s" % (args.clients, args.requests, elapsed))
+    print("%-16s %6s  %7s  %7s  %7s  %7s  %7s" % ("path", "ok", "req/s", "p50 ms", "p95 ms", "p99 ms", "max ms"))
+    everything = []
+    for path in args.paths:
+        times = [t for client in clients for t in client.times[path]]
+        everything += times
+        report(path, times, elapsed)
+    report("all", everything, elapsed)
+    errors = sum(client.errors for client in clients)
+    connects = sum(client.connects for client in clients)
+    print("%d errors, %d connections for %d requests, %d KB received" % (
+        errors, connects, args.clients * args.requests, sum(client.bytes for client in clients) // 1024))
+    if errors:
+        raise SystemExit(1)
+
+
+if __name__ == "__main__":
+    main()
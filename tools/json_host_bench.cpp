@@ -0,0 +1,242 @@
+// SmartSpin2K code
+// This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+// BLE code based on examples from https://github.com/nkolban
+// Copyright 2020 Anthony Doud
+// This work is licensed under the GNU General Public License v2
+// Prototype hardware build from plans in the SmartSpin2k repository are licensed under Cern Open Hardware Licence version 2 Permissive
+
+// Heap use per /configJSON request on a computer. Builds src/JSON_Stream_Writer.cpp against the
+// shim in tools/host and counts every operator new while a config-like object is sent:
+//   buffered  the whole body printed into a growing buffer first, as AsyncResponseStream does
+//   chunked   JsonChunkedSource read() in chunks of the given size, as beginChunkedResponse does
+// Both outputs are compared byte for byte. Built and run by tools/json_host_bench.py.
+
+#include "JSON_Stream_Writer.h"
+
+#include <memory>
+#include <new>
+#include <stdlib.h>
+#include <string>
+
+static size_t allocations = 0;
+static size_t allocated   = 0;
+static size_t live        = 0;
+static size_t peak        = 0;
+
+// Every block carries its size in front so delete can keep the live count. Kept out of line so the
+// compiler doesn't check the size prefix against the object it sees allocated
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    size_t *block = (size_t *)malloc(size + sizeof(max_align_t));
+    if (block == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    *block = size;
+    allocations++;
+    allocated += size;
+    live += size;
+    peak = max(peak, live);
+    return (uint8_t *)block + sizeof(max_align_t);
+}
+
+__attribute__((noinline)) void operator delete(void *pointer) noexcept
+{
+    if (pointer)
+    {
+        size_t *block = (size_t *)((uint8_t *)pointer - sizeof(max_align_t));
+        live -= *block;
+        free(block);
+    }
+}
+
+void *operator new[](size_t size)                   {return operator new(size);}
+void operator delete[](void *pointer) noexcept      {operator delete(pointer);}
+void operator delete(void *pointer, size_t) noexcept    {operator delete(pointer);}
+void operator delete[](void *pointer, size_t) noexcept  {operator delete(pointer);}
+
+static size_t baseline = 0;
+
+static void resetCounters()
+{
+    allocations = 0;
+    allocated   = 0;
+    baseline    = live;
+    peak        = live;
+}
+
+// Stand-in for the config: same field names, types and typical values as configFields
+struct BenchField
+{
+    const char  *name;
+    char        type;   //i, f, b, s
+    float       number;
+    const char  *text;
+};
+
+static const BenchField benchFields[] = {
+    {"firmwareUpdateURL", 's', 0, "https://raw.githubusercontent.com/doudar/OTAUpdates/main/"},
+    {"incline", 'f', 150.0f, nullptr},
+    {"simulatedWatts", 'i', 215, nullptr},
+    {"simulatedHr", 'i', 142, nullptr},
+    {"simulatedCad", 'i', 91, nullptr},
+    {"deviceName", 's', 0, "SmartSpin2K"},
+    {"shiftStep", 'i', 400, nullptr},
+    {"ftp", 'i', 230, nullptr},
+    {"stepperPower", 'i', 1000, nullptr},
+    {"stealthchop", 'b', 1, nullptr},
+    {"inclineMultiplier", 'f', 3.0f, nullptr},
+    {"doublePower", 'b', 0, nullptr},
+    {"simulateHr", 'b', 1, nullptr},
+    {"ERGMode", 'b', 1, nullptr},
+    {"targetWatts", 'i', 220, nullptr},
+    {"autoUpdate", 'b', 1, nullptr},
+    {"logLevels", 'i', 0x333333, nullptr},
+    {"ssid", 's', 0, "HomeNetwork-5G"},
+    {"password", 's', 0, "correct horse battery staple"},
+    {"foundDevices", 's', 0, "[{\"device 0\":{\"address\":\"c7:3e:10:a4:22:91\",\"UUID\":\"0x1818\"}},{\"device 1\":{\"address\":\"e4:11:93:0b:5c:70\",\"UUID\":\"0x180d\"}}]"},
+    {"connectedPowerMeter", 's', 0, "KICKR CORE 5A21"},
+    {"connectedHeartMonitor", 's', 0, "HRM-Pro:123456"},
+    {"firmwareVersion", 's', 0, "0.1.1.12"},
+};
+
+static bool writeBenchField(JsonStreamWriter &writer, size_t index)
+{
+    if (index >= sizeof(benchFields) / sizeof(benchFields[0]))
+    {
+        return false;
+    }
+    const BenchField &field = benchFields[index];
+    switch (field.type)
+    {
+    case 'i':
+        writer.field(field.name, (int)field.number);
+        break;
+    case 'f':
+        writer.field(field.name, field.number);
+        break;
+    case 'b':
+        writer.field(field.name, field.number != 0);
+        break;
+    default:
+        writer.field(field.name, field.text);
+        break;
+    }
+    return true;
+}
+
+// AsyncResponseStream keeps the body in a cbuf that starts at 1460 bytes and grows to fit each write
+class BufferedBody : public Print
+{
+public:
+    BufferedBody() : data(new uint8_t[1460]), capacity(1460) {}
+    ~BufferedBody()     {delete[] data;}
+    size_t write(uint8_t c) override
+    {
+        if (used == capacity)
+        {
+            uint8_t *grown = new uint8_t[capacity + 1];
+            memcpy(grown, data, used);
+            delete[] data;
+            data = grown;
+            capacity++;
+        }
+        data[used++] = c;
+        return 1;
+    }
+    std::string text()  {return std::string((const char *)data, used);}
+
+private:
+    uint8_t *data;
+    size_t  capacity;
+    size_t  used = 0;
+};
+
+struct Result
+{
+    std::string body;
+    size_t      allocations;
+    size_t      allocated;
+    size_t      peak;
+};
+
+static Result buffered(const char *fields)
+{
+    resetCounters();
+    Result result;
+    {
+        std::unique_ptr<BufferedBody> body(new BufferedBody());
+        JsonStreamWriter writer(*body, fields);
+        writer.beginObject();
+        for (size_t i = 0; writeBenchField(writer, i); i++)
+        {
+        }
+        writer.endObject();
+        result.allocations = allocations;
+        result.allocated   = allocated;
+        result.peak        = peak - baseline;
+        result.body        = body->text();
+    }
+    return result;
+}
+
+static Result chunked(const char *fields, size_t chunkSize)
+{
+    std::string body;
+    body.reserve(4096); //Outside the measurement, stands for the socket
+    resetCounters();
+    Result result;
+    {
+        std::shared_ptr<JsonChunkedSource> json(new JsonChunkedSource(writeBenchField, fields));
+        uint8_t *chunk = (uint8_t *)malloc(chunkSize); //The server's send buffer, not ours
+        for (size_t length; (length = json->read(chunk, chunkSize)) > 0;)
+        {
+            body.append((const char *)chunk, length);
+        }
+        free(chunk);
+        result.allocations = allocations;
+        result.allocated   = allocated;
+        result.peak        = peak - baseline;
+    }
+    result.body = body;
+    return result;
+}
+
+static void report(const char *name, const char *fields, size_t chunkSize, const Result &result)
+{
+    printf("%-9s %-8s %5zu  %5zu  %6zu  %6zu  %6zu\n", name, fields[0] ? "4 fields" : "all", chunkSize, result.body.size(),
+           result.allocations, result.allocated, result.peak);
+}
+
+int main()
+{
+    const char *selections[] = {"", "simulatedWatts,simulatedHr,simulatedCad,incline"};
+    const size_t chunkSizes[] = {64, 536, 1436};
+    bool ok = true;
+    printf("%-9s %-8s %5s  %5s  %6s  %6s  %6s\n", "method", "fields", "chunk", "body", "allocs", "bytes", "peak");
+    for (const char *fields : selections)
+    {
+        Result reference = buffered(fields);
+        report("buffered", fields, 0, reference);
+        for (size_t chunkSize : chunkSizes)
+        {
+            Result result = chunked(fields, chunkSize);
+            report("chunked", fields, chunkSize, result);
+            if (result.body != reference.body)
+            {
+                printf("  body differs:\n  %s\n  %s\n", reference.body.c_str(), result.body.c_str());
+                ok = false;
+            }
+        }
+        //Every chunk size down to one byte has to give the same body
+        for (size_t chunkSize = 1; chunkSize < 300; chunkSize++)
+        {
+            if (chunked(fields, chunkSize).body != reference.body)
+            {
+                printf("  body differs with %zu byte chunks\n", chunkSize);
+                ok = false;
+            }
+        }
+    }
+    return ok ? 0 : 1;
+}
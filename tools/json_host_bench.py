@@ -0,0 +1,39 @@
+# SmartSpin2K code
+# This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+# Copyright 2020 Anthony Doud
+# This work is licensed under the GNU General Public License v2
+#
+# Host benchmark of the JSON endpoints: builds src/JSON_Stream_Writer.cpp with tools/json_host_bench.cpp
+# and the Arduino shim in tools/host using the computer's compiler (warnings are errors), then reports
+# heap allocations, bytes and peak per request for a buffered body and for chunked sends.
+# Exits non-zero if a chunked body differs from the buffered one.
+#
+#   python tools/json_host_bench.py [c++ compiler]
+
+import os
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+
+def main():
+    compiler = sys.argv[1] if len(sys.argv) > 1 else os.environ.get("CXX", "g++")
+    with tempfile.TemporaryDirectory() as work:
+        binary = os.path.join(work, "json_host_bench")
+        subprocess.run([compiler, "-std=gnu++11", "-Wall", "-Wextra", "-Werror", "-O2",
+                        "-I", os.path.join(ROOT, "tools", "host"),
+                        "-I", os.path.join(ROOT, "include"),
+                        os.path.join(ROOT, "src", "JSON_Stream_Writer.cpp"),
+                        os.path.join(ROOT, "tools", "json_host_bench.cpp"),
+                        "-o", binary], check=True)
+        subprocess.run([binary], check=True)
+    print("JSON host benchmark passed, chunked bodies match")
+
+
+if __name__ == "__main__":
+    try:
+        main()
+    except subprocess.CalledProcessError as e:
+        raise SystemExit("FAILED: %s" % e)
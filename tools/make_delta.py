@@ -0,0 +1,155 @@
+# SmartSpin2K code
+# This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+# Copyright 2020 Anthony Doud
+# This work is licensed under the GNU General Public License v2
+#
+# Makes a firmware delta patch for the background updater (see include/Update_Delta.h).
+# The old image has to be the exact build the units are running, they check its SHA-256 first.
+#
+#   python tools/make_delta.py <old firmware.bin> <new firmware.bin> <out>
+#
+# Publish <out> as "firmware-<old version>.delta" next to firmware.bin, together with the
+# <out>.sha256 written here. Units without a matching delta download the full image.
+
+import hashlib
+import struct
+import sys
+import zlib
+
+MAGIC = b"S2KD"
+VERSION = 1
+OP_END = 0
+OP_ADD = 1
+OP_INSERT = 2
+
+BLOCK = 16  # Bytes hashed per index entry
+STEP = 4  # Index every STEP offsets of the old image (instructions are 4 byte aligned)
+MIN_MATCH = 32  # Shorter matches go into INSERT ops
+GIVE_UP = 32  # Stop extending a match once it's this far below its best score
+
+
+def index_source(old):
+    index = {}
+    for pos in range(0, len(old) - BLOCK + 1, STEP):
+        index.setdefault(old[pos:pos + BLOCK], pos)
+    return index
+
+
+def extend(old, new, src, dst):
+    """Length of the approximate match at old[src:] / new[dst:]. Mismatching bytes are fine as long
+    as matches keep outnumbering them, recompiled code differs mostly in shifted addresses."""
+    best_len = 0
+    best_score = 0
+    score = 0
+    length = 0
+    limit = min(len(old) - src, len(new) - dst)
+    while length < limit:
+        score += 1 if old[src + length] == new[dst + length] else -1
+        length += 1
+        if score > best_score:
+            best_score = score
+            best_len = length
+        elif score < best_score - GIVE_UP:
+            break
+    return best_len
+
+
+def diff(old, new):
+    index = index_source(old)
+    ops = []
+    insert = bytearray()
+    last_shift = 0  # new offset - old offset of the previous match, code tends to move in blocks
+    dst = 0
+    while dst < len(new):
+        candidates = []
+        if 0 <= dst - last_shift < len(old):
+            candidates.append(dst - last_shift)
+        found = index.get(bytes(new[dst:dst + BLOCK]))
+        if found is not None:
+            candidates.append(found)
+        best_src, best_len = 0, 0
+        for src in candidates:
+            length = extend(old, new, src, dst)
+            if length > best_len:
+                best_src, best_len = src, length
+        if best_len < MIN_MATCH:
+            insert.append(new[dst])
+            dst += 1
+            continue
+        if insert:
+            ops.append((OP_INSERT, bytes(insert)))
+            insert = bytearray()
+        added = bytes((new[dst + i] - old[best_src + i]) & 0xFF for i in range(best_len))
+        ops.append((OP_ADD, best_src, added))
+        last_shift = dst - best_src
+        dst += best_len
+    if insert:
+        ops.append((OP_INSERT, bytes(insert)))
+    return ops
+
+
+def encode(old, new, ops):
+    stream = bytearray()
+    for op in ops:
+        if op[0] == OP_ADD:
+            stream += struct.pack("<BII", OP_ADD, op[1], len(op[2])) + op[2]
+        else:
+            stream += struct.pack("<BI", OP_INSERT, len(op[1])) + op[1]
+    stream.append(OP_END)
+    header = MAGIC + struct.pack("<II", VERSION, len(old)) + hashlib.sha256(old).digest()
+    header += struct.pack("<I", len(new)) + hashlib.sha256(new).digest()
+    return header + zlib.compress(bytes(stream), 9)
+
+
+def apply(old, patch):
+    """Same as DeltaPatch on the unit. Used to check every patch before it's published."""
+    if patch[:4] != MAGIC:
+        raise ValueError("not a delta patch")
+    version, source_size = struct.unpack_from("<II", patch, 4)
+    if version != VERSION or source_size != len(old) or patch[12:44] != hashlib.sha256(old).digest():
+        raise ValueError("patch is for a different source image")
+    (target_size,) = struct.unpack_from("<I", patch, 44)
+    target_hash = patch[48:80]
+    stream = zlib.decompress(patch[80:])
+    out = bytearray()
+    pos = 0
+    while True:
+        op = stream[pos]
+        pos += 1
+        if op == OP_END:
+            break
+        if op == OP_ADD:
+            src, length = struct.unpack_from("<II", stream, pos)
+            pos += 8
+            out += bytes((old[src + i] + stream[pos + i]) & 0xFF for i in range(length))
+        elif op == OP_INSERT:
+            (length,) = struct.unpack_from("<I", stream, pos)
+            pos += 4
+            out += stream[pos:pos + length]
+        else:
+            raise ValueError("unknown op %d" % op)
+        pos += length
+    if len(out) != target_size or hashlib.sha256(out).digest() != target_hash:
+        raise ValueError("rebuilt image doesn't match")
+    return bytes(out)
+
+
+def main(old_path, new_path, out_path):
+    with open(old_path, "rb") as f:
+        old = f.read()
+    with open(new_path, "rb") as f:
+        new = f.read()
+    patch = encode(old, new, diff(old, new))
+    if apply(old, patch) != new:
+        raise SystemExit("patch check failed")
+    with open(out_path, "wb") as f:
+        f.write(patch)
+    with open(out_path + ".sha256", "w") as f:
+        f.write(hashlib.sha256(patch).hexdigest() + "\n")
+    print("%s: %d bytes, %.1f%% of the %d byte image" % (out_path, len(patch), 100.0 * len(patch) / len(new), len(new)))
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 4:
+        raise SystemExit("usage: make_delta.py <old firmware.bin> <new firmware.bin> <out>")
+    main(sys.argv[1], sys.argv[2], sys.argv[3])
@@ -0,0 +1,228 @@
+# SmartSpin2K code
+# This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+# Copyright 2020 Anthony Doud
+# This work is licensed under the GNU General Public License v2
+#
+# Computer side of the ride recorder (include/Ride_Recorder.h, include/Ride_Codec.h).
+# Packs and unpacks ride blocks exactly like the firmware and reads a copy of /rides.bin.
+#
+#   python tools/ride_codec.py dump <rides.bin>          list rides and print their samples as CSV
+#   python tools/ride_codec.py bench [rides.bin]         compression ratio on synthetic rides (or real ones)
+
+import math
+import random
+import struct
+import sys
+import zlib
+
+BLOCK_SIZE = 251  # RIDE_BLOCK_SIZE, one SPIFFS data page
+HEADER = struct.Struct("<IIHBBI")  # sequence, startTime, rideId, count, format, crc
+PAYLOAD_SIZE = BLOCK_SIZE - HEADER.size
+SAMPLE = struct.Struct("<HhBBhhHi")  # time, power, cadence, heartRate, incline, targetWatts, flags, stepperPosition
+CHANNELS = ("time", "power", "cadence", "heart_rate", "incline", "target_watts", "flags", "stepper_position")
+FORMAT_RAW = 0
+FORMAT_PACKED = 1
+MIN_REPEAT = 3
+PACKED_MAX_SAMPLES = 120  # RIDE_PACKED_MAX_SAMPLES
+FLAG_ERG = 0x01
+
+
+def zigzag(value):
+    return ((value << 1) ^ (value >> 31)) & 0xFFFFFFFF
+
+
+def unzigzag(value):
+    return (value >> 1) ^ -(value & 1)
+
+
+def put_varint(out, value):
+    while True:
+        byte = value & 0x7F
+        value >>= 7
+        out.append(byte | (0x80 if value else 0))
+        if not value:
+            return
+
+
+def get_varint(data, pos):
+    value = 0
+    shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7F) << shift
+        if not byte & 0x80:
+            return value, pos
+        shift += 7
+
+
+def encode(samples):
+    """samples: list of tuples in CHANNELS order. Returns the packed payload (may be longer than a block)."""
+    out = bytearray()
+    for channel in range(len(CHANNELS)):
+        values = [s[channel] for s in samples]
+        deltas = [v - (values[i - 1] if i else 0) for i, v in enumerate(values)]
+        i = 0
+        while i < len(deltas):
+            same = 1
+            while i + same < len(deltas) and deltas[i + same] == deltas[i]:
+                same += 1
+            if same >= MIN_REPEAT:
+                put_varint(out, (same << 1) | 1)
+                put_varint(out, zigzag(deltas[i]))
+                i += same
+                continue
+            literals = same
+            while i + literals < len(deltas):
+                run = 1
+                while (run < MIN_REPEAT and i + literals + run < len(deltas)
+                       and deltas[i + literals + run] == deltas[i + literals]):
+                    run += 1
+                if run >= MIN_REPEAT:
+                    break
+                literals += run
+            put_varint(out, literals << 1)
+            for delta in deltas[i:i + literals]:
+                put_varint(out, zigzag(delta))
+            i += literals
+    return bytes(out)
+
+
+def decode(payload, count):
+    columns = []
+    pos = 0
+    for _ in CHANNELS:
+        column = []
+        value = 0
+        while len(column) < count:
+            header, pos = get_varint(payload, pos)
+            length, repeat = header >> 1, header & 1
+            if length == 0:
+                raise ValueError("empty run")
+            if repeat:
+                raw, pos = get_varint(payload, pos)
+                deltas = [unzigzag(raw)] * length
+            else:
+                deltas = []
+                for _ in range(length):
+                    raw, pos = get_varint(payload, pos)
+                    deltas.append(unzigzag(raw))
+            for delta in deltas:
+                value += delta
+                column.append(value)
+        columns.append(column)
+    return list(zip(*columns))
+
+
+def block_crc(block):
+    return zlib.crc32(block[:HEADER.size - 4] + block[HEADER.size:]) & 0xFFFFFFFF
+
+
+def read_block(block):
+    """Returns (header dict, samples) or None if the block is empty or broken."""
+    sequence, start_time, ride_id, count, fmt, crc = HEADER.unpack_from(block)
+    if crc != block_crc(block) or count == 0:
+        return None
+    payload = block[HEADER.size:]
+    if fmt == FORMAT_RAW:
+        samples = [SAMPLE.unpack_from(payload, i * SAMPLE.size) for i in range(count)]
+    elif fmt == FORMAT_PACKED:
+        samples = decode(payload, count)
+    else:
+        return None
+    return {"sequence": sequence, "start_time": start_time, "ride_id": ride_id, "format": fmt}, samples
+
+
+def read_ring(data):
+    """Blocks of a /rides.bin copy, oldest first."""
+    blocks = [b for b in (read_block(data[i:i + BLOCK_SIZE]) for i in range(0, len(data) - BLOCK_SIZE + 1, BLOCK_SIZE)) if b]
+    return sorted(blocks, key=lambda b: b[0]["sequence"])
+
+
+def pack_ride(samples):
+    """Splits a ride into packed blocks the way the recorder does. Returns a list of (count, payload)."""
+    blocks = []
+    pending = []
+    for sample in samples:
+        pending.append(sample)
+        if len(pending) == PACKED_MAX_SAMPLES:
+            blocks.append((len(pending), encode(pending)))
+            pending = []
+        elif len(encode(pending)) > PAYLOAD_SIZE:
+            blocks.append((len(pending) - 1, encode(pending[:-1])))
+            pending = pending[-1:]
+    if pending:
+        blocks.append((len(pending), encode(pending)))
+    return blocks
+
+
+def synthetic_ride(seconds, erg, seed):
+    """Plausible trainer data: noisy power and cadence, slowly drifting HR, ERG or grade changes."""
+    rng = random.Random(seed)
+    samples = []
+    target = 150
+    incline = 0
+    hr = 90.0
+    stepper = 0
+    for t in range(seconds):
+        if t % 300 == 0:
+            target = rng.choice((120, 150, 200, 250, 300))
+            incline = rng.randrange(-300, 800, 50)
+        power = int(target + rng.gauss(0, 12)) if erg else int(180 + incline / 10 + rng.gauss(0, 25))
+        cadence = int(88 + 4 * math.sin(t / 40) + rng.gauss(0, 2))
+        hr += ((power / 2.2) - hr) / 60
+        stepper += rng.choice((0, 0, 0, 400, -400))
+        samples.append((t, power, max(cadence, 0), int(hr), 0 if erg else incline, target if erg else 0,
+                        FLAG_ERG if erg else 0, stepper))
+    return samples
+
+
+def check(samples, blocks):
+    decoded = []
+    for count, payload in blocks:
+        if len(payload) > PAYLOAD_SIZE:
+            raise SystemExit("block overflow")
+        decoded += decode(payload, count)
+    if decoded != [tuple(s) for s in samples]:
+        raise SystemExit("round trip failed")
+
+
+def report(name, samples):
+    blocks = pack_ride(samples)
+    check(samples, blocks)
+    raw_blocks = math.ceil(len(samples) / (PAYLOAD_SIZE // SAMPLE.size))
+    packed = sum(len(p) for _, p in blocks)
+    print("%-16s %6d samples  raw %7d B (%4d blocks)  packed %6d B (%3d blocks)  %.1fx  %.1f KB/hour" % (
+        name, len(samples), len(samples) * SAMPLE.size, raw_blocks, packed, len(blocks),
+        len(samples) * SAMPLE.size / packed, len(blocks) * BLOCK_SIZE * 3600 / len(samples) / 1024))
+
+
+def bench(path=None):
+    if path:
+        rides = {}
+        with open(path, "rb") as f:
+            for header, samples in read_ring(f.read()):
+                rides.setdefault(header["ride_id"], []).extend(samples)
+        for ride_id, samples in rides.items():
+            report("ride %d" % ride_id, samples)
+        return
+    report("ERG hour", synthetic_ride(3600, True, 1))
+    report("SIM hour", synthetic_ride(3600, False, 2))
+
+
+def dump(path):
+    with open(path, "rb") as f:
+        blocks = read_ring(f.read())
+    print("ride_id,start_time," + ",".join(CHANNELS))
+    for header, samples in blocks:
+        for sample in samples:
+            print("%d,%d,%s" % (header["ride_id"], header["start_time"], ",".join(str(v) for v in sample)))
+
+
+if __name__ == "__main__":
+    if len(sys.argv) >= 2 and sys.argv[1] == "bench":
+        bench(sys.argv[2] if len(sys.argv) > 2 else None)
+    elif len(sys.argv) == 3 and sys.argv[1] == "dump":
+        dump(sys.argv[2])
+    else:
+        raise SystemExit("usage: ride_codec.py dump <rides.bin> | bench [rides.bin]")
@@ -0,0 +1,289 @@
+# SmartSpin2K code
+# This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+# Copyright 2020 Anthony Doud
+# This work is licensed under the GNU General Public License v2
+#
+# End to end test of the background firmware update against tools/update_server.py. It makes a delta
+# with make_delta.py, serves it with --drop so every response is cut short, then downloads the delta
+# and the full image the way UpdateAgent::download does (Range resumes, at most UPDATE_MAX_RESUMES,
+# SHA-256 from the .sha256 file). The delta is applied as it arrives, the way DeltaPatch does, and
+# both results must match the new image. An image whose .sha256 is gone has to be refused.
+# Exits non-zero on the first failure.
+#
+#   python tools/update_e2e_test.py [--old firmware.bin --new firmware.bin]
+#
+# Without --old/--new two firmware-like images are generated. Pass two real builds (for example
+# .pio/build/<env>/firmware.bin from consecutive releases) to see the size of a real delta.
+
+import argparse
+import hashlib
+import http.client
+import os
+import random
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+import zlib
+
+import make_delta
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+OLD_VERSION = "1.2.15"
+MAX_RESUMES = 5  # UPDATE_MAX_RESUMES
+CHUNK = 1024  # UPDATE_CHUNK_SIZE
+HEADER = struct.Struct("<4sII32sI32s")  # DeltaHeader
+
+
+class StreamingPatch:
+    """DeltaPatch::write/end on the host: the patch comes in pieces as it downloads, so the header,
+    op arguments and op data can all be split across writes."""
+
+    def __init__(self, old):
+        self.old = old
+        self.header = b""
+        self.inflator = zlib.decompressobj()
+        self.pending = b""  # Inflated bytes not yet parsed
+        self.out = bytearray()
+        self.done = False
+
+    def write(self, data):
+        if len(self.header) < HEADER.size:
+            take = HEADER.size - len(self.header)
+            self.header += data[:take]
+            data = data[take:]
+            if len(self.header) < HEADER.size:
+                return
+            magic, version, self.source_size, source_hash, self.target_size, self.target_hash = HEADER.unpack(self.header)
+            if magic != make_delta.MAGIC or version != make_delta.VERSION:
+                raise ValueError("not a delta patch")
+            if self.source_size != len(self.old) or source_hash != hashlib.sha256(self.old).digest():
+                raise ValueError("patch is for a different firmware")
+        if data:
+            self.pending += self.inflator.decompress(data)
+            self.apply()
+
+    def apply(self):
+        stream = self.pending
+        pos = 0
+        while pos < len(stream) and not self.done:
+            op = stream[pos]
+            if op == make_delta.OP_END:
+                self.done = True
+                pos += 1
+                break
+            args = 8 if op == make_delta.OP_ADD else 4
+            if op not in (make_delta.OP_ADD, make_delta.OP_INSERT):
+                raise ValueError("unknown op %d" % op)
+            if len(stream) - pos < 1 + args:
+                break
+            if op == make_delta.OP_ADD:
+                source, length = struct.unpack_from("<II", stream, pos + 1)
+                if source + length > self.source_size:
+                    raise ValueError("op reads past the source")
+            else:
+                (length,) = struct.unpack_from("<I", stream, pos + 1)
+            if len(self.out) + length > self.target_size:
+                raise ValueError("op writes past the target")
+            if len(stream) - pos < 1 + args + length:
+                break  # Wait for the whole op, the unit applies it piecemeal but the result is the same
+            data = stream[pos + 1 + args:pos + 1 + args + length]
+            if op == make_delta.OP_ADD:
+                data = bytes((self.old[source + i] + data[i]) & 0xFF for i in range(length))
+            self.out += data
+            pos += 1 + args + length
+        if self.done and pos < len(stream):
+            raise ValueError("data after the end of the patch")
+        self.pending = stream[pos:]
+
+    def end(self):
+        if not self.done:
+            raise ValueError("patch incomplete")
+        if len(self.out) != self.target_size or hashlib.sha256(self.out).digest() != self.target_hash:
+            raise ValueError("rebuilt image doesn't match")
+        return bytes(self.out)
+
+
+def fetch_text(port, path):
+    connection = http.client.HTTPConnection("127.0.0.1", port, timeout=10)
+    connection.request("GET", path)
+    response = connection.getresponse()
+    text = response.read().decode().strip()
+    connection.close()
+    return text if response.status == 200 else None
+
+
+def download(port, path, sha256, sink):
+    """UpdateAgent::download: resume with a Range request after every dropped transfer. Returns the
+    number of requests it took. Nothing is fetched without a digest to check against."""
+    if not sha256 or len(sha256.split()[0]) != 64:
+        raise ValueError("%s: no SHA-256, refused" % path)
+    sha256 = sha256.split()[0]
+    written, total, failures, requests = 0, None, 0, 0
+    digest = hashlib.sha256()
+    while failures <= MAX_RESUMES and (total is None or written < total):
+        connection = http.client.HTTPConnection("127.0.0.1", port, timeout=10)
+        connection.request("GET", path, headers={"Range": "bytes=%d-" % written} if written else {})
+        response = connection.getresponse()
+        requests += 1
+        if response.status not in (200, 206):
+            raise ValueError("%s: HTTP %d" % (path, response.status))
+        if total is None:
+            total = int(response.getheader("Content-Length"))
+        skip = written if response.status == 200 else 0  # Server ignored the Range header
+        while written < total:
+            try:
+                data = response.read(CHUNK)
+            except http.client.IncompleteRead as e:
+                data = e.partial
+            if not data:
+                break
+            cut = min(skip, len(data))
+            skip -= cut
+            data = data[cut:]
+            sink(data)
+            digest.update(data)
+            written += len(data)
+        connection.close()
+        if written < total:
+            failures += 1
+    if total is None or written != total:
+        raise ValueError("%s: gave up at %s of %s bytes after %d tries" % (path, written, total, requests))
+    if digest.hexdigest() != sha256.lower():
+        raise ValueError("%s: SHA-256 mismatch" % path)
+    return requests
+
+
+def firmware_images(size, seed=1):
+    """Two builds in miniature: 4 byte instruction words with absolute addresses mixed in. The second
+    one has a few functions added, which moves the code after them and shifts every address past
+    that point, the way a small source change does in a real image."""
+    rng = random.Random(seed)
+    base = 0x400D0000
+    words = []
+    for _ in range(size // 4):
+        if rng.random() < 0.15:
+            words.append(("addr", rng.randrange(0, size)))
+        else:
+            words.append(("code", rng.getrandbits(32)))
+
+    def build(inserts):
+        out = bytearray()
+        for index, (kind, value) in enumerate(words):
+            for at, length in inserts:
+                if at == index:
+                    out += bytes(rng.getrandbits(8) for _ in range(length))
+            if kind == "addr":
+                value += sum(length for at, length in inserts if at * 4 < value)
+                out += struct.pack("<I", base + value)
+            else:
+                out += struct.pack("<I", value)
+        return bytes(out)
+
+    old = build([])
+    new = build([(len(words) // 5, 512), (len(words) // 2, 96), (len(words) * 4 // 5, 1024)])
+    return old, new
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def serve(folder, drop):
+    port = free_port()
+    server = subprocess.Popen([sys.executable, os.path.join(ROOT, "tools", "update_server.py"), folder, str(port),
+                               "--drop", str(drop)], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    for _ in range(50):
+        try:
+            socket.create_connection(("127.0.0.1", port), timeout=1).close()
+            return server, port
+        except OSError:
+            time.sleep(0.1)
+    server.kill()
+    raise SystemExit("update_server.py didn't start")
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--old", help="firmware the unit runs")
+    parser.add_argument("--new", help="firmware to update to")
+    parser.add_argument("--size", type=int, default=256 * 1024, help="size of the generated images")
+    args = parser.parse_args()
+    if bool(args.old) != bool(args.new):
+        raise SystemExit("--old and --new go together")
+    if args.old:
+        with open(args.old, "rb") as f:
+            old = f.read()
+        with open(args.new, "rb") as f:
+            new = f.read()
+    else:
+        old, new = firmware_images(args.size)
+
+    with tempfile.TemporaryDirectory() as folder:
+        with open(os.path.join(folder, "version.txt"), "w") as f:
+            f.write("9.9.9\n")
+        old_path = os.path.join(folder, "old.bin")
+        with open(old_path, "wb") as f:
+            f.write(old)
+        new_path = os.path.join(folder, "firmware.bin")
+        with open(new_path, "wb") as f:
+            f.write(new)
+        with open(new_path + ".sha256", "w") as f:
+            f.write(hashlib.sha256(new).hexdigest() + "\n")
+        delta_path = os.path.join(folder, "firmware-%s.delta" % OLD_VERSION)
+        subprocess.run([sys.executable, os.path.join(ROOT, "tools", "make_delta.py"), old_path, new_path, delta_path],
+                       check=True)
+        delta_size = os.path.getsize(delta_path)
+
+        # Every response is cut so each transfer needs resuming, but within the unit's retry budget
+        delta_drop = delta_size // 3 + 1
+        server, port = serve(folder, delta_drop)
+        try:
+            if fetch_text(port, "/version.txt") != "9.9.9":
+                raise ValueError("version.txt not served")
+            if fetch_text(port, "/firmware-0.0.0.delta.sha256") is not None:
+                raise ValueError("a missing delta has to 404 so the unit falls back to the full image")
+            patch = StreamingPatch(old)
+            delta_requests = download(port, "/firmware-%s.delta" % OLD_VERSION,
+                                      fetch_text(port, "/firmware-%s.delta.sha256" % OLD_VERSION), patch.write)
+            if patch.end() != new:
+                raise ValueError("delta rebuilt the wrong image")
+        finally:
+            server.kill()
+            server.wait()
+
+        image_drop = len(new) // MAX_RESUMES + 1
+        server, port = serve(folder, image_drop)
+        try:
+            image = bytearray()
+            image_requests = download(port, "/firmware.bin", fetch_text(port, "/firmware.bin.sha256"), image.extend)
+            if bytes(image) != new:
+                raise ValueError("full image download doesn't match")
+            os.remove(new_path + ".sha256")
+            try:
+                download(port, "/firmware.bin", fetch_text(port, "/firmware.bin.sha256"), image.extend)
+                raise ValueError("an image without its .sha256 was installed")
+            except ValueError as e:
+                if "refused" not in str(e):
+                    raise
+        finally:
+            server.kill()
+            server.wait()
+
+    if delta_requests < 2 or image_requests < 2:
+        raise SystemExit("FAILED: transfers weren't cut, --drop didn't take effect")
+    print("  delta %d bytes, %.1f%% of the %d byte image, %d requests" % (
+        delta_size, 100.0 * delta_size / len(new), len(new), delta_requests))
+    print("  full image in %d requests of at most %d bytes" % (image_requests, image_drop))
+    print("Update end to end test passed")
+
+
+if __name__ == "__main__":
+    try:
+        main()
+    except (ValueError, OSError, subprocess.CalledProcessError) as e:
+        raise SystemExit("FAILED: %s" % e)
@@ -0,0 +1,65 @@
+# SmartSpin2K code
+# This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+# Copyright 2020 Anthony Doud
+# This work is licensed under the GNU General Public License v2
+#
+# Local stand-in for the update server, for trying updates without publishing anything.
+# Serves a folder laid out like the real one (version.txt, firmware.bin, firmware-<ver>.delta,
+# spiffs.bin, data/ ...) over plain http with Range support, so interrupted downloads resume.
+#
+#   python tools/update_server.py <folder> [port]
+#
+# Then set the unit's update URL to http://<this computer>:<port>/ on the settings page. The unit only
+# accepts plain http when built with FW_ALLOW_PLAIN_HTTP true (include/settings.h).
+# --drop N cuts every response after N bytes to exercise resuming. tools/update_e2e_test.py uses it.
+
+import argparse
+import functools
+import os
+import re
+from http.server import SimpleHTTPRequestHandler, ThreadingHTTPServer
+
+
+class RangeHandler(SimpleHTTPRequestHandler):
+    drop_after = 0
+
+    def send_head(self):
+        path = self.translate_path(self.path)
+        match = re.match(r"bytes=(\d+)-$", self.headers.get("Range", ""))
+        if not match or not os.path.isfile(path):
+            return super().send_head()
+        size = os.path.getsize(path)
+        start = int(match.group(1))
+        if start >= size:
+            self.send_error(416)
+            return None
+        f = open(path, "rb")
+        f.seek(start)
+        self.send_response(206)
+        self.send_header("Content-Type", self.guess_type(path))
+        self.send_header("Content-Range", "bytes %d-%d/%d" % (start, size - 1, size))
+        self.send_header("Content-Length", str(size - start))
+        self.end_headers()
+        return f
+
+    def copyfile(self, source, outputfile):
+        if not self.drop_after:
+            return super().copyfile(source, outputfile)
+        outputfile.write(source.read(self.drop_after))
+        self.close_connection = True
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("folder")
+    parser.add_argument("port", nargs="?", type=int, default=8080)
+    parser.add_argument("--drop", type=int, default=0)
+    args = parser.parse_args()
+    RangeHandler.drop_after = args.drop
+    handler = functools.partial(RangeHandler, directory=args.folder)
+    print("Serving %s on port %d" % (args.folder, args.port))
+    ThreadingHTTPServer(("", args.port), handler).serve_forever()
+
+
+if __name__ == "__main__":
+    main()
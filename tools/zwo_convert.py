@@ -0,0 +1,124 @@
+# SmartSpin2K code
+# This software registers an ESP32 as a BLE FTMS device which then uses a stepper motor to turn the resistance knob on a regular spin bike.
+# Copyright 2020 Anthony Doud
+# This work is licensed under the GNU General Public License v2
+#
+# Converts a Zwift .zwo workout into the step file the workout player reads (include/Workout_Player.h)
+# and optionally uploads it. Intervals are expanded into single steps, free rides and max efforts
+# become steps without an ERG target. Text events and cadence targets are dropped.
+#
+#   python tools/zwo_convert.py <workout.zwo> [name] [--upload <device address>]
+#
+# The file is written as <name>.wkt next to the .zwo and stored on the device as /wk/<name>.wkt,
+# so it's started with http://<device>/workout?start=<name>.
+
+import os
+import re
+import struct
+import sys
+import urllib.request
+import uuid
+import xml.etree.ElementTree as ET
+
+MAGIC = 0x4B575353  # "SSWK"
+VERSION = 1
+HEADER = struct.Struct("<IBBH24s")  # magic, version, reserved, stepCount, name
+STEP = struct.Struct("<HHHBB")  # duration, startPower, endPower, flags, reserved
+MAX_STEPS = 200  # WORKOUT_MAX_STEPS
+FLAG_FREE = 0x01
+PATH_PREFIX = "/wk/"  # WORKOUT_PATH_PREFIX
+SUFFIX = ".wkt"  # WORKOUT_FILE_SUFFIX
+MAX_NAME = 20  # SPIFFS names are at most 31 characters with the path
+
+
+def attr(element, *names, default=None):
+    for name in names:
+        if name in element.attrib:
+            return float(element.attrib[name])
+    if default is None:
+        raise ValueError("%s needs %s" % (element.tag, " or ".join(names)))
+    return default
+
+
+def step(duration, start, end=None, flags=0):
+    """start and end are fractions of FTP"""
+    duration = int(round(duration))
+    if not 0 < duration <= 0xFFFF:
+        raise ValueError("step of %d s can't be stored" % duration)
+    end = start if end is None else end
+    return (duration, int(round(start * 1000)), int(round(end * 1000)), flags)
+
+
+def parse(path):
+    root = ET.parse(path).getroot()
+    workout = root.find("workout")
+    if workout is None:
+        raise ValueError("no <workout> in %s" % path)
+    title = (root.findtext("name") or "").strip()
+    steps = []
+    for element in workout:
+        tag = element.tag.lower()
+        duration = attr(element, "Duration", default=0)
+        if tag == "steadystate":
+            steps.append(step(duration, attr(element, "Power", "PowerLow")))
+        elif tag in ("warmup", "cooldown", "ramp"):
+            steps.append(step(duration, attr(element, "PowerLow"), attr(element, "PowerHigh")))
+        elif tag == "intervalst":
+            repeat = int(attr(element, "Repeat", default=1))
+            on = step(attr(element, "OnDuration"), attr(element, "OnPower", "PowerOnHigh"))
+            off = step(attr(element, "OffDuration"), attr(element, "OffPower", "PowerOffLow"))
+            steps.extend([on, off] * repeat)
+        elif tag in ("freeride", "maxeffort"):
+            steps.append(step(duration, 0, 0, FLAG_FREE))
+        elif tag != "textevent":
+            print("skipping <%s>" % element.tag, file=sys.stderr)
+    if not steps:
+        raise ValueError("%s has no steps" % path)
+    if len(steps) > MAX_STEPS:
+        raise ValueError("%d steps, the player takes %d" % (len(steps), MAX_STEPS))
+    return title, steps
+
+
+def encode(title, steps):
+    out = bytearray(HEADER.pack(MAGIC, VERSION, 0, len(steps), title.encode("utf-8")[:24]))
+    for duration, start, end, flags in steps:
+        out += STEP.pack(duration, start, end, flags, 0)
+    return bytes(out)
+
+
+def upload(address, filename, content):
+    """Same multipart upload the /update page does. Files that aren't firmware.bin go to SPIFFS."""
+    boundary = uuid.uuid4().hex
+    body = ("--%s\r\nContent-Disposition: form-data; name=\"update\"; filename=\"%s\"\r\n"
+            "Content-Type: application/octet-stream\r\n\r\n" % (boundary, filename)).encode() + content + \
+        ("\r\n--%s--\r\n" % boundary).encode()
+    url = address if address.startswith("http") else "http://" + address
+    request = urllib.request.Request(url.rstrip("/") + "/update", data=body, method="POST",
+                                     headers={"Content-Type": "multipart/form-data; boundary=" + boundary})
+    with urllib.request.urlopen(request, timeout=30) as response:
+        return response.read().decode(errors="replace")
+
+
+if __name__ == "__main__":
+    args = sys.argv[1:]
+    address = None
+    if "--upload" in args:
+        index = args.index("--upload")
+        address = args[index + 1]
+        del args[index:index + 2]
+    if not args:
+        raise SystemExit("usage: zwo_convert.py <workout.zwo> [name] [--upload <device address>]")
+    source = args[0]
+    name = args[1] if len(args) > 1 else os.path.splitext(os.path.basename(source))[0]
+    name = re.sub(r"[^A-Za-z0-9_-]", "_", name)[:MAX_NAME]
+
+    title, steps = parse(source)
+    content = encode(title or name, steps)
+    target = os.path.join(os.path.dirname(source), name + SUFFIX)
+    with open(target, "wb") as f:
+        f.write(content)
+    total = sum(s[0] for s in steps)
+    print("%s: %d steps, %d:%02d, %d bytes" % (target, len(steps), total // 60, total % 60, len(content)))
+    if address:
+        print(upload(address, PATH_PREFIX + name + SUFFIX, content))
+        print("start it with /workout?start=%s" % name)